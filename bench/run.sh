@@ -0,0 +1,312 @@
+#!/bin/bash
+# Loopback benchmarks for the lab programs, compared with stored baselines
+#
+#   bench/run.sh             run everything, compare with bench/baselines.txt
+#   bench/run.sh --update    run everything, write the results as the baselines
+#   bench/run.sh --train     run the transfer workloads only (PGO training)
+#
+# Build first (make bench does: DATA_SIZE=1400). Runs in _bench/ at the top
+# of the tree on ports BENCH_PORT and up (default 7700). Every result is one
+# line "<metric> <value>"; a metric is a regression when it is worse than its
+# baseline by more than the tolerance given there (none: "-", only shown).
+# A run that produced no number is MISSING. Exit status 1 if any metric
+# regressed or is missing; --update refuses to write missing values.
+
+set -u
+cd "$(dirname "$0")/.."
+ROOT=$PWD
+LAB3=$ROOT/lab3_TCP_Client_Server_Implementation
+LAB5=$ROOT/lab5_Reliable_UDP_File_Transfer
+LAB7=$ROOT/lab7_Link_State_Routing
+BASELINES=$ROOT/bench/baselines.txt
+WORK=$ROOT/_bench
+PORT=${BENCH_PORT:-7700}
+MODE=${1:-compare}
+HZ=$(getconf CLK_TCK)
+
+case $MODE in
+compare|--update|--train) ;;
+*) echo "Usage: $0 [--update|--train]" >&2; exit 2 ;;
+esac
+
+for bin in "$LAB3/tcp_server" "$LAB3/tcp_client" "$LAB3/tcp_fetch_bench" \
+           "$LAB5/udp_server" "$LAB5/udp_client" "$LAB7/ls_router"; do
+    if [ ! -x "$bin" ]; then
+        echo "$bin is not built (run make bench)" >&2
+        exit 2
+    fi
+done
+
+rm -rf "$WORK" && mkdir -p "$WORK" && cd "$WORK" || exit 2
+RESULTS=$WORK/results.txt
+: > "$RESULTS"
+PIDS=()
+trap 'kill "${PIDS[@]}" 2>/dev/null; wait 2>/dev/null' EXIT
+
+# A failed run leaves an empty or non-numeric value: record it as MISSING
+result() {
+    local value=$2
+    [[ $value =~ ^-?[0-9]+(\.[0-9]+)?([eE][-+]?[0-9]+)?$ ]] || value=MISSING
+    printf '  %-32s %s\n' "$1" "$value"
+    echo "$1 $value" >> "$RESULTS"
+}
+
+# Seconds from $1 to $2 (date +%s.%N); nothing if either is unset
+elapsed() {
+    [ -n "$1" ] && [ -n "$2" ] && awk -v a="$2" -v b="$1" 'BEGIN { printf "%.2f", a - b }'
+}
+
+# User + system CPU seconds of a running process
+cpu_of() {
+    awk -v hz="$HZ" '{ print ($14 + $15) / hz }' "/proc/$1/stat"
+}
+
+wait_port() {
+    for _ in $(seq 50); do
+        ss -Hltn "sport = :$1" 2>/dev/null | grep -q . && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+# ---------- TCP: one large download, then many small ones ----------
+
+# Download large.bin from the server (pid $1) three times, client options
+# after it; results <prefix>_MBps and <prefix>_cpu_ns_per_byte of the best
+# run. CPU is client plus server per byte delivered (ns/byte = s per GB).
+download_bench() {
+    local server=$1 prefix=$2 best=0 cpu=0
+    shift 2
+    for _ in 1 2 3; do
+        rm -rf downloads
+        before=$(cpu_of $server)
+        TIMEFORMAT='%R %U %S'
+        t=$( { time "$LAB3/tcp_client" "$@" 127.0.0.1 $PORT large.bin > /dev/null 2>&1; } 2>&1 )
+        after=$(cpu_of $server)
+        read -r real user sys <<< "$t"
+        mbps=$(awk -v r="$real" 'BEGIN { printf "%.1f", 64 * 1.048576 / r }')
+        if awk -v a="$mbps" -v b="$best" 'BEGIN { exit !(a > b) }'; then
+            best=$mbps
+            cpu=$(awk -v u="$user" -v s="$sys" -v a="$after" -v b="$before" \
+                  'BEGIN { printf "%.3f", (u + s + a - b) * 1e9 / (64 * 1048576) }')
+        fi
+    done
+    cmp -s large.bin downloads/large.bin || echo "  warning: downloaded file differs" >&2
+    result ${prefix}_MBps "$best"
+    result ${prefix}_cpu_ns_per_byte "$cpu"
+}
+
+files_per_s() {
+    awk '/files\/s/ { for (i = 1; i <= NF; i++) if ($(i+1) ~ /^files\/s/) print $i }' <<< "$1"
+}
+
+echo "TCP (lab 3)"
+head -c $((64 << 20)) /dev/urandom > large.bin
+mkdir -p small
+for i in $(seq 1 100); do head -c $((512 + i * 97)) /dev/urandom > small/f$i.bin; done
+
+"$LAB3/tcp_server" $PORT > tcp_server.log 2>&1 &
+PIDS+=($!)
+server=$!
+wait_port $PORT || { echo "tcp_server did not start" >&2; exit 2; }
+
+download_bench $server tcp_download
+out=$("$LAB3/tcp_fetch_bench" -n 20000 -c 256 -p 16 127.0.0.1:$PORT small/*.bin 2>&1)
+result tcp_small_files_per_s "$(files_per_s "$out")"
+result tcp_small_p50_ms "$(awk '/latency ms/ { print $4 }' <<< "$out")"
+result tcp_small_p99_ms "$(awk '/latency ms/ { print $6 }' <<< "$out")"
+kill -TERM $server && wait $server 2>/dev/null
+
+# A new connection per download (connection rate): one listener, then one
+# SO_REUSEPORT listener per CPU (at least two). Server options as arguments.
+connection_bench() {
+    local prefix=$1
+    shift
+    "$LAB3/tcp_server" "$@" $PORT > ${prefix}_server.log 2>&1 &
+    PIDS+=($!)
+    server=$!
+    wait_port $PORT || { echo "tcp_server did not start" >&2; exit 2; }
+    out=$("$LAB3/tcp_fetch_bench" -k -n 20000 -c 64 -p 64 127.0.0.1:$PORT small/f1.bin 2>&1)
+    result ${prefix}_per_s "$(files_per_s "$out")"
+    kill -TERM $server && wait $server 2>/dev/null
+}
+
+connection_bench tcp_connections
+cpus=$(nproc)
+connection_bench tcp_connections_reuseport -L $((cpus > 2 ? cpus : 2))
+
+# Small downloads while eight large ones keep the server busy: p99 latency
+# with the server as is, then with a bandwidth budget (-B, MB/s) shared by
+# the scheduler. Server options as arguments; result <prefix>_small_p99_ms.
+loaded_bench() {
+    local prefix=$1 load
+    shift
+    "$LAB3/tcp_server" "$@" $PORT > ${prefix}_server.log 2>&1 &
+    PIDS+=($!)
+    server=$!
+    wait_port $PORT || { echo "tcp_server did not start" >&2; exit 2; }
+    "$LAB3/tcp_fetch_bench" -n 1000000 -c 8 -p 8 127.0.0.1:$PORT large.bin > /dev/null 2>&1 &
+    load=$!
+    sleep 1
+    out=$("$LAB3/tcp_fetch_bench" -n 20000 -c 32 -p 4 127.0.0.1:$PORT small/*.bin 2>&1)
+    kill $load && wait $load 2>/dev/null
+    result ${prefix}_small_p99_ms "$(awk '/latency ms/ { print $6 }' <<< "$out")"
+    kill -TERM $server && wait $server 2>/dev/null
+}
+
+if [ "$MODE" != "--train" ]; then
+    echo "TCP under load (lab 3)"
+    loaded_bench tcp_loaded
+    loaded_bench tcp_shaped -B 500
+fi
+
+# The same over TLS 1.3, with a throwaway certificate. Whether the kernel
+# did the encryption (kTLS, sendfile kept) is shown, not compared.
+if openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 \
+        -subj /CN=localhost -addext "subjectAltName=IP:127.0.0.1" \
+        -keyout tls.key -out tls.crt > /dev/null 2>&1 \
+   && cat tls.key tls.crt > tls.pem \
+   && { "$LAB3/tcp_server" -T tls.pem $PORT > tcp_tls_server.log 2>&1 & } \
+   && PIDS+=($!) && server=$! && wait_port $PORT; then
+    echo "TCP over TLS (lab 3)"
+    download_bench $server tcp_tls_download -T tls.crt
+    out=$("$LAB3/tcp_fetch_bench" -T tls.crt -n 20000 -c 256 -p 16 127.0.0.1:$PORT small/*.bin 2>&1)
+    result tcp_tls_small_files_per_s "$(files_per_s "$out")"
+    if grep -q "Kernel TLS not available" tcp_tls_server.log; then
+        result tcp_tls_kernel_offload 0
+    else
+        result tcp_tls_kernel_offload 1
+    fi
+    kill -TERM $server && wait $server 2>/dev/null
+else
+    echo "  TLS skipped: no openssl command, or tcp_server built without OpenSSL" >&2
+fi
+
+# ---------- UDP: striped over three ports, 20% simulated loss ----------
+
+echo "UDP (lab 5)"
+head -c 1000000 /dev/urandom > udp.bin
+U1=$((PORT + 10)) U2=$((PORT + 11)) U3=$((PORT + 12))
+"$LAB5/udp_server" $U1,$U2,$U3 udp.out > udp_server.log 2>&1 &
+PIDS+=($!)
+server=$!
+sleep 0.2
+before=$(date +%s.%N)
+"$LAB5/udp_client" -d xxh64 -m 127.0.0.1:$U2 -m 127.0.0.1:$U3 127.0.0.1 $U1 udp.bin > udp_client.log 2>&1
+after=$(date +%s.%N)
+wait $server
+# A transfer that did not verify is not a measurement
+grep -q "Digest verified" udp_server.log || { echo "  warning: UDP digest not verified" >&2; after=; }
+result udp_transfer_s "$(elapsed "$before" "$after")"
+result udp_gap_p99_ms "$(sed -n 's/.*p99 \([0-9.]*\) ms.*/\1/p' udp_server.log)"
+
+# The same with 64 packets in flight per path (version 1 format), timed by
+# the client until the last data packet is ACKed (the end handshake runs on
+# a 20% lossy link and is not part of the transfer); datagrams the server
+# received per ACK it sent
+rm -f udp.out
+"$LAB5/udp_server" $U1,$U2,$U3 udp.out > udp_server_w.log 2>&1 &
+PIDS+=($!)
+server=$!
+sleep 0.2
+"$LAB5/udp_client" -d xxh64 -w 64 -m 127.0.0.1:$U2 -m 127.0.0.1:$U3 127.0.0.1 $U1 udp.bin \
+    > udp_client_w.log 2>&1
+wait $server
+secs=$(sed -n 's/.*File sent over .* bytes in \([0-9.]*\) s.*/\1/p' udp_client_w.log)
+grep -q "Digest verified" udp_server_w.log || { echo "  warning: windowed UDP digest not verified" >&2; secs=; }
+result udp_windowed_transfer_s "$secs"
+result udp_packets_per_ack "$(sed -n 's/.*Received \([0-9]*\) packets.*sent \([0-9]*\) ACKs.*/\1 \2/p' udp_server_w.log |
+    awk '$2 > 0 { printf "%.1f", $1 / $2 }')"
+
+# ---------- Routing: time for a cost change to reach every table; fast reroute ----------
+
+if [ "$MODE" != "--train" ]; then
+    echo "Link-state routing (lab 7)"
+    for i in 0 1 2 3; do echo "router$i 127.0.0.1 $((PORT + 20 + i))"; done > routers.txt
+    cp "$LAB7/costs_sample.txt" costs.txt
+    # Router 0 changes its link to 1 from cost 1 to 10; these are the new
+    # least-cost rows of routers 0-3
+    expect=("0 4 3 5" "4 0 1 3" "3 1 0 2" "5 3 2 0")
+    mkfifo change
+    "$LAB7/ls_router" 0 4 routers.txt costs.txt < change > r0.log 2>&1 &
+    PIDS+=($!)
+    exec 3> change
+    for i in 1 2 3; do
+        "$LAB7/ls_router" $i 4 routers.txt costs.txt < /dev/null > r$i.log 2>&1 &
+        PIDS+=($!)
+    done
+    sleep 11                    # the first prompt comes after 10 s
+    start=$(date +%s.%N)
+    echo "1 10" >&3
+    done_at=()
+    while [ ${#done_at[@]} -lt 4 ]; do
+        for i in 0 1 2 3; do
+            if [ -z "${done_at[$i]:-}" ] && grep -qE "(^|[^0-9])${expect[$i]} ?$" r$i.log; then
+                done_at[$i]=$(date +%s.%N)
+            fi
+        done
+        if awk -v s="$start" -v n="$(date +%s.%N)" 'BEGIN { exit !(n - s > 60) }'; then
+            echo "  routing did not converge in 60 s" >&2
+            break
+        fi
+        sleep 0.05
+    done
+    last=$(printf '%s\n' "${done_at[@]}" | sort -n | tail -1)
+    [ ${#done_at[@]} -lt 4 ] && last=
+    result routing_convergence_s "$(elapsed "$start" "$last")"
+
+    # Then router 0's link to 2 fails (second prompt, 10 s after the first):
+    # its three routes move to precomputed backups, timed by the router
+    echo "2 1000" >&3
+    for i in $(seq 150); do
+        grep -q "Link 0-2 down" r0.log && break
+        sleep 0.1
+    done
+    exec 3>&-
+    result routing_reroute_us "$(sed -n 's/.*Link 0-2 down: .* in \([0-9.]*\) us.*/\1/p' r0.log)"
+fi
+
+kill "${PIDS[@]}" 2>/dev/null
+wait 2>/dev/null
+PIDS=()
+
+# ---------- Compare ----------
+
+case $MODE in
+--train)
+    exit 0 ;;
+--update)
+    if grep -q ' MISSING$' "$RESULTS"; then
+        echo "Not updating the baselines: some measurements failed" >&2
+        exit 1
+    fi
+    # Keep each metric's direction and tolerance, replace its value
+    awk 'NR == FNR { now[$1] = $2; next }
+         /^#/ || NF < 4 { print; next }
+         $1 in now { printf "%-32s %-10s %-7s %s\n", $1, now[$1], $3, $4; next }
+         { print }' "$RESULTS" "$BASELINES" > "$BASELINES.new" && mv "$BASELINES.new" "$BASELINES"
+    echo "Baselines written to bench/baselines.txt"
+    exit 0 ;;
+esac
+
+echo
+printf '  %-32s %10s %10s %8s\n' metric baseline now change
+awk 'NR == FNR { if ($1 !~ /^#/ && NF >= 4) { base[$1] = $2; better[$1] = $3; tol[$1] = $4 } next }
+     {
+         if ($2 == "MISSING") {
+             printf "  %-32s %10s %10s  %7s   MISSING\n", $1, ($1 in base) ? base[$1] : "-", "-", ""
+             bad++
+             next
+         }
+         if (!($1 in base)) { printf "  %-32s %10s %10s  no baseline\n", $1, "-", $2; next }
+         b = base[$1]; v = $2
+         change = b != 0 ? (v - b) * 100 / b : 0
+         worse = better[$1] == "higher" ? -change : change
+         if (tol[$1] == "-")
+             status = "info"
+         else
+             status = worse > tol[$1] ? "REGRESSION" : worse < -tol[$1] ? "better" : "ok"
+         if (status == "REGRESSION") bad++
+         printf "  %-32s %10s %10s %+7.1f%%  %s\n", $1, b, v, change, status
+     }
+     END { exit bad > 0 }' "$BASELINES" "$RESULTS"
@@ -0,0 +1,347 @@
+/*
+ * Block compression: built-in LZ4, optional zstd and zlib (see compress.h).
+ */
+
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/* ---------- LZ4 block format ---------- */
+
+#define LZ4_HASH_LOG    12
+#define LZ4_MIN_MATCH   4
+#define LZ4_MFLIMIT     12      // last match must start this far from the end
+#define LZ4_LAST_LITS   5       // and the last 5 bytes are always literals
+#define LZ4_MAX_OFFSET  65535
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Length of the common prefix of a and b, stopping at limit (a side)
+static inline size_t match_length(const uint8_t *a, const uint8_t *b, const uint8_t *limit) {
+    const uint8_t *start = a;
+    while (a + 8 <= limit) {
+        uint64_t diff = read64(a) ^ read64(b);
+        if (diff != 0) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return (size_t)(a - start) + (size_t)(__builtin_ctzll(diff) >> 3);
+#else
+            return (size_t)(a - start) + (size_t)(__builtin_clzll(diff) >> 3);
+#endif
+        }
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return (size_t)(a - start);
+}
+
+static inline uint32_t lz4_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Writes the 255-run continuation of a length whose nibble was 15
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Greedy single-probe compressor, same block format as the reference LZ4
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ4_HASH_LOG];
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *end = src + n;
+    const uint8_t *mflimit = end - LZ4_MFLIMIT;
+    const uint8_t *matchlimit = end - LZ4_LAST_LITS;
+    uint8_t *op = dst, *oend = dst + cap;
+    size_t lit;
+
+    if (n > LZ4_MFLIMIT) {
+        memset(table, 0, sizeof(table));
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = lz4_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq) {
+                // Skip faster through data that keeps missing
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + LZ4_MIN_MATCH;
+            mp += match_length(mp, ref + LZ4_MIN_MATCH, matchlimit);
+
+            lit = (size_t)(ip - anchor);
+            size_t mlen = (size_t)(mp - ip) - LZ4_MIN_MATCH;
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1)
+                return 0;
+
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15)
+                op = put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            uint16_t off = (uint16_t)(ip - ref);
+            *op++ = (uint8_t)off;
+            *op++ = (uint8_t)(off >> 8);
+            *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15)
+                op = put_length(op, mlen - 15);
+
+            ip = anchor = mp;
+            if (ip - 2 > src)
+                table[lz4_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+    // Final literals-only sequence
+    lit = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+        return 0;
+    *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15)
+        op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (size_t)(op - dst);
+}
+
+// Reads a 255-run length continuation; returns 0 on truncated input
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend)
+            return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+// Every length and offset is checked: the input comes off the network
+static long lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && !get_length(&ip, iend, &lit))
+            return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return -1;
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);     // fixed-size copy: no libc call for short runs
+        else
+            memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst))
+            return -1;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !get_length(&ip, iend, &mlen))
+            return -1;
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+
+        const uint8_t *m = op - off;
+        if (off >= 8 && (size_t)(oend - op) >= mlen + 8) {
+            // 8 bytes at a time; may write up to 7 bytes past the match, later overwritten
+            uint8_t *stop = op + mlen;
+            do {
+                memcpy(op, m, 8);
+                op += 8;
+                m += 8;
+            } while (op < stop);
+            op = stop;
+        } else {
+            // Overlapping copy repeats the last off bytes
+            while (mlen--)
+                *op++ = *m++;
+        }
+    }
+    return (long)(op - dst);
+}
+
+/* ---------- Public interface ---------- */
+
+int comp_available(comp_alg_t alg) {
+    switch (alg) {
+    case COMP_LZ4:
+        return 1;
+#ifdef HAVE_ZSTD
+    case COMP_ZSTD:
+        return 1;
+#endif
+#ifdef HAVE_ZLIB
+    case COMP_DEFLATE:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+comp_alg_t comp_negotiate(comp_alg_t alg) {
+    if (alg == COMP_NONE || alg > COMP_MAX_ALG)
+        return COMP_NONE;
+    if (comp_available(alg))
+        return alg;
+    // A level-tuned codec was asked for: deflate is the closest substitute
+    if (alg == COMP_ZSTD && comp_available(COMP_DEFLATE))
+        return COMP_DEFLATE;
+    if (alg == COMP_DEFLATE && comp_available(COMP_ZSTD))
+        return COMP_ZSTD;
+    return COMP_LZ4;
+}
+
+int comp_level(comp_alg_t alg, int level) {
+    switch (alg) {
+    case COMP_ZSTD:
+        if (level <= 0) return 3;
+        return level > 19 ? 19 : level;
+    case COMP_DEFLATE:
+        if (level <= 0) return 6;
+        return level > 9 ? 9 : level;
+    default:
+        return 1;
+    }
+}
+
+size_t comp_bound(comp_alg_t alg, size_t n) {
+    switch (alg) {
+#ifdef HAVE_ZSTD
+    case COMP_ZSTD:
+        return ZSTD_compressBound(n);
+#endif
+#ifdef HAVE_ZLIB
+    case COMP_DEFLATE:
+        return compressBound((uLong)n);
+#endif
+    default:
+        return n + n / 255 + 16;
+    }
+}
+
+size_t comp_compress(comp_alg_t alg, int level, const void *src, size_t n, void *dst, size_t cap) {
+    switch (alg) {
+    case COMP_LZ4:
+        return lz4_compress(src, n, dst, cap);
+#ifdef HAVE_ZSTD
+    case COMP_ZSTD: {
+        size_t r = ZSTD_compress(dst, cap, src, n, comp_level(alg, level));
+        return ZSTD_isError(r) ? 0 : r;
+    }
+#endif
+#ifdef HAVE_ZLIB
+    case COMP_DEFLATE: {
+        uLongf out = (uLongf)cap;
+        if (compress2(dst, &out, src, (uLong)n, comp_level(alg, level)) != Z_OK)
+            return 0;
+        return (size_t)out;
+    }
+#endif
+    default:
+        (void)level;
+        return 0;
+    }
+}
+
+int comp_decompress(comp_alg_t alg, const void *src, size_t n, void *dst, size_t raw_len) {
+    switch (alg) {
+    case COMP_LZ4:
+        return lz4_decompress(src, n, dst, raw_len) == (long)raw_len ? 0 : -1;
+#ifdef HAVE_ZSTD
+    case COMP_ZSTD:
+        return ZSTD_decompress(dst, raw_len, src, n) == raw_len ? 0 : -1;
+#endif
+#ifdef HAVE_ZLIB
+    case COMP_DEFLATE: {
+        uLongf out = (uLongf)raw_len;
+        if (uncompress(dst, &out, src, (uLong)n) != Z_OK || out != raw_len)
+            return -1;
+        return 0;
+    }
+#endif
+    default:
+        return -1;
+    }
+}
+
+int comp_probe(const void *src, size_t n) {
+    uint8_t out[4096 + 4096 / 255 + 16];
+    const uint8_t *p = src;
+
+    // Sample from the middle: headers at the start are often compressible
+    if (n > 4096) {
+        p += (n - 4096) / 2;
+        n = 4096;
+    }
+    // Needs at least ~6% savings on the sample to be worth a real pass
+    return lz4_compress(p, n, out, n - n / 16) != 0;
+}
+
+const char *comp_name(comp_alg_t alg) {
+    switch (alg) {
+    case COMP_LZ4: return "lz4";
+    case COMP_ZSTD: return "zstd";
+    case COMP_DEFLATE: return "deflate";
+    default: return "none";
+    }
+}
+
+comp_alg_t comp_from_name(const char *spec, int *level) {
+    static const comp_alg_t algs[] = { COMP_LZ4, COMP_ZSTD, COMP_DEFLATE };
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    *level = colon ? atoi(colon + 1) : 0;
+    for (size_t i = 0; i < sizeof(algs) / sizeof(algs[0]); i++) {
+        const char *name = comp_name(algs[i]);
+        if (strlen(name) == len && strncasecmp(spec, name, len) == 0)
+            return algs[i];
+    }
+    return COMP_NONE;
+}
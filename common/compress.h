@@ -0,0 +1,44 @@
+/*
+ * Block compression for chunked transfers.
+ * Each chunk is compressed on its own, so a receiver can decode chunk by
+ * chunk and a sender can pipeline compression with sending.
+ *
+ *   lz4      - LZ4 block format, built in (no external library), very fast
+ *   zstd     - Zstandard levels 1..19, when built with libzstd (HAVE_ZSTD)
+ *   deflate  - zlib levels 1..9, when built with zlib (HAVE_ZLIB)
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+typedef enum {
+    COMP_NONE = 0,
+    COMP_LZ4 = 1,
+    COMP_ZSTD = 2,
+    COMP_DEFLATE = 3
+} comp_alg_t;
+
+#define COMP_MAX_ALG COMP_DEFLATE
+
+int comp_available(comp_alg_t alg);
+// Best available substitute for alg (zstd -> deflate -> lz4)
+comp_alg_t comp_negotiate(comp_alg_t alg);
+// Default level when the caller gives 0; levels are clamped to the codec's range
+int comp_level(comp_alg_t alg, int level);
+
+// Worst-case compressed size of n bytes
+size_t comp_bound(comp_alg_t alg, size_t n);
+// Returns the compressed size, or 0 if it would not fit in cap (caller sends the chunk raw)
+size_t comp_compress(comp_alg_t alg, int level, const void *src, size_t n, void *dst, size_t cap);
+// Returns 0 when src decodes to exactly raw_len bytes, -1 on corrupt input
+int comp_decompress(comp_alg_t alg, const void *src, size_t n, void *dst, size_t raw_len);
+// Cheap LZ4 probe on a sample: 0 if the data already looks compressed/random
+int comp_probe(const void *src, size_t n);
+
+const char *comp_name(comp_alg_t alg);
+// Parses "lz4", "zstd", "zstd:9", "deflate:6"; returns COMP_NONE for an unknown name
+comp_alg_t comp_from_name(const char *spec, int *level);
+
+#endif
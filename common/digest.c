@@ -0,0 +1,647 @@
+/*
+ * Streaming digests: CRC-32C, xxHash64 and BLAKE3 (see digest.h).
+ */
+
+#include "digest.h"
+
+#include <string.h>
+
+/* ---------- CRC-32C ---------- */
+
+/*
+ * Tables and CPU feature checks are filled in once at load time (see
+ * digest_setup), so threads hashing concurrently never race on them.
+ */
+static uint32_t crc32c_table[8][256];
+#if defined(__x86_64__) && defined(__GNUC__)
+static int has_sse42, has_avx2;
+#endif
+
+static void crc32c_init_tables(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8)
+                                 ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+}
+
+// Slicing-by-8 table implementation
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8
+                             | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+            ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+            ^ crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]]
+            ^ crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t len) {
+    return has_sse42 ? crc32c_hw(crc, p, len) : crc32c_sw(crc, p, len);
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#else
+static uint32_t crc32c_update(uint32_t crc, const uint8_t *p, size_t len) {
+    return crc32c_sw(crc, p, len);
+}
+#endif
+
+/* ---------- xxHash64 ---------- */
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64le(const uint8_t *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+         | (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40
+         | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint32_t read32le(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_init(xxh64_state_t *s) {
+    memset(s, 0, sizeof(*s));
+    s->acc[0] = XXH_P1 + XXH_P2;
+    s->acc[1] = XXH_P2;
+    s->acc[2] = 0;
+    s->acc[3] = 0 - XXH_P1;
+}
+
+static void xxh64_update(xxh64_state_t *s, const uint8_t *p, size_t len) {
+    s->total_len += len;
+
+    if (s->mem_size + len < 32) {
+        memcpy(s->mem + s->mem_size, p, len);
+        s->mem_size += (unsigned)len;
+        return;
+    }
+    if (s->mem_size) {
+        size_t fill = 32 - s->mem_size;
+        memcpy(s->mem + s->mem_size, p, fill);
+        for (int i = 0; i < 4; i++)
+            s->acc[i] = xxh_round(s->acc[i], read64le(s->mem + 8 * i));
+        p += fill;
+        len -= fill;
+        s->mem_size = 0;
+    }
+    while (len >= 32) {
+        s->acc[0] = xxh_round(s->acc[0], read64le(p));
+        s->acc[1] = xxh_round(s->acc[1], read64le(p + 8));
+        s->acc[2] = xxh_round(s->acc[2], read64le(p + 16));
+        s->acc[3] = xxh_round(s->acc[3], read64le(p + 24));
+        p += 32;
+        len -= 32;
+    }
+    memcpy(s->mem, p, len);
+    s->mem_size = (unsigned)len;
+}
+
+static uint64_t xxh64_final(const xxh64_state_t *s) {
+    uint64_t h;
+    const uint8_t *p = s->mem;
+    size_t len = s->mem_size;
+
+    if (s->total_len >= 32) {
+        h = rotl64(s->acc[0], 1) + rotl64(s->acc[1], 7)
+          + rotl64(s->acc[2], 12) + rotl64(s->acc[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh_merge(h, s->acc[i]);
+    } else {
+        h = s->acc[2] + XXH_P5;
+    }
+    h += s->total_len;
+
+    while (len >= 8) {
+        h ^= xxh_round(0, read64le(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32le(p) * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    while (len--) {
+        h ^= (*p++) * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* ---------- BLAKE3 ---------- */
+
+#define B3_CHUNK_LEN   1024
+#define B3_BLOCK_LEN   64
+#define B3_CHUNK_START 1
+#define B3_CHUNK_END   2
+#define B3_PARENT      4
+#define B3_ROOT        8
+
+static const uint32_t B3_IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t B3_SCHEDULE[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t load32le(const uint8_t *p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+#else
+    return read32le(p);
+#endif
+}
+
+static inline uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+#define B3_G(a, b, c, d, x, y)                        \
+    do {                                               \
+        s[a] = s[a] + s[b] + (x);                      \
+        s[d] = rotr32(s[d] ^ s[a], 16);                \
+        s[c] = s[c] + s[d];                            \
+        s[b] = rotr32(s[b] ^ s[c], 12);                \
+        s[a] = s[a] + s[b] + (y);                      \
+        s[d] = rotr32(s[d] ^ s[a], 8);                 \
+        s[c] = s[c] + s[d];                            \
+        s[b] = rotr32(s[b] ^ s[c], 7);                 \
+    } while (0)
+
+// Full 16-word compression output; the first 8 words are the chaining value
+static void b3_compress(const uint32_t cv[8], const uint8_t block[B3_BLOCK_LEN],
+                        uint8_t block_len, uint64_t counter, uint8_t flags,
+                        uint32_t out[16]) {
+    uint32_t m[16], s[16];
+
+    for (int i = 0; i < 16; i++)
+        m[i] = read32le(block + 4 * i);
+    for (int i = 0; i < 8; i++)
+        s[i] = cv[i];
+    s[8] = B3_IV[0];
+    s[9] = B3_IV[1];
+    s[10] = B3_IV[2];
+    s[11] = B3_IV[3];
+    s[12] = (uint32_t)counter;
+    s[13] = (uint32_t)(counter >> 32);
+    s[14] = block_len;
+    s[15] = flags;
+
+    for (int r = 0; r < 7; r++) {
+        const uint8_t *sc = B3_SCHEDULE[r];
+        B3_G(0, 4, 8, 12, m[sc[0]], m[sc[1]]);
+        B3_G(1, 5, 9, 13, m[sc[2]], m[sc[3]]);
+        B3_G(2, 6, 10, 14, m[sc[4]], m[sc[5]]);
+        B3_G(3, 7, 11, 15, m[sc[6]], m[sc[7]]);
+        B3_G(0, 5, 10, 15, m[sc[8]], m[sc[9]]);
+        B3_G(1, 6, 11, 12, m[sc[10]], m[sc[11]]);
+        B3_G(2, 7, 8, 13, m[sc[12]], m[sc[13]]);
+        B3_G(3, 4, 9, 14, m[sc[14]], m[sc[15]]);
+    }
+    for (int i = 0; i < 8; i++) {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+static void b3_chunk_init(blake3_chunk_t *c, uint64_t counter) {
+    memcpy(c->cv, B3_IV, sizeof(c->cv));
+    c->chunk_counter = counter;
+    memset(c->block, 0, sizeof(c->block));
+    c->block_len = 0;
+    c->blocks_compressed = 0;
+}
+
+static size_t b3_chunk_len(const blake3_chunk_t *c) {
+    return (size_t)B3_BLOCK_LEN * c->blocks_compressed + c->block_len;
+}
+
+static uint8_t b3_chunk_start_flag(const blake3_chunk_t *c) {
+    return c->blocks_compressed == 0 ? B3_CHUNK_START : 0;
+}
+
+static void b3_chunk_update(blake3_chunk_t *c, const uint8_t *p, size_t len) {
+    while (len > 0) {
+        if (c->block_len == B3_BLOCK_LEN) {
+            uint32_t out[16];
+            b3_compress(c->cv, c->block, B3_BLOCK_LEN, c->chunk_counter,
+                        b3_chunk_start_flag(c), out);
+            memcpy(c->cv, out, 8 * sizeof(uint32_t));
+            c->blocks_compressed++;
+            memset(c->block, 0, sizeof(c->block));
+            c->block_len = 0;
+        }
+        size_t take = B3_BLOCK_LEN - c->block_len;
+        if (take > len)
+            take = len;
+        memcpy(c->block + c->block_len, p, take);
+        c->block_len += (uint8_t)take;
+        p += take;
+        len -= take;
+    }
+}
+
+// Inputs of the not-yet-compressed node that ends a chunk or a parent merge
+typedef struct {
+    uint32_t cv[8];
+    uint8_t block[B3_BLOCK_LEN];
+    uint64_t counter;
+    uint8_t block_len;
+    uint8_t flags;
+} b3_output_t;
+
+static void b3_chunk_output(const blake3_chunk_t *c, b3_output_t *o) {
+    memcpy(o->cv, c->cv, sizeof(o->cv));
+    memcpy(o->block, c->block, B3_BLOCK_LEN);
+    o->counter = c->chunk_counter;
+    o->block_len = c->block_len;
+    o->flags = b3_chunk_start_flag(c) | B3_CHUNK_END;
+}
+
+static void b3_output_cv(const b3_output_t *o, uint32_t cv[8]) {
+    uint32_t out[16];
+    b3_compress(o->cv, o->block, o->block_len, o->counter, o->flags, out);
+    memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void b3_parent_output(const uint32_t left[8], const uint32_t right[8], b3_output_t *o) {
+    memcpy(o->cv, B3_IV, sizeof(o->cv));
+    for (int i = 0; i < 8; i++) {
+        uint32_t l = left[i], r = right[i];
+        o->block[4 * i] = (uint8_t)l;
+        o->block[4 * i + 1] = (uint8_t)(l >> 8);
+        o->block[4 * i + 2] = (uint8_t)(l >> 16);
+        o->block[4 * i + 3] = (uint8_t)(l >> 24);
+        o->block[32 + 4 * i] = (uint8_t)r;
+        o->block[32 + 4 * i + 1] = (uint8_t)(r >> 8);
+        o->block[32 + 4 * i + 2] = (uint8_t)(r >> 16);
+        o->block[32 + 4 * i + 3] = (uint8_t)(r >> 24);
+    }
+    o->counter = 0;
+    o->block_len = B3_BLOCK_LEN;
+    o->flags = B3_PARENT;
+}
+
+/*
+ * SIMD path: compress B3_LANES whole chunks side by side, one chunk per
+ * vector lane (GCC vector extensions; AVX2 when the CPU has it).
+ */
+#define B3_LANES 8
+
+typedef uint32_t b3_vec_t __attribute__((vector_size(4 * B3_LANES)));
+
+#define B3_VROT(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+#define B3_VG(a, b, c, d, x, y)                       \
+    do {                                               \
+        v[a] = v[a] + v[b] + (x);                      \
+        v[d] = B3_VROT(v[d] ^ v[a], 16);               \
+        v[c] = v[c] + v[d];                            \
+        v[b] = B3_VROT(v[b] ^ v[c], 12);               \
+        v[a] = v[a] + v[b] + (y);                      \
+        v[d] = B3_VROT(v[d] ^ v[a], 8);                \
+        v[c] = v[c] + v[d];                            \
+        v[b] = B3_VROT(v[b] ^ v[c], 7);                \
+    } while (0)
+
+#define B3_HASH_LANES_BODY                                                     \
+    b3_vec_t cv[8], v[16], m[16];                                              \
+    for (int i = 0; i < 8; i++)                                                \
+        for (int l = 0; l < B3_LANES; l++)                                     \
+            cv[i][l] = B3_IV[i];                                               \
+    for (int blk = 0; blk < B3_CHUNK_LEN / B3_BLOCK_LEN; blk++) {              \
+        uint32_t flags = (blk == 0 ? B3_CHUNK_START : 0)                       \
+                       | (blk == B3_CHUNK_LEN / B3_BLOCK_LEN - 1 ? B3_CHUNK_END : 0); \
+        for (int l = 0; l < B3_LANES; l++) {                                   \
+            const uint8_t *src = in + (size_t)l * B3_CHUNK_LEN                 \
+                               + (size_t)blk * B3_BLOCK_LEN;                   \
+            for (int w = 0; w < 16; w++)                                       \
+                m[w][l] = load32le(src + 4 * w);                               \
+        }                                                                      \
+        for (int i = 0; i < 8; i++)                                            \
+            v[i] = cv[i];                                                      \
+        for (int l = 0; l < B3_LANES; l++) {                                   \
+            v[8][l] = B3_IV[0];                                                \
+            v[9][l] = B3_IV[1];                                                \
+            v[10][l] = B3_IV[2];                                               \
+            v[11][l] = B3_IV[3];                                               \
+            v[12][l] = (uint32_t)(counter + l);                                \
+            v[13][l] = (uint32_t)((counter + l) >> 32);                        \
+            v[14][l] = B3_BLOCK_LEN;                                           \
+            v[15][l] = flags;                                                  \
+        }                                                                      \
+        for (int r = 0; r < 7; r++) {                                          \
+            const uint8_t *sc = B3_SCHEDULE[r];                                \
+            B3_VG(0, 4, 8, 12, m[sc[0]], m[sc[1]]);                            \
+            B3_VG(1, 5, 9, 13, m[sc[2]], m[sc[3]]);                            \
+            B3_VG(2, 6, 10, 14, m[sc[4]], m[sc[5]]);                           \
+            B3_VG(3, 7, 11, 15, m[sc[6]], m[sc[7]]);                           \
+            B3_VG(0, 5, 10, 15, m[sc[8]], m[sc[9]]);                           \
+            B3_VG(1, 6, 11, 12, m[sc[10]], m[sc[11]]);                         \
+            B3_VG(2, 7, 8, 13, m[sc[12]], m[sc[13]]);                          \
+            B3_VG(3, 4, 9, 14, m[sc[14]], m[sc[15]]);                          \
+        }                                                                      \
+        for (int i = 0; i < 8; i++)                                            \
+            cv[i] = v[i] ^ v[i + 8];                                           \
+    }                                                                          \
+    for (int l = 0; l < B3_LANES; l++)                                         \
+        for (int i = 0; i < 8; i++)                                            \
+            out[l][i] = cv[i][l];
+
+static void b3_hash_lanes_generic(const uint8_t *in, uint64_t counter,
+                                  uint32_t out[B3_LANES][8]) {
+    B3_HASH_LANES_BODY
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+static void b3_hash_lanes_avx2(const uint8_t *in, uint64_t counter,
+                               uint32_t out[B3_LANES][8]) {
+    B3_HASH_LANES_BODY
+}
+#endif
+
+static void b3_hash_lanes(const uint8_t *in, uint64_t counter, uint32_t out[B3_LANES][8]) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (has_avx2) {
+        b3_hash_lanes_avx2(in, counter, out);
+        return;
+    }
+#endif
+    b3_hash_lanes_generic(in, counter, out);
+}
+
+static void b3_init(blake3_state_t *s) {
+    b3_chunk_init(&s->chunk, 0);
+    s->cv_stack_len = 0;
+    s->stage_len = 0;
+}
+
+// Merge completed subtrees: one merge per trailing zero bit of the chunk count
+static void b3_push_chunk_cv(blake3_state_t *s, uint32_t cv[8], uint64_t total_chunks) {
+    while ((total_chunks & 1) == 0) {
+        b3_output_t o;
+        s->cv_stack_len--;
+        b3_parent_output(s->cv_stack[s->cv_stack_len], cv, &o);
+        b3_output_cv(&o, cv);
+        total_chunks >>= 1;
+    }
+    memcpy(s->cv_stack[s->cv_stack_len++], cv, 8 * sizeof(uint32_t));
+}
+
+// Scalar chunk-by-chunk update (reference algorithm)
+static void b3_update_scalar(blake3_state_t *s, const uint8_t *p, size_t len) {
+    while (len > 0) {
+        if (b3_chunk_len(&s->chunk) == B3_CHUNK_LEN) {
+            b3_output_t o;
+            uint32_t cv[8];
+            uint64_t total = s->chunk.chunk_counter + 1;
+            b3_chunk_output(&s->chunk, &o);
+            b3_output_cv(&o, cv);
+            b3_push_chunk_cv(s, cv, total);
+            b3_chunk_init(&s->chunk, total);
+        }
+        size_t take = B3_CHUNK_LEN - b3_chunk_len(&s->chunk);
+        if (take > len)
+            take = len;
+        b3_chunk_update(&s->chunk, p, take);
+        p += take;
+        len -= take;
+    }
+}
+
+static void b3_hash_lanes_and_push(blake3_state_t *s, const uint8_t *in) {
+    uint32_t cvs[B3_LANES][8];
+    uint64_t counter = s->chunk.chunk_counter;
+
+    b3_hash_lanes(in, counter, cvs);
+    for (int l = 0; l < B3_LANES; l++)
+        b3_push_chunk_cv(s, cvs[l], counter + l + 1);
+    b3_chunk_init(&s->chunk, counter + B3_LANES);
+}
+
+/*
+ * Input is staged in B3_LANES whole chunks. A full stage is only hashed
+ * (on the SIMD path) once more input arrives, because the final chunk of
+ * the message has to go through the root finalization instead.
+ */
+static void b3_update(blake3_state_t *s, const uint8_t *p, size_t len) {
+    const size_t stage = sizeof(s->stage);
+
+    while (len > 0) {
+        if (s->stage_len == stage) {
+            b3_hash_lanes_and_push(s, s->stage);
+            s->stage_len = 0;
+        }
+        if (s->stage_len == 0 && len > stage) {
+            // Hash straight from the caller's buffer, no staging copy
+            b3_hash_lanes_and_push(s, p);
+            p += stage;
+            len -= stage;
+            continue;
+        }
+        size_t take = stage - s->stage_len;
+        if (take > len)
+            take = len;
+        memcpy(s->stage + s->stage_len, p, take);
+        s->stage_len += (uint32_t)take;
+        p += take;
+        len -= take;
+    }
+}
+
+static void b3_final(blake3_state_t *s, uint8_t out[32]) {
+    b3_output_t o;
+    uint32_t words[16];
+
+    // Whatever is still staged ends the message: run it through the scalar path
+    b3_update_scalar(s, s->stage, s->stage_len);
+    s->stage_len = 0;
+
+    int remaining = s->cv_stack_len;
+
+    b3_chunk_output(&s->chunk, &o);
+    while (remaining > 0) {
+        uint32_t cv[8];
+        b3_output_cv(&o, cv);
+        remaining--;
+        b3_parent_output(s->cv_stack[remaining], cv, &o);
+    }
+    b3_compress(o.cv, o.block, o.block_len, 0, o.flags | B3_ROOT, words);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (uint8_t)words[i];
+        out[4 * i + 1] = (uint8_t)(words[i] >> 8);
+        out[4 * i + 2] = (uint8_t)(words[i] >> 16);
+        out[4 * i + 3] = (uint8_t)(words[i] >> 24);
+    }
+}
+
+/* ---------- Public interface ---------- */
+
+__attribute__((constructor)) static void digest_setup(void) {
+    crc32c_init_tables();
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    has_sse42 = __builtin_cpu_supports("sse4.2");
+    has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+void digest_init(digest_ctx_t *ctx, digest_alg_t alg) {
+    ctx->alg = alg;
+    switch (alg) {
+    case DIGEST_CRC32C: ctx->u.crc = 0xFFFFFFFFu; break;
+    case DIGEST_XXH64:  xxh64_init(&ctx->u.xxh); break;
+    case DIGEST_BLAKE3: b3_init(&ctx->u.b3); break;
+    default: break;
+    }
+}
+
+void digest_update(digest_ctx_t *ctx, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    switch (ctx->alg) {
+    case DIGEST_CRC32C: ctx->u.crc = crc32c_update(ctx->u.crc, p, len); break;
+    case DIGEST_XXH64:  xxh64_update(&ctx->u.xxh, p, len); break;
+    case DIGEST_BLAKE3: b3_update(&ctx->u.b3, p, len); break;
+    default: break;
+    }
+}
+
+size_t digest_final(digest_ctx_t *ctx, uint8_t out[DIGEST_MAX_SIZE]) {
+    switch (ctx->alg) {
+    case DIGEST_CRC32C: {
+        uint32_t crc = ~ctx->u.crc;
+        for (int i = 0; i < 4; i++)
+            out[i] = (uint8_t)(crc >> (24 - 8 * i));
+        return 4;
+    }
+    case DIGEST_XXH64: {
+        uint64_t h = xxh64_final(&ctx->u.xxh);
+        for (int i = 0; i < 8; i++)
+            out[i] = (uint8_t)(h >> (56 - 8 * i));
+        return 8;
+    }
+    case DIGEST_BLAKE3:
+        b3_final(&ctx->u.b3, out);
+        return 32;
+    default:
+        return 0;
+    }
+}
+
+size_t digest_size(digest_alg_t alg) {
+    switch (alg) {
+    case DIGEST_CRC32C: return 4;
+    case DIGEST_XXH64:  return 8;
+    case DIGEST_BLAKE3: return 32;
+    default:            return 0;
+    }
+}
+
+const char *digest_name(digest_alg_t alg) {
+    switch (alg) {
+    case DIGEST_CRC32C: return "crc32c";
+    case DIGEST_XXH64:  return "xxh64";
+    case DIGEST_BLAKE3: return "blake3";
+    default:            return "none";
+    }
+}
+
+digest_alg_t digest_from_name(const char *name) {
+    if (strcmp(name, "crc32c") == 0)
+        return DIGEST_CRC32C;
+    if (strcmp(name, "xxh64") == 0)
+        return DIGEST_XXH64;
+    if (strcmp(name, "blake3") == 0)
+        return DIGEST_BLAKE3;
+    return DIGEST_NONE;
+}
+
+void digest_hex(const uint8_t *digest, size_t len, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    hex[2 * len] = '\0';
+}
@@ -0,0 +1,70 @@
+/*
+ * Streaming digests shared by the copy and transfer programs.
+ * Data is hashed in the same pass that copies/sends/receives it, so
+ * verifying a transfer never needs a second read of the file.
+ *
+ *   crc32c  - CRC-32C (Castagnoli), SSE4.2 / ARMv8 CRC instructions when available
+ *   xxh64   - xxHash64, fast non-cryptographic hash
+ *   blake3  - BLAKE3-256, cryptographic
+ */
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_MAX_SIZE 32
+
+typedef enum {
+    DIGEST_NONE = 0,
+    DIGEST_CRC32C = 1,
+    DIGEST_XXH64 = 2,
+    DIGEST_BLAKE3 = 3
+} digest_alg_t;
+
+typedef struct {
+    uint64_t acc[4];
+    uint64_t total_len;
+    uint8_t mem[32];
+    unsigned mem_size;
+} xxh64_state_t;
+
+typedef struct {
+    uint32_t cv[8];
+    uint64_t chunk_counter;
+    uint8_t block[64];
+    uint8_t block_len;
+    uint8_t blocks_compressed;
+} blake3_chunk_t;
+
+typedef struct {
+    blake3_chunk_t chunk;
+    uint32_t cv_stack[54][8];
+    uint8_t cv_stack_len;
+    uint32_t stage_len;
+    uint8_t stage[8 * 1024];    // whole chunks waiting for the SIMD path
+} blake3_state_t;
+
+typedef struct {
+    digest_alg_t alg;
+    union {
+        uint32_t crc;
+        xxh64_state_t xxh;
+        blake3_state_t b3;
+    } u;
+} digest_ctx_t;
+
+void digest_init(digest_ctx_t *ctx, digest_alg_t alg);
+void digest_update(digest_ctx_t *ctx, const void *data, size_t len);
+// Writes digest_size(alg) bytes (big-endian for the integer digests); returns that size
+size_t digest_final(digest_ctx_t *ctx, uint8_t out[DIGEST_MAX_SIZE]);
+
+size_t digest_size(digest_alg_t alg);
+const char *digest_name(digest_alg_t alg);
+// Returns DIGEST_NONE for an unknown name
+digest_alg_t digest_from_name(const char *name);
+// hex must hold 2 * len + 1 bytes
+void digest_hex(const uint8_t *digest, size_t len, char *hex);
+
+#endif
@@ -0,0 +1,510 @@
+/*
+ * Asynchronous logger: per-thread rings and the background writer.
+ * See log.h for the model.
+ *
+ * Each ring has one producer (its thread) and one consumer (the writer),
+ * so head and tail are plain atomics with acquire/release ordering. A
+ * record never wraps: if it doesn't fit before the end of the buffer, a
+ * filler record covers the rest and the record starts at offset 0.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#define RING_SIZE   (128 * 1024)        /* power of two */
+#define STR_MAX     255
+#define MAX_ARGS    12
+#define LINE_MAX    4096                /* longer messages are truncated */
+#define BATCH_SIZE  (64 * 1024)
+#define IDLE_WAIT_MS 50
+
+typedef struct {
+    uint32_t size;          /* whole record, multiple of 8 */
+    uint8_t level;
+    uint8_t filler;         /* covers the end of the buffer, skip it */
+    uint16_t reserved;
+    uint32_t suppressed;    /* lines this site dropped before this one */
+    uint64_t sig;           /* argument types, see LOG_SIG */
+    const char *fmt;
+    uint64_t ts_ns;         /* CLOCK_REALTIME, 0 without LOG_TIMESTAMPS */
+    uint64_t args[];        /* LOG_T_STR: offset of the copy from the record */
+} log_rec_t;
+
+typedef struct log_ring {
+    _Atomic uint64_t head;      /* bytes written, by the owning thread */
+    char pad1[56];
+    _Atomic uint64_t tail;      /* bytes consumed, by the writer */
+    char pad2[56];
+    uint64_t cached_tail;       /* producer's last view of tail */
+    _Atomic uint32_t dropped;
+    _Atomic int closed;         /* owning thread has exited */
+    struct log_ring *next;
+    _Alignas(8) uint8_t buf[RING_SIZE];
+} log_ring_t;
+
+int log_level = LOG_LVL_INFO;
+unsigned log_rate = LOG_DEFAULT_RATE;
+
+static unsigned log_flags;
+static int started;
+static _Thread_local log_ring_t *my_ring;
+static pthread_key_t ring_key;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flushed = PTHREAD_COND_INITIALIZER;
+static log_ring_t *rings;
+static _Atomic int writer_sleeping;
+static uint64_t flush_requested, flush_done;
+static _Atomic(log_site_t *) limited_sites;     /* sites that ever suppressed */
+static int exit_hooked;
+
+static const char *level_prefix[] = { "error: ", "warning: ", "", "" };
+
+/* ---------- Formatting (writer thread, or in place with LOG_SYNC) ---------- */
+
+static size_t format_message(const log_rec_t *r, char *out, size_t cap) {
+    const char *f = r->fmt;
+    size_t n = 0;
+    int arg = 0;
+
+    while (*f != '\0' && n + 1 < cap) {
+        char spec[32];
+        const char *start;
+        uint64_t v;
+        double d;
+        int w = 0;
+
+        if (*f != '%') {
+            out[n++] = *f++;
+            continue;
+        }
+        if (f[1] == '%') {
+            out[n++] = '%';
+            f += 2;
+            continue;
+        }
+        start = f++;
+        while (*f != '\0' && strchr("diouxXeEfFgGaAcspn", *f) == NULL)
+            f++;
+        if (*f == '\0' || (size_t)(f - start + 1) >= sizeof(spec) || arg >= MAX_ARGS)
+            break;
+        memcpy(spec, start, (size_t)(f - start + 1));
+        spec[f - start + 1] = '\0';
+        f++;
+
+        v = r->args[arg];
+        switch ((r->sig >> (4 * arg++)) & 0xf) {
+        case LOG_T_INT:    w = snprintf(out + n, cap - n, spec, (int)v); break;
+        case LOG_T_UINT:   w = snprintf(out + n, cap - n, spec, (unsigned)v); break;
+        case LOG_T_LONG:   w = snprintf(out + n, cap - n, spec, (long)v); break;
+        case LOG_T_ULONG:  w = snprintf(out + n, cap - n, spec, (unsigned long)v); break;
+        case LOG_T_LLONG:  w = snprintf(out + n, cap - n, spec, (long long)v); break;
+        case LOG_T_ULLONG: w = snprintf(out + n, cap - n, spec, (unsigned long long)v); break;
+        case LOG_T_DOUBLE:
+            memcpy(&d, &v, sizeof(d));
+            w = snprintf(out + n, cap - n, spec, d);
+            break;
+        case LOG_T_STR:
+            w = snprintf(out + n, cap - n, spec, (const char *)r + v);
+            break;
+        case LOG_T_PTR:
+            if (spec[strlen(spec) - 1] != 'n')
+                w = snprintf(out + n, cap - n, spec, (void *)(uintptr_t)v);
+            break;
+        default:
+            break;      /* fewer arguments than conversions */
+        }
+        if (w > 0)
+            n += (size_t)w < cap - n ? (size_t)w : cap - n - 1;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/* One or two output lines for a record; cap must be at least LINE_MAX */
+static size_t format_record(const log_rec_t *r, char *out, size_t cap) {
+    static _Thread_local time_t last_sec = -1;
+    static _Thread_local char last_stamp[16];
+    char stamp[32] = "";
+    size_t n = 0, len;
+
+    if (r->ts_ns != 0) {
+        time_t sec = (time_t)(r->ts_ns / 1000000000u);
+        if (sec != last_sec) {
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            strftime(last_stamp, sizeof(last_stamp), "%H:%M:%S", &tm);
+            last_sec = sec;
+        }
+        snprintf(stamp, sizeof(stamp), "%s.%06u ", last_stamp,
+                 (unsigned)(r->ts_ns % 1000000000u / 1000));
+    }
+    if (r->suppressed > 0)
+        n += (size_t)snprintf(out, cap, "%s(%u similar lines suppressed)\n", stamp, r->suppressed);
+    n += (size_t)snprintf(out + n, cap - n, "%s%s", stamp, level_prefix[r->level]);
+    len = format_message(r, out + n, cap - n - 1);
+    n += len;
+    if (len == 0 || out[n - 1] != '\n')
+        out[n++] = '\n';
+    return n;
+}
+
+/* ---------- Writer thread ---------- */
+
+static void write_batch(const char *buf, size_t len) {
+    if (len > 0) {
+        fwrite(buf, 1, len, stdout);
+        fflush(stdout);
+    }
+}
+
+/* Format everything currently in the ring; returns 1 if it held anything */
+static int drain(log_ring_t *ring, char *batch, size_t *len) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+
+    if (dropped > 0) {
+        dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        *len += (size_t)snprintf(batch + *len, BATCH_SIZE - *len,
+                                 "(%u debug lines dropped: log ring full)\n", dropped);
+    }
+    if (tail == head)
+        return dropped > 0;
+
+    while (tail < head) {
+        const log_rec_t *r = (const log_rec_t *)(ring->buf + (tail & (RING_SIZE - 1)));
+        if (!r->filler) {
+            if (BATCH_SIZE - *len < LINE_MAX + 64) {
+                write_batch(batch, *len);
+                *len = 0;
+            }
+            *len += format_record(r, batch + *len, BATCH_SIZE - *len);
+        }
+        tail += r->size;
+        /* Hand space back as we go so a waiting producer can continue */
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return 1;
+}
+
+static int rings_pending(void) {
+    for (log_ring_t *r = rings; r != NULL; r = r->next) {
+        if (atomic_load_explicit(&r->head, memory_order_acquire)
+            != atomic_load_explicit(&r->tail, memory_order_relaxed))
+            return 1;
+    }
+    return 0;
+}
+
+static void *writer(void *arg) {
+    char *batch = malloc(BATCH_SIZE);
+    (void)arg;
+
+    if (batch == NULL)
+        return NULL;
+    for (;;) {
+        log_ring_t *list, **pp;
+        uint64_t gen;
+        size_t len = 0;
+        int busy = 0;
+
+        pthread_mutex_lock(&lock);
+        gen = flush_requested;
+        list = rings;
+        pthread_mutex_unlock(&lock);
+
+        /* New rings are pushed on the front, so this list stays valid */
+        for (log_ring_t *r = list; r != NULL; r = r->next)
+            busy |= drain(r, batch, &len);
+        write_batch(batch, len);
+
+        pthread_mutex_lock(&lock);
+        /* Free rings of exited threads once they're empty */
+        for (pp = &rings; *pp != NULL;) {
+            log_ring_t *r = *pp;
+            if (atomic_load_explicit(&r->closed, memory_order_acquire)
+                && atomic_load_explicit(&r->head, memory_order_acquire)
+                   == atomic_load_explicit(&r->tail, memory_order_relaxed)) {
+                *pp = r->next;
+                free(r);
+            } else {
+                pp = &r->next;
+            }
+        }
+        if (flush_done < gen) {
+            flush_done = gen;
+            pthread_cond_broadcast(&flushed);
+        }
+        if (!busy) {
+            atomic_store(&writer_sleeping, 1);
+            if (!rings_pending() && flush_requested == flush_done) {
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += IDLE_WAIT_MS * 1000000L;
+                if (until.tv_nsec >= 1000000000L) {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&wake, &lock, &until);
+            }
+            atomic_store(&writer_sleeping, 0);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static void wake_writer(void) {
+    if (atomic_load_explicit(&writer_sleeping, memory_order_relaxed)) {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/* ---------- Producers ---------- */
+
+static void ring_close(void *arg) {
+    log_ring_t *ring = arg;
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
+
+static log_ring_t *ring_attach(void) {
+    log_ring_t *ring = malloc(sizeof(*ring));
+
+    if (ring == NULL)
+        return NULL;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->closed, 0);
+    ring->cached_tail = 0;
+    pthread_mutex_lock(&lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&lock);
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+/* Space for size bytes at the head, or NULL if the ring is full */
+static log_rec_t *ring_reserve(log_ring_t *ring, uint32_t size, uint64_t *new_head) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t off = (uint32_t)(head & (RING_SIZE - 1));
+    uint32_t skip = off + size > RING_SIZE ? RING_SIZE - off : 0;
+
+    if (head + skip + size - ring->cached_tail > RING_SIZE) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head + skip + size - ring->cached_tail > RING_SIZE)
+            return NULL;
+    }
+    if (skip > 0) {
+        log_rec_t *fill = (log_rec_t *)(ring->buf + off);
+        fill->size = skip;
+        fill->filler = 1;
+        head += skip;
+        off = 0;
+    }
+    *new_head = head + size;
+    return (log_rec_t *)(ring->buf + off);
+}
+
+/* Returns 0 to log, -1 to suppress; *suppressed gets the count to report */
+static int rate_check(log_site_t *site, const char *fmt, uint32_t *suppressed) {
+    struct timespec now;
+    uint32_t sec, window;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    sec = (uint32_t)now.tv_sec;
+    window = atomic_load_explicit(&site->window, memory_order_relaxed);
+    if (window != sec
+        && atomic_compare_exchange_strong_explicit(&site->window, &window, sec,
+                                                   memory_order_relaxed, memory_order_relaxed))
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= log_rate) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        if (!atomic_exchange_explicit(&site->listed, 1, memory_order_relaxed)) {
+            /* First suppression here: remember the site so exit can report it */
+            site->fmt = fmt;
+            site->next = atomic_load_explicit(&limited_sites, memory_order_relaxed);
+            while (!atomic_compare_exchange_weak_explicit(&limited_sites, &site->next, site,
+                                                          memory_order_release,
+                                                          memory_order_relaxed))
+                ;
+        }
+        return -1;
+    }
+    if (atomic_load_explicit(&site->suppressed, memory_order_relaxed) > 0)
+        *suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    return 0;
+}
+
+void log_emit(int level, log_site_t *site, uint64_t sig, const char *fmt, ...) {
+    _Alignas(8) uint8_t tmp[sizeof(log_rec_t) + MAX_ARGS * (sizeof(uint64_t) + STR_MAX + 1) + 8];
+    uint64_t vals[MAX_ARGS];
+    const char *strs[MAX_ARGS];
+    size_t lens[MAX_ARGS];
+    uint32_t suppressed = 0, size;
+    int nargs = 0;
+    log_ring_t *ring;
+    log_rec_t *r;
+    uint64_t new_head;
+    va_list ap;
+
+    /* Errors and warnings are rare and matter: only the chatty levels are limited */
+    if (log_rate > 0 && level > LOG_LVL_WARN && rate_check(site, fmt, &suppressed) < 0)
+        return;
+
+    /* Pull the arguments by their recorded types */
+    size = sizeof(log_rec_t);
+    va_start(ap, fmt);
+    for (; nargs < MAX_ARGS; nargs++) {
+        unsigned t = (sig >> (4 * nargs)) & 0xf;
+        double d;
+        if (t == 0)
+            break;
+        strs[nargs] = NULL;
+        switch (t) {
+        case LOG_T_INT:    vals[nargs] = (uint64_t)(int64_t)va_arg(ap, int); break;
+        case LOG_T_UINT:   vals[nargs] = va_arg(ap, unsigned); break;
+        case LOG_T_LONG:   vals[nargs] = (uint64_t)va_arg(ap, long); break;
+        case LOG_T_ULONG:  vals[nargs] = va_arg(ap, unsigned long); break;
+        case LOG_T_LLONG:  vals[nargs] = (uint64_t)va_arg(ap, long long); break;
+        case LOG_T_ULLONG: vals[nargs] = va_arg(ap, unsigned long long); break;
+        case LOG_T_DOUBLE:
+            d = va_arg(ap, double);
+            memcpy(&vals[nargs], &d, sizeof(d));
+            break;
+        case LOG_T_STR:
+            strs[nargs] = va_arg(ap, const char *);
+            if (strs[nargs] == NULL)
+                strs[nargs] = "(null)";
+            lens[nargs] = strnlen(strs[nargs], STR_MAX);
+            size += (uint32_t)lens[nargs] + 1;
+            break;
+        default:
+            vals[nargs] = (uintptr_t)va_arg(ap, void *);
+            break;
+        }
+    }
+    va_end(ap);
+    size += (uint32_t)(nargs * sizeof(uint64_t));
+    size = (size + 7) & ~7u;
+
+    ring = my_ring;
+    if (started && ring == NULL)
+        ring = ring_attach();
+
+    if (ring == NULL) {
+        /* Not started (or no memory): build the record on the stack and print it now */
+        r = (log_rec_t *)tmp;
+        new_head = 0;
+    } else {
+        while ((r = ring_reserve(ring, size, &new_head)) == NULL) {
+            if (level == LOG_LVL_DEBUG) {
+                atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+                return;
+            }
+            /* Never lose errors and normal output: wait for the writer */
+            wake_writer();
+            sched_yield();
+        }
+    }
+
+    r->size = size;
+    r->level = (uint8_t)level;
+    r->filler = 0;
+    r->sig = sig;
+    r->suppressed = suppressed;
+    r->fmt = fmt;
+    r->ts_ns = 0;
+    if (log_flags & LOG_TIMESTAMPS) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        r->ts_ns = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    }
+    {
+        uint32_t str_off = (uint32_t)(sizeof(log_rec_t) + nargs * sizeof(uint64_t));
+        for (int i = 0; i < nargs; i++) {
+            if (strs[i] == NULL) {
+                r->args[i] = vals[i];
+                continue;
+            }
+            memcpy((char *)r + str_off, strs[i], lens[i]);
+            ((char *)r)[str_off + lens[i]] = '\0';
+            r->args[i] = str_off;
+            str_off += (uint32_t)lens[i] + 1;
+        }
+    }
+
+    if (ring == NULL) {
+        char line[LINE_MAX + 64];
+        fwrite(line, 1, format_record(r, line, sizeof(line)), stdout);
+        fflush(stdout);
+        return;
+    }
+    atomic_store_explicit(&ring->head, new_head, memory_order_release);
+    wake_writer();
+}
+
+/* ---------- Setup ---------- */
+
+void log_set_rate(unsigned per_second) {
+    log_rate = per_second;
+}
+
+void log_flush(void) {
+    uint64_t gen;
+
+    if (!started) {
+        fflush(stdout);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    gen = ++flush_requested;
+    pthread_cond_signal(&wake);
+    while (flush_done < gen)
+        pthread_cond_wait(&flushed, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+/* atexit: write what is queued, then the counts no later line reported */
+static void log_at_exit(void) {
+    log_flush();
+    for (log_site_t *s = atomic_load_explicit(&limited_sites, memory_order_acquire);
+         s != NULL; s = s->next) {
+        uint32_t n = atomic_exchange_explicit(&s->suppressed, 0, memory_order_relaxed);
+        if (n > 0)
+            printf("(%u similar lines suppressed: \"%s\")\n", n, s->fmt);
+    }
+    fflush(stdout);
+}
+
+void log_init(log_level_t level, unsigned flags) {
+    pthread_t tid;
+
+    log_level = level;
+    log_flags = flags;
+    if (!exit_hooked) {
+        exit_hooked = 1;
+        atexit(log_at_exit);
+    }
+    if (started || (flags & LOG_SYNC))
+        return;
+    if (pthread_key_create(&ring_key, ring_close) != 0
+        || pthread_create(&tid, NULL, writer, NULL) != 0)
+        return;     /* stay synchronous */
+    pthread_detach(tid);
+    started = 1;
+}
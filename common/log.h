@@ -0,0 +1,133 @@
+/*
+ * Asynchronous logger for the network programs.
+ *
+ * log_info("sent %d bytes to %s", n, name) does not format anything: it
+ * copies the format pointer, the arguments (tagged by type with _Generic)
+ * and a timestamp into a ring owned by the calling thread. One background
+ * thread drains all rings, formats the records and writes them to stdout
+ * in batches. The hot path is a level check, a few stores and no locks.
+ *
+ *   - levels: error, warn, info, debug; below log_level costs one compare,
+ *     and levels above LOG_COMPILE_LEVEL are compiled out
+ *   - rate limiting: each info or debug call site may log at most log_rate
+ *     lines per second; the number suppressed is reported when the site
+ *     logs again, or at exit. Errors and warnings are never limited.
+ *   - a full ring drops debug records (counted and reported) and makes
+ *     other levels wait for space
+ *
+ * Formats are checked by the compiler. Up to 12 arguments of integer,
+ * floating point, string or pointer type; strings are copied (up to 255
+ * bytes). '*' widths are not supported.
+ * Lines of one thread keep their order; lines of different threads are
+ * written ring by ring, so timestamps may go slightly back across threads.
+ * Call log_flush() before writing to stdout directly (prompts); exit()
+ * flushes as well.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+typedef enum {
+    LOG_LVL_ERROR = 0,
+    LOG_LVL_WARN,
+    LOG_LVL_INFO,
+    LOG_LVL_DEBUG
+} log_level_t;
+
+#define LOG_TIMESTAMPS  0x1     /* prefix lines with the wall-clock time */
+#define LOG_SYNC        0x2     /* no background thread, format in place */
+
+#define LOG_DEFAULT_RATE 1000   /* lines per second per call site */
+
+/* Building with -DNO_VERBOSE drops debug logging from the binary */
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NO_VERBOSE
+#define LOG_COMPILE_LEVEL LOG_LVL_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_LVL_DEBUG
+#endif
+#endif
+
+/* Set by log_init(); read without locks on every call */
+extern int log_level;
+extern unsigned log_rate;
+
+/* Start the background writer. Without it, records are formatted in place. */
+void log_init(log_level_t level, unsigned flags);
+/* Lines per second per call site, 0 = unlimited */
+void log_set_rate(unsigned per_second);
+/* Wait until everything logged so far has been written */
+void log_flush(void);
+
+#define log_enabled(lvl) ((lvl) <= LOG_COMPILE_LEVEL && (int)(lvl) <= log_level)
+
+#define log_error(...)  LOG_AT(LOG_LVL_ERROR, __VA_ARGS__)
+#define log_warn(...)   LOG_AT(LOG_LVL_WARN, __VA_ARGS__)
+#define log_info(...)   LOG_AT(LOG_LVL_INFO, __VA_ARGS__)
+#define log_debug(...)  LOG_AT(LOG_LVL_DEBUG, __VA_ARGS__)
+
+/* ---------- Internals used by the macros ---------- */
+
+/* Per call site rate-limit state */
+typedef struct log_site {
+    _Atomic uint32_t window;        /* second the count belongs to */
+    _Atomic uint32_t count;
+    _Atomic uint32_t suppressed;
+    _Atomic int listed;             /* on the list reported at exit */
+    const char *fmt;
+    struct log_site *next;
+} log_site_t;
+
+enum {
+    LOG_T_INT = 1, LOG_T_UINT, LOG_T_LONG, LOG_T_ULONG, LOG_T_LLONG, LOG_T_ULLONG,
+    LOG_T_DOUBLE, LOG_T_STR, LOG_T_PTR
+};
+
+void log_emit(int level, log_site_t *site, uint64_t sig, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#define LOG_AT(lvl, ...) \
+    do { \
+        if (log_enabled(lvl)) { \
+            static log_site_t log_site_; \
+            log_emit((lvl), &log_site_, LOG_SIG(__VA_ARGS__), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_TYPE(x) _Generic((x), \
+    _Bool: LOG_T_INT, char: LOG_T_INT, signed char: LOG_T_INT, unsigned char: LOG_T_INT, \
+    short: LOG_T_INT, unsigned short: LOG_T_INT, int: LOG_T_INT, unsigned int: LOG_T_UINT, \
+    long: LOG_T_LONG, unsigned long: LOG_T_ULONG, \
+    long long: LOG_T_LLONG, unsigned long long: LOG_T_ULLONG, \
+    float: LOG_T_DOUBLE, double: LOG_T_DOUBLE, \
+    char *: LOG_T_STR, const char *: LOG_T_STR, default: LOG_T_PTR)
+
+/* Argument types, 4 bits each: first argument in the low bits, 0 ends the list */
+#define LOG_CAT_(a, b) a##b
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_COUNT_(f, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, n, ...) n
+#define LOG_COUNT(...) LOG_COUNT_(__VA_ARGS__, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0, _)
+#define LOG_SIG(...) LOG_CAT(LOG_SIG_, LOG_COUNT(__VA_ARGS__))(__VA_ARGS__)
+#define LOG_T(x, i) ((uint64_t)LOG_TYPE(x) << (4 * (i)))
+#define LOG_SIG_0(f) 0u
+#define LOG_SIG_1(f, a) LOG_T(a, 0)
+#define LOG_SIG_2(f, a, b) (LOG_T(a, 0) | LOG_T(b, 1))
+#define LOG_SIG_3(f, a, b, c) (LOG_SIG_2(f, a, b) | LOG_T(c, 2))
+#define LOG_SIG_4(f, a, b, c, d) (LOG_SIG_3(f, a, b, c) | LOG_T(d, 3))
+#define LOG_SIG_5(f, a, b, c, d, e) (LOG_SIG_4(f, a, b, c, d) | LOG_T(e, 4))
+#define LOG_SIG_6(f, a, b, c, d, e, g) (LOG_SIG_5(f, a, b, c, d, e) | LOG_T(g, 5))
+#define LOG_SIG_7(f, a, b, c, d, e, g, h) (LOG_SIG_6(f, a, b, c, d, e, g) | LOG_T(h, 6))
+#define LOG_SIG_8(f, a, b, c, d, e, g, h, i) (LOG_SIG_7(f, a, b, c, d, e, g, h) | LOG_T(i, 7))
+#define LOG_SIG_9(f, a, b, c, d, e, g, h, i, j) \
+    (LOG_SIG_8(f, a, b, c, d, e, g, h, i) | LOG_T(j, 8))
+#define LOG_SIG_10(f, a, b, c, d, e, g, h, i, j, k) \
+    (LOG_SIG_9(f, a, b, c, d, e, g, h, i, j) | LOG_T(k, 9))
+#define LOG_SIG_11(f, a, b, c, d, e, g, h, i, j, k, l) \
+    (LOG_SIG_10(f, a, b, c, d, e, g, h, i, j, k) | LOG_T(l, 10))
+#define LOG_SIG_12(f, a, b, c, d, e, g, h, i, j, k, l, m) \
+    (LOG_SIG_11(f, a, b, c, d, e, g, h, i, j, k, l) | LOG_T(m, 11))
+
+#endif
@@ -0,0 +1,290 @@
+/*
+ * Transfer manifests (see manifest.h).
+ *
+ * On disk: manifest_hdr_t, then one bit per chunk (bit i % 8 of byte i / 8).
+ * Host byte order, since a manifest never leaves the machine. A sync writes
+ * the whole thing to <path>.manifest.tmp, fsyncs it and renames it over
+ * the old one; a bitmap is 1 bit per chunk, so even multi-GB files cost a
+ * few hundred KB per second at most.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "manifest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MANIFEST_MAGIC 0x464d5458u     /* "XTMF" */
+#define MANIFEST_FORMAT 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t format;
+    uint64_t size;
+    uint64_t version;
+    uint32_t chunk;
+    uint32_t reserved;
+} manifest_hdr_t;
+
+struct manifest {
+    char *path;                 /* <data>.manifest */
+    char *tmp_path;             /* <data>.manifest.tmp, renamed over it */
+    int data_fd;
+    manifest_hdr_t hdr;
+    uint64_t chunks, have;
+    uint64_t first_missing;     /* everything before it has arrived */
+    uint8_t *bits;
+    size_t bits_len;
+    int dirty;
+    uint64_t synced_ns;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static char *manifest_path(const char *path, const char *suffix) {
+    size_t len = strlen(path);
+    char *p = malloc(len + strlen(MANIFEST_SUFFIX) + strlen(suffix) + 1);
+
+    if (p != NULL) {
+        memcpy(p, path, len);
+        strcpy(p + len, MANIFEST_SUFFIX);
+        strcat(p + len, suffix);
+    }
+    return p;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static uint64_t chunk_count(uint64_t size, uint32_t chunk) {
+    return (size + chunk - 1) / chunk;
+}
+
+/* Header and bitmap of an existing manifest; bits is malloc'd */
+static int load(const char *mpath, manifest_hdr_t *hdr, uint8_t **bits, size_t *bits_len) {
+    int fd = open(mpath, O_RDONLY | O_CLOEXEC);
+    int ok;
+
+    if (fd < 0)
+        return -1;
+    ok = read_full(fd, hdr, sizeof(*hdr)) == 0 && hdr->magic == MANIFEST_MAGIC
+         && hdr->format == MANIFEST_FORMAT && hdr->chunk > 0;
+    if (ok) {
+        *bits_len = (size_t)((chunk_count(hdr->size, hdr->chunk) + 7) / 8);
+        *bits = calloc(*bits_len ? *bits_len : 1, 1);
+        ok = *bits != NULL && read_full(fd, *bits, *bits_len) == 0;
+        if (!ok)
+            free(*bits);
+    }
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+static int bit(const uint8_t *bits, uint64_t i) {
+    return bits[i / 8] >> (i % 8) & 1;
+}
+
+static uint64_t scan_missing(const uint8_t *bits, uint64_t chunks, uint64_t from) {
+    while (from < chunks && bit(bits, from)) {
+        /* Skip whole bytes of arrived chunks */
+        if (from % 8 == 0 && from + 8 <= chunks && bits[from / 8] == 0xff)
+            from += 8;
+        else
+            from++;
+    }
+    return from;
+}
+
+manifest_t *manifest_open(const char *path, int data_fd, uint64_t size, uint32_t chunk,
+                          uint64_t version, int fresh) {
+    manifest_t *m;
+    manifest_hdr_t old;
+    uint8_t *bits;
+    size_t bits_len;
+
+    if (chunk == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((m = calloc(1, sizeof(*m))) == NULL)
+        return NULL;
+    m->path = manifest_path(path, "");
+    m->tmp_path = manifest_path(path, ".tmp");
+    if (m->path == NULL || m->tmp_path == NULL) {
+        free(m->path);
+        free(m->tmp_path);
+        free(m);
+        return NULL;
+    }
+    m->data_fd = data_fd;
+    m->hdr.magic = MANIFEST_MAGIC;
+    m->hdr.format = MANIFEST_FORMAT;
+    m->hdr.size = size;
+    m->hdr.version = version;
+    m->hdr.chunk = chunk;
+    m->chunks = chunk_count(size, chunk);
+    m->bits_len = (size_t)((m->chunks + 7) / 8);
+
+    if (!fresh && load(m->path, &old, &bits, &bits_len) == 0) {
+        if (old.size == size && old.chunk == chunk && old.version == version) {
+            m->bits = bits;
+            for (uint64_t i = 0; i < m->chunks; i++)
+                m->have += (uint64_t)bit(bits, i);
+        } else {
+            free(bits);
+        }
+    }
+    if (m->bits == NULL && (m->bits = calloc(m->bits_len ? m->bits_len : 1, 1)) == NULL) {
+        free(m->path);
+        free(m->tmp_path);
+        free(m);
+        return NULL;
+    }
+    m->first_missing = scan_missing(m->bits, m->chunks, 0);
+    /* A new manifest goes to disk at the first sync, not before any data */
+    m->dirty = 1;
+    m->synced_ns = now_ns();
+    return m;
+}
+
+int manifest_peek(const char *path, uint64_t *size, uint64_t *version, uint64_t *prefix) {
+    manifest_hdr_t hdr;
+    uint8_t *bits;
+    size_t bits_len;
+    char *mpath = manifest_path(path, "");
+    uint64_t chunks, first;
+
+    if (mpath == NULL)
+        return -1;
+    if (load(mpath, &hdr, &bits, &bits_len) < 0) {
+        free(mpath);
+        return -1;
+    }
+    free(mpath);
+    chunks = chunk_count(hdr.size, hdr.chunk);
+    first = scan_missing(bits, chunks, 0);
+    free(bits);
+    *size = hdr.size;
+    *version = hdr.version;
+    *prefix = first >= chunks ? hdr.size : first * hdr.chunk;
+    return 0;
+}
+
+void manifest_set(manifest_t *m, uint64_t index) {
+    if (index >= m->chunks || bit(m->bits, index))
+        return;
+    m->bits[index / 8] |= (uint8_t)(1u << (index % 8));
+    m->have++;
+    m->dirty = 1;
+    if (index == m->first_missing)
+        m->first_missing = scan_missing(m->bits, m->chunks, index);
+}
+
+int manifest_has(const manifest_t *m, uint64_t index) {
+    return index < m->chunks && bit(m->bits, index);
+}
+
+uint64_t manifest_chunks(const manifest_t *m) {
+    return m->chunks;
+}
+
+uint64_t manifest_missing(const manifest_t *m) {
+    return m->chunks - m->have;
+}
+
+uint64_t manifest_prefix(const manifest_t *m) {
+    return m->first_missing >= m->chunks ? m->hdr.size : m->first_missing * m->hdr.chunk;
+}
+
+uint64_t manifest_next_missing(const manifest_t *m, uint64_t from, uint64_t *run) {
+    uint64_t start = scan_missing(m->bits, m->chunks, from > m->first_missing ? from : m->first_missing);
+    uint64_t end = start;
+
+    while (end < m->chunks && !bit(m->bits, end))
+        end++;
+    *run = end - start;
+    return start;
+}
+
+int manifest_due(const manifest_t *m) {
+    return m->dirty && now_ns() - m->synced_ns >= (uint64_t)MANIFEST_SYNC_MS * 1000000;
+}
+
+int manifest_sync(manifest_t *m) {
+    int fd, err = 0;
+
+    if (!m->dirty)
+        return 0;
+    /* Data before the bitmap that says it is there */
+    if (fdatasync(m->data_fd) < 0)
+        return -1;
+    fd = open(m->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0
+        || write_full(fd, &m->hdr, sizeof(m->hdr)) < 0
+        || write_full(fd, m->bits, m->bits_len) < 0
+        || fsync(fd) < 0)
+        err = -1;
+    if (fd >= 0)
+        close(fd);
+    if (err == 0 && rename(m->tmp_path, m->path) < 0)
+        err = -1;
+    if (err < 0)
+        unlink(m->tmp_path);
+    if (err == 0) {
+        m->dirty = 0;
+        m->synced_ns = now_ns();
+    }
+    return err;
+}
+
+int manifest_close(manifest_t *m, int discard) {
+    int err = 0;
+
+    if (m == NULL)
+        return 0;
+    if (discard || m->have == m->chunks) {
+        if (unlink(m->path) < 0 && errno != ENOENT)
+            err = -1;
+    } else {
+        err = manifest_sync(m);
+    }
+    free(m->bits);
+    free(m->path);
+    free(m->tmp_path);
+    free(m);
+    return err;
+}
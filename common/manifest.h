@@ -0,0 +1,67 @@
+/*
+ * Transfer manifests: which chunks of a file being received have arrived,
+ * kept on disk next to it as <path>.manifest so an interrupted transfer
+ * can be resumed instead of restarted from byte zero.
+ *
+ *   manifest_t *m = manifest_open("out.bin", fd, size, 64 * 1024, version, 0);
+ *   ... pwrite(fd, chunk i) ...
+ *   manifest_set(m, i);
+ *   if (manifest_due(m))
+ *       manifest_sync(m);          // fdatasync(fd), then the bitmap
+ *   manifest_close(m, 0);          // removed once every chunk is in
+ *
+ * The receiver owns the manifest. A chunk is one unit of the transfer
+ * (a packet's worth of data, a compression chunk); the last one may be
+ * short. version identifies the sender's copy of the file (e.g. its mtime)
+ * so a manifest is never applied to a file that changed in between.
+ *
+ * A sync makes the data durable before the bitmap that describes it, and
+ * replaces the manifest atomically, so after a crash the manifest may
+ * miss the last MANIFEST_SYNC_MS of progress but never claims a chunk
+ * that is not on disk. One thread per manifest.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+
+#define MANIFEST_SUFFIX ".manifest"
+#define MANIFEST_SYNC_MS 1000
+
+typedef struct manifest manifest_t;
+
+/*
+ * Manifest for data file path, whose descriptor is data_fd. Unless fresh
+ * is set, an existing manifest for the same size, chunk size and version
+ * is loaded; otherwise it starts with no chunks. NULL with errno set.
+ */
+manifest_t *manifest_open(const char *path, int data_fd, uint64_t size, uint32_t chunk,
+                          uint64_t version, int fresh);
+
+/*
+ * What an interrupted transfer into path left behind, without opening it
+ * for writing: 0 and its size, version and contiguous prefix in bytes,
+ * or -1 if there is no (readable) manifest.
+ */
+int manifest_peek(const char *path, uint64_t *size, uint64_t *version, uint64_t *prefix);
+
+void manifest_set(manifest_t *m, uint64_t index);
+int manifest_has(const manifest_t *m, uint64_t index);
+
+uint64_t manifest_chunks(const manifest_t *m);
+uint64_t manifest_missing(const manifest_t *m);
+/* Bytes from offset 0 that have all arrived */
+uint64_t manifest_prefix(const manifest_t *m);
+/* First missing chunk at or after from (manifest_chunks() if none) and how many follow it */
+uint64_t manifest_next_missing(const manifest_t *m, uint64_t from, uint64_t *run);
+
+/* Changed and not synced for MANIFEST_SYNC_MS */
+int manifest_due(const manifest_t *m);
+/* fdatasync the data file, then write the manifest; 0 or -1 */
+int manifest_sync(manifest_t *m);
+
+/* Sync and free; the file is removed when the transfer is complete or discard is set */
+int manifest_close(manifest_t *m, int discard);
+
+#endif
@@ -0,0 +1,484 @@
+/*
+ * Metrics registry, per-thread shards and the Prometheus exporter.
+ * See metrics.h for the model.
+ *
+ * Each thread gets a shard on its first update. When the thread exits its
+ * counts are folded into a retired shard and the shard is reused, so
+ * thread-per-connection servers don't grow without bound. Scrapes take
+ * the registry lock and sum the retired shard plus all live ones.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+
+#define MAX_COLLECTORS 8
+
+typedef struct {
+    const char *name;
+    const char *help;
+} metric_desc_t;
+
+struct metrics_writer {
+    char *buf;
+    size_t len, cap;
+};
+
+_Thread_local metrics_shard_t *metrics_tls;
+
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+
+static metric_desc_t counters[METRICS_MAX_COUNTERS];
+static metric_desc_t gauges[METRICS_MAX_GAUGES];
+static metric_desc_t histograms[METRICS_MAX_HISTOGRAMS];
+static int ncounters, ngauges, nhistograms;
+static _Atomic int64_t gauge_values[METRICS_MAX_GAUGES];
+static metrics_collect_fn collectors[MAX_COLLECTORS];
+static int ncollectors;
+
+static metrics_shard_t *live;       /* shards owned by running threads */
+static metrics_shard_t *spare;      /* shards of exited threads, zeroed */
+static metrics_shard_t retired;     /* counts from exited threads */
+
+/* Prometheus "le" bounds for histograms, in seconds */
+static const double bucket_bounds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+    1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static void shard_fold(metrics_shard_t *dst, metrics_shard_t *src) {
+    for (int i = 0; i < METRICS_MAX_COUNTERS; i++)
+        metrics_bump(&dst->counters[i], atomic_load_explicit(&src->counters[i], memory_order_relaxed));
+    for (int h = 0; h < METRICS_MAX_HISTOGRAMS; h++) {
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            metrics_bump(&dst->hist[h][b], atomic_load_explicit(&src->hist[h][b], memory_order_relaxed));
+        metrics_bump(&dst->hist_sum[h], atomic_load_explicit(&src->hist_sum[h], memory_order_relaxed));
+    }
+}
+
+/* Thread exit: keep the counts, recycle the memory */
+static void shard_release(void *arg) {
+    metrics_shard_t *s = arg, **pp;
+
+    pthread_mutex_lock(&reg_lock);
+    for (pp = &live; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+    shard_fold(&retired, s);
+    memset(s, 0, sizeof(*s));
+    s->next = spare;
+    spare = s;
+    pthread_mutex_unlock(&reg_lock);
+}
+
+static void make_key(void) {
+    pthread_key_create(&shard_key, shard_release);
+}
+
+metrics_shard_t *metrics_attach(void) {
+    metrics_shard_t *s;
+
+    pthread_once(&key_once, make_key);
+    pthread_mutex_lock(&reg_lock);
+    s = spare;
+    if (s != NULL)
+        spare = s->next;
+    else
+        s = calloc(1, sizeof(*s));
+    if (s != NULL) {
+        s->next = live;
+        live = s;
+    }
+    pthread_mutex_unlock(&reg_lock);
+    if (s != NULL) {
+        pthread_setspecific(shard_key, s);
+        metrics_tls = s;
+    }
+    return s;
+}
+
+static int add_desc(metric_desc_t *table, int *count, int max, const char *name, const char *help) {
+    int id = -1;
+    pthread_mutex_lock(&reg_lock);
+    if (*count < max) {
+        id = (*count)++;
+        table[id].name = name;
+        table[id].help = help;
+    }
+    pthread_mutex_unlock(&reg_lock);
+    return id;
+}
+
+int metrics_counter(const char *name, const char *help) {
+    return add_desc(counters, &ncounters, METRICS_MAX_COUNTERS, name, help);
+}
+
+int metrics_gauge(const char *name, const char *help) {
+    return add_desc(gauges, &ngauges, METRICS_MAX_GAUGES, name, help);
+}
+
+int metrics_histogram(const char *name, const char *help) {
+    return add_desc(histograms, &nhistograms, METRICS_MAX_HISTOGRAMS, name, help);
+}
+
+void metrics_gauge_set(int id, int64_t value) {
+    if (id >= 0)
+        atomic_store_explicit(&gauge_values[id], value, memory_order_relaxed);
+}
+
+void metrics_gauge_add(int id, int64_t delta) {
+    if (id >= 0)
+        atomic_fetch_add_explicit(&gauge_values[id], delta, memory_order_relaxed);
+}
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_add_collector(metrics_collect_fn fn) {
+    pthread_mutex_lock(&reg_lock);
+    if (ncollectors < MAX_COLLECTORS)
+        collectors[ncollectors++] = fn;
+    pthread_mutex_unlock(&reg_lock);
+}
+
+/* ---------- Aggregation (callers hold reg_lock) ---------- */
+
+static uint64_t sum_counter(int id) {
+    uint64_t total = atomic_load_explicit(&retired.counters[id], memory_order_relaxed);
+    for (metrics_shard_t *s = live; s != NULL; s = s->next)
+        total += atomic_load_explicit(&s->counters[id], memory_order_relaxed);
+    return total;
+}
+
+/* Merge one histogram over all shards into buckets[]; returns the sum in ns */
+static uint64_t sum_histogram(int id, uint64_t *buckets) {
+    uint64_t total = atomic_load_explicit(&retired.hist_sum[id], memory_order_relaxed);
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        buckets[b] = atomic_load_explicit(&retired.hist[id][b], memory_order_relaxed);
+    for (metrics_shard_t *s = live; s != NULL; s = s->next) {
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            buckets[b] += atomic_load_explicit(&s->hist[id][b], memory_order_relaxed);
+        total += atomic_load_explicit(&s->hist_sum[id], memory_order_relaxed);
+    }
+    return total;
+}
+
+/* Largest value that lands in bucket idx */
+static uint64_t bucket_upper(unsigned idx) {
+    unsigned e, shift;
+    if (idx < HIST_SUB)
+        return idx;
+    e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    shift = e - HIST_SUB_BITS;
+    return (((uint64_t)(HIST_SUB + idx % HIST_SUB) + 1) << shift) - 1;
+}
+
+static uint64_t quantile_of(const uint64_t *buckets, double q) {
+    uint64_t count = 0, rank, seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        count += buckets[b];
+    if (count == 0)
+        return 0;
+    /* Nearest rank: the ceil(q * count)-th smallest value */
+    rank = (uint64_t)(q * (double)count);
+    if ((double)rank < q * (double)count || rank == 0)
+        rank++;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank)
+            return bucket_upper((unsigned)b);
+    }
+    return bucket_upper(HIST_BUCKETS - 1);
+}
+
+uint64_t metrics_counter_value(int id) {
+    uint64_t v;
+    if (id < 0)
+        return 0;
+    pthread_mutex_lock(&reg_lock);
+    v = sum_counter(id);
+    pthread_mutex_unlock(&reg_lock);
+    return v;
+}
+
+uint64_t metrics_histogram_count(int id) {
+    uint64_t buckets[HIST_BUCKETS], count = 0;
+    if (id < 0)
+        return 0;
+    pthread_mutex_lock(&reg_lock);
+    sum_histogram(id, buckets);
+    pthread_mutex_unlock(&reg_lock);
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        count += buckets[b];
+    return count;
+}
+
+uint64_t metrics_histogram_quantile(int id, double q) {
+    uint64_t buckets[HIST_BUCKETS];
+    if (id < 0)
+        return 0;
+    pthread_mutex_lock(&reg_lock);
+    sum_histogram(id, buckets);
+    pthread_mutex_unlock(&reg_lock);
+    return quantile_of(buckets, q);
+}
+
+/* ---------- Exposition ---------- */
+
+static void emit(metrics_writer_t *w, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    if (w->buf == NULL)
+        return;
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(w->buf + w->len, w->cap - w->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (w->len + (size_t)n < w->cap)
+            break;
+        char *bigger = realloc(w->buf, w->cap * 2 + (size_t)n);
+        if (bigger == NULL) {
+            free(w->buf);
+            w->buf = NULL;
+            return;
+        }
+        w->buf = bigger;
+        w->cap = w->cap * 2 + (size_t)n;
+    }
+    w->len += (size_t)n;
+}
+
+void metrics_family(metrics_writer_t *w, const char *name, const char *type, const char *help) {
+    emit(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_sample(metrics_writer_t *w, const char *name, const char *labels, double value) {
+    if (labels != NULL)
+        emit(w, "%s{%s} %.17g\n", name, labels, value);
+    else
+        emit(w, "%s %.17g\n", name, value);
+}
+
+static void render_histogram(metrics_writer_t *w, int id) {
+    uint64_t buckets[HIST_BUCKETS], count = 0, sum_ns;
+    const char *name = histograms[id].name;
+    unsigned b = 0;
+
+    sum_ns = sum_histogram(id, buckets);
+    metrics_family(w, name, "histogram", histograms[id].help);
+    for (size_t i = 0; i < sizeof(bucket_bounds) / sizeof(bucket_bounds[0]); i++) {
+        uint64_t limit = (uint64_t)(bucket_bounds[i] * 1e9);
+        while (b < HIST_BUCKETS && bucket_upper(b) <= limit)
+            count += buckets[b++];
+        emit(w, "%s_bucket{le=\"%g\"} %llu\n", name, bucket_bounds[i], (unsigned long long)count);
+    }
+    while (b < HIST_BUCKETS)
+        count += buckets[b++];
+    emit(w, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+    emit(w, "%s_sum %.9f\n%s_count %llu\n", name, sum_ns / 1e9, name, (unsigned long long)count);
+
+    /* Quantiles straight from the fine-grained buckets */
+    emit(w, "# HELP %s_quantile %s (quantiles)\n# TYPE %s_quantile gauge\n",
+         name, histograms[id].help, name);
+    emit(w, "%s_quantile{quantile=\"0.5\"} %.9f\n", name, quantile_of(buckets, 0.5) / 1e9);
+    emit(w, "%s_quantile{quantile=\"0.99\"} %.9f\n", name, quantile_of(buckets, 0.99) / 1e9);
+    emit(w, "%s_quantile{quantile=\"0.999\"} %.9f\n", name, quantile_of(buckets, 0.999) / 1e9);
+}
+
+char *metrics_render(size_t *len) {
+    metrics_writer_t w = { malloc(16384), 0, 16384 };
+    int nc;
+
+    pthread_mutex_lock(&reg_lock);
+    for (int i = 0; i < ncounters; i++) {
+        metrics_family(&w, counters[i].name, "counter", counters[i].help);
+        emit(&w, "%s %llu\n", counters[i].name, (unsigned long long)sum_counter(i));
+    }
+    for (int i = 0; i < ngauges; i++) {
+        metrics_family(&w, gauges[i].name, "gauge", gauges[i].help);
+        emit(&w, "%s %lld\n", gauges[i].name,
+             (long long)atomic_load_explicit(&gauge_values[i], memory_order_relaxed));
+    }
+    for (int i = 0; i < nhistograms; i++)
+        render_histogram(&w, i);
+    nc = ncollectors;
+    pthread_mutex_unlock(&reg_lock);
+
+    /* Collectors take their own locks */
+    for (int i = 0; i < nc; i++)
+        collectors[i](&w);
+
+    if (len != NULL)
+        *len = w.buf != NULL ? w.len : 0;
+    return w.buf;
+}
+
+/* ---------- Exporter ---------- */
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * One scrape per connection. HTTP clients (curl, Prometheus) get an HTTP
+ * response; anything else, e.g. `nc -U`, gets the bare text.
+ */
+static void serve_scrape(int fd) {
+    char req[1024], header[160];
+    struct timeval tv = { 0, 200000 };
+    ssize_t got = 0, n;
+    size_t len;
+    char *body;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while ((size_t)got < sizeof(req) - 1) {
+        n = read(fd, req + got, sizeof(req) - 1 - (size_t)got);
+        if (n <= 0)
+            break;
+        got += n;
+        req[got] = '\0';
+        if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+            break;
+    }
+
+    body = metrics_render(&len);
+    if (body == NULL)
+        return;
+    if (got >= 4 && memcmp(req, "GET ", 4) == 0) {
+        int hl = snprintf(header, sizeof(header),
+                          "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n\r\n", len);
+        if (write_all(fd, header, (size_t)hl) == 0)
+            write_all(fd, body, len);
+    } else {
+        write_all(fd, body, len);
+    }
+    free(body);
+}
+
+static void *exporter(void *arg) {
+    int listenfd = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        serve_scrape(fd);
+        close(fd);
+    }
+    close(listenfd);
+    return NULL;
+}
+
+static int listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);   // stale socket from an earlier run
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int listen_tcp(const char *spec) {
+    struct sockaddr_in addr;
+    const char *colon = strrchr(spec, ':');
+    char host[64] = "127.0.0.1";
+    int fd, one = 1, port;
+
+    if (colon != NULL) {
+        if ((size_t)(colon - spec) >= sizeof(host)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(host, spec, (size_t)(colon - spec));
+        host[colon - spec] = '\0';
+        spec = colon + 1;
+    }
+    port = atoi(spec);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (port <= 0 || port > 65535 || inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int metrics_serve(const char *endpoint) {
+    pthread_t tid;
+    int fd;
+
+    if (strncmp(endpoint, "unix:", 5) == 0)
+        fd = listen_unix(endpoint + 5);
+    else
+        fd = listen_tcp(endpoint);
+    if (fd < 0)
+        return -1;
+    if (pthread_create(&tid, NULL, exporter, (void *)(intptr_t)fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * Socket addressing (see net.h).
+ *
+ * The steering program is classic BPF, which needs no loader library:
+ * load the receiving CPU (an ancillary field), reduce it modulo the group
+ * size and return that as the socket index.
+ */
+
+#define _GNU_SOURCE
+#include "net.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+int net_resolve(const char *host, int port, int socktype, struct sockaddr_storage *addr,
+                socklen_t *len) {
+    struct addrinfo hints, *res;
+    char service[8];
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (port <= 0 || port > 65535) {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(service, sizeof(service), "%d", port);
+    if ((rc = getaddrinfo(host, service, &hints, &res)) != 0) {
+        if (rc != EAI_SYSTEM)
+            errno = ENOENT;
+        return -1;
+    }
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    *len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+int net_split(const char *hostport, char *host, size_t hostlen, int *port) {
+    const char *start = hostport, *end, *colon;
+    char *rest;
+    long p;
+
+    if (*hostport == '[') {
+        start = hostport + 1;
+        if ((end = strchr(start, ']')) == NULL || end[1] != ':')
+            return -1;
+        colon = end + 1;
+    } else {
+        if ((colon = strrchr(hostport, ':')) == NULL || memchr(hostport, ':', (size_t)(colon - hostport)))
+            return -1;          /* none, or an IPv6 literal without brackets */
+        end = colon;
+    }
+    if (end == start || (size_t)(end - start) >= hostlen)
+        return -1;
+    p = strtol(colon + 1, &rest, 10);
+    if (rest == colon + 1 || *rest != '\0' || p <= 0 || p > 65535)
+        return -1;
+    memcpy(host, start, (size_t)(end - start));
+    host[end - start] = '\0';
+    *port = (int)p;
+    return 0;
+}
+
+static int bind_family(int family, int socktype, int port, int flags) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    int fd, one = 1, zero = 0;
+
+    memset(&ss, 0, sizeof(ss));
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *a = (struct sockaddr_in6 *)&ss;
+        a->sin6_family = AF_INET6;
+        a->sin6_addr = in6addr_any;
+        a->sin6_port = htons((uint16_t)port);
+        len = sizeof(*a);
+    } else {
+        struct sockaddr_in *a = (struct sockaddr_in *)&ss;
+        a->sin_family = AF_INET;
+        a->sin_addr.s_addr = htonl(INADDR_ANY);
+        a->sin_port = htons((uint16_t)port);
+        len = sizeof(*a);
+    }
+    if ((fd = socket(family, socktype, 0)) < 0)
+        return -1;
+    /* Dual stack whatever net.ipv6.bindv6only says */
+    if (family == AF_INET6)
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    /* Allow a restart while pooled client connections still linger on the port */
+    if (socktype == SOCK_STREAM)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((flags & NET_REUSEPORT) && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        goto fail;
+    if (bind(fd, (struct sockaddr *)&ss, len) < 0)
+        goto fail;
+    if (socktype == SOCK_STREAM && listen(fd, SOMAXCONN) < 0)
+        goto fail;
+    return fd;
+
+fail:
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+    }
+    return -1;
+}
+
+int net_bind(int socktype, int port, int flags) {
+    int fd;
+
+    if (flags & NET_IPV4)
+        return bind_family(AF_INET, socktype, port, flags);
+    fd = bind_family(AF_INET6, socktype, port, flags);
+
+    /* No IPv6 in this kernel or network namespace */
+    if (fd < 0 && (errno == EAFNOSUPPORT || errno == EADDRNOTAVAIL))
+        fd = bind_family(AF_INET, socktype, port, flags);
+    return fd;
+}
+
+const char *net_ntop(const struct sockaddr *addr, char *buf, size_t len) {
+    const void *src = &((const struct sockaddr_in *)addr)->sin_addr;
+    int family = AF_INET;
+
+    if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *a6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6)) {
+            src = &a6->s6_addr[12];
+        } else {
+            src = a6;
+            family = AF_INET6;
+        }
+    }
+    if (inet_ntop(family, src, buf, (socklen_t)len) == NULL)
+        snprintf(buf, len, "?");
+    return buf;
+}
+
+int net_port(const struct sockaddr *addr) {
+    if (addr->sa_family == AF_INET6)
+        return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+    return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+}
+
+int net_steer_by_cpu(int fd, unsigned nsockets) {
+    struct sock_filter code[2 * CPU_SETSIZE + 3];
+    struct sock_fprog prog = { 0, code };
+    cpu_set_t allowed;
+    unsigned rank = 0;
+
+    if (nsockets == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    code[prog.len++] = (struct sock_filter){ BPF_LD | BPF_W | BPF_ABS, 0, 0,
+                                             (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) };
+
+    /*
+     * The i-th allowed CPU goes to socket i % nsockets, as net_pin_cpu()
+     * counts. Only CPUs where that differs from cpu % nsockets (taskset to
+     * a subset) need an entry; the rest fall through to the modulo.
+     */
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &allowed))
+                continue;
+            if (rank % nsockets != cpu % nsockets) {
+                code[prog.len++] = (struct sock_filter){ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, cpu };
+                code[prog.len++] = (struct sock_filter){ BPF_RET | BPF_K, 0, 0, rank % nsockets };
+            }
+            rank++;
+        }
+    }
+    code[prog.len++] = (struct sock_filter){ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nsockets };
+    code[prog.len++] = (struct sock_filter){ BPF_RET | BPF_A, 0, 0, 0 };
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int net_pin_cpu(unsigned index) {
+    cpu_set_t allowed, one;
+    int count, cpu;
+
+    /* Count within the CPUs this process may use (taskset, cgroups) */
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || (count = CPU_COUNT(&allowed)) == 0)
+        return -1;
+    index %= (unsigned)count;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0)
+            break;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(one), &one) != 0)
+        return -1;
+    return cpu;
+}
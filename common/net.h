@@ -0,0 +1,69 @@
+/*
+ * Socket addressing shared by the servers and clients: IPv4 and IPv6
+ * through getaddrinfo(), dual-stack server sockets, and the pieces for
+ * spreading one port over several sockets with SO_REUSEPORT.
+ *
+ *   struct sockaddr_storage a;
+ *   socklen_t len;
+ *   if (net_resolve("example.org", 5000, SOCK_STREAM, &a, &len) == 0)
+ *       connect(fd, (struct sockaddr *)&a, len);
+ *
+ *   int fd = net_bind(SOCK_STREAM, 5000, NET_REUSEPORT);   // [::]:5000, IPv4 too
+ *
+ * A dual-stack socket sees IPv4 peers as IPv4-mapped IPv6 addresses
+ * (::ffff:a.b.c.d); net_ntop() prints those in dotted form.
+ */
+
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define NET_ADDRSTRLEN INET6_ADDRSTRLEN
+
+#define NET_REUSEPORT 1             /* join a SO_REUSEPORT group */
+#define NET_IPV4 2                  /* IPv4 only */
+
+/*
+ * First address of host (a name, an IPv4 or an IPv6 literal) for port
+ * and socktype. 0, or -1 with errno set (ENOENT: no such host).
+ */
+int net_resolve(const char *host, int port, int socktype, struct sockaddr_storage *addr,
+                socklen_t *len);
+
+/*
+ * Split "host:port" or "[IPv6 literal]:port" into host (at most
+ * hostlen - 1 bytes, without the brackets) and port. 0 or -1.
+ */
+int net_split(const char *hostport, char *host, size_t hostlen, int *port);
+
+/*
+ * Socket bound to port on all addresses: IPv6 accepting IPv4 as well, or
+ * IPv4 only on a host without IPv6. Stream sockets are listening
+ * (SOMAXCONN) with SO_REUSEADDR. -1 with errno set.
+ */
+int net_bind(int socktype, int port, int flags);
+
+/* Peer address as text, without the port; IPv4-mapped addresses as a.b.c.d */
+const char *net_ntop(const struct sockaddr *addr, char *buf, size_t len);
+int net_port(const struct sockaddr *addr);
+
+/*
+ * Steer each connection or datagram of a SO_REUSEPORT group by the CPU
+ * that received it: the i-th CPU this process may run on goes to the
+ * socket at index i % nsockets, any other CPU to cpu % nsockets (a classic
+ * BPF program on the group; fd is any member). Sockets join the group in
+ * the order they are bound. 0, or -1 with errno set.
+ */
+int net_steer_by_cpu(int fd, unsigned nsockets);
+
+/*
+ * Pin the calling thread to the (index % count)-th of the count CPUs this
+ * process may run on, the CPU whose traffic net_steer_by_cpu() sends to
+ * socket index. Returns the CPU or -1.
+ */
+int net_pin_cpu(unsigned index);
+
+#endif
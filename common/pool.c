@@ -0,0 +1,249 @@
+/*
+ * Slab pool with per-thread caches (see pool.h).
+ *
+ * Every object is preceded by a 16-byte header naming its pool and holding
+ * the reference count, so pool_put() needs only the object pointer. Free
+ * objects are linked through their first word. Thread caches are indexed
+ * by the pool's slot; a slot carries a generation so a cache left over from
+ * a destroyed pool is recognised and dropped instead of reused.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define ALIGN 16
+
+typedef struct {
+    pool_t *pool;
+    _Atomic uint32_t refs;
+    uint32_t reserved;
+} obj_hdr_t;
+
+_Static_assert(sizeof(obj_hdr_t) == ALIGN, "object header must keep objects aligned");
+
+typedef struct slab {
+    struct slab *next;
+    uint8_t pad[ALIGN - sizeof(struct slab *)];
+} slab_t;
+
+struct pool {
+    char name[32];
+    size_t stride;          /* header + object, rounded up to ALIGN */
+    unsigned per_slab;
+    unsigned cache_cap;     /* per-thread cache size for this pool */
+    int slot;               /* index into the thread caches, -1 = none */
+    uint64_t gen;
+
+    pthread_mutex_t lock;
+    void *free_list;
+    slab_t *slabs;
+    pool_stats_t stats;
+};
+
+typedef struct {
+    uint64_t gen;
+    unsigned n;
+    void *items[POOL_CACHE_MAX];
+} thread_cache_t;
+
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_t *slots[POOL_MAX_CACHED];
+static uint64_t next_gen = 1;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static _Thread_local thread_cache_t caches[POOL_MAX_CACHED];
+static _Thread_local int cache_registered;
+
+static inline obj_hdr_t *hdr_of(void *obj) {
+    return (obj_hdr_t *)((uint8_t *)obj - sizeof(obj_hdr_t));
+}
+
+/* Shared list operations, pool->lock held */
+static inline void *list_pop(pool_t *pool) {
+    void *obj = pool->free_list;
+    if (obj != NULL) {
+        pool->free_list = *(void **)obj;
+        pool->stats.shared_free--;
+    }
+    return obj;
+}
+
+static inline void list_push(pool_t *pool, void *obj) {
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->stats.shared_free++;
+}
+
+/* Carve a new slab onto the shared list */
+static int grow(pool_t *pool) {
+    slab_t *slab = malloc(sizeof(slab_t) + pool->stride * pool->per_slab);
+    uint8_t *p;
+
+    if (slab == NULL)
+        return -1;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    p = (uint8_t *)(slab + 1);
+    for (unsigned i = pool->per_slab; i-- > 0;) {
+        obj_hdr_t *h = (obj_hdr_t *)(p + (size_t)i * pool->stride);
+        h->pool = pool;
+        list_push(pool, h + 1);
+    }
+    pool->stats.slabs++;
+    pool->stats.objects += pool->per_slab;
+    return 0;
+}
+
+/* Thread exit: give cached objects back to pools that still exist */
+static void cache_release(void *arg) {
+    thread_cache_t *tc = arg;
+
+    pthread_mutex_lock(&slots_lock);
+    for (int i = 0; i < POOL_MAX_CACHED; i++) {
+        pool_t *pool = slots[i];
+        if (tc[i].n == 0 || pool == NULL || pool->gen != tc[i].gen)
+            continue;
+        pthread_mutex_lock(&pool->lock);
+        while (tc[i].n > 0)
+            list_push(pool, tc[i].items[--tc[i].n]);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&slots_lock);
+}
+
+static void make_key(void) {
+    pthread_key_create(&cache_key, cache_release);
+}
+
+static thread_cache_t *cache_for(pool_t *pool) {
+    thread_cache_t *tc;
+
+    if (pool->slot < 0)
+        return NULL;
+    if (!cache_registered) {
+        pthread_once(&key_once, make_key);
+        pthread_setspecific(cache_key, caches);
+        cache_registered = 1;
+    }
+    tc = &caches[pool->slot];
+    if (tc->gen != pool->gen) {
+        /* Left by a destroyed pool: its objects are gone with it */
+        tc->gen = pool->gen;
+        tc->n = 0;
+    }
+    return tc;
+}
+
+pool_t *pool_create(const char *name, size_t size, unsigned per_slab) {
+    pool_t *pool = calloc(1, sizeof(*pool));
+    size_t cap;
+
+    if (pool == NULL)
+        return NULL;
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    strncpy(pool->name, name, sizeof(pool->name) - 1);
+    pool->stride = (sizeof(obj_hdr_t) + size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    pool->per_slab = per_slab > 0 ? per_slab : 1;
+    cap = POOL_CACHE_BYTES / pool->stride;
+    pool->cache_cap = cap > POOL_CACHE_MAX ? POOL_CACHE_MAX : cap < 2 ? 2 : (unsigned)cap;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    pool->slot = -1;
+    pthread_mutex_lock(&slots_lock);
+    pool->gen = next_gen++;
+    for (int i = 0; i < POOL_MAX_CACHED; i++) {
+        if (slots[i] == NULL) {
+            slots[i] = pool;
+            pool->slot = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&slots_lock);
+    return pool;
+}
+
+void pool_destroy(pool_t *pool) {
+    slab_t *slab, *next;
+
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&slots_lock);
+    if (pool->slot >= 0)
+        slots[pool->slot] = NULL;
+    pthread_mutex_unlock(&slots_lock);
+    for (slab = pool->slabs; slab != NULL; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void *pool_get(pool_t *pool) {
+    thread_cache_t *tc = cache_for(pool);
+    void *obj;
+
+    if (tc != NULL && tc->n > 0) {
+        obj = tc->items[--tc->n];
+    } else {
+        /* Refill half the cache in one trip to the shared list */
+        pthread_mutex_lock(&pool->lock);
+        if (pool->free_list == NULL && grow(pool) < 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        obj = list_pop(pool);
+        if (tc != NULL) {
+            while (tc->n < pool->cache_cap / 2 && pool->free_list != NULL)
+                tc->items[tc->n++] = list_pop(pool);
+            pool->stats.refills++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    atomic_store_explicit(&hdr_of(obj)->refs, 1, memory_order_relaxed);
+    return obj;
+}
+
+void pool_ref(void *obj) {
+    atomic_fetch_add_explicit(&hdr_of(obj)->refs, 1, memory_order_relaxed);
+}
+
+void pool_put(void *obj) {
+    obj_hdr_t *h;
+    pool_t *pool;
+    thread_cache_t *tc;
+
+    if (obj == NULL)
+        return;
+    h = hdr_of(obj);
+    if (atomic_fetch_sub_explicit(&h->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    pool = h->pool;
+    tc = cache_for(pool);
+    if (tc != NULL && tc->n < pool->cache_cap) {
+        tc->items[tc->n++] = obj;
+        return;
+    }
+
+    /* Cache full (or none): move half of it back along with this object */
+    pthread_mutex_lock(&pool->lock);
+    list_push(pool, obj);
+    if (tc != NULL) {
+        while (tc->n > pool->cache_cap / 2)
+            list_push(pool, tc->items[--tc->n]);
+        pool->stats.refills++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_stats(pool_t *pool, pool_stats_t *st) {
+    pthread_mutex_lock(&pool->lock);
+    *st = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
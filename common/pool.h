@@ -0,0 +1,54 @@
+/*
+ * Fixed-size object pool for buffers and descriptors that are allocated
+ * per packet, per chunk or per connection.
+ *
+ *   pool_t *packets = pool_create("packets", sizeof(Packet), 64);
+ *   Packet *p = pool_get(packets);     // refcount 1
+ *   pool_ref(p);                       // hand a reference to another thread
+ *   pool_put(p);                       // back to the pool when the last ref goes
+ *
+ * Objects are carved from slabs of per_slab objects; a slab is one malloc
+ * and is only freed by pool_destroy(). Each thread keeps a small cache of
+ * free objects per pool, so get/put are a few instructions with no lock;
+ * the shared free list is touched (under a mutex) in batches when a cache
+ * runs empty or full, and a thread's cache goes back to the pool when the
+ * thread exits. Objects may be put by a different thread than got them.
+ *
+ * Objects are 16-byte aligned and not zeroed. Up to POOL_MAX_CACHED pools
+ * exist with per-thread caches at once; further pools still work, always
+ * through the shared list.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_MAX_CACHED     8
+#define POOL_CACHE_MAX      32          /* objects per thread and pool */
+#define POOL_CACHE_BYTES    (256 * 1024) /* fewer cached when objects are big */
+
+typedef struct pool pool_t;
+
+typedef struct {
+    uint64_t slabs;         /* mallocs done by the pool */
+    uint64_t objects;       /* objects in all slabs */
+    uint64_t shared_free;   /* objects on the shared list (not in thread caches) */
+    uint64_t refills;       /* batch transfers between caches and the shared list */
+} pool_stats_t;
+
+/* NULL on failure */
+pool_t *pool_create(const char *name, size_t size, unsigned per_slab);
+/* Frees every slab; no thread may use the pool or its objects any more */
+void pool_destroy(pool_t *pool);
+
+/* An object with refcount 1, or NULL when out of memory */
+void *pool_get(pool_t *pool);
+void pool_ref(void *obj);
+/* Drop a reference; the object returns to its pool with the last one */
+void pool_put(void *obj);
+
+void pool_stats(pool_t *pool, pool_stats_t *st);
+
+#endif
@@ -2,6 +2,7 @@
  * File Copy Program using Functions (fread/fwrite)
  * This program copies files (both text and binary) using standard I/O functions
  * and measures the time taken for the copy operation.
+ * An optional "-d <crc32c|xxh64|blake3>" also digests the data while copying.
  */
 
 #include <stdio.h>
@@ -9,6 +10,8 @@
 #include <time.h>
 #include <string.h>
 
+#include "digest.h"
+
 #define BUFFER_SIZE 4096  // Buffer size for reading/writing
 
 int main(int argc, char *argv[]) {
@@ -17,10 +20,26 @@ int main(int argc, char *argv[]) {
     size_t bytes_read, bytes_written;
     clock_t start, end;
     double cpu_time_used;
+    digest_alg_t alg = DIGEST_NONE;
+    digest_ctx_t digest;
+    uint8_t digest_out[DIGEST_MAX_SIZE];
+    size_t digest_len;
+
+    // Optional leading "-d <algorithm>"
+    if (argc == 5 && strcmp(argv[1], "-d") == 0) {
+        alg = digest_from_name(argv[2]);
+        if (alg == DIGEST_NONE) {
+            fprintf(stderr, "Unknown digest: %s (use crc32c, xxh64 or blake3)\n", argv[2]);
+            exit(1);
+        }
+        argv += 2;
+        argc -= 2;
+    }
 
     // Check for correct number of arguments
     if (argc != 3) {
-        fprintf(stderr, "Usage: %s <source_file> <destination_file>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-d crc32c|xxh64|blake3] <source_file> <destination_file>\n",
+                argv[0]);
         exit(1);
     }
 
@@ -41,6 +60,7 @@ int main(int argc, char *argv[]) {
 
     // Start timing
     start = clock();
+    digest_init(&digest, alg);
 
     // Copy file content using fread and fwrite
     while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, source_file)) > 0) {
@@ -51,6 +71,7 @@ int main(int argc, char *argv[]) {
             fclose(dest_file);
             exit(1);
         }
+        digest_update(&digest, buffer, bytes_read);
     }
 
     // Check for read errors
@@ -61,6 +82,8 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    digest_len = digest_final(&digest, digest_out);
+
     // End timing
     end = clock();
     cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
@@ -74,6 +97,11 @@ int main(int argc, char *argv[]) {
     printf("Source: %s\n", argv[1]);
     printf("Destination: %s\n", argv[2]);
     printf("Time taken: %.6f seconds\n", cpu_time_used);
+    if (digest_len > 0) {
+        char hex[2 * DIGEST_MAX_SIZE + 1];
+        digest_hex(digest_out, digest_len, hex);
+        printf("Digest (%s): %s\n", digest_name(alg), hex);
+    }
 
     return 0;
 }
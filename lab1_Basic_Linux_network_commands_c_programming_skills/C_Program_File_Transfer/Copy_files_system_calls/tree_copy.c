@@ -0,0 +1,700 @@
+/*
+ * Recursive directory tree copy (see tree_copy.h).
+ *
+ * Every directory, file and large-file chunk is a work item. Items are
+ * handed to the worker threads through a bounded lock-free MPMC queue
+ * (sequence-numbered ring); when the queue is full the producer simply
+ * runs the item itself. A global "pending" counter tells the workers when
+ * the whole tree is done.
+ *
+ * Entries are opened relative to their directory (openat() and friends),
+ * never by full path: a queued child holds a reference on its parent's
+ * source and destination descriptors, which close when the last child
+ * has run. Full paths are kept only for messages and the final fixups.
+ */
+
+#define _GNU_SOURCE
+#include "tree_copy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define QUEUE_CAPACITY  65536       // must be a power of two
+#define DIRENT_BUF_SIZE (64 * 1024)
+#define MAX_WORKERS     256
+
+// Record layout returned by getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef enum { ITEM_DIR, ITEM_FILE, ITEM_CHUNK } item_kind_t;
+
+// An open source directory and its copy, shared by the items found in it
+typedef struct {
+    int src_fd;
+    int dst_fd;                 // O_PATH
+    atomic_int refs;
+} dir_ref_t;
+
+// Shared state of a large file being copied as several chunks
+typedef struct {
+    int src_fd;
+    int dst_fd;
+    struct stat st;
+    char *dst;
+    atomic_int chunks_left;
+    atomic_int failed;
+} large_file_t;
+
+typedef struct {
+    item_kind_t kind;
+    char *src;              // ITEM_DIR / ITEM_FILE: full paths, for messages
+    char *dst;
+    dir_ref_t *parent;      // directory holding name (NULL: the root, by path)
+    const char *name;       // last component of src and dst (NULL: the root)
+    large_file_t *lf;       // ITEM_CHUNK
+    off_t offset;
+    size_t len;
+} work_item_t;
+
+typedef struct {
+    atomic_size_t seq;
+    work_item_t *item;
+} queue_cell_t;
+
+typedef struct {
+    queue_cell_t *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+} work_queue_t;
+
+// Directory whose metadata is applied once all of its children exist
+typedef struct {
+    char *dst;
+    struct stat st;
+} dir_fixup_t;
+
+// Per-thread scratch space: the copy buffer, and one getdents buffer per
+// directory being walked (a directory run inline while the queue is full
+// nests inside its parent's walk)
+typedef struct {
+    char *buffer;
+    size_t buffer_size;
+    char **dents;
+    unsigned depth, levels;
+} worker_t;
+
+typedef struct {
+    work_queue_t queue;
+    atomic_llong pending;       // items queued or running
+    tree_copy_opts_t opts;
+    atomic_llong files, dirs, links, bytes, errors;
+    pthread_mutex_t fixup_lock;
+    dir_fixup_t *fixups;
+    size_t fixup_count, fixup_cap;
+} tree_ctx_t;
+
+/* ---------- Lock-free bounded MPMC queue ---------- */
+
+static int queue_init(work_queue_t *q, size_t capacity) {
+    q->cells = malloc(capacity * sizeof(queue_cell_t));
+    if (q->cells == NULL)
+        return -1;
+    for (size_t i = 0; i < capacity; i++)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = capacity - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return 0;
+}
+
+static int queue_push(work_queue_t *q, work_item_t *item) {
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    queue_cell_t *cell;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1;  // full
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->item = item;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+static work_item_t *queue_pop(work_queue_t *q) {
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    queue_cell_t *cell;
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return NULL;  // empty
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    work_item_t *item = cell->item;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return item;
+}
+
+/* ---------- Helpers ---------- */
+
+static char *join_path(const char *dir, const char *name) {
+    size_t a = strlen(dir), b = strlen(name);
+    char *path = malloc(a + b + 2);
+    if (path == NULL)
+        return NULL;
+    memcpy(path, dir, a);
+    path[a] = '/';
+    memcpy(path + a + 1, name, b + 1);
+    return path;
+}
+
+static void report_error(tree_ctx_t *ctx, const char *what, const char *path) {
+    fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+    atomic_fetch_add(&ctx->errors, 1);
+}
+
+// Copy ownership, permissions and timestamps onto an open destination file
+static void apply_file_metadata(int fd, const struct stat *st) {
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+    if (fchown(fd, st->st_uid, st->st_gid) < 0 && errno != EPERM)
+        perror("fchown");
+    fchmod(fd, st->st_mode & 07777);
+    futimens(fd, times);
+}
+
+static void dir_release(dir_ref_t *dir) {
+    if (dir != NULL && atomic_fetch_sub(&dir->refs, 1) == 1) {
+        close(dir->src_fd);
+        close(dir->dst_fd);
+        free(dir);
+    }
+}
+
+static void run_item(tree_ctx_t *ctx, work_item_t *item, worker_t *w);
+
+// Queue an item; if the queue is full the caller copies it right away
+static void submit(tree_ctx_t *ctx, work_item_t *item, worker_t *w) {
+    atomic_fetch_add(&ctx->pending, 1);
+    if (queue_push(&ctx->queue, item) < 0)
+        run_item(ctx, item, w);
+}
+
+// Item for name in parent (which it takes a reference on), or the root
+// when parent is NULL; NULL if out of memory
+static work_item_t *new_path_item(item_kind_t kind, dir_ref_t *parent, const char *src,
+                                  const char *dst, const char *name) {
+    work_item_t *item = calloc(1, sizeof(*item));
+    if (item == NULL)
+        return NULL;
+    item->src = parent != NULL ? join_path(src, name) : strdup(src);
+    item->dst = parent != NULL ? join_path(dst, name) : strdup(dst);
+    if (item->src == NULL || item->dst == NULL) {
+        free(item->src);
+        free(item->dst);
+        free(item);
+        return NULL;
+    }
+    item->kind = kind;
+    item->parent = parent;
+    item->name = parent != NULL ? item->src + strlen(src) + 1 : NULL;
+    if (parent != NULL)
+        atomic_fetch_add(&parent->refs, 1);
+    return item;
+}
+
+/* ---------- Symlinks ---------- */
+
+static void copy_symlink(tree_ctx_t *ctx, const dir_ref_t *dir, const char *name,
+                         const char *src) {
+    char target[4096];
+    struct stat st;
+    ssize_t n = readlinkat(dir->src_fd, name, target, sizeof(target) - 1);
+
+    if (n < 0 || fstatat(dir->src_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        report_error(ctx, "Cannot read symlink", src);
+        return;
+    }
+    target[n] = '\0';
+    unlinkat(dir->dst_fd, name, 0);
+    if (symlinkat(target, dir->dst_fd, name) < 0) {
+        report_error(ctx, "Cannot create symlink for", src);
+        return;
+    }
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if (fchownat(dir->dst_fd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) < 0
+        && errno != EPERM)
+        perror("lchown");
+    utimensat(dir->dst_fd, name, times, AT_SYMLINK_NOFOLLOW);
+    atomic_fetch_add(&ctx->links, 1);
+}
+
+/* ---------- Directories ---------- */
+
+// getdents buffer for the next nesting level of w's walks
+static char *dents_buffer(worker_t *w) {
+    if (w->depth == w->levels) {
+        char **grown = realloc(w->dents, (w->levels + 1) * sizeof(*grown));
+        if (grown == NULL)
+            return NULL;
+        w->dents = grown;
+        if ((w->dents[w->levels] = malloc(DIRENT_BUF_SIZE)) == NULL)
+            return NULL;
+        w->levels++;
+    }
+    return w->dents[w->depth++];
+}
+
+static void copy_dir(tree_ctx_t *ctx, work_item_t *item, worker_t *w) {
+    int src_parent = item->parent != NULL ? item->parent->src_fd : AT_FDCWD;
+    int dst_parent = item->parent != NULL ? item->parent->dst_fd : AT_FDCWD;
+    const char *src = item->src, *dst = item->dst;
+    const char *src_name = item->parent != NULL ? item->name : src;
+    const char *dst_name = item->parent != NULL ? item->name : dst;
+    struct stat st;
+    dir_ref_t *dir = malloc(sizeof(*dir));
+    char *dents = dents_buffer(w);
+
+    if (dir == NULL || dents == NULL) {
+        errno = ENOMEM;
+        report_error(ctx, "Cannot read directory", src);
+        free(dir);
+        if (dents != NULL)
+            w->depth--;
+        return;
+    }
+    dir->src_fd = openat(src_parent, src_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir->src_fd < 0 || fstat(dir->src_fd, &st) < 0) {
+        report_error(ctx, "Cannot open directory", src);
+        if (dir->src_fd >= 0)
+            close(dir->src_fd);
+        free(dir);
+        w->depth--;
+        return;
+    }
+    // Created owner-writable; the real mode is applied after the copy
+    if ((mkdirat(dst_parent, dst_name, 0700) < 0 && errno != EEXIST)
+        || (dir->dst_fd = openat(dst_parent, dst_name, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        report_error(ctx, "Cannot create directory", dst);
+        close(dir->src_fd);
+        free(dir);
+        w->depth--;
+        return;
+    }
+    atomic_init(&dir->refs, 1);
+
+    pthread_mutex_lock(&ctx->fixup_lock);
+    if (ctx->fixup_count == ctx->fixup_cap) {
+        size_t cap = ctx->fixup_cap ? ctx->fixup_cap * 2 : 64;
+        dir_fixup_t *grown = realloc(ctx->fixups, cap * sizeof(*grown));
+        if (grown != NULL) {
+            ctx->fixups = grown;
+            ctx->fixup_cap = cap;
+        }
+    }
+    if (ctx->fixup_count < ctx->fixup_cap) {
+        ctx->fixups[ctx->fixup_count].dst = strdup(dst);
+        ctx->fixups[ctx->fixup_count].st = st;
+        ctx->fixup_count++;
+    }
+    pthread_mutex_unlock(&ctx->fixup_lock);
+    atomic_fetch_add(&ctx->dirs, 1);
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, dir->src_fd, dents, DIRENT_BUF_SIZE);
+        if (n < 0) {
+            report_error(ctx, "Cannot read directory", src);
+            break;
+        }
+        if (n == 0)
+            break;
+
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + pos);
+            const char *name = d->d_name;
+            unsigned char type = d->d_type;
+            pos += d->d_reclen;
+
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                continue;
+            if (type == DT_UNKNOWN) {
+                struct stat est;
+                if (fstatat(dir->src_fd, name, &est, AT_SYMLINK_NOFOLLOW) < 0) {
+                    report_error(ctx, "Cannot stat", name);
+                    continue;
+                }
+                type = S_ISDIR(est.st_mode) ? DT_DIR : S_ISREG(est.st_mode) ? DT_REG
+                     : S_ISLNK(est.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+
+            if (type == DT_LNK) {
+                copy_symlink(ctx, dir, name, src);
+            } else if (type == DT_DIR || type == DT_REG) {
+                work_item_t *child = new_path_item(type == DT_DIR ? ITEM_DIR : ITEM_FILE,
+                                                   dir, src, dst, name);
+                if (child == NULL) {
+                    report_error(ctx, "Out of memory at", src);
+                    continue;
+                }
+                submit(ctx, child, w);
+            } else {
+                fprintf(stderr, "Skipping special file %s/%s\n", src, name);
+            }
+        }
+    }
+    w->depth--;
+    dir_release(dir);
+}
+
+/* ---------- Files ---------- */
+
+static int write_all(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Copy [offset, offset + len) with copy_file_range, falling back to pread/pwrite
+static long long copy_range(int src_fd, int dst_fd, off_t offset, size_t len,
+                            char *buffer, size_t buffer_size) {
+    long long copied = 0;
+    off_t in_off = offset, out_off = offset;
+
+    while (len > 0) {
+        ssize_t n = copy_file_range(src_fd, &in_off, dst_fd, &out_off, len, 0);
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                      || errno == EOPNOTSUPP))
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            return copied;  // source shrank
+        copied += n;
+        len -= (size_t)n;
+    }
+
+    while (len > 0) {
+        size_t want = len < buffer_size ? len : buffer_size;
+        ssize_t n = pread(src_fd, buffer, want, in_off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        if (write_all(dst_fd, buffer, (size_t)n, in_off) < 0)
+            return -1;
+        in_off += n;
+        copied += n;
+        len -= (size_t)n;
+    }
+    return copied;
+}
+
+static void copy_chunk(tree_ctx_t *ctx, large_file_t *lf, off_t offset, size_t len,
+                       worker_t *w) {
+    long long n = copy_range(lf->src_fd, lf->dst_fd, offset, len, w->buffer, w->buffer_size);
+
+    if (n < 0) {
+        report_error(ctx, "Error copying", lf->dst);
+        atomic_store(&lf->failed, 1);
+    } else {
+        atomic_fetch_add(&ctx->bytes, n);
+    }
+
+    // The last chunk to finish closes the file and applies its metadata
+    if (atomic_fetch_sub(&lf->chunks_left, 1) == 1) {
+        if (!atomic_load(&lf->failed)) {
+            apply_file_metadata(lf->dst_fd, &lf->st);
+            atomic_fetch_add(&ctx->files, 1);
+        }
+        close(lf->src_fd);
+        close(lf->dst_fd);
+        free(lf->dst);
+        free(lf);
+    }
+}
+
+static void copy_file(tree_ctx_t *ctx, const work_item_t *item, worker_t *w) {
+    const char *src = item->src, *dst = item->dst;
+    char *buffer = w->buffer;
+    size_t buffer_size = w->buffer_size;
+    struct stat st;
+    int src_fd = openat(item->parent->src_fd, item->name, O_RDONLY | O_CLOEXEC);
+
+    if (src_fd < 0 || fstat(src_fd, &st) < 0) {
+        report_error(ctx, "Cannot open source file", src);
+        if (src_fd >= 0)
+            close(src_fd);
+        return;
+    }
+    int dst_fd = openat(item->parent->dst_fd, item->name,
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (dst_fd < 0) {
+        report_error(ctx, "Cannot create destination file", dst);
+        close(src_fd);
+        return;
+    }
+
+    if ((size_t)st.st_size <= ctx->opts.small_file_limit) {
+        // Small file strategy: plain read/write through the worker's buffer
+        off_t offset = 0;
+        ssize_t n;
+        while ((n = read(src_fd, buffer, buffer_size)) > 0) {
+            if (write_all(dst_fd, buffer, (size_t)n, offset) < 0)
+                break;
+            offset += n;
+        }
+        if (n != 0) {
+            report_error(ctx, "Error copying", src);
+        } else {
+            apply_file_metadata(dst_fd, &st);
+            atomic_fetch_add(&ctx->bytes, (long long)offset);
+            atomic_fetch_add(&ctx->files, 1);
+        }
+        close(src_fd);
+        close(dst_fd);
+        return;
+    }
+
+    // Large file strategy: size the output, then copy chunks in parallel
+    large_file_t *lf = calloc(1, sizeof(*lf));
+    if (lf == NULL || ftruncate(dst_fd, st.st_size) < 0 || (lf->dst = strdup(dst)) == NULL) {
+        report_error(ctx, "Cannot prepare destination file", dst);
+        free(lf);
+        close(src_fd);
+        close(dst_fd);
+        return;
+    }
+    size_t chunk = ctx->opts.chunk_size;
+    int nchunks = (int)((st.st_size + (off_t)chunk - 1) / (off_t)chunk);
+    lf->src_fd = src_fd;
+    lf->dst_fd = dst_fd;
+    lf->st = st;
+    atomic_init(&lf->chunks_left, nchunks);
+    atomic_init(&lf->failed, 0);
+
+    for (int i = 0; i < nchunks; i++) {
+        work_item_t *item = calloc(1, sizeof(*item));
+        off_t offset = (off_t)i * (off_t)chunk;
+        size_t len = (st.st_size - offset < (off_t)chunk) ? (size_t)(st.st_size - offset) : chunk;
+
+        if (item == NULL) {
+            // Copy the chunk here instead of queueing it
+            copy_chunk(ctx, lf, offset, len, w);
+            continue;
+        }
+        item->kind = ITEM_CHUNK;
+        item->lf = lf;
+        item->offset = offset;
+        item->len = len;
+        submit(ctx, item, w);
+    }
+}
+
+// Run one item, then release it (the item and its paths are heap allocated)
+static void run_item(tree_ctx_t *ctx, work_item_t *item, worker_t *w) {
+    switch (item->kind) {
+    case ITEM_DIR:
+        copy_dir(ctx, item, w);
+        break;
+    case ITEM_FILE:
+        copy_file(ctx, item, w);
+        break;
+    case ITEM_CHUNK:
+        copy_chunk(ctx, item->lf, item->offset, item->len, w);
+        break;
+    }
+    dir_release(item->parent);
+    free(item->src);
+    free(item->dst);
+    free(item);
+    atomic_fetch_sub(&ctx->pending, 1);
+}
+
+/* ---------- Worker pool ---------- */
+
+static void *tree_worker(void *arg) {
+    tree_ctx_t *ctx = (tree_ctx_t *)arg;
+    worker_t w = { NULL, ctx->opts.small_file_limit, NULL, 0, 0 };
+    unsigned idle = 0;
+
+    if (w.buffer_size < 64 * 1024)
+        w.buffer_size = 64 * 1024;
+    if (w.buffer_size > 4 * 1024 * 1024)
+        w.buffer_size = 4 * 1024 * 1024;
+    w.buffer = malloc(w.buffer_size);
+    if (w.buffer == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    for (;;) {
+        work_item_t *item = queue_pop(&ctx->queue);
+        if (item != NULL) {
+            run_item(ctx, item, &w);
+            idle = 0;
+            continue;
+        }
+        if (atomic_load(&ctx->pending) == 0)
+            break;
+        // Nothing queued yet but others still walking: back off briefly
+        if (++idle < 64) {
+            sched_yield();
+        } else {
+            struct timespec ts = { 0, 50000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    for (unsigned i = 0; i < w.levels; i++)
+        free(w.dents[i]);
+    free(w.dents);
+    free(w.buffer);
+    return NULL;
+}
+
+static int fixup_cmp(const void *a, const void *b) {
+    // Deepest directories first so parents' mtimes are set last
+    size_t la = strlen(((const dir_fixup_t *)a)->dst);
+    size_t lb = strlen(((const dir_fixup_t *)b)->dst);
+    return (la < lb) - (la > lb);
+}
+
+int tree_copy(const char *src_dir, const char *dst_dir,
+              const tree_copy_opts_t *opts, tree_copy_stats_t *stats) {
+    tree_ctx_t ctx;
+    pthread_t tids[MAX_WORKERS];
+    unsigned threads = opts->threads, started = 0, i;
+    struct timespec t0, t1;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&ctx, 0, sizeof(ctx));
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_WORKERS)
+        threads = MAX_WORKERS;
+    ctx.opts = *opts;
+    if (ctx.opts.chunk_size == 0)
+        ctx.opts.chunk_size = 8 * 1024 * 1024;
+    if (queue_init(&ctx.queue, QUEUE_CAPACITY) < 0) {
+        perror("Unable to allocate work queue");
+        return -1;
+    }
+    pthread_mutex_init(&ctx.fixup_lock, NULL);
+    atomic_init(&ctx.pending, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // Every queued item keeps its directory open: allow as many descriptors
+    // as the hard limit does
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // The root directory is the first work item
+    work_item_t *root = new_path_item(ITEM_DIR, NULL, src_dir, dst_dir, NULL);
+    if (root == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        free(ctx.queue.cells);
+        return -1;
+    }
+    atomic_fetch_add(&ctx.pending, 1);
+    queue_push(&ctx.queue, root);
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, tree_worker, &ctx) != 0) {
+            perror("Unable to create thread");
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        // No workers at all: copy the tree on this thread
+        tree_worker(&ctx);
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    // Directory modes and times last, deepest first
+    qsort(ctx.fixups, ctx.fixup_count, sizeof(dir_fixup_t), fixup_cmp);
+    for (size_t k = 0; k < ctx.fixup_count; k++) {
+        dir_fixup_t *f = &ctx.fixups[k];
+        struct timespec times[2] = { f->st.st_atim, f->st.st_mtim };
+        if (f->dst == NULL)
+            continue;
+        if (chown(f->dst, f->st.st_uid, f->st.st_gid) < 0 && errno != EPERM)
+            perror("chown");
+        chmod(f->dst, f->st.st_mode & 07777);
+        utimensat(AT_FDCWD, f->dst, times, 0);
+        free(f->dst);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    stats->files = atomic_load(&ctx.files);
+    stats->dirs = atomic_load(&ctx.dirs);
+    stats->links = atomic_load(&ctx.links);
+    stats->bytes = atomic_load(&ctx.bytes);
+    stats->errors = atomic_load(&ctx.errors);
+    stats->wall_time = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    free(ctx.fixups);
+    free(ctx.queue.cells);
+    pthread_mutex_destroy(&ctx.fixup_lock);
+    return stats->errors ? -1 : 0;
+}
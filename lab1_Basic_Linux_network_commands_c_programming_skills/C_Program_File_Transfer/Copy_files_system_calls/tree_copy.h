@@ -0,0 +1,32 @@
+/*
+ * Recursive directory tree copy using a pool of worker threads.
+ * Directories are read with getdents64, files are dispatched through a
+ * lock-free work queue and copied either whole (small files) or as
+ * parallel chunks (large files). Mode, ownership and timestamps are kept.
+ */
+
+#ifndef TREE_COPY_H
+#define TREE_COPY_H
+
+#include <stddef.h>
+
+typedef struct {
+    unsigned threads;           // worker threads
+    size_t small_file_limit;    // files up to this size are copied in one piece
+    size_t chunk_size;          // chunk size for large files
+} tree_copy_opts_t;
+
+typedef struct {
+    long long files;
+    long long dirs;
+    long long links;
+    long long bytes;
+    long long errors;
+    double wall_time;
+} tree_copy_stats_t;
+
+// Copy src_dir into dst_dir (created if needed). Returns 0 if every entry was copied.
+int tree_copy(const char *src_dir, const char *dst_dir,
+              const tree_copy_opts_t *opts, tree_copy_stats_t *stats);
+
+#endif
@@ -0,0 +1,593 @@
+/*
+ * Open-file cache for tcp_server (see fcache.h).
+ */
+
+#define _GNU_SOURCE
+#include "fcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define FCACHE_SHARDS   16
+#define FCACHE_BUCKETS  256         /* per shard, power of two */
+#define MAX_WATCHES     256
+#define HUGE_PAGE_SIZE  (2UL * 1024 * 1024)
+
+/* Content arena size classes: 4K, 8K, 16K, 32K, 64K, ... */
+#define MIN_CLASS_SHIFT 12
+#define NUM_CLASSES     8
+
+typedef struct {
+    pthread_mutex_t lock;
+    fcache_entry_t *buckets[FCACHE_BUCKETS];
+    fcache_entry_t *lru_head, *lru_tail;
+    unsigned count;
+} fcache_shard_t;
+
+typedef struct fcache_variant {
+    struct fcache_variant *next;
+    unsigned key;
+    size_t len;
+    void *data;
+} fcache_variant_t;
+
+typedef struct {
+    int wd;
+    char *dir;
+} fcache_watch_t;
+
+static fcache_shard_t shards[FCACHE_SHARDS];
+static unsigned shard_capacity;
+static size_t content_max_file;
+
+static atomic_ullong stat_hits, stat_misses, stat_content_hits;
+static atomic_ullong stat_evictions, stat_invalidations, stat_entries;
+static atomic_ullong stat_variant_hits, stat_variant_bytes;
+static size_t variant_budget;
+
+/* Content arena: carved lazily into per-class slots, freed slots are reused */
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *arena_base;
+static size_t arena_size, arena_used;
+static void *class_free[NUM_CLASSES];
+
+static int inotify_fd = -1;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static fcache_watch_t watches[MAX_WATCHES];
+static int watch_count;
+/* Bumped on every change event; a miss that saw it move while reading stays uncached */
+static atomic_ullong change_gen;
+
+/* ---------- Helpers ---------- */
+
+static uint64_t hash_path(const char *s) {
+    uint64_t h = 1469598103934665603ULL;    /* FNV-1a */
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* "./a/./b" and "a/b" name the same file; collapse leading and inner "./" */
+static void normalize_path(const char *in, char *out, size_t outlen) {
+    size_t o = 0;
+    while (in[0] == '.' && in[1] == '/')
+        in += 2;
+    while (*in && o + 1 < outlen) {
+        if (in[0] == '/' && in[1] == '.' && in[2] == '/') {
+            in += 2;
+            continue;
+        }
+        if (in[0] == '/' && in[1] == '/') {
+            in++;
+            continue;
+        }
+        out[o++] = *in++;
+    }
+    out[o] = '\0';
+}
+
+static int size_class(size_t size) {
+    for (int c = 0; c < NUM_CLASSES; c++)
+        if (size <= ((size_t)1 << (MIN_CLASS_SHIFT + c)))
+            return c;
+    return -1;
+}
+
+static char *content_alloc(size_t size, int *class_out) {
+    int c = size_class(size);
+    char *slot = NULL;
+
+    if (c < 0 || arena_base == NULL)
+        return NULL;
+    pthread_mutex_lock(&arena_lock);
+    if (class_free[c] != NULL) {
+        slot = class_free[c];
+        memcpy(&class_free[c], slot, sizeof(void *));
+    } else {
+        size_t bytes = (size_t)1 << (MIN_CLASS_SHIFT + c);
+        if (arena_used + bytes <= arena_size) {
+            slot = arena_base + arena_used;
+            arena_used += bytes;
+        }
+    }
+    pthread_mutex_unlock(&arena_lock);
+    *class_out = c;
+    return slot;
+}
+
+static void content_free(char *slot, int c) {
+    pthread_mutex_lock(&arena_lock);
+    memcpy(slot, &class_free[c], sizeof(void *));
+    class_free[c] = slot;
+    pthread_mutex_unlock(&arena_lock);
+}
+
+static void entry_free(fcache_entry_t *e) {
+    if (e->content != NULL)
+        content_free((char *)e->content, e->content_class);
+    while (e->variants != NULL) {
+        fcache_variant_t *v = e->variants;
+        e->variants = v->next;
+        atomic_fetch_sub(&stat_variant_bytes, v->len);
+        free(v->data);
+        free(v);
+    }
+    close(e->fd);
+    free(e->path);
+    free(e);
+    atomic_fetch_sub(&stat_entries, 1);
+}
+
+static void lru_unlink(fcache_shard_t *sh, fcache_entry_t *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else sh->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else sh->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(fcache_shard_t *sh, fcache_entry_t *e) {
+    e->lru_prev = NULL;
+    e->lru_next = sh->lru_head;
+    if (sh->lru_head) sh->lru_head->lru_prev = e;
+    sh->lru_head = e;
+    if (sh->lru_tail == NULL) sh->lru_tail = e;
+}
+
+/* Take an entry out of the table (shard lock held); returns it if it can be freed now */
+static fcache_entry_t *detach(fcache_shard_t *sh, fcache_entry_t *e) {
+    fcache_entry_t **pp = &sh->buckets[e->hash & (FCACHE_BUCKETS - 1)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    lru_unlink(sh, e);
+    sh->count--;
+    e->dead = 1;
+    return e->refs == 0 ? e : NULL;
+}
+
+static fcache_entry_t *lookup(fcache_shard_t *sh, const char *path, uint64_t h) {
+    fcache_entry_t *e = sh->buckets[h & (FCACHE_BUCKETS - 1)];
+    while (e != NULL && (e->hash != h || strcmp(e->path, path) != 0))
+        e = e->hnext;
+    return e;
+}
+
+/* ---------- inotify invalidation ---------- */
+
+static void invalidate_path(const char *path) {
+    uint64_t h = hash_path(path);
+    fcache_shard_t *sh = &shards[h % FCACHE_SHARDS];
+    fcache_entry_t *e, *victim = NULL;
+
+    pthread_mutex_lock(&sh->lock);
+    e = lookup(sh, path, h);
+    if (e != NULL) {
+        victim = detach(sh, e);
+        atomic_fetch_add(&stat_invalidations, 1);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if (victim != NULL)
+        entry_free(victim);
+}
+
+static void invalidate_all(void) {
+    for (unsigned s = 0; s < FCACHE_SHARDS; s++) {
+        fcache_shard_t *sh = &shards[s];
+        pthread_mutex_lock(&sh->lock);
+        while (sh->lru_head != NULL) {
+            fcache_entry_t *victim = detach(sh, sh->lru_head);
+            atomic_fetch_add(&stat_invalidations, 1);
+            if (victim != NULL)
+                entry_free(victim);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+/*
+ * Make sure path's directory is watched; 0, or -1 if it cannot be (table
+ * full, inotify limit) and the file must not be cached. Each spelling of a
+ * directory gets its own slot: two spellings of one directory share a wd,
+ * and an event is resolved against all of them.
+ */
+static int watch_dir_of(const char *path) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    int rc = -1;
+
+    if (inotify_fd < 0)
+        return -1;
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        size_t n = (size_t)(slash - path);
+        if (n == 0)
+            n = 1;  /* "/file" lives in "/" */
+        if (n >= sizeof(dir))
+            return -1;
+        memcpy(dir, path, n);
+        dir[n] = '\0';
+    }
+
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0; i < watch_count; i++) {
+        if (strcmp(watches[i].dir, dir) == 0) {
+            pthread_mutex_unlock(&watch_lock);
+            return 0;
+        }
+    }
+    if (watch_count < MAX_WATCHES) {
+        int wd = inotify_add_watch(inotify_fd, dir,
+                                   IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE
+                                   | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE
+                                   | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd >= 0 && (watches[watch_count].dir = strdup(dir)) != NULL) {
+            watches[watch_count].wd = wd;
+            watch_count++;
+            rc = 0;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return rc;
+}
+
+/* The kernel dropped a watch (directory removed or unmounted): free its slots */
+static void forget_watch(int wd) {
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            free(watches[i].dir);
+            watches[i--] = watches[--watch_count];
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void *inotify_thread(void *arg) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    (void)arg;
+
+    for (;;) {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return NULL;
+        }
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+
+            atomic_fetch_add(&change_gen, 1);
+            if (ev->mask & IN_IGNORED)
+                forget_watch(ev->wd);
+            if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                /* Lost track of something: start from a clean slate */
+                invalidate_all();
+                continue;
+            }
+            if (ev->len == 0)
+                continue;
+
+            /* Every spelling of the directory names a cached path */
+            pthread_mutex_lock(&watch_lock);
+            for (int i = 0; i < watch_count; i++) {
+                const char *dir = watches[i].dir;
+                char path[PATH_MAX];
+                if (watches[i].wd != ev->wd)
+                    continue;
+                if (strcmp(dir, ".") == 0)
+                    snprintf(path, sizeof(path), "%s", ev->name);
+                else if (strcmp(dir, "/") == 0)
+                    snprintf(path, sizeof(path), "/%s", ev->name);
+                else
+                    snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+                invalidate_path(path);
+            }
+            pthread_mutex_unlock(&watch_lock);
+        }
+    }
+}
+
+/* ---------- Public interface ---------- */
+
+int fcache_init(const fcache_config_t *cfg) {
+    pthread_t tid;
+
+    for (unsigned s = 0; s < FCACHE_SHARDS; s++)
+        pthread_mutex_init(&shards[s].lock, NULL);
+    shard_capacity = cfg->max_entries / FCACHE_SHARDS;
+    if (shard_capacity == 0)
+        shard_capacity = 1;
+    content_max_file = cfg->content_max_file;
+    variant_budget = cfg->variant_budget;
+
+    if (cfg->content_budget > 0) {
+        /* Prefer explicit huge pages, fall back to transparent huge pages */
+        arena_size = (cfg->content_budget + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        arena_base = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena_base == MAP_FAILED) {
+            arena_base = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (arena_base == MAP_FAILED) {
+                arena_base = NULL;
+                arena_size = 0;
+            } else {
+                madvise(arena_base, arena_size, MADV_HUGEPAGE);
+            }
+        }
+    }
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1 failed, file cache disabled");
+        shard_capacity = 0;
+        return -1;
+    }
+    if (pthread_create(&tid, NULL, inotify_thread, NULL) != 0) {
+        perror("Unable to create inotify thread, file cache disabled");
+        close(inotify_fd);
+        inotify_fd = -1;
+        shard_capacity = 0;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+fcache_entry_t *fcache_acquire(const char *request) {
+    char path[PATH_MAX];
+    uint64_t h;
+    fcache_shard_t *sh;
+    fcache_entry_t *e, *victim = NULL;
+    struct stat st;
+    unsigned long long gen;
+    int watched = 0;
+
+    normalize_path(request, path, sizeof(path));
+    h = hash_path(path);
+    sh = &shards[h % FCACHE_SHARDS];
+
+    pthread_mutex_lock(&sh->lock);
+    e = lookup(sh, path, h);
+    if (e != NULL) {
+        e->refs++;
+        lru_unlink(sh, e);
+        lru_push_front(sh, e);
+        pthread_mutex_unlock(&sh->lock);
+        atomic_fetch_add(&stat_hits, 1);
+        if (e->content != NULL)
+            atomic_fetch_add(&stat_content_hits, 1);
+        return e;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    atomic_fetch_add(&stat_misses, 1);
+
+    /* Miss: watch before reading so a change during the read is seen */
+    if (shard_capacity > 0)
+        watched = watch_dir_of(path) == 0;
+    gen = atomic_load(&change_gen);
+
+    /* Open and stat outside the lock */
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = EISDIR;
+        return NULL;
+    }
+    e = calloc(1, sizeof(*e));
+    if (e == NULL || (e->path = strdup(path)) == NULL) {
+        free(e);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    e->fd = fd;
+    e->size = st.st_size;
+    e->version = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+    e->hash = h;
+    e->shard = (unsigned)(h % FCACHE_SHARDS);
+    e->refs = 1;
+    atomic_fetch_add(&stat_entries, 1);
+
+    if ((size_t)st.st_size <= content_max_file && st.st_size > 0) {
+        char *slot = content_alloc((size_t)st.st_size, &e->content_class);
+        if (slot != NULL) {
+            if (pread(fd, slot, (size_t)st.st_size, 0) == st.st_size)
+                e->content = slot;
+            else
+                content_free(slot, e->content_class);
+        }
+    }
+
+    if (!watched) {
+        /*
+         * Cache disabled, or no watch on the directory (nothing would tell
+         * us the file changed): hand out a private entry that dies on release
+         */
+        e->dead = 1;
+        return e;
+    }
+
+    pthread_mutex_lock(&sh->lock);
+    if (atomic_load(&change_gen) != gen) {
+        /* Something changed while we read: serve this copy but do not cache it */
+        pthread_mutex_unlock(&sh->lock);
+        e->dead = 1;
+        return e;
+    }
+    fcache_entry_t *other = lookup(sh, path, h);
+    if (other != NULL) {
+        /* Someone else inserted it meanwhile: use theirs */
+        other->refs++;
+        pthread_mutex_unlock(&sh->lock);
+        entry_free(e);
+        return other;
+    }
+    e->hnext = sh->buckets[h & (FCACHE_BUCKETS - 1)];
+    sh->buckets[h & (FCACHE_BUCKETS - 1)] = e;
+    lru_push_front(sh, e);
+    sh->count++;
+    if (sh->count > shard_capacity && sh->lru_tail != e) {
+        victim = detach(sh, sh->lru_tail);
+        atomic_fetch_add(&stat_evictions, 1);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    if (victim != NULL)
+        entry_free(victim);
+    return e;
+}
+
+void fcache_release(fcache_entry_t *e) {
+    fcache_shard_t *sh = &shards[e->shard];
+    int free_it;
+
+    pthread_mutex_lock(&sh->lock);
+    free_it = --e->refs == 0 && e->dead;
+    pthread_mutex_unlock(&sh->lock);
+    if (free_it)
+        entry_free(e);
+}
+
+size_t fcache_digest(fcache_entry_t *e, digest_alg_t alg, uint8_t out[DIGEST_MAX_SIZE]) {
+    fcache_shard_t *sh = &shards[e->shard];
+    digest_ctx_t ctx;
+    size_t len;
+
+    if (alg <= DIGEST_NONE || alg > DIGEST_BLAKE3)
+        return 0;
+
+    pthread_mutex_lock(&sh->lock);
+    len = e->digest_len[alg];
+    if (len > 0)
+        memcpy(out, e->digest[alg], len);
+    pthread_mutex_unlock(&sh->lock);
+    if (len > 0)
+        return len;
+
+    /* First request for this digest of this file version */
+    digest_init(&ctx, alg);
+    if (e->content != NULL) {
+        digest_update(&ctx, e->content, (size_t)e->size);
+    } else {
+        char buf[64 * 1024];
+        off_t off = 0;
+        while (off < e->size) {
+            ssize_t n = pread(e->fd, buf, sizeof(buf), off);
+            if (n <= 0)
+                return 0;
+            digest_update(&ctx, buf, (size_t)n);
+            off += n;
+        }
+    }
+    len = digest_final(&ctx, out);
+
+    pthread_mutex_lock(&sh->lock);
+    memcpy(e->digest[alg], out, len);
+    e->digest_len[alg] = (uint8_t)len;
+    pthread_mutex_unlock(&sh->lock);
+    return len;
+}
+
+const void *fcache_variant_get(fcache_entry_t *e, unsigned key, size_t *len) {
+    fcache_shard_t *sh = &shards[e->shard];
+    const void *data = NULL;
+
+    pthread_mutex_lock(&sh->lock);
+    for (fcache_variant_t *v = e->variants; v != NULL; v = v->next) {
+        if (v->key == key) {
+            data = v->data;
+            *len = v->len;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if (data != NULL)
+        atomic_fetch_add(&stat_variant_hits, 1);
+    return data;
+}
+
+int fcache_variant_put(fcache_entry_t *e, unsigned key, void *data, size_t len) {
+    fcache_shard_t *sh = &shards[e->shard];
+    fcache_variant_t *v;
+
+    /* Reserve budget first */
+    if (atomic_fetch_add(&stat_variant_bytes, len) + len > variant_budget) {
+        atomic_fetch_sub(&stat_variant_bytes, len);
+        return -1;
+    }
+    v = malloc(sizeof(*v));
+    if (v == NULL) {
+        atomic_fetch_sub(&stat_variant_bytes, len);
+        return -1;
+    }
+    v->key = key;
+    v->len = len;
+    v->data = data;
+
+    pthread_mutex_lock(&sh->lock);
+    /* A dropped (or never cached) entry is about to go: don't bother */
+    int keep = !e->dead;
+    for (fcache_variant_t *o = e->variants; o != NULL; o = o->next)
+        if (o->key == key)
+            keep = 0;
+    if (keep) {
+        v->next = e->variants;
+        e->variants = v;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if (!keep) {
+        atomic_fetch_sub(&stat_variant_bytes, len);
+        free(v);
+        return -1;
+    }
+    return 0;
+}
+
+void fcache_get_stats(fcache_stats_t *stats) {
+    stats->hits = atomic_load(&stat_hits);
+    stats->misses = atomic_load(&stat_misses);
+    stats->content_hits = atomic_load(&stat_content_hits);
+    stats->evictions = atomic_load(&stat_evictions);
+    stats->invalidations = atomic_load(&stat_invalidations);
+    stats->entries = atomic_load(&stat_entries);
+    stats->variant_hits = atomic_load(&stat_variant_hits);
+    stats->variant_bytes = atomic_load(&stat_variant_bytes);
+}
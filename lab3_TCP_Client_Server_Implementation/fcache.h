@@ -0,0 +1,84 @@
+/*
+ * Open-file cache for tcp_server.
+ *
+ * Keeps an open fd plus stat metadata for recently requested files so a
+ * hot file costs a hash lookup instead of open/fseek/ftell/fclose per
+ * request. The table is split into shards (one mutex each) with an LRU
+ * bound per shard. An inotify thread drops entries whose file changes.
+ * Small files can also be kept in RAM, in a hugepage-backed arena, and
+ * compressed copies of a file version can be attached to its entry.
+ */
+
+#ifndef FCACHE_H
+#define FCACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "digest.h"
+
+typedef struct {
+    unsigned max_entries;       /* LRU bound on cached fds (all shards) */
+    size_t content_budget;      /* bytes of RAM for small file contents, 0 = off */
+    size_t content_max_file;    /* largest file kept in RAM */
+    size_t variant_budget;      /* bytes of RAM for precompressed copies, 0 = off */
+} fcache_config_t;
+
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long content_hits;    /* hits served straight from RAM */
+    unsigned long long evictions;
+    unsigned long long invalidations;
+    unsigned long long entries;
+    unsigned long long variant_hits;    /* transfers sent from a precompressed copy */
+    unsigned long long variant_bytes;
+} fcache_stats_t;
+
+struct fcache_variant;
+
+typedef struct fcache_entry {
+    /* Read-only for callers while the entry is held */
+    int fd;
+    off_t size;
+    uint64_t version;           /* mtime in ns: tells copies of the file apart */
+    const char *content;        /* file bytes if cached in RAM, else NULL */
+
+    /* Private to fcache.c */
+    char *path;
+    uint64_t hash;
+    struct fcache_entry *hnext, *lru_prev, *lru_next;
+    int refs;
+    int dead;
+    unsigned shard;
+    int content_class;
+    uint8_t digest[DIGEST_BLAKE3 + 1][DIGEST_MAX_SIZE];
+    uint8_t digest_len[DIGEST_BLAKE3 + 1];
+    struct fcache_variant *variants;
+} fcache_entry_t;
+
+/* Set up the shards, content arena and inotify thread; returns 0 or -1 */
+int fcache_init(const fcache_config_t *cfg);
+
+/* Look up (or open and insert) a regular file. NULL with errno set if it cannot be opened. */
+fcache_entry_t *fcache_acquire(const char *path);
+
+/* Drop the caller's reference; the fd is closed once the entry is evicted and unused */
+void fcache_release(fcache_entry_t *entry);
+
+/* Digest of the whole file, computed once per cached version. Returns its length. */
+size_t fcache_digest(fcache_entry_t *entry, digest_alg_t alg, uint8_t out[DIGEST_MAX_SIZE]);
+
+/*
+ * Precompressed copies, keyed by the caller (e.g. codec and level). Both
+ * live as long as this file version is cached. get returns NULL if there
+ * is none; the data stays valid while the entry is held. put takes
+ * ownership of a malloc'd buffer and returns 0, or -1 (buffer not taken)
+ * if the budget is used up or the key already exists.
+ */
+const void *fcache_variant_get(fcache_entry_t *entry, unsigned key, size_t *len);
+int fcache_variant_put(fcache_entry_t *entry, unsigned key, void *data, size_t len);
+
+void fcache_get_stats(fcache_stats_t *stats);
+
+#endif
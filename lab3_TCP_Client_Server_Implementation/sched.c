@@ -0,0 +1,371 @@
+/*
+ * Token buckets and deficit round robin for tcp_server (see sched.h).
+ *
+ * The flows form a ring in round robin order; a cursor marks the next one
+ * to visit. Whichever thread is in sched_acquire() runs the dispatcher:
+ * it walks the ring from the cursor, gives each waiting flow its credit
+ * and grants the pieces the buckets allow, waking the flows' threads.
+ * When the server bucket runs dry the cursor stays on the flow that is
+ * next in line. One waiting thread then sleeps until the bucket has
+ * refilled enough for it (the timer); the others sleep until granted.
+ *
+ * As in fq_codel, a flow that starts a new response is "fresh": it has
+ * one quantum it may spend ahead of the ring. Without this a small
+ * response would still wait for a whole round of large pieces, once per
+ * request on a pipelined connection.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "sched.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define BURST_SEC 0.05          /* a bucket holds this much of its rate, at least one max piece */
+#define CLIENT_SLOTS 256
+#define IDLE_RECHECK_NS 10000000ULL
+
+typedef struct {
+    double rate;                /* bytes/s, 0 = unlimited */
+    double burst;
+    double tokens;
+    uint64_t last;
+} bucket_t;
+
+typedef struct sched_client {
+    int family;
+    uint8_t addr[16];
+    bucket_t bucket;
+    unsigned refs;
+    struct sched_client *next;
+} sched_client_t;
+
+struct sched_flow {
+    sched_client_t *client;
+    size_t want;                /* piece waited for */
+    size_t deficit;             /* credit earned in earlier rounds */
+    size_t fresh;               /* priority credit left from sched_start() */
+    int waiting, granted;
+    pthread_cond_t cond;
+    sched_flow_t *prev, *next;
+};
+
+static struct {
+    int enabled;
+    sched_config_t cfg;
+    pthread_mutex_t lock;
+    pthread_condattr_t cond_attr;
+    bucket_t total;
+    sched_flow_t *cursor;
+    unsigned nflows, nclients, nwaiting, nfresh;
+    int timer;                  /* a waiter sleeps until the next refill */
+    sched_client_t *clients[CLIENT_SLOTS];
+    unsigned long long throttled, bytes;
+} S = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* ---------- Token buckets ---------- */
+
+static void bucket_init(bucket_t *b, double rate, uint64_t now) {
+    b->rate = rate;
+    b->burst = rate * BURST_SEC > SCHED_MAX_PIECE ? rate * BURST_SEC : SCHED_MAX_PIECE;
+    b->tokens = b->burst;
+    b->last = now;
+}
+
+static void bucket_refill(bucket_t *b, uint64_t now) {
+    if (b->rate <= 0 || now <= b->last)
+        return;
+    b->tokens += (double)(now - b->last) * b->rate / 1e9;
+    if (b->tokens > b->burst)
+        b->tokens = b->burst;
+    b->last = now;
+}
+
+static int bucket_has(const bucket_t *b, size_t n) {
+    return b->rate <= 0 || b->tokens >= (double)n;
+}
+
+/* Nanoseconds until the bucket holds n tokens */
+static uint64_t bucket_wait(const bucket_t *b, size_t n) {
+    return (uint64_t)(((double)n - b->tokens) / b->rate * 1e9) + 1;
+}
+
+static void bucket_take(bucket_t *b, size_t n) {
+    if (b->rate > 0)
+        b->tokens -= (double)n;
+}
+
+/* ---------- Clients ---------- */
+
+static unsigned client_slot(int family, const uint8_t *addr, size_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t)family;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ addr[i]) * 16777619u;
+    return h % CLIENT_SLOTS;
+}
+
+static sched_client_t *client_get(const struct sockaddr *sa, uint64_t now) {
+    uint8_t addr[16] = { 0 };
+    size_t len;
+    sched_client_t *c;
+    unsigned slot;
+
+    if (sa->sa_family == AF_INET6) {
+        memcpy(addr, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+        len = 16;
+    } else {
+        memcpy(addr, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+        len = 4;
+    }
+    slot = client_slot(sa->sa_family, addr, len);
+    for (c = S.clients[slot]; c != NULL; c = c->next)
+        if (c->family == sa->sa_family && memcmp(c->addr, addr, 16) == 0) {
+            c->refs++;
+            return c;
+        }
+    if ((c = calloc(1, sizeof(*c))) == NULL)
+        return NULL;
+    c->family = sa->sa_family;
+    memcpy(c->addr, addr, 16);
+    bucket_init(&c->bucket, S.cfg.client_rate, now);
+    c->refs = 1;
+    c->next = S.clients[slot];
+    S.clients[slot] = c;
+    S.nclients++;
+    return c;
+}
+
+static void client_put(sched_client_t *c) {
+    sched_client_t **pp;
+
+    if (--c->refs > 0)
+        return;
+    pp = &S.clients[client_slot(c->family, c->addr, c->family == AF_INET6 ? 16 : 4)];
+    while (*pp != c)
+        pp = &(*pp)->next;
+    *pp = c->next;
+    S.nclients--;
+    free(c);
+}
+
+/* ---------- Scheduling ---------- */
+
+static void grant(sched_flow_t *f) {
+    bucket_take(&S.total, f->want);
+    bucket_take(&f->client->bucket, f->want);
+    if (f->fresh >= f->want) {
+        f->fresh -= f->want;
+        S.nfresh -= f->fresh == 0;
+    } else {
+        f->deficit -= f->want;
+    }
+    f->waiting = 0;
+    f->granted = 1;
+    S.nwaiting--;
+    pthread_cond_signal(&f->cond);
+}
+
+/*
+ * Grant waiting flows in round robin order while the buckets allow.
+ * Returns the nanoseconds until more tokens could serve a flow still
+ * waiting (0 if none is).
+ */
+static uint64_t dispatch(uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    unsigned idle = 0;          /* visits in a row that changed nothing */
+
+    bucket_refill(&S.total, now);
+
+    /* Fresh flows first, in ring order */
+    if (S.nfresh > 0) {
+        sched_flow_t *f = S.cursor;
+        unsigned i;
+        for (i = 0; i < S.nflows && S.nwaiting > 0; i++, f = f->next) {
+            if (!f->waiting || f->fresh < f->want)
+                continue;
+            bucket_refill(&f->client->bucket, now);
+            if (!bucket_has(&f->client->bucket, f->want)) {
+                uint64_t wait = bucket_wait(&f->client->bucket, f->want);
+                next = wait < next ? wait : next;
+                continue;
+            }
+            if (!bucket_has(&S.total, f->want))
+                return bucket_wait(&S.total, f->want);
+            grant(f);
+        }
+    }
+    while (S.nwaiting > 0 && idle < S.nflows) {
+        sched_flow_t *f = S.cursor;
+        bucket_t *cb = &f->client->bucket;
+
+        S.cursor = f->next;
+        if (!f->waiting) {
+            idle++;
+            continue;
+        }
+        /* A client over its own rate sits out without earning credit */
+        bucket_refill(cb, now);
+        if (!bucket_has(cb, f->want)) {
+            uint64_t wait = bucket_wait(cb, f->want);
+            next = wait < next ? wait : next;
+            idle++;
+            continue;
+        }
+        if (f->deficit < f->want) {
+            f->deficit += SCHED_QUANTUM;
+            if (f->deficit < f->want) {
+                idle = 0;       /* a large piece: sent after a few rounds */
+                continue;
+            }
+        }
+        if (!bucket_has(&S.total, f->want)) {
+            uint64_t wait = bucket_wait(&S.total, f->want);
+            S.cursor = f;       /* first in line once the server bucket refills */
+            return wait < next ? wait : next;
+        }
+        grant(f);
+        idle = 0;
+    }
+    if (S.nwaiting == 0)
+        return 0;
+    return next != UINT64_MAX ? next : IDLE_RECHECK_NS;
+}
+
+/* ---------- Public interface ---------- */
+
+void sched_init(const sched_config_t *cfg) {
+    S.cfg = *cfg;
+    S.enabled = cfg->total_rate > 0 || cfg->client_rate > 0;
+    pthread_condattr_init(&S.cond_attr);
+    pthread_condattr_setclock(&S.cond_attr, CLOCK_MONOTONIC);
+    bucket_init(&S.total, cfg->total_rate, now_ns());
+}
+
+int sched_enabled(void) {
+    return S.enabled;
+}
+
+sched_flow_t *sched_open(const struct sockaddr *addr) {
+    sched_flow_t *f;
+
+    if (!S.enabled || (f = calloc(1, sizeof(*f))) == NULL)
+        return NULL;
+    pthread_cond_init(&f->cond, &S.cond_attr);
+    pthread_mutex_lock(&S.lock);
+    if ((f->client = client_get(addr, now_ns())) == NULL) {
+        pthread_mutex_unlock(&S.lock);
+        pthread_cond_destroy(&f->cond);
+        free(f);
+        return NULL;
+    }
+    /* Join at the end of the current round: just before the cursor */
+    if (S.cursor == NULL) {
+        f->prev = f->next = f;
+        S.cursor = f;
+    } else {
+        f->next = S.cursor;
+        f->prev = S.cursor->prev;
+        f->prev->next = f;
+        S.cursor->prev = f;
+    }
+    S.nflows++;
+    pthread_mutex_unlock(&S.lock);
+    return f;
+}
+
+void sched_close(sched_flow_t *f) {
+    if (f == NULL)
+        return;
+    pthread_mutex_lock(&S.lock);
+    if (f->next == f) {
+        S.cursor = NULL;
+    } else {
+        f->prev->next = f->next;
+        f->next->prev = f->prev;
+        if (S.cursor == f)
+            S.cursor = f->next;
+    }
+    S.nflows--;
+    S.nfresh -= f->fresh > 0;
+    client_put(f->client);
+    pthread_mutex_unlock(&S.lock);
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+void sched_start(sched_flow_t *f) {
+    if (f == NULL)
+        return;
+    pthread_mutex_lock(&S.lock);
+    S.nfresh += f->fresh == 0;
+    f->fresh = SCHED_QUANTUM;
+    pthread_mutex_unlock(&S.lock);
+}
+
+uint64_t sched_acquire(sched_flow_t *f, size_t n) {
+    uint64_t start;
+    int slept = 0;
+
+    if (f == NULL || n == 0)
+        return 0;
+    if (n > SCHED_MAX_PIECE)
+        n = SCHED_MAX_PIECE;
+    start = now_ns();
+
+    pthread_mutex_lock(&S.lock);
+    if (f->fresh > 0 && f->fresh < n) {
+        /* A piece too large for the fast lane: a large response, back in the ring */
+        f->fresh = 0;
+        S.nfresh--;
+    }
+    f->want = n;
+    f->waiting = 1;
+    S.nwaiting++;
+    for (;;) {
+        uint64_t next = dispatch(now_ns());
+        if (f->granted)
+            break;
+        slept = 1;
+        if (!S.timer) {
+            uint64_t at = now_ns() + next;
+            struct timespec ts = { (time_t)(at / 1000000000ULL), (long)(at % 1000000000ULL) };
+            S.timer = 1;
+            pthread_cond_timedwait(&f->cond, &S.lock, &ts);
+            S.timer = 0;
+        } else {
+            pthread_cond_wait(&f->cond, &S.lock);
+        }
+    }
+    f->granted = 0;
+    S.bytes += n;
+    S.throttled += slept;
+
+    /* Flows still waiting and nobody watching the clock: wake one to take over */
+    if (S.nwaiting > 0 && !S.timer) {
+        sched_flow_t *w = S.cursor;
+        while (!w->waiting)
+            w = w->next;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&S.lock);
+    return slept ? now_ns() - start : 0;
+}
+
+void sched_get_stats(sched_stats_t *st) {
+    pthread_mutex_lock(&S.lock);
+    st->flows = S.nflows;
+    st->clients = S.nclients;
+    st->waiting = S.nwaiting;
+    st->throttled = S.throttled;
+    st->bytes = S.bytes;
+    pthread_mutex_unlock(&S.lock);
+}
@@ -0,0 +1,61 @@
+/*
+ * Bandwidth scheduler for tcp_server.
+ *
+ * Every transfer (a connection) is a flow. Before a connection thread puts
+ * a piece of a response on the wire it calls sched_acquire() for that many
+ * bytes; the call returns once the piece may go. Two token buckets limit
+ * the rate: one for the whole server and one per client address, shared
+ * by all connections from it. When the flows want more than the server
+ * budget, the waiting ones are served in deficit round robin order: each
+ * round a flow earns quantum bytes of credit and sends once its credit
+ * covers its next piece. A connection calls sched_start() when it begins
+ * a response; up to one quantum of that response may then go ahead of
+ * the round, so small responses are not held up by large transfers.
+ *
+ * With neither rate set, sched_acquire() returns at once without locking.
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define SCHED_QUANTUM (64 * 1024)       /* credit per flow per round */
+#define SCHED_MAX_PIECE (256 * 1024)    /* largest piece one acquire may ask for */
+
+typedef struct {
+    double total_rate;          /* bytes/s for all transfers together, 0 = unlimited */
+    double client_rate;         /* bytes/s per client address, 0 = unlimited */
+} sched_config_t;
+
+typedef struct {
+    unsigned long long flows;           /* open */
+    unsigned long long clients;         /* distinct addresses with open flows */
+    unsigned long long waiting;         /* flows blocked in sched_acquire() */
+    unsigned long long throttled;       /* acquires that had to wait */
+    unsigned long long bytes;           /* granted */
+} sched_stats_t;
+
+typedef struct sched_flow sched_flow_t;
+
+void sched_init(const sched_config_t *cfg);
+int sched_enabled(void);
+
+/* A flow for a connection from addr (AF_INET or AF_INET6); NULL if disabled or out of memory */
+sched_flow_t *sched_open(const struct sockaddr *addr);
+void sched_close(sched_flow_t *flow);
+
+/* flow begins a new response: its first quantum gets priority */
+void sched_start(sched_flow_t *flow);
+
+/*
+ * Wait until flow may send n bytes (at most SCHED_MAX_PIECE). Returns the
+ * nanoseconds waited. One thread per flow.
+ */
+uint64_t sched_acquire(sched_flow_t *flow, size_t n);
+
+void sched_get_stats(sched_stats_t *stats);
+
+#endif
@@ -1,6 +1,22 @@
 /*
- * TCP Client - Connects to server and requests a file download.
- * Usage: ./tcp_client <server_ip> <port> <filename>
+ * TCP Client - Connects to server and requests file downloads.
+ * The transfer itself is done by the tcp_fetch library; several files are
+ * fetched concurrently over a small pool of connections.
+ * With -d the server appends a digest of the file, which the client checks
+ * against its own digest computed while receiving (no second read).
+ * With -z the file is sent as compressed chunks, decoded as they arrive.
+ * With -r an interrupted download is continued where it stopped: a
+ * manifest next to the file (downloads/<name>.manifest) records what is on
+ * disk, and only the rest is requested.
+ * With -T the connections use TLS 1.3 and the server's certificate is
+ * checked against the given CA file (for a self-signed server, its own
+ * certificate).
+ * Output goes through the asynchronous logger (log.h); -v adds connection
+ * events from the library.
+ * Usage: ./tcp_client [-v] [-r] [-T ca.pem] [-d crc32c|xxh64|blake3]
+ *                     [-z lz4|zstd[:level]|deflate[:level]] [-p connections]
+ *                     <server> <port> <filename>...
+ * The server is a host name or an IPv4 or IPv6 address.
  * Example: ./tcp_client 127.0.0.1 5000 myfile.txt
  */
 
@@ -8,116 +24,140 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/socket.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <signal.h>
+
+#include "transfer.h"
+#include "tcp_fetch.h"
+#include "log.h"
 
-#define FILENAME_SIZE 256
-#define FILE_BUFFER_SIZE 1024
 #define DOWNLOAD_DIR "downloads"
+#define DEFAULT_CONNECTIONS 4
 
-int main(int argc, char *argv[]) {
-    int sockfd;
-    struct sockaddr_in serverAddr;
-    char filename[FILENAME_SIZE];
-    char buffer[FILE_BUFFER_SIZE];
-    ssize_t bytes_received;
-    FILE *outfile;
-    uint32_t file_size, remaining;
-    uint32_t size_net;
-
-    if (argc != 4) {
-        printf("Usage: %s <server_ip> <port> <filename>\n", argv[0]);
-        exit(1);
-    }
+comp_alg_t requestedCodec = COMP_NONE;
 
-    /* Create TCP socket */
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(1);
-    }
+void usage(const char *prog) {
+    printf("Usage: %s [-v] [-r] [-T ca.pem] [-d crc32c|xxh64|blake3] "
+           "[-z lz4|zstd[:level]|deflate[:level]] [-p connections] <server> <port> <filename>...\n",
+           prog);
+    exit(1);
+}
 
-    /* Setup server address */
-    memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(atoi(argv[2]));
-    if (inet_pton(AF_INET, argv[1], &serverAddr.sin_addr) <= 0) {
-        perror("Invalid address");
-        close(sockfd);
-        exit(1);
-    }
+/* Called by the library as each download finishes */
+void onDownloaded(const fetch_result_t *res, void *user) {
+    double secs = res->seconds > 0 ? res->seconds : 1e-9;
+    (void)user;
 
-    /* Connect to server */
-    if (connect(sockfd, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-        perror("Connection failed");
-        close(sockfd);
-        exit(1);
-    }
-    printf("Connected to server %s:%s\n", argv[1], argv[2]);
-
-    /* Send requested filename to server */
-    memset(filename, 0, FILENAME_SIZE);
-    strncpy(filename, argv[3], FILENAME_SIZE - 1);
-    if (send(sockfd, filename, FILENAME_SIZE, 0) < 0) {
-        perror("Send filename failed");
-        close(sockfd);
-        exit(1);
+    switch (res->status) {
+    case FETCH_OK:
+        break;
+    case FETCH_NOT_FOUND:
+        log_error("Server reported: file not found (%s).", res->filename);
+        return;
+    case FETCH_DIGEST_MISMATCH:
+        log_error("Digest mismatch (%s) for %s: received data hashes to %s",
+                  digest_name(res->digest), res->filename, res->digest_hex);
+        return;
+    default:
+        log_error("Download of '%s' failed: %s", res->filename, fetch_status_str(res->status));
+        return;
     }
-    printf("Requested file: %s\n", filename);
 
-    /* Receive file size (4 bytes, network byte order) */
-    if (recv(sockfd, &size_net, sizeof(size_net), 0) != sizeof(size_net)) {
-        perror("Receive file size failed");
-        close(sockfd);
-        exit(1);
-    }
-    file_size = ntohl(size_net);
+    if (requestedCodec != COMP_NONE && res->codec != requestedCodec)
+        log_info("Server used %s instead of %s", comp_name(res->codec), comp_name(requestedCodec));
+    if (res->digest != DIGEST_NONE)
+        log_info("Digest verified (%s): %s", digest_name(res->digest), res->digest_hex);
+    if (res->resumed_from > 0)
+        log_info("Resumed '%s' at byte %llu", res->filename, (unsigned long long)res->resumed_from);
 
-    if (file_size == 0) {
-        printf("Server reported: file not found.\n");
-        close(sockfd);
-        exit(1);
+    /* Goodput counts file bytes delivered in this run, not bytes on the wire */
+    double fetched = (double)(res->size - res->resumed_from);
+    if (res->codec != COMP_NONE)
+        log_info("File '%s' downloaded to %s/ (%llu bytes, %llu on the wire with %s, "
+                 "ratio %.2f:1, goodput %.1f MB/s).", res->filename, DOWNLOAD_DIR,
+                 (unsigned long long)res->size,
+                 (unsigned long long)res->wire_bytes, comp_name(res->codec),
+                 res->wire_bytes ? fetched / res->wire_bytes : 0.0, fetched / secs / 1e6);
+    else
+        log_info("File '%s' downloaded to %s/ (%llu bytes, goodput %.1f MB/s).",
+                 res->filename, DOWNLOAD_DIR, (unsigned long long)res->size, fetched / secs / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    fetch_config_t cfg;
+    fetch_client_t *client;
+    int opt, port, verbose = 0;
+    unsigned failed;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.max_conns_per_server = DEFAULT_CONNECTIONS;
+
+    while ((opt = getopt(argc, argv, "vrT:d:z:p:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'r':
+            cfg.resume = 1;
+            break;
+        case 'T':
+            cfg.tls_ca = optarg;
+            break;
+        case 'd':
+            cfg.digest = digest_from_name(optarg);
+            if (cfg.digest == DIGEST_NONE) {
+                printf("Unknown digest: %s (use crc32c, xxh64 or blake3)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'z':
+            cfg.compress = comp_from_name(optarg, &cfg.level);
+            if (cfg.compress == COMP_NONE) {
+                printf("Unknown compression: %s (use lz4, zstd or deflate)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'p':
+            cfg.max_conns_per_server = (unsigned)atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (argc - optind < 3)
+        usage(argv[0]);
+    requestedCodec = cfg.compress;
+    log_init(verbose ? LOG_LVL_DEBUG : LOG_LVL_INFO, verbose ? LOG_TIMESTAMPS : 0);
+    port = atoi(argv[optind + 1]);
+    /* A server closing a TLS connection must not kill us mid-write (see tcp_fetch.h) */
+    signal(SIGPIPE, SIG_IGN);
 
     /* Create downloads directory if it doesn't exist */
     if (mkdir(DOWNLOAD_DIR, 0755) < 0 && errno != EEXIST) {
         perror("Cannot create download directory");
-        close(sockfd);
         exit(1);
     }
 
-    /* Build path: downloads/<filename> and open for writing */
-    {
-        char filepath[FILENAME_SIZE + sizeof(DOWNLOAD_DIR) + 2];
-        snprintf(filepath, sizeof(filepath), "%s/%s", DOWNLOAD_DIR, filename);
-        outfile = fopen(filepath, "wb");
-    }
-    if (outfile == NULL) {
-        perror("Cannot create local file");
-        close(sockfd);
+    client = fetch_client_new(&cfg);
+    if (client == NULL) {
+        perror("Cannot set up client");
         exit(1);
     }
 
-    /* Receive file content */
-    remaining = file_size;
-    while (remaining > 0) {
-        size_t to_read = remaining < FILE_BUFFER_SIZE ? remaining : FILE_BUFFER_SIZE;
-        bytes_received = recv(sockfd, buffer, to_read, 0);
-        if (bytes_received <= 0) {
-            perror("Receive file content failed");
-            fclose(outfile);
-            close(sockfd);
+    /* Queue one download per filename: downloads/<filename> */
+    for (int i = optind + 2; i < argc; i++) {
+        char filepath[FILENAME_SIZE + sizeof(DOWNLOAD_DIR) + 2];
+        snprintf(filepath, sizeof(filepath), "%s/%s", DOWNLOAD_DIR, argv[i]);
+        if (fetch_download(client, argv[optind], port, argv[i], filepath, onDownloaded, NULL) < 0) {
+            printf("Invalid address or filename: %s %s\n", argv[optind], argv[i]);
+            fetch_client_free(client);
             exit(1);
         }
-        fwrite(buffer, 1, bytes_received, outfile);
-        remaining -= bytes_received;
+        log_info("Requested file: %s", argv[i]);
     }
 
-    fclose(outfile);
-    close(sockfd);
-    printf("File '%s' downloaded to %s/ (%u bytes).\n", filename, DOWNLOAD_DIR, file_size);
-    return 0;
+    failed = fetch_run(client);
+    fetch_client_free(client);
+    return failed ? 1 : 0;
 }
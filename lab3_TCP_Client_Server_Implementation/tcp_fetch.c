@@ -0,0 +1,869 @@
+/*
+ * Asynchronous download library for tcp_server (see tcp_fetch.h).
+ *
+ * Each download moves through: queued (pending) -> started, waiting on its
+ * server for a connection -> running on a connection -> finished. A
+ * connection reads the response with a byte-driven parser, so a read can
+ * end anywhere (mid-header, mid-chunk) and pick up on the next event.
+ * A resumed download appends to its output file and marks each complete
+ * COMP_CHUNK_SIZE piece in the file's manifest.
+ * With TLS, a connection does its handshake between connecting and
+ * sending its first request, and reads and writes go through tls.c.
+ */
+
+#define _GNU_SOURCE
+#include "tcp_fetch.h"
+#include "transfer.h"
+#include "manifest.h"
+#include "tls.h"
+#include "log.h"
+#include "net.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define RECV_BUF_SIZE (256 * 1024)
+#define MAX_EVENTS 256
+
+typedef struct fetch_server fetch_server_t;
+typedef struct fetch_conn fetch_conn_t;
+typedef struct fetch_req fetch_req_t;
+
+struct fetch_req {
+    fetch_server_t *srv;
+    char filename[REQ_NAME_MAX];
+    char *out_path;
+    FILE *out;
+    manifest_t *manifest;           /* resume: chunks of out on disk */
+    uint64_t written;               /* file offset reached in out */
+    uint64_t marked;                /* chunks marked in the manifest */
+    fetch_done_fn done;
+    void *user;
+    double start, deadline;
+    int retried;
+    fetch_conn_t *conn;
+    fetch_result_t result;
+    fetch_req_t *prev, *next;       /* pending queue or server wait list */
+    fetch_req_t *rprev, *rnext;     /* started list, oldest (= earliest deadline) first */
+};
+
+/* Connection states; the C_SIZE..C_TRAILER states parse a response */
+enum { C_CONNECTING, C_HANDSHAKE, C_SENDING, C_SIZE, C_BODY, C_CHUNK_HEAD, C_CHUNK_DATA, C_TRAILER, C_DONE, C_IDLE };
+
+struct fetch_conn {
+    int fd;
+    tls_conn_t *tls;                /* NULL: plaintext */
+    int state;
+    uint32_t events;
+    fetch_server_t *srv;
+    fetch_req_t *req;
+    fetch_conn_t *next_idle;
+    int reused;                     /* served a request: the server may have closed it since */
+    int got_bytes;                  /* any response bytes for the current request */
+    request_t request;
+    size_t sent;
+    uint8_t small[2 + DIGEST_MAX_SIZE];     /* size, chunk header or trailer being collected */
+    size_t have, need;
+    fetch_status_t status;          /* outcome once state is C_DONE */
+    digest_ctx_t digest;
+    uint64_t remaining;
+    uint32_t chunk_raw, chunk_len;
+    int chunk_stored;
+    uint8_t *chunk_buf, *raw_buf;
+    size_t chunk_cap;
+};
+
+_Static_assert(2 + DIGEST_MAX_SIZE >= 4 + 8 + 1 + 16, "response header must fit in small");
+
+struct fetch_server {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char ip[NET_ADDRSTRLEN];        /* for logs and certificate checks */
+    int port;
+    unsigned nconns;
+    fetch_conn_t *idle;
+    fetch_req_t *wait_head, *wait_tail;
+    fetch_server_t *next;
+};
+
+struct fetch_client {
+    fetch_config_t cfg;
+    int epfd;
+    fetch_server_t *servers;
+    fetch_req_t *pending_head, *pending_tail;
+    fetch_req_t *run_head, *run_tail;
+    unsigned running, outstanding, failed;
+    uint8_t *rbuf;
+    tls_ctx_t *tls;                 /* NULL: plaintext */
+};
+
+static void dispatch(fetch_client_t *c, fetch_server_t *s);
+
+/* ---------- Helpers ---------- */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void queue_push(fetch_req_t **head, fetch_req_t **tail, fetch_req_t *r) {
+    r->next = NULL;
+    r->prev = *tail;
+    if (*tail) (*tail)->next = r;
+    else *head = r;
+    *tail = r;
+}
+
+static void queue_push_front(fetch_req_t **head, fetch_req_t **tail, fetch_req_t *r) {
+    r->prev = NULL;
+    r->next = *head;
+    if (*head) (*head)->prev = r;
+    else *tail = r;
+    *head = r;
+}
+
+static void queue_remove(fetch_req_t **head, fetch_req_t **tail, fetch_req_t *r) {
+    if (r->prev) r->prev->next = r->next;
+    else *head = r->next;
+    if (r->next) r->next->prev = r->prev;
+    else *tail = r->prev;
+    r->prev = r->next = NULL;
+}
+
+static void run_push(fetch_client_t *c, fetch_req_t *r) {
+    r->rnext = NULL;
+    r->rprev = c->run_tail;
+    if (c->run_tail) c->run_tail->rnext = r;
+    else c->run_head = r;
+    c->run_tail = r;
+}
+
+static void run_remove(fetch_client_t *c, fetch_req_t *r) {
+    if (r->rprev) r->rprev->rnext = r->rnext;
+    else c->run_head = r->rnext;
+    if (r->rnext) r->rnext->rprev = r->rprev;
+    else c->run_tail = r->rprev;
+}
+
+static void set_events(fetch_client_t *c, fetch_conn_t *conn, uint32_t events) {
+    struct epoll_event ev;
+    if (conn->events == events)
+        return;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(c->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = events;
+}
+
+/* ---------- Download completion ---------- */
+
+static void finish(fetch_client_t *c, fetch_req_t *r, fetch_status_t status) {
+    r->result.status = status;
+    r->result.filename = r->filename;
+    r->result.seconds = now() - r->start;
+    if (r->manifest != NULL) {
+        /* Kept for the next attempt unless complete (removed) or the data is bad */
+        if (r->out != NULL)
+            fflush(r->out);
+        manifest_close(r->manifest, status == FETCH_DIGEST_MISMATCH);
+        r->manifest = NULL;
+    }
+    if (r->out != NULL && fclose(r->out) != 0 && status == FETCH_OK)
+        r->result.status = FETCH_IO_ERROR;
+    r->out = NULL;
+
+    run_remove(c, r);
+    c->running--;
+    c->outstanding--;
+    if (r->result.status != FETCH_OK)
+        c->failed++;
+    if (r->done != NULL)
+        r->done(&r->result, r->user);
+    free(r->out_path);
+    free(r);
+}
+
+/* ---------- Connections ---------- */
+
+static void conn_close(fetch_client_t *c, fetch_conn_t *conn) {
+    (void)c;
+    tls_close(conn->tls);
+    close(conn->fd);        /* also drops it from the epoll set */
+    conn->srv->nconns--;
+    free(conn->chunk_buf);
+    free(conn->raw_buf);
+    free(conn);
+}
+
+static fetch_conn_t *conn_open(fetch_client_t *c, fetch_server_t *s) {
+    struct epoll_event ev;
+    fetch_conn_t *conn;
+    int one = 1;
+    int fd = socket(s->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return NULL;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&s->addr, s->addr_len) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return NULL;
+    }
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        close(fd);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->srv = s;
+    conn->state = C_CONNECTING;
+    conn->events = EPOLLOUT;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        free(conn);
+        return NULL;
+    }
+    s->nconns++;
+    log_debug("Connecting to %s port %d (%u open)", s->ip, s->port, s->nconns);
+    return conn;
+}
+
+/* The connection broke while serving its request */
+static void conn_fail(fetch_client_t *c, fetch_conn_t *conn, fetch_status_t status) {
+    fetch_server_t *s = conn->srv;
+    fetch_req_t *r = conn->req;
+    int stale = conn->reused && !conn->got_bytes;
+
+    conn_close(c, conn);
+    if (r != NULL) {
+        r->conn = NULL;
+        if (stale && !r->retried) {
+            /* A pooled connection the server had already closed: retry once on a fresh one */
+            r->retried = 1;
+            log_debug("Pooled connection to %s port %d was closed, retrying %s",
+                      s->ip, s->port, r->filename);
+            queue_push_front(&s->wait_head, &s->wait_tail, r);
+        } else {
+            finish(c, r, status);
+        }
+    }
+    dispatch(c, s);
+}
+
+/* Epoll events a TLS call that would block is waiting for */
+static uint32_t tls_events(fetch_conn_t *conn) {
+    return tls_wants_write(conn->tls) ? EPOLLOUT : EPOLLIN;
+}
+
+static void conn_send(fetch_client_t *c, fetch_conn_t *conn) {
+    while (conn->sent < sizeof(conn->request)) {
+        const char *p = (const char *)&conn->request + conn->sent;
+        size_t len = sizeof(conn->request) - conn->sent;
+        ssize_t n = conn->tls ? tls_write(conn->tls, p, len) : send(conn->fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_events(c, conn, conn->tls ? tls_events(conn) : EPOLLOUT);
+                return;
+            }
+            conn_fail(c, conn, FETCH_IO_ERROR);
+            return;
+        }
+        conn->sent += (size_t)n;
+    }
+    /* Response starts with the size, plus the codec byte if compression was asked for */
+    conn->state = C_SIZE;
+    conn->have = 0;
+    conn->need = 4;
+    set_events(c, conn, EPOLLIN);
+}
+
+/* Connected: set up TLS, or go on with it; the request goes out once it is done */
+static void conn_handshake(fetch_client_t *c, fetch_conn_t *conn) {
+    if (conn->tls == NULL) {
+        if ((conn->tls = tls_connect(c->tls, conn->fd, conn->srv->ip)) == NULL) {
+            conn_fail(c, conn, FETCH_TLS_FAILED);
+            return;
+        }
+        conn->state = C_HANDSHAKE;
+    }
+    if (tls_handshake(conn->tls) < 0) {
+        if (errno == EAGAIN)
+            set_events(c, conn, tls_events(conn));
+        else
+            conn_fail(c, conn, FETCH_TLS_FAILED);
+        return;
+    }
+    log_debug("TLS to %s port %d: %s%s", conn->srv->ip, conn->srv->port, tls_cipher(conn->tls),
+              tls_ktls_send(conn->tls) ? " (kernel TLS)" : "");
+    conn->state = C_SENDING;
+    conn_send(c, conn);
+}
+
+static void conn_start(fetch_client_t *c, fetch_conn_t *conn, fetch_req_t *r) {
+    conn->req = r;
+    r->conn = conn;
+    conn->got_bytes = 0;
+    memset(&r->result, 0, sizeof(r->result));
+    r->result.digest = c->cfg.digest;
+
+    request_init(&conn->request, r->filename);
+    conn->request.digest = (uint8_t)c->cfg.digest;
+    conn->request.compress = (uint8_t)c->cfg.compress;
+    conn->request.level = (uint8_t)(c->cfg.level > 0 && c->cfg.level < 256 ? c->cfg.level : 0);
+    conn->request.flags = REQ_FLAG_SIZE64 | (c->cfg.no_keepalive ? 0 : REQ_FLAG_KEEPALIVE);
+    if (c->cfg.resume && r->out_path != NULL) {
+        uint64_t size, version, prefix;
+        struct stat st;
+        /* Continue where an interrupted download stopped, if its data is still there */
+        if (manifest_peek(r->out_path, &size, &version, &prefix) < 0
+            || stat(r->out_path, &st) < 0 || (uint64_t)st.st_size < prefix)
+            prefix = version = 0;
+        request_set_resume(&conn->request, prefix, version);
+    }
+    conn->sent = 0;
+
+    if (conn->state == C_CONNECTING || conn->state == C_HANDSHAKE)
+        return;     /* sent once the connect (and handshake) completes */
+    conn->state = C_SENDING;
+    conn_send(c, conn);
+}
+
+/* Hand queued downloads of this server to idle or new connections */
+static void dispatch(fetch_client_t *c, fetch_server_t *s) {
+    unsigned max_conns = c->cfg.max_conns_per_server ? c->cfg.max_conns_per_server : 1;
+
+    while (s->wait_head != NULL) {
+        fetch_conn_t *conn = s->idle;
+        fetch_req_t *r;
+
+        if (conn != NULL) {
+            s->idle = conn->next_idle;
+        } else if (s->nconns < max_conns) {
+            conn = conn_open(c, s);
+        } else {
+            break;
+        }
+        r = s->wait_head;
+        queue_remove(&s->wait_head, &s->wait_tail, r);
+        if (conn == NULL)
+            finish(c, r, FETCH_CONNECT_FAILED);
+        else
+            conn_start(c, conn, r);
+    }
+}
+
+/* Request answered: report it and reuse the connection (or close it) */
+static void conn_complete(fetch_client_t *c, fetch_conn_t *conn) {
+    fetch_server_t *s = conn->srv;
+    fetch_req_t *r = conn->req;
+
+    if (c->cfg.no_keepalive) {
+        fetch_status_t status = conn->status;
+        r->conn = NULL;
+        conn_close(c, conn);
+        finish(c, r, status);
+        dispatch(c, s);
+        return;
+    }
+    conn->req = NULL;
+    conn->reused = 1;
+    conn->state = C_IDLE;
+    r->conn = NULL;
+    set_events(c, conn, EPOLLIN);   /* notices the server closing it while idle */
+    conn->next_idle = s->idle;
+    s->idle = conn;
+
+    finish(c, r, conn->status);
+    dispatch(c, s);
+}
+
+/* ---------- Response parsing ---------- */
+
+static int deliver(fetch_conn_t *conn, const uint8_t *data, size_t len) {
+    fetch_req_t *r = conn->req;
+    if (r->out != NULL && fwrite(data, 1, len, r->out) != len)
+        return -1;
+    digest_update(&conn->digest, data, len);
+    conn->remaining -= len;
+
+    if (r->manifest != NULL) {
+        /* Mark the chunks now complete; the last one ends with the file */
+        uint64_t full;
+        r->written += len;
+        full = conn->remaining == 0 ? manifest_chunks(r->manifest) : r->written / COMP_CHUNK_SIZE;
+        while (r->marked < full)
+            manifest_set(r->manifest, r->marked++);
+        if (manifest_due(r->manifest)
+            && (fflush(r->out) != 0 || manifest_sync(r->manifest) < 0))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Open the output file for a response starting at file offset start. A
+ * resumed download keeps the first start bytes and hashes them, so the
+ * digest still covers the whole file.
+ */
+static fetch_status_t open_output(fetch_client_t *c, fetch_conn_t *conn, uint64_t start,
+                                  uint64_t version) {
+    fetch_req_t *r = conn->req;
+
+    digest_init(&conn->digest, c->cfg.digest);
+    if (r->out_path == NULL)
+        return start == 0 ? FETCH_OK : FETCH_PROTOCOL_ERROR;
+    if (start == 0) {
+        if ((r->out = fopen(r->out_path, "wb")) == NULL)
+            return FETCH_IO_ERROR;
+    } else {
+        uint8_t *buf;
+        uint64_t left = start;
+
+        if ((r->out = fopen(r->out_path, "r+b")) == NULL
+            || ftruncate(fileno(r->out), (off_t)start) < 0)
+            return FETCH_IO_ERROR;
+        if (c->cfg.digest != DIGEST_NONE) {
+            if ((buf = malloc(COMP_CHUNK_SIZE)) == NULL)
+                return FETCH_IO_ERROR;
+            while (left > 0) {
+                size_t n = fread(buf, 1, left < COMP_CHUNK_SIZE ? (size_t)left : COMP_CHUNK_SIZE, r->out);
+                if (n == 0)
+                    break;
+                digest_update(&conn->digest, buf, n);
+                left -= n;
+            }
+            free(buf);
+            if (left > 0)
+                return FETCH_IO_ERROR;
+        }
+        if (fseeko(r->out, (off_t)start, SEEK_SET) < 0)
+            return FETCH_IO_ERROR;
+        log_debug("Resuming %s at byte %llu", r->filename, (unsigned long long)start);
+    }
+    if (c->cfg.resume) {
+        r->manifest = manifest_open(r->out_path, fileno(r->out), r->result.size, COMP_CHUNK_SIZE,
+                                    version, start == 0);
+        if (r->manifest == NULL)
+            return FETCH_IO_ERROR;
+        r->written = start;
+        r->marked = start / COMP_CHUNK_SIZE;
+        r->result.resumed_from = start;
+    }
+    return FETCH_OK;
+}
+
+static void body_done(fetch_client_t *c, fetch_conn_t *conn) {
+    if (c->cfg.digest != DIGEST_NONE) {
+        conn->state = C_TRAILER;
+        conn->have = 0;
+        conn->need = 2 + digest_size(c->cfg.digest);
+    } else {
+        conn->state = C_DONE;
+        conn->status = FETCH_OK;
+    }
+}
+
+static void next_chunk(fetch_client_t *c, fetch_conn_t *conn) {
+    if (conn->remaining == 0) {
+        body_done(c, conn);
+        return;
+    }
+    conn->state = C_CHUNK_HEAD;
+    conn->have = 0;
+    conn->need = CHUNK_HEADER_SIZE;
+}
+
+/* A fixed-size piece (size, chunk header, trailer) is complete; FETCH_OK or why not */
+static fetch_status_t small_done(fetch_client_t *c, fetch_conn_t *conn) {
+    fetch_req_t *r = conn->req;
+
+    switch (conn->state) {
+    case C_SIZE: {
+        uint32_t size_net;
+        uint64_t start = 0, version = 0;
+        size_t need = 4, codec_at;
+        fetch_status_t st;
+        memcpy(&size_net, conn->small, 4);
+        r->result.size = ntohl(size_net);
+        if (r->result.size == 0) {
+            conn->state = C_DONE;
+            conn->status = FETCH_NOT_FOUND;
+            return FETCH_OK;
+        }
+        /* The 64-bit size, codec byte and resume header follow, except in a not-found reply */
+        if (r->result.size == SIZE64_ESCAPE)
+            need += 8;
+        codec_at = need;
+        if (c->cfg.compress != COMP_NONE)
+            need += 1;
+        if (conn->request.flags & REQ_FLAG_RESUME)
+            need += 16;
+        if (conn->have < need) {
+            conn->need = need;
+            return FETCH_OK;
+        }
+        if (codec_at > 4 && (r->result.size = get_be64(conn->small + 4)) < SIZE64_ESCAPE)
+            return FETCH_PROTOCOL_ERROR;
+        if (c->cfg.compress != COMP_NONE) {
+            r->result.codec = (comp_alg_t)conn->small[codec_at];
+            if (r->result.codec != COMP_NONE && !comp_available(r->result.codec))
+                return FETCH_PROTOCOL_ERROR;
+        }
+        if (conn->request.flags & REQ_FLAG_RESUME) {
+            start = get_be64(conn->small + need - 16);
+            version = get_be64(conn->small + need - 8);
+            if (start > r->result.size)
+                return FETCH_PROTOCOL_ERROR;
+        }
+        if ((st = open_output(c, conn, start, version)) != FETCH_OK)
+            return st;
+        conn->remaining = r->result.size - start;
+        if (conn->remaining == 0) {
+            /* Everything was already there */
+            while (r->manifest != NULL && r->marked < manifest_chunks(r->manifest))
+                manifest_set(r->manifest, r->marked++);
+            body_done(c, conn);
+            return FETCH_OK;
+        }
+        if (r->result.codec == COMP_NONE) {
+            conn->state = C_BODY;
+        } else {
+            size_t cap = comp_bound(r->result.codec, COMP_CHUNK_SIZE);
+            if (cap > conn->chunk_cap) {
+                free(conn->chunk_buf);
+                conn->chunk_buf = malloc(cap);
+                conn->chunk_cap = conn->chunk_buf ? cap : 0;
+            }
+            if (conn->raw_buf == NULL)
+                conn->raw_buf = malloc(COMP_CHUNK_SIZE);
+            if (conn->chunk_buf == NULL || conn->raw_buf == NULL)
+                return FETCH_IO_ERROR;
+            next_chunk(c, conn);
+        }
+        return FETCH_OK;
+    }
+    case C_CHUNK_HEAD: {
+        uint32_t raw_len, payload;
+        chunk_header_unpack(conn->small, &raw_len, &payload);
+        conn->chunk_stored = (payload & CHUNK_STORED) != 0;
+        payload &= ~CHUNK_STORED;
+        if (raw_len == 0 || raw_len > COMP_CHUNK_SIZE || raw_len > conn->remaining
+            || payload > conn->chunk_cap || (conn->chunk_stored && payload != raw_len))
+            return FETCH_PROTOCOL_ERROR;
+        conn->chunk_raw = raw_len;
+        conn->chunk_len = payload;
+        conn->state = C_CHUNK_DATA;
+        conn->have = 0;
+        return FETCH_OK;
+    }
+    case C_TRAILER: {
+        uint8_t actual[DIGEST_MAX_SIZE];
+        size_t len = digest_final(&conn->digest, actual);
+        digest_hex(actual, len, r->result.digest_hex);
+        conn->state = C_DONE;
+        if (conn->small[0] != c->cfg.digest || conn->small[1] != len)
+            return FETCH_PROTOCOL_ERROR;
+        conn->status = memcmp(conn->small + 2, actual, len) == 0 ? FETCH_OK : FETCH_DIGEST_MISMATCH;
+        return FETCH_OK;
+    }
+    default:
+        return FETCH_PROTOCOL_ERROR;
+    }
+}
+
+/* Feed received bytes to the parser; returns -1 if the connection was dropped */
+static int feed(fetch_client_t *c, fetch_conn_t *conn, const uint8_t *p, size_t n) {
+    fetch_req_t *r = conn->req;
+    fetch_status_t err = FETCH_PROTOCOL_ERROR;
+
+    if (r == NULL)
+        goto fail;      /* bytes on an idle connection */
+    conn->got_bytes = 1;
+
+    while (n > 0 && conn->state != C_DONE) {
+        size_t take;
+        switch (conn->state) {
+        case C_SIZE:
+        case C_CHUNK_HEAD:
+        case C_TRAILER:
+            take = conn->need - conn->have < n ? conn->need - conn->have : n;
+            memcpy(conn->small + conn->have, p, take);
+            conn->have += take;
+            if (conn->have == conn->need && (err = small_done(c, conn)) != FETCH_OK)
+                goto fail;
+            break;
+        case C_BODY:
+            take = conn->remaining < n ? conn->remaining : n;
+            if (deliver(conn, p, take) < 0) {
+                err = FETCH_IO_ERROR;
+                goto fail;
+            }
+            r->result.wire_bytes += take;
+            if (conn->remaining == 0)
+                body_done(c, conn);
+            break;
+        case C_CHUNK_DATA:
+            take = conn->chunk_len - conn->have < n ? conn->chunk_len - conn->have : n;
+            memcpy(conn->chunk_buf + conn->have, p, take);
+            conn->have += take;
+            if (conn->have == conn->chunk_len) {
+                const uint8_t *data = conn->chunk_buf;
+                if (!conn->chunk_stored) {
+                    if (comp_decompress(r->result.codec, conn->chunk_buf, conn->chunk_len,
+                                        conn->raw_buf, conn->chunk_raw) < 0)
+                        goto fail;
+                    data = conn->raw_buf;
+                }
+                if (deliver(conn, data, conn->chunk_raw) < 0) {
+                    err = FETCH_IO_ERROR;
+                    goto fail;
+                }
+                r->result.wire_bytes += CHUNK_HEADER_SIZE + conn->chunk_len;
+                next_chunk(c, conn);
+            }
+            break;
+        default:
+            goto fail;
+        }
+        p += take;
+        n -= take;
+    }
+    /* The server never sends ahead of a request */
+    if (n > 0)
+        goto fail;
+    if (conn->state == C_DONE)
+        conn_complete(c, conn);
+    return 0;
+
+fail:
+    conn_fail(c, conn, err);
+    return -1;
+}
+
+static void on_event(fetch_client_t *c, fetch_conn_t *conn) {
+    ssize_t n;
+
+    switch (conn->state) {
+    case C_CONNECTING: {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            conn_fail(c, conn, FETCH_CONNECT_FAILED);
+            return;
+        }
+        if (c->tls != NULL) {
+            conn_handshake(c, conn);
+            return;
+        }
+        conn->state = C_SENDING;
+        conn_send(c, conn);
+        return;
+    }
+    case C_HANDSHAKE:
+        conn_handshake(c, conn);
+        return;
+    case C_SENDING:
+        conn_send(c, conn);
+        return;
+    case C_IDLE: {
+        /* Idle connections only wake up when the server closes them */
+        fetch_conn_t **pp = &conn->srv->idle;
+        while (*pp != conn)
+            pp = &(*pp)->next_idle;
+        *pp = conn->next_idle;
+        conn_close(c, conn);
+        return;
+    }
+    default:
+        break;
+    }
+
+    /*
+     * One read per wakeup keeps busy connections from starving the rest.
+     * A TLS read takes one record and OpenSSL reads no further ahead, so
+     * what is left stays in the socket and epoll reports it again.
+     */
+    n = conn->tls ? tls_read(conn->tls, c->rbuf, RECV_BUF_SIZE) : recv(conn->fd, c->rbuf, RECV_BUF_SIZE, 0);
+    if (n > 0) {
+        set_events(c, conn, EPOLLIN);
+        feed(c, conn, c->rbuf, (size_t)n);
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && conn->tls != NULL) {
+        set_events(c, conn, tls_events(conn));
+    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        conn_fail(c, conn, FETCH_IO_ERROR);
+    }
+}
+
+/* ---------- Scheduling ---------- */
+
+static void admit(fetch_client_t *c) {
+    while (c->pending_head != NULL
+           && (c->cfg.max_inflight == 0 || c->running < c->cfg.max_inflight)) {
+        fetch_req_t *r = c->pending_head;
+        queue_remove(&c->pending_head, &c->pending_tail, r);
+        r->start = now();
+        r->deadline = c->cfg.timeout_ms ? r->start + c->cfg.timeout_ms / 1000.0 : 0;
+        run_push(c, r);
+        c->running++;
+        queue_push(&r->srv->wait_head, &r->srv->wait_tail, r);
+        dispatch(c, r->srv);
+    }
+}
+
+/* Started downloads are in start order, so the expired ones are at the head */
+static void expire(fetch_client_t *c) {
+    double t = now();
+
+    while (c->run_head != NULL && c->run_head->deadline != 0 && c->run_head->deadline <= t) {
+        fetch_req_t *r = c->run_head;
+        fetch_server_t *s = r->srv;
+        fetch_conn_t *conn = r->conn;
+
+        if (conn != NULL) {
+            /* Its response may still be in flight: the connection can't be reused */
+            conn->req = NULL;
+            r->conn = NULL;
+            conn_close(c, conn);
+        } else {
+            queue_remove(&s->wait_head, &s->wait_tail, r);
+        }
+        finish(c, r, FETCH_TIMEOUT);
+        dispatch(c, s);
+    }
+}
+
+/* ---------- Public interface ---------- */
+
+fetch_client_t *fetch_client_new(const fetch_config_t *cfg) {
+    fetch_client_t *c = calloc(1, sizeof(*c));
+
+    if (c == NULL)
+        return NULL;
+    c->cfg = *cfg;
+    c->epfd = epoll_create1(EPOLL_CLOEXEC);
+    c->rbuf = malloc(RECV_BUF_SIZE);
+    if (cfg->tls_ca != NULL)
+        c->tls = tls_client_new(cfg->tls_ca);
+    if (c->epfd < 0 || c->rbuf == NULL || (cfg->tls_ca != NULL && c->tls == NULL)) {
+        if (c->epfd >= 0)
+            close(c->epfd);
+        tls_ctx_free(c->tls);
+        free(c->rbuf);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void fetch_client_free(fetch_client_t *c) {
+    while (c->servers != NULL) {
+        fetch_server_t *s = c->servers;
+        c->servers = s->next;
+        while (s->idle != NULL) {
+            fetch_conn_t *conn = s->idle;
+            s->idle = conn->next_idle;
+            conn_close(c, conn);
+        }
+        free(s);
+    }
+    close(c->epfd);
+    tls_ctx_free(c->tls);
+    free(c->rbuf);
+    free(c);
+}
+
+int fetch_download(fetch_client_t *c, const char *host, int port, const char *filename,
+                   const char *out_path, fetch_done_fn done, void *user) {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    fetch_server_t *s;
+    fetch_req_t *r;
+
+    if (strlen(filename) >= (c->cfg.resume ? REQ_RESUME_NAME_MAX : REQ_NAME_MAX))
+        return -1;
+    /* Blocking lookup for a name; literals return at once */
+    memset(&addr, 0, sizeof(addr));
+    if (net_resolve(host, port, SOCK_STREAM, &addr, &len) < 0)
+        return -1;
+
+    for (s = c->servers; s != NULL; s = s->next)
+        if (s->addr_len == len && memcmp(&s->addr, &addr, len) == 0)
+            break;
+    if (s == NULL) {
+        if ((s = calloc(1, sizeof(*s))) == NULL)
+            return -1;
+        s->addr = addr;
+        s->addr_len = len;
+        s->port = port;
+        net_ntop((struct sockaddr *)&addr, s->ip, sizeof(s->ip));
+        s->next = c->servers;
+        c->servers = s;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return -1;
+    if (out_path != NULL && (r->out_path = strdup(out_path)) == NULL) {
+        free(r);
+        return -1;
+    }
+    strcpy(r->filename, filename);
+    r->srv = s;
+    r->done = done;
+    r->user = user;
+    queue_push(&c->pending_head, &c->pending_tail, r);
+    c->outstanding++;
+    return 0;
+}
+
+unsigned fetch_run(fetch_client_t *c) {
+    struct epoll_event events[MAX_EVENTS];
+    unsigned failed;
+
+    while (c->outstanding > 0) {
+        int timeout = -1, n;
+
+        admit(c);
+        if (c->run_head != NULL && c->run_head->deadline != 0) {
+            double left = c->run_head->deadline - now();
+            timeout = left <= 0 ? 0 : (int)(left * 1000) + 1;
+        }
+        n = epoll_wait(c->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; i++)
+            on_event(c, events[i].data.ptr);
+        expire(c);
+    }
+    failed = c->failed;
+    c->failed = 0;
+    return failed;
+}
+
+const char *fetch_status_str(fetch_status_t status) {
+    switch (status) {
+    case FETCH_OK: return "ok";
+    case FETCH_NOT_FOUND: return "file not found";
+    case FETCH_TIMEOUT: return "timed out";
+    case FETCH_CONNECT_FAILED: return "connect failed";
+    case FETCH_IO_ERROR: return "I/O error";
+    case FETCH_PROTOCOL_ERROR: return "bad response";
+    case FETCH_DIGEST_MISMATCH: return "digest mismatch";
+    case FETCH_TLS_FAILED: return "TLS handshake failed";
+    default: return "unknown";
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * Asynchronous download library for tcp_server.
+ *
+ * Many downloads, from many servers, run inside one thread: every socket
+ * is non-blocking and an epoll loop (fetch_run) drives each download as a
+ * small state machine. Finished downloads are reported through a callback.
+ *
+ *   - connection pooling: connections to a server are kept open
+ *     (REQ_FLAG_KEEPALIVE) and reused, up to max_conns_per_server; with
+ *     no_keepalive every download has a connection of its own
+ *   - bounded concurrency: at most max_inflight downloads are started,
+ *     the rest wait in a FIFO queue
+ *   - timeouts: a download not finished timeout_ms after it started fails
+ *   - resume: with resume set, each output file gets a manifest (see
+ *     manifest.h) recording which chunks are on disk; a later download of
+ *     the same file asks the server for the rest only
+ *   - TLS: with tls_ca set, connections run TLS 1.3 (see tls.h) and the
+ *     server's certificate must verify against that CA file and name the
+ *     server's address; a pooled connection pays for its handshake once.
+ *     Writes to a closed TLS connection can raise SIGPIPE: ignore it
+ *
+ * Digest checks and compression work as in tcp_client (see transfer.h).
+ */
+
+#ifndef TCP_FETCH_H
+#define TCP_FETCH_H
+
+#include <stdint.h>
+
+#include "digest.h"
+#include "compress.h"
+
+typedef struct fetch_client fetch_client_t;
+
+typedef struct {
+    unsigned max_inflight;          /* downloads running at once, 0 = unlimited */
+    unsigned max_conns_per_server;  /* pool size per server, 0 = 1 */
+    unsigned timeout_ms;            /* per download, 0 = no timeout */
+    digest_alg_t digest;            /* ask for and check a digest trailer */
+    comp_alg_t compress;            /* ask for compression */
+    int level;                      /* codec level, 0 = default */
+    int resume;                     /* continue interrupted downloads (needs out_path) */
+    const char *tls_ca;             /* TLS, verifying servers with this CA file; NULL = plaintext */
+    int no_keepalive;               /* a new connection per download, closed after it */
+} fetch_config_t;
+
+typedef enum {
+    FETCH_OK = 0,
+    FETCH_NOT_FOUND,
+    FETCH_TIMEOUT,
+    FETCH_CONNECT_FAILED,
+    FETCH_IO_ERROR,
+    FETCH_PROTOCOL_ERROR,
+    FETCH_DIGEST_MISMATCH,
+    FETCH_TLS_FAILED
+} fetch_status_t;
+
+typedef struct {
+    fetch_status_t status;
+    const char *filename;       /* as requested; valid during the callback */
+    uint64_t size;              /* file bytes delivered */
+    uint64_t resumed_from;      /* of which already there from an interrupted download */
+    uint64_t wire_bytes;        /* body bytes read off the socket */
+    comp_alg_t codec;           /* codec the server used */
+    digest_alg_t digest;
+    char digest_hex[2 * DIGEST_MAX_SIZE + 1];   /* digest of the received data */
+    double seconds;             /* from start (not queueing) to completion */
+} fetch_result_t;
+
+typedef void (*fetch_done_fn)(const fetch_result_t *result, void *user);
+
+fetch_client_t *fetch_client_new(const fetch_config_t *cfg);
+void fetch_client_free(fetch_client_t *client);
+
+/*
+ * Queue a download of filename from host:port; host is a name (looked up
+ * here, blocking) or an IPv4 or IPv6 literal. The file is written to
+ * out_path (only created once the server has it), or dropped if out_path
+ * is NULL. done may queue further downloads. Returns 0, or -1 for a bad
+ * address or name (at most REQ_RESUME_NAME_MAX - 1 bytes with resume).
+ */
+int fetch_download(fetch_client_t *client, const char *host, int port, const char *filename,
+                   const char *out_path, fetch_done_fn done, void *user);
+
+/* Run the event loop until every queued download has finished; returns the number that failed */
+unsigned fetch_run(fetch_client_t *client);
+
+const char *fetch_status_str(fetch_status_t status);
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Throughput benchmark for the tcp_fetch library: queues many downloads at
+ * once (spread over the given servers and files), discards the data and
+ * reports files/sec, MB/s and per-download latency. -T runs it over TLS;
+ * -k opens a new connection per download, which measures connection rate.
+ * Usage: ./tcp_fetch_bench [-n requests] [-c max_inflight] [-p conns_per_server]
+ *                          [-t timeout_ms] [-z codec] [-T ca.pem] [-k] <host:port[,host:port...]> <file>...
+ * Example: ./tcp_fetch_bench -n 10000 -c 10000 -p 64 127.0.0.1:5000 a.txt b.txt
+ *          ./tcp_fetch_bench [::1]:5000 a.txt
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+
+#include "tcp_fetch.h"
+#include "net.h"
+
+#define MAX_SERVERS 64
+
+typedef struct {
+    char host[256];
+    int port;
+} endpoint_t;
+
+double *latencies;
+unsigned completed, failures;
+unsigned long long bytes;
+
+void onDone(const fetch_result_t *res, void *user) {
+    (void)user;
+    if (res->status != FETCH_OK) {
+        if (failures++ < 5)
+            printf("  %s: %s\n", res->filename, fetch_status_str(res->status));
+        return;
+    }
+    latencies[completed++] = res->seconds;
+    bytes += res->size;
+}
+
+int cmpDouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(double p) {
+    size_t i = (size_t)(p * (completed - 1));
+    return latencies[i] * 1000;
+}
+
+int main(int argc, char *argv[]) {
+    fetch_config_t cfg;
+    fetch_client_t *client;
+    endpoint_t servers[MAX_SERVERS];
+    int nservers = 0, opt, nfiles;
+    unsigned requests = 10000;
+    struct timespec t0, t1;
+    double secs;
+    char *list, *tok;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.max_inflight = 10000;
+    cfg.max_conns_per_server = 64;
+
+    while ((opt = getopt(argc, argv, "n:c:p:t:z:T:k")) != -1) {
+        switch (opt) {
+        case 'n': requests = (unsigned)atoi(optarg); break;
+        case 'c': cfg.max_inflight = (unsigned)atoi(optarg); break;
+        case 'p': cfg.max_conns_per_server = (unsigned)atoi(optarg); break;
+        case 't': cfg.timeout_ms = (unsigned)atoi(optarg); break;
+        case 'z': cfg.compress = comp_from_name(optarg, &cfg.level); break;
+        case 'T': cfg.tls_ca = optarg; break;
+        case 'k': cfg.no_keepalive = 1; break;
+        default:
+            printf("Usage: %s [-n requests] [-c max_inflight] [-p conns_per_server] "
+                   "[-t timeout_ms] [-z codec] [-T ca.pem] [-k] <host:port[,host:port...]> <file>...\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind < 2 || requests == 0) {
+        printf("Usage: %s [-n requests] [-c max_inflight] [-p conns_per_server] "
+               "[-t timeout_ms] [-z codec] [-T ca.pem] [-k] <host:port[,host:port...]> <file>...\n", argv[0]);
+        exit(1);
+    }
+
+    /* Comma-separated list of servers */
+    list = argv[optind];
+    for (tok = strtok(list, ","); tok != NULL && nservers < MAX_SERVERS; tok = strtok(NULL, ",")) {
+        if (net_split(tok, servers[nservers].host, sizeof(servers[0].host), &servers[nservers].port) < 0) {
+            printf("Bad server address: %s (use host:port or [ipv6]:port)\n", tok);
+            exit(1);
+        }
+        nservers++;
+    }
+    nfiles = argc - optind - 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    latencies = malloc(requests * sizeof(double));
+    client = fetch_client_new(&cfg);
+    if (latencies == NULL || client == NULL) {
+        perror("Setup failed");
+        exit(1);
+    }
+    for (unsigned i = 0; i < requests; i++) {
+        const endpoint_t *ep = &servers[i % nservers];
+        if (fetch_download(client, ep->host, ep->port, argv[optind + 1 + i % nfiles],
+                           NULL, onDone, NULL) < 0) {
+            printf("Invalid address or filename\n");
+            exit(1);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    fetch_run(client);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fetch_client_free(client);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("%u requests, %u in flight, %u connections x %d server(s)\n",
+           requests, cfg.max_inflight ? cfg.max_inflight : requests,
+           cfg.max_conns_per_server, nservers);
+    printf("  %u ok, %u failed in %.3f s: %.0f files/s, %.1f MB/s\n",
+           completed, failures, secs, completed / secs, bytes / secs / 1e6);
+    if (completed > 0) {
+        qsort(latencies, completed, sizeof(double), cmpDouble);
+        printf("  latency ms: p50 %.2f  p99 %.2f  max %.2f\n",
+               percentile(0.50), percentile(0.99), latencies[completed - 1] * 1000);
+    }
+    free(latencies);
+    return failures ? 1 : 0;
+}
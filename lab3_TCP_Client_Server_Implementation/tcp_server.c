@@ -1,160 +1,984 @@
 /*
  * Concurrent TCP Server - Accepts multiple clients, spawns a thread per client
  * for file transfer. Each client sends a filename; server sends the file.
- * Usage: ./tcp_server <port>
- * Example: ./tcp_server 5000
+ * If the request asks for a digest, it is appended as a trailer (see transfer.h).
+ * Open files are kept in a sharded fd/metadata cache (fcache.c) and sent
+ * with sendfile(); small hot files are served straight from RAM.
+ * If the client asks for compression, a worker thread compresses chunks
+ * while this thread sends earlier ones; the framed result is kept in the
+ * cache so the next request for the same file and codec just sends it.
+ * Clients may keep the connection open for more requests (keep-alive), and
+ * may resume an interrupted download from the offset they already have.
+ * Per-connection state and chunk buffers come from pools (see pool.h),
+ * so a busy server does not malloc/free them per connection or request.
+ * With -M, request counters, a request latency histogram and the cache
+ * counters are served in Prometheus format (see metrics.h); -v logs a
+ * line per connection and request (see log.h).
+ * With -T the connections use TLS 1.3 (see tls.h); when the kernel takes
+ * over the record encryption (kTLS), files still go out with sendfile().
+ * At most -C connections are served at once; more wait in a bounded
+ * accept queue (-Q) and are shed (reset) when it is full or they waited
+ * too long. -B and -R cap the bandwidth of the whole server and of each
+ * client address; file data then goes out in pieces granted by a deficit
+ * round robin scheduler (see sched.h), so small downloads are not stuck
+ * behind large ones.
+ * The port takes IPv6 and IPv4 connections (see net.h). With -L n, n
+ * SO_REUSEPORT listeners share it, each accepting in a thread pinned to its
+ * own CPU, whose connection threads stay on that CPU; -E steers every
+ * connection to the listener on the CPU that received it.
+ * Usage: ./tcp_server [-v] [-M port|unix:path] [-T cert_and_key.pem] [-L listeners [-E]] [-C max_connections]
+ *                     [-Q accept_queue] [-B total_MBps] [-R per_client_MBps] [-c max_cached_files]
+ *                     [-m content_cache_MB] [-z compressed_cache_MB] <port>
+ * Example: ./tcp_server -M 9100 5000
+ * Send SIGUSR1 to print the cache hit-rate counters.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
 
-#define N 100
-#define FILENAME_SIZE 256
-#define FILE_BUFFER_SIZE 1024
+#include "transfer.h"
+#include "digest.h"
+#include "fcache.h"
+#include "compress.h"
+#include "metrics.h"
+#include "log.h"
+#include "pool.h"
+#include "tls.h"
+#include "sched.h"
+#include "net.h"
 
-int threadCount = 0;
-pthread_t clients[N];
+#define DEFAULT_CACHE_ENTRIES 1024
+#define DEFAULT_CONTENT_MB 64
+#define CONTENT_MAX_FILE (64 * 1024)
+#define DEFAULT_VARIANT_MB 64
+#define VARIANT_MAX_FILE (16 * 1024 * 1024)    /* larger files are compressed per request */
+#define PIPE_SLOTS 4
+#define KEEPALIVE_IDLE_SEC 30   /* pooled connections idle longer than this are closed */
+#define DEFAULT_MAX_CONNECTIONS 512
+#define DEFAULT_ACCEPT_QUEUE 1024
+#define QUEUE_MAX_WAIT_MS 5000  /* queued longer than this: the client has likely given up */
 
-int sockfd;
-int connfd;
-struct sockaddr_in servAddr, clienAddr;
-socklen_t clienLen = sizeof(clienAddr);
+/* SO_REUSEPORT listeners on the port, one accept thread each */
+typedef struct {
+    int fd;
+    unsigned index;
+    atomic_ullong accepted;
+    pthread_t thread;
+} listener_t;
+
+listener_t *listeners;
+unsigned nListeners = 1;
+pthread_attr_t threadAttr;      /* connection threads: detached */
+
+/* Metric ids, registered in registerMetrics() */
+int mConnections, mRequests, mNotFound, mFailed, mFileBytes, mWireBytes;
+int mTlsConnections, mKtlsConnections, mTlsFailed, mShed;
+int gOpenConnections, gQueued, hRequestTime, hQueueWait, hPaceWait;
+
+/* TLS context with -T, NULL for plaintext */
+tls_ctx_t *tlsCtx;
+atomic_int ktlsWarned;
 
 /* Structure passed to each thread (so connfd and client address are not overwritten) */
 typedef struct {
     int connfd;
-    struct sockaddr_in clientAddr;
+    struct sockaddr_storage clientAddr;
 } client_info_t;
 
-void *connectionHandler(void *arg) {
-    char filename[FILENAME_SIZE];
-    char buffer[FILE_BUFFER_SIZE];
-    FILE *file;
-    size_t bytes_read;
-    uint32_t file_size, file_size_net;
-    long file_len;
+/* Admission: connections beyond maxConnections wait here for a thread */
+typedef struct {
+    int fd;
+    struct sockaddr_storage addr;
+    uint64_t since;
+} queued_conn_t;
 
-    client_info_t *info = (client_info_t *)arg;
-    int conn = info->connfd;
-    struct sockaddr_in clientAddr = info->clientAddr;
+unsigned maxConnections = DEFAULT_MAX_CONNECTIONS, queueCap = DEFAULT_ACCEPT_QUEUE;
+unsigned activeConnections, queueHead, queueLen;
+queued_conn_t *acceptQueue;
+pthread_mutex_t admitLock = PTHREAD_MUTEX_INITIALIZER;
 
-    /* Connection established */
-    printf("Connection established with client IP: %s and Port: %d\n",
-           inet_ntoa(clientAddr.sin_addr), ntohs(clientAddr.sin_port));
+/*
+ * A client connection. Plaintext and kernel-encrypted TLS (ktls) both take
+ * plain writes, sendmsg() and sendfile() on fd; TLS in user space has to
+ * go through tls_write(). With -B/-R, flow paces the file data.
+ */
+typedef struct {
+    int fd;
+    tls_conn_t *tls;            /* NULL: plaintext */
+    int ktls;
+    sched_flow_t *flow;         /* NULL: not rate limited */
+} conn_t;
+
+/* client_info_t for connection threads; framed-chunk and read buffers for compression */
+pool_t *clientPool, *chunkPool;
+
+/* Wait until the scheduler lets n bytes of file data go (no-op without -B/-R) */
+void pace(conn_t *c, size_t n) {
+    uint64_t waited = sched_acquire(c->flow, n);
+    if (waited > 0)
+        metrics_observe(hPaceWait, waited);
+}
+
+/* Loop until len bytes are sent on the connection; returns 0 or -1 */
+int connSend(conn_t *c, const void *buf, size_t len) {
+    if (c->tls != NULL && !c->ktls)
+        return tls_write_all(c->tls, buf, len);
+    return send_all(c->fd, buf, len);
+}
+
+/*
+ * The same for file data, in pieces the scheduler grants. Headers and
+ * trailers go unpaced with connSend(): a few bytes, and a small file then
+ * needs a single turn.
+ */
+int connSendPaced(conn_t *c, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+
+    if (c->flow == NULL)
+        return connSend(c, buf, len);
+    while (len > 0) {
+        size_t n = len < SCHED_MAX_PIECE ? len : SCHED_MAX_PIECE;
+        pace(c, n);
+        if (connSend(c, p, n) < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int connRecv(conn_t *c, void *buf, size_t len) {
+    if (c->tls != NULL)
+        return tls_read_all(c->tls, buf, len);
+    return recv_all(c->fd, buf, len);
+}
+
+/* Compressor -> sender hand-off: a small ring of framed chunks */
+typedef struct {
+    fcache_entry_t *file;
+    comp_alg_t alg;
+    int level;
+    off_t start;                /* first chunk, for a resumed download */
+    uint8_t *slots[PIPE_SLOTS];
+    size_t slot_len[PIPE_SLOTS];
+    unsigned produced, consumed;
+    int done, failed, stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} comp_pipe_t;
 
-    /* Receive filename from client */
-    memset(filename, 0, FILENAME_SIZE);
-    if (recv(conn, filename, FILENAME_SIZE, 0) <= 0) {
-        perror("Receive filename failed");
-        close(conn);
-        free(info);
-        pthread_exit(0);
+/* Frame one chunk into out; stored raw unless compression saves at least 1/8 */
+size_t frameChunk(comp_alg_t alg, int level, const uint8_t *src, size_t n, uint8_t *out) {
+    size_t clen = 0;
+
+    /* LZ4 is cheap enough to just try; slower codecs skip data that looks compressed */
+    if (alg == COMP_LZ4 || comp_probe(src, n))
+        clen = comp_compress(alg, level, src, n, out + CHUNK_HEADER_SIZE, n - n / 8);
+    if (clen == 0) {
+        memcpy(out + CHUNK_HEADER_SIZE, src, n);
+        chunk_header_pack(out, (uint32_t)n, (uint32_t)n | CHUNK_STORED);
+        return CHUNK_HEADER_SIZE + n;
     }
+    chunk_header_pack(out, (uint32_t)n, (uint32_t)clen);
+    return CHUNK_HEADER_SIZE + clen;
+}
+
+void *compressWorker(void *arg) {
+    comp_pipe_t *p = (comp_pipe_t *)arg;
+    fcache_entry_t *file = p->file;
+    uint8_t *raw = NULL;
+    off_t off = p->start;
+    int failed = 0;
+
+    if (file->content == NULL && (raw = pool_get(chunkPool)) == NULL)
+        failed = 1;
+
+    while (!failed && off < file->size) {
+        size_t n = file->size - off < COMP_CHUNK_SIZE ? (size_t)(file->size - off) : COMP_CHUNK_SIZE;
+        const uint8_t *src;
+        unsigned slot;
+        int stop;
+
+        pthread_mutex_lock(&p->lock);
+        while (p->produced - p->consumed == PIPE_SLOTS && !p->stop)
+            pthread_cond_wait(&p->cond, &p->lock);
+        slot = p->produced % PIPE_SLOTS;
+        stop = p->stop;
+        pthread_mutex_unlock(&p->lock);
+        if (stop)
+            break;
+
+        if (raw != NULL) {
+            if (pread(file->fd, raw, n, off) != (ssize_t)n) {
+                failed = 1;
+                break;
+            }
+            src = raw;
+        } else {
+            src = (const uint8_t *)file->content + off;
+        }
+        p->slot_len[slot] = frameChunk(p->alg, p->level, src, n, p->slots[slot]);
+        off += n;
 
-    /* Open file and send to client */
-    file = fopen(filename, "rb");
+        pthread_mutex_lock(&p->lock);
+        p->produced++;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->done = 1;
+    p->failed = failed;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pool_put(raw);
+    return NULL;
+}
+
+/*
+ * Send the chunked, compressed body from start (a multiple of
+ * COMP_CHUNK_SIZE); returns bytes put on the wire or -1
+ */
+long long sendCompressed(conn_t *conn, fcache_entry_t *file, comp_alg_t alg, int level, off_t start) {
+    unsigned key = (unsigned)alg << 8 | (unsigned)level;
+    const void *cached;
+    size_t cached_len, blob_len = 0, blob_cap = 0;
+    uint8_t *blob = NULL;
+    comp_pipe_t p;
+    pthread_t worker;
+    long long wire = 0;
+    int error = 0;
+
+    /* Precompressed copy of this file version */
+    cached = fcache_variant_get(file, key, &cached_len);
+    if (cached != NULL) {
+        const uint8_t *from = cached, *end = from + cached_len;
+        /* Resumed: skip the chunks the client has */
+        for (off_t off = 0; off < start && from + CHUNK_HEADER_SIZE <= end;) {
+            uint32_t raw_len, payload;
+            chunk_header_unpack(from, &raw_len, &payload);
+            from += CHUNK_HEADER_SIZE + (payload & ~CHUNK_STORED);
+            off += raw_len;
+        }
+        if (from > end)
+            return -1;
+        return connSendPaced(conn, from, (size_t)(end - from)) < 0 ? -1 : (long long)(end - from);
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.file = file;
+    p.alg = alg;
+    p.level = level;
+    p.start = start;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    for (int i = 0; i < PIPE_SLOTS; i++) {
+        if ((p.slots[i] = pool_get(chunkPool)) == NULL)
+            error = 1;
+    }
+    /* Keep a copy of the framed stream for the cache (worst case: all stored) */
+    if (!error && start == 0 && file->size <= VARIANT_MAX_FILE) {
+        blob_cap = (size_t)file->size
+                   + CHUNK_HEADER_SIZE * ((size_t)file->size / COMP_CHUNK_SIZE + 1);
+        blob = malloc(blob_cap);
+    }
+    if (error || pthread_create(&worker, NULL, compressWorker, &p) != 0) {
+        for (int i = 0; i < PIPE_SLOTS; i++)
+            pool_put(p.slots[i]);
+        free(blob);
+        return -1;
+    }
+
+    for (;;) {
+        unsigned slot;
+
+        pthread_mutex_lock(&p.lock);
+        while (p.consumed == p.produced && !p.done)
+            pthread_cond_wait(&p.cond, &p.lock);
+        if (p.consumed == p.produced) {
+            pthread_mutex_unlock(&p.lock);
+            break;
+        }
+        slot = p.consumed % PIPE_SLOTS;
+        pthread_mutex_unlock(&p.lock);
+
+        if (connSendPaced(conn, p.slots[slot], p.slot_len[slot]) < 0) {
+            error = 1;
+            break;
+        }
+        wire += (long long)p.slot_len[slot];
+        if (blob != NULL) {
+            memcpy(blob + blob_len, p.slots[slot], p.slot_len[slot]);
+            blob_len += p.slot_len[slot];
+        }
+
+        pthread_mutex_lock(&p.lock);
+        p.consumed++;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.lock);
+    }
+
+    pthread_mutex_lock(&p.lock);
+    p.stop = 1;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+    pthread_join(worker, NULL);
+    if (p.failed)
+        error = 1;
+
+    if (blob != NULL) {
+        uint8_t *shrunk = error ? NULL : realloc(blob, blob_len ? blob_len : 1);
+        if (shrunk == NULL || fcache_variant_put(file, key, shrunk, blob_len) < 0)
+            free(shrunk ? shrunk : blob);
+    }
+    for (int i = 0; i < PIPE_SLOTS; i++)
+        pool_put(p.slots[i]);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.cond);
+    return error ? -1 : wire;
+}
+
+/* Response header and a body from RAM, in one call (one record under TLS) */
+int sendFromMemory(conn_t *c, const uint8_t *head, size_t head_len, const char *body, size_t body_len) {
+    pace(c, head_len + body_len);
+    if (c->tls != NULL && !c->ktls) {
+        uint8_t *buf = pool_get(chunkPool);
+        int ret;
+        if (buf == NULL || head_len + body_len > CHUNK_HEADER_SIZE + COMP_CHUNK_SIZE) {
+            pool_put(buf);
+            return connSend(c, head, head_len) < 0 ? -1 : connSend(c, body, body_len);
+        }
+        memcpy(buf, head, head_len);
+        memcpy(buf + head_len, body, body_len);
+        ret = tls_write_all(c->tls, buf, head_len + body_len);
+        pool_put(buf);
+        return ret;
+    }
+
+    struct iovec iov[2] = {
+        { (void *)head, head_len },
+        { (void *)body, body_len }
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ssize_t sent = sendmsg(c->fd, &msg, 0);
+    if (sent < 0)
+        return -1;
+    if ((size_t)sent < head_len + body_len) {
+        /* Finish a partial send */
+        size_t done = (size_t)sent;
+        if (done < head_len) {
+            if (send_all(c->fd, head + done, head_len - done) < 0)
+                return -1;
+            done = head_len;
+        }
+        return send_all(c->fd, body + (done - head_len), head_len + body_len - done);
+    }
+    return 0;
+}
+
+/*
+ * File body from offset to size. The kernel copies it from the shared
+ * cached fd, and encrypts it too with kTLS; TLS in user space reads it
+ * into a buffer and encrypts it there.
+ */
+int sendFromFile(conn_t *c, int fd, off_t offset, off_t size) {
+    if (c->tls != NULL && !c->ktls) {
+        uint8_t *buf = pool_get(chunkPool);
+        int ok = buf != NULL;
+        while (ok && offset < size) {
+            size_t want = size - offset < COMP_CHUNK_SIZE ? (size_t)(size - offset) : COMP_CHUNK_SIZE;
+            ssize_t n = pread(fd, buf, want, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n > 0)
+                pace(c, (size_t)n);
+            if (n <= 0 || tls_write_all(c->tls, buf, (size_t)n) < 0)
+                ok = 0;
+            else
+                offset += n;
+        }
+        pool_put(buf);
+        return ok ? 0 : -1;
+    }
+
+    size_t granted = 0;         /* paced bytes not yet sent */
+    while (offset < size) {
+        size_t want = (size_t)(size - offset);
+        ssize_t n;
+        if (c->flow != NULL) {
+            /* Rate limited: one granted piece at a time */
+            if (granted == 0) {
+                granted = want < SCHED_MAX_PIECE ? want : SCHED_MAX_PIECE;
+                pace(c, granted);
+            }
+            want = granted;
+        }
+        n = sendfile(c->fd, fd, &offset, want);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        if (c->flow != NULL)
+            granted -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Read one request from conn and send the response.
+ * Returns 1 if the client asked to keep the connection for another request,
+ * 0 when done, -1 on error or when the client went away.
+ */
+int serveRequest(conn_t *conn, int first) {
+    request_t req;
+    char filename[FILENAME_SIZE + 1];
+    fcache_entry_t *file;
+    uint64_t file_size;
+    uint32_t file_size_net;
+    uint8_t head[4 + 8 + 1 + 16];   /* size, [64-bit size], codec, resume start and version */
+    size_t head_len;
+    uint64_t resume_from = 0, resume_version = 0;
+    off_t from = 0;
+    digest_alg_t alg = DIGEST_NONE;
+    uint8_t trailer[2 + DIGEST_MAX_SIZE];
+    size_t trailer_len = 0;
+    comp_alg_t calg = COMP_NONE;
+    int level = 0;
+    long long wire = -1;
+    int keepalive = 0, resume = 0, size64 = 0, ok = 1;
+    uint64_t start;
+
+    /* Receive filename (and optional extension block) from client */
+    if (connRecv(conn, &req, sizeof(req)) < 0) {
+        /* A pooled connection closing (or idling out) between requests is normal */
+        if (first)
+            perror("Receive filename failed");
+        return -1;
+    }
+    /* Time the service, not the wait for the request */
+    start = metrics_now_ns();
+    metrics_inc(mRequests);
+    if (request_has_ext(&req)) {
+        resume = (req.flags & REQ_FLAG_RESUME) != 0;
+        memcpy(filename, req.filename, REQ_NAME_MAX);
+        /* A resume request keeps its offset and version at the end of the name field */
+        filename[(resume ? REQ_RESUME_NAME_MAX : REQ_NAME_MAX) - 1] = '\0';
+        if (resume)
+            request_get_resume(&req, &resume_from, &resume_version);
+        if (req.digest <= DIGEST_BLAKE3)
+            alg = (digest_alg_t)req.digest;
+        /* Settle on a codec we actually have, and tell the client which */
+        calg = comp_negotiate((comp_alg_t)req.compress);
+        level = comp_level(calg, req.level);
+        keepalive = (req.flags & REQ_FLAG_KEEPALIVE) != 0;
+        size64 = (req.flags & REQ_FLAG_SIZE64) != 0;
+    } else {
+        /* Plain request from an older client: the whole buffer is the name */
+        memcpy(filename, &req, FILENAME_SIZE);
+        filename[FILENAME_SIZE] = '\0';
+    }
+    TRACE2(tcp_server, request_start, conn->fd, filename);
+    sched_start(conn->flow);
+
+    /* Look up file (cached fd + size) and send to client; size 0 means not found */
+    file = fcache_acquire(filename);
+    if (file != NULL && file->size == 0) {
+        fcache_release(file);
+        file = NULL;
+    }
+    if (file != NULL && (uint64_t)file->size >= SIZE64_ESCAPE && !size64) {
+        /* The 4-byte size cannot carry it, and sending it modulo 2^32 would truncate */
+        log_warn("Refusing %s: %lld bytes is too large for a client without 64-bit sizes",
+                 filename, (long long)file->size);
+        fcache_release(file);
+        file = NULL;
+    }
     if (file == NULL) {
         file_size_net = htonl(0);
-        send(conn, &file_size_net, sizeof(file_size_net), 0);
-        printf("File not found: %s\n", filename);
-        close(conn);
-        free(info);
-        pthread_exit(0);
-    }
-
-    /* Get file size */
-    fseek(file, 0, SEEK_END);
-    file_len = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    file_size = (uint32_t)file_len;
-    file_size_net = htonl(file_size);
-    send(conn, &file_size_net, sizeof(file_size_net), 0);
-
-    /* Read file and send to connection descriptor */
-    while ((bytes_read = fread(buffer, 1, FILE_BUFFER_SIZE, file)) > 0) {
-        if (send(conn, buffer, bytes_read, 0) < 0) {
+        metrics_inc(mNotFound);
+        log_debug("File not found: %s", filename);
+        if (connSend(conn, &file_size_net, sizeof(file_size_net)) < 0)
+            return -1;
+        return keepalive;
+    }
+
+    /* Size comes from the cached stat, no fseek/ftell */
+    file_size = (uint64_t)file->size;
+    file_size_net = htonl(file_size >= SIZE64_ESCAPE ? SIZE64_ESCAPE : (uint32_t)file_size);
+
+    /* Resume only into the same version of the file, at a chunk boundary if compressing */
+    if (resume && resume_version == file->version && resume_from <= file_size) {
+        from = (off_t)resume_from;
+        if (calg != COMP_NONE)
+            from -= from % COMP_CHUNK_SIZE;
+    }
+
+    /* Response header: size, [64-bit size], [codec], [resume start and version] */
+    memcpy(head, &file_size_net, sizeof(file_size_net));
+    head_len = sizeof(file_size_net);
+    if (file_size >= SIZE64_ESCAPE) {
+        put_be64(head + head_len, file_size);
+        head_len += 8;
+    }
+    if (calg != COMP_NONE)
+        head[head_len++] = (uint8_t)calg;
+    if (resume) {
+        put_be64(head + head_len, (uint64_t)from);
+        put_be64(head + head_len + 8, file->version);
+        head_len += 16;
+    }
+
+    /* Digest trailer: <algorithm><length><digest>, cached per file version */
+    if (alg != DIGEST_NONE) {
+        size_t len = fcache_digest(file, alg, trailer + 2);
+        trailer[0] = (uint8_t)alg;
+        trailer[1] = (uint8_t)len;
+        trailer_len = 2 + len;
+    }
+
+    if (calg != COMP_NONE) {
+        /* Compressed: header with the chosen codec, then framed chunks */
+        if (connSend(conn, head, head_len) == 0)
+            wire = sendCompressed(conn, file, calg, level, from);
+        if (wire < 0) {
             perror("Send file failed");
-            break;
+            ok = 0;
+        }
+    } else if (file->content != NULL) {
+        /* Small hot file: header + contents straight from RAM in one call */
+        if (sendFromMemory(conn, head, head_len, file->content + from, file_size - (size_t)from) < 0) {
+            perror("Send file failed");
+            ok = 0;
+        }
+    } else {
+        /* Larger file: header, then the body from the cached fd */
+        if (connSend(conn, head, head_len) < 0)
+            ok = 0;
+        else if (sendFromFile(conn, file->fd, from, (off_t)file_size) < 0) {
+            perror("Send file failed");
+            ok = 0;
         }
     }
+    if (ok && trailer_len > 0 && connSend(conn, trailer, trailer_len) < 0)
+        ok = 0;
 
-    printf("File transfer complete: %s\n", filename);
-    fclose(file);
-    close(conn);
-    free(info);
-    pthread_exit(0);
+    if (ok) {
+        uint64_t elapsed = metrics_now_ns() - start;
+        metrics_observe(hRequestTime, elapsed);
+        metrics_add(mFileBytes, file_size - (uint64_t)from);
+        metrics_add(mWireBytes, calg != COMP_NONE ? (uint64_t)wire : file_size - (uint64_t)from);
+        TRACE3(tcp_server, request_done, conn->fd, file_size, elapsed);
+    } else {
+        metrics_inc(mFailed);
+    }
+    if (calg != COMP_NONE && wire >= 0)
+        log_debug("File transfer complete: %s (%s, %llu -> %lld bytes)",
+                  filename, comp_name(calg), (unsigned long long)file_size, wire);
+    else
+        log_debug("File transfer complete: %s", filename);
+    if (from > 0)
+        log_debug("Resumed %s at byte %lld", filename, (long long)from);
+    fcache_release(file);
+    return ok ? keepalive : -1;
 }
 
-int main(int argc, char *argv[]) {
-    int port;
-    pthread_attr_t attr;
+/* Serve one client connection until it closes; closes fd */
+void serveConnection(int fd, const struct sockaddr_storage *clientAddr) {
+    conn_t conn = { fd, NULL, 0, NULL };
+    char ip[NET_ADDRSTRLEN];
 
-    if (argc != 2) {
-        printf("Usage: %s <port #>\n", argv[0]);
-        exit(0);
+    net_ntop((const struct sockaddr *)clientAddr, ip, sizeof(ip));
+
+    /* Connection established */
+    metrics_gauge_add(gOpenConnections, 1);
+    log_debug("Connection established with client IP: %s and Port: %d",
+              ip, net_port((const struct sockaddr *)clientAddr));
+
+    if (tlsCtx != NULL) {
+        if ((conn.tls = tls_accept(tlsCtx, conn.fd)) == NULL) {
+            metrics_inc(mTlsFailed);
+            log_debug("TLS handshake with %s failed", ip);
+            goto done;
+        }
+        conn.ktls = tls_ktls_send(conn.tls);
+        metrics_inc(mTlsConnections);
+        if (conn.ktls)
+            metrics_inc(mKtlsConnections);
+        else if (!atomic_exchange(&ktlsWarned, 1))
+            log_warn("Kernel TLS not available for %s, encrypting in user space "
+                     "(is the tls module loaded? modprobe tls)", tls_cipher(conn.tls));
+        log_debug("TLS established with %s: %s, %s", ip,
+                  tls_cipher(conn.tls), conn.ktls ? "kernel TLS" : "user-space TLS");
     }
-    port = atoi(argv[1]);
 
-    /* Open a TCP socket */
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        exit(1);
+    /* Serve requests until the client stops asking to keep the connection */
+    conn.flow = sched_open((const struct sockaddr *)clientAddr);
+    if (serveRequest(&conn, 1) == 1) {
+        struct timeval idle = { KEEPALIVE_IDLE_SEC, 0 };
+        int one = 1;
+        setsockopt(conn.fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        /* Back-to-back small responses: don't let Nagle hold the trailer */
+        setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        while (serveRequest(&conn, 0) == 1)
+            ;
     }
+    sched_close(conn.flow);
+    tls_close(conn.tls);
 
-    /* Setup server address to bind */
-    memset(&servAddr, 0, sizeof(servAddr));
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_addr.s_addr = INADDR_ANY;
-    servAddr.sin_port = htons(port);
+done:
+    close(conn.fd);
+    metrics_gauge_add(gOpenConnections, -1);
+}
 
-    /* Bind IP address and port for server endpoint socket */
-    if (bind(sockfd, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0) {
-        perror("Bind failed");
-        close(sockfd);
-        exit(1);
+/* Refuse a connection: a reset tells the client at once, without TIME_WAIT here */
+void shed(int fd) {
+    struct linger lg = { 1, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+    metrics_inc(mShed);
+}
+
+/*
+ * Next queued connection for a thread that has finished one, dropping
+ * those that waited too long. Returns 0, or -1 with the thread's slot
+ * given up when the queue is empty.
+ */
+int nextQueued(client_info_t *info) {
+    uint64_t now = metrics_now_ns();
+
+    pthread_mutex_lock(&admitLock);
+    while (queueLen > 0) {
+        queued_conn_t q = acceptQueue[queueHead];
+        queueHead = (queueHead + 1) % queueCap;
+        queueLen--;
+        metrics_gauge_add(gQueued, -1);
+        if (now - q.since > (uint64_t)QUEUE_MAX_WAIT_MS * 1000000) {
+            shed(q.fd);
+            continue;
+        }
+        pthread_mutex_unlock(&admitLock);
+        metrics_observe(hQueueWait, now - q.since);
+        info->connfd = q.fd;
+        info->clientAddr = q.addr;
+        return 0;
     }
+    activeConnections--;
+    pthread_mutex_unlock(&admitLock);
+    return -1;
+}
 
-    /* Server listening; queue up to 5 client requests */
-    if (listen(sockfd, 5) < 0) {
-        perror("Listen failed");
-        close(sockfd);
-        exit(1);
+void *connectionHandler(void *arg) {
+    client_info_t *info = (client_info_t *)arg;
+
+    do {
+        serveConnection(info->connfd, &info->clientAddr);
+    } while (nextQueued(info) == 0);
+    pool_put(info);
+    pthread_exit(0);
+}
+
+/*
+ * Hand an accepted connection to a new thread while fewer than
+ * maxConnections are served, else queue it for the next free thread,
+ * else shed it.
+ */
+void admit(int fd, const struct sockaddr_storage *addr) {
+    client_info_t *info;
+    pthread_t thread;
+
+    pthread_mutex_lock(&admitLock);
+    if (activeConnections >= maxConnections) {
+        if (queueLen < queueCap) {
+            queued_conn_t *q = &acceptQueue[(queueHead + queueLen) % queueCap];
+            q->fd = fd;
+            q->addr = *addr;
+            q->since = metrics_now_ns();
+            queueLen++;
+            metrics_gauge_add(gQueued, 1);
+        } else {
+            shed(fd);
+        }
+        pthread_mutex_unlock(&admitLock);
+        return;
     }
-    printf("Server listening/waiting for client at port %d\n", port);
+    activeConnections++;
+    pthread_mutex_unlock(&admitLock);
 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /* Pass copy of connfd and client address to thread */
+    if ((info = pool_get(clientPool)) != NULL) {
+        info->connfd = fd;
+        info->clientAddr = *addr;
+        if (pthread_create(&thread, &threadAttr, connectionHandler, (void *)info) == 0)
+            return;
+        log_warn("Unable to create thread: %s", strerror(errno));
+        pool_put(info);
+    }
+    pthread_mutex_lock(&admitLock);
+    activeConnections--;
+    pthread_mutex_unlock(&admitLock);
+    shed(fd);
+}
 
-    while (1) {
-        connfd = accept(sockfd, (struct sockaddr *)&clienAddr, &clienLen);
-        if (connfd < 0) {
-            perror("Accept failed");
+/*
+ * Accept on one listener. With several, the thread is pinned to a CPU
+ * first; connection threads inherit that, so a connection the kernel
+ * steered to this listener is served on the same CPU.
+ */
+void *acceptLoop(void *arg) {
+    listener_t *l = (listener_t *)arg;
+
+    if (nListeners > 1) {
+        int cpu = net_pin_cpu(l->index);
+        if (cpu < 0)
+            log_warn("Cannot pin listener %u to a CPU: %s", l->index, strerror(errno));
+        else
+            log_debug("Listener %u on CPU %d", l->index, cpu);
+    }
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept(l->fd, (struct sockaddr *)&addr, &len);
+
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                log_warn("Accept failed: %s", strerror(errno));
             continue;
         }
+        atomic_fetch_add_explicit(&l->accepted, 1, memory_order_relaxed);
+        metrics_inc(mConnections);
+        admit(fd, &addr);
+    }
+    return NULL;
+}
 
-        /* Pass copy of connfd and client address to thread */
-        client_info_t *info = (client_info_t *)malloc(sizeof(client_info_t));
-        if (info == NULL) {
-            perror("malloc failed");
-            close(connfd);
-            continue;
+void printCacheStats(void) {
+    fcache_stats_t st;
+    unsigned long long lookups;
+
+    fcache_get_stats(&st);
+    lookups = st.hits + st.misses;
+    log_info("File cache: %llu lookups, %llu hits (%.1f%%), %llu served from RAM, "
+             "%llu misses, %llu evictions, %llu invalidations, %llu entries, "
+             "%llu precompressed sends (%llu KB cached)",
+             lookups, st.hits, lookups ? 100.0 * st.hits / lookups : 0.0,
+             st.content_hits, st.misses, st.evictions, st.invalidations, st.entries,
+             st.variant_hits, st.variant_bytes / 1024);
+}
+
+/* Cache counters live in fcache; copy them out at scrape time */
+void collectCacheStats(metrics_writer_t *w) {
+    fcache_stats_t st;
+
+    fcache_get_stats(&st);
+    metrics_family(w, "fcache_lookups_total", "counter", "File cache lookups by result");
+    metrics_sample(w, "fcache_lookups_total", "result=\"hit\"", (double)st.hits);
+    metrics_sample(w, "fcache_lookups_total", "result=\"miss\"", (double)st.misses);
+    metrics_family(w, "fcache_content_hits_total", "counter", "Hits served from the in-RAM copy");
+    metrics_sample(w, "fcache_content_hits_total", NULL, (double)st.content_hits);
+    metrics_family(w, "fcache_evictions_total", "counter", "Entries evicted by the LRU");
+    metrics_sample(w, "fcache_evictions_total", NULL, (double)st.evictions);
+    metrics_family(w, "fcache_invalidations_total", "counter", "Entries dropped after the file changed");
+    metrics_sample(w, "fcache_invalidations_total", NULL, (double)st.invalidations);
+    metrics_family(w, "fcache_entries", "gauge", "Files currently cached");
+    metrics_sample(w, "fcache_entries", NULL, (double)st.entries);
+    metrics_family(w, "fcache_variant_hits_total", "counter", "Sends of a cached compressed copy");
+    metrics_sample(w, "fcache_variant_hits_total", NULL, (double)st.variant_hits);
+    metrics_family(w, "fcache_variant_bytes", "gauge", "Bytes of cached compressed copies");
+    metrics_sample(w, "fcache_variant_bytes", NULL, (double)st.variant_bytes);
+}
+
+/* How evenly the kernel spreads connections over the listeners */
+void collectListenerStats(metrics_writer_t *w) {
+    char label[32];
+
+    metrics_family(w, "tcp_listener_connections_total", "counter", "Connections accepted per listener");
+    for (unsigned i = 0; i < nListeners; i++) {
+        snprintf(label, sizeof(label), "listener=\"%u\"", i);
+        metrics_sample(w, "tcp_listener_connections_total", label,
+                       (double)atomic_load_explicit(&listeners[i].accepted, memory_order_relaxed));
+    }
+}
+
+/* Scheduler state, copied out at scrape time like the cache counters */
+void collectSchedStats(metrics_writer_t *w) {
+    sched_stats_t st;
+
+    sched_get_stats(&st);
+    metrics_family(w, "tcp_sched_flows", "gauge", "Connections under the rate limits");
+    metrics_sample(w, "tcp_sched_flows", NULL, (double)st.flows);
+    metrics_family(w, "tcp_sched_clients", "gauge", "Client addresses with connections under the rate limits");
+    metrics_sample(w, "tcp_sched_clients", NULL, (double)st.clients);
+    metrics_family(w, "tcp_sched_waiting", "gauge", "Connections waiting for the rate limits");
+    metrics_sample(w, "tcp_sched_waiting", NULL, (double)st.waiting);
+    metrics_family(w, "tcp_sched_throttled_total", "counter", "Pieces of file data that had to wait");
+    metrics_sample(w, "tcp_sched_throttled_total", NULL, (double)st.throttled);
+    metrics_family(w, "tcp_sched_bytes_total", "counter", "File bytes granted by the scheduler");
+    metrics_sample(w, "tcp_sched_bytes_total", NULL, (double)st.bytes);
+}
+
+void registerMetrics(void) {
+    mConnections = metrics_counter("tcp_connections_total", "Connections accepted");
+    mRequests = metrics_counter("tcp_requests_total", "File requests received");
+    mNotFound = metrics_counter("tcp_requests_not_found_total", "Requests for missing files");
+    mFailed = metrics_counter("tcp_requests_failed_total", "Requests that failed mid-send");
+    mFileBytes = metrics_counter("tcp_file_bytes_total", "File bytes delivered");
+    mWireBytes = metrics_counter("tcp_wire_bytes_total", "Body bytes sent (after compression)");
+    mTlsConnections = metrics_counter("tcp_tls_connections_total", "TLS handshakes completed");
+    mKtlsConnections = metrics_counter("tcp_ktls_connections_total",
+                                       "TLS connections encrypted by the kernel (sendfile kept)");
+    mTlsFailed = metrics_counter("tcp_tls_handshake_failures_total", "TLS handshakes that failed");
+    gOpenConnections = metrics_gauge("tcp_open_connections", "Connections being served");
+    hRequestTime = metrics_histogram("tcp_request_duration_seconds",
+                                     "Time from request received to response sent");
+    mShed = metrics_counter("tcp_connections_shed_total",
+                            "Connections reset because the accept queue was full or they waited too long");
+    gQueued = metrics_gauge("tcp_accept_queue_length", "Accepted connections waiting for a thread");
+    hQueueWait = metrics_histogram("tcp_accept_queue_wait_seconds",
+                                   "Time queued connections waited for a thread");
+    hPaceWait = metrics_histogram("tcp_ratelimit_wait_seconds",
+                                  "Time a piece of file data waited for the rate limits");
+    metrics_add_collector(collectCacheStats);
+    if (nListeners > 1)
+        metrics_add_collector(collectListenerStats);
+    if (sched_enabled())
+        metrics_add_collector(collectSchedStats);
+}
+
+#define USAGE "Usage: %s [-v] [-M port|unix:path] [-T cert_and_key.pem] [-L listeners [-E]] [-C max_connections] " \
+              "[-Q accept_queue] [-B total_MBps] [-R per_client_MBps] [-c max_cached_files] " \
+              "[-m content_cache_MB] [-z compressed_cache_MB] <port #>\n"
+
+int main(int argc, char *argv[]) {
+    int port, opt;
+    const char *metricsEndpoint = NULL;
+    const char *tlsPem = NULL;
+    int verbose = 0;
+    sched_config_t rates = { 0, 0 };
+    int steer = 0, sig;
+    sigset_t signals;
+    fcache_config_t cache = { DEFAULT_CACHE_ENTRIES,
+                              (size_t)DEFAULT_CONTENT_MB * 1024 * 1024, CONTENT_MAX_FILE,
+                              (size_t)DEFAULT_VARIANT_MB * 1024 * 1024 };
+
+    while ((opt = getopt(argc, argv, "c:m:z:M:T:L:EC:Q:B:R:v")) != -1) {
+        switch (opt) {
+        case 'M': metricsEndpoint = optarg; break;
+        case 'T': tlsPem = optarg; break;
+        case 'L': nListeners = (unsigned)atoi(optarg); break;
+        case 'E': steer = 1; break;
+        case 'C': maxConnections = (unsigned)atoi(optarg); break;
+        case 'Q': queueCap = (unsigned)atoi(optarg); break;
+        case 'B': rates.total_rate = atof(optarg) * 1e6; break;
+        case 'R': rates.client_rate = atof(optarg) * 1e6; break;
+        case 'v': verbose = 1; break;
+        case 'c': cache.max_entries = (unsigned)atoi(optarg); break;
+        case 'm': cache.content_budget = (size_t)atol(optarg) * 1024 * 1024; break;
+        case 'z': cache.variant_budget = (size_t)atol(optarg) * 1024 * 1024; break;
+        default:
+            printf(USAGE, argv[0]);
+            exit(0);
+        }
+    }
+    if (argc - optind != 1) {
+        printf(USAGE, argv[0]);
+        exit(0);
+    }
+    port = atoi(argv[optind]);
+    if (maxConnections == 0)
+        maxConnections = 1;
+    if (queueCap == 0)
+        queueCap = 1;
+    if (nListeners == 0)
+        nListeners = 1;
+
+    /*
+     * SIGUSR1 prints cache counters, SIGINT/SIGTERM print them and exit(),
+     * which also writes the profile of an instrumented (PGO) build. They
+     * are blocked in every thread, which inherit this mask, and taken by
+     * sigwait() in this one.
+     */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    log_init(verbose ? LOG_LVL_DEBUG : LOG_LVL_INFO, verbose ? LOG_TIMESTAMPS : 0);
+
+    if (tlsPem != NULL) {
+        if ((tlsCtx = tls_server_new(tlsPem)) == NULL)
+            exit(1);
+        log_info("TLS 1.3 with certificate %s", tlsPem);
+    }
+    fcache_init(&cache);
+    sched_init(&rates);
+    if (sched_enabled())
+        log_info("Rate limits: %.1f MB/s in total, %.1f MB/s per client (0 = none)",
+                 rates.total_rate / 1e6, rates.client_rate / 1e6);
+    registerMetrics();
+    clientPool = pool_create("clients", sizeof(client_info_t), 64);
+    chunkPool = pool_create("chunks", CHUNK_HEADER_SIZE + COMP_CHUNK_SIZE, 4);
+    acceptQueue = calloc(queueCap, sizeof(*acceptQueue));
+    listeners = calloc(nListeners, sizeof(*listeners));
+    if (clientPool == NULL || chunkPool == NULL || acceptQueue == NULL || listeners == NULL) {
+        perror("Cannot create buffer pools");
+        exit(1);
+    }
+    if (metricsEndpoint != NULL) {
+        if (metrics_serve(metricsEndpoint) < 0) {
+            perror("Cannot serve metrics");
+            exit(1);
         }
-        info->connfd = connfd;
-        info->clientAddr = clienAddr;
+        log_info("Metrics at %s", metricsEndpoint);
+    }
 
-        if (pthread_create(&clients[threadCount % N], &attr, connectionHandler, (void *)info) < 0) {
-            perror("Unable to create thread");
-            free(info);
-            close(connfd);
+    /* Listening sockets, IPv6 and IPv4; several share the port through SO_REUSEPORT */
+    for (unsigned i = 0; i < nListeners; i++) {
+        listeners[i].index = i;
+        listeners[i].fd = net_bind(SOCK_STREAM, port, nListeners > 1 ? NET_REUSEPORT : 0);
+        if (listeners[i].fd < 0) {
+            perror("Bind failed");
             exit(1);
         }
-        printf("Thread %d has been created to service client request\n", ++threadCount);
     }
+    if (steer && nListeners > 1 && net_steer_by_cpu(listeners[0].fd, nListeners) < 0) {
+        perror("Cannot attach the steering program");
+        exit(1);
+    }
+    if (nListeners > 1)
+        log_info("Server listening/waiting for client at port %d (%u listeners%s)", port,
+                 nListeners, steer ? ", steered by CPU" : "");
+    else
+        log_info("Server listening/waiting for client at port %d", port);
+
+    pthread_attr_init(&threadAttr);
+    pthread_attr_setdetachstate(&threadAttr, PTHREAD_CREATE_DETACHED);
+    for (unsigned i = 0; i < nListeners; i++) {
+        if (pthread_create(&listeners[i].thread, &threadAttr, acceptLoop, &listeners[i]) != 0) {
+            perror("Unable to create listener thread");
+            exit(1);
+        }
+    }
+
+    while (sigwait(&signals, &sig) == 0 && sig == SIGUSR1)
+        printCacheStats();
+
+    printCacheStats();
+    exit(0);
 }
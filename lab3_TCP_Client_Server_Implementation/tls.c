@@ -0,0 +1,364 @@
+/*
+ * TLS 1.3 with kernel offload (see tls.h).
+ *
+ * OpenSSL does the kTLS setup itself when SSL_OP_ENABLE_KTLS is set: once
+ * the handshake is done it installs the keys with setsockopt(TCP_ULP,
+ * "tls") / setsockopt(SOL_TLS, TLS_TX), and falls back to encrypting in
+ * user space if the kernel refuses. Session tickets are turned off: they
+ * would be written after the handshake, through OpenSSL, interleaved with
+ * what the server writes to the fd directly.
+ */
+
+#include "tls.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_OPENSSL
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+/* AES-GCM first: the kernel has it (ChaCha20 only since 5.11) and so do most CPUs */
+#define TLS_CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+
+struct tls_ctx {
+    SSL_CTX *ssl_ctx;
+};
+
+struct tls_conn {
+    SSL *ssl;
+    int want_write;
+};
+
+int tls_available(void) {
+    return 1;
+}
+
+/* First queued OpenSSL error as text; clears the queue */
+static const char *last_error(char *buf, size_t len) {
+    unsigned long err = ERR_get_error();
+    if (err == 0)
+        snprintf(buf, len, "%s", errno ? strerror(errno) : "connection closed");
+    else
+        ERR_error_string_n(err, buf, len);
+    ERR_clear_error();
+    return buf;
+}
+
+static tls_ctx_t *ctx_new(const SSL_METHOD *method) {
+    tls_ctx_t *ctx = calloc(1, sizeof(*ctx));
+
+    if (ctx == NULL || (ctx->ssl_ctx = SSL_CTX_new(method)) == NULL) {
+        free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx->ssl_ctx, TLS1_3_VERSION);
+    SSL_CTX_set_ciphersuites(ctx->ssl_ctx, TLS_CIPHERSUITES);
+    /* Messages are length-framed, so a peer that just closes is not a truncation risk */
+    SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return ctx;
+}
+
+tls_ctx_t *tls_server_new(const char *pem_path) {
+    tls_ctx_t *ctx = ctx_new(TLS_server_method());
+    char err[256];
+
+    if (ctx == NULL) {
+        log_error("TLS: cannot create context: %s", last_error(err, sizeof(err)));
+        return NULL;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx->ssl_ctx, pem_path) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx->ssl_ctx, pem_path, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx->ssl_ctx) != 1) {
+        log_error("TLS: cannot load key and certificate from %s: %s",
+                  pem_path, last_error(err, sizeof(err)));
+        tls_ctx_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_num_tickets(ctx->ssl_ctx, 0);
+    return ctx;
+}
+
+tls_ctx_t *tls_client_new(const char *ca_path) {
+    tls_ctx_t *ctx = ctx_new(TLS_client_method());
+    char err[256];
+
+    if (ctx == NULL) {
+        log_error("TLS: cannot create context: %s", last_error(err, sizeof(err)));
+        return NULL;
+    }
+    if (SSL_CTX_load_verify_locations(ctx->ssl_ctx, ca_path, NULL) != 1) {
+        log_error("TLS: cannot load CA certificates from %s: %s",
+                  ca_path, last_error(err, sizeof(err)));
+        tls_ctx_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx->ssl_ctx, SSL_VERIFY_PEER, NULL);
+    return ctx;
+}
+
+void tls_ctx_free(tls_ctx_t *ctx) {
+    if (ctx == NULL)
+        return;
+    SSL_CTX_free(ctx->ssl_ctx);
+    free(ctx);
+}
+
+/* Map an OpenSSL result to the read()/write() convention */
+static int result(tls_conn_t *conn, int ret, const char *what) {
+    char err[256];
+
+    conn->want_write = 0;
+    switch (SSL_get_error(conn->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_WANT_WRITE:
+        conn->want_write = 1;
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (ERR_peek_error() == 0) {
+            if (errno == 0)
+                errno = EPIPE;
+            return -1;
+        }
+        /* fall through */
+    default:
+        log_debug("TLS %s failed: %s", what, last_error(err, sizeof(err)));
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+static tls_conn_t *conn_new(tls_ctx_t *ctx, int fd) {
+    tls_conn_t *conn = calloc(1, sizeof(*conn));
+
+    if (conn == NULL)
+        return NULL;
+    if ((conn->ssl = SSL_new(ctx->ssl_ctx)) == NULL || SSL_set_fd(conn->ssl, fd) != 1) {
+        SSL_free(conn->ssl);
+        free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+tls_conn_t *tls_accept(tls_ctx_t *ctx, int fd) {
+    tls_conn_t *conn = conn_new(ctx, fd);
+    int ret;
+
+    if (conn == NULL)
+        return NULL;
+    ERR_clear_error();
+    if ((ret = SSL_accept(conn->ssl)) != 1) {
+        result(conn, ret, "handshake");
+        SSL_free(conn->ssl);
+        free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+tls_conn_t *tls_connect(tls_ctx_t *ctx, int fd, const char *ip) {
+    tls_conn_t *conn = conn_new(ctx, fd);
+
+    if (conn == NULL)
+        return NULL;
+    /* The certificate must be for the address we dialled */
+    if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(conn->ssl), ip) != 1) {
+        SSL_free(conn->ssl);
+        free(conn);
+        return NULL;
+    }
+    SSL_set_connect_state(conn->ssl);
+    return conn;
+}
+
+int tls_handshake(tls_conn_t *conn) {
+    int ret;
+
+    ERR_clear_error();
+    ret = SSL_do_handshake(conn->ssl);
+    if (ret == 1)
+        return 0;
+    if (result(conn, ret, "handshake") < 0 && errno == EAGAIN)
+        return -1;
+    if (SSL_get_verify_result(conn->ssl) != X509_V_OK)
+        log_error("TLS: server certificate rejected: %s",
+                  X509_verify_cert_error_string(SSL_get_verify_result(conn->ssl)));
+    errno = EPROTO;
+    return -1;
+}
+
+ssize_t tls_read(tls_conn_t *conn, void *buf, size_t len) {
+    size_t n;
+    int ret;
+
+    ERR_clear_error();
+    ret = SSL_read_ex(conn->ssl, buf, len, &n);
+    if (ret == 1) {
+        conn->want_write = 0;
+        return (ssize_t)n;
+    }
+    return result(conn, ret, "read");
+}
+
+ssize_t tls_write(tls_conn_t *conn, const void *buf, size_t len) {
+    size_t n;
+    int ret;
+
+    ERR_clear_error();
+    ret = SSL_write_ex(conn->ssl, buf, len, &n);
+    if (ret == 1) {
+        conn->want_write = 0;
+        return (ssize_t)n;
+    }
+    /* A write never legitimately meets the end of the stream */
+    if (result(conn, ret, "write") == 0)
+        errno = EPIPE;
+    return -1;
+}
+
+int tls_wants_write(const tls_conn_t *conn) {
+    return conn->want_write;
+}
+
+int tls_ktls_send(const tls_conn_t *conn) {
+#ifdef BIO_get_ktls_send
+    return BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+#else
+    (void)conn;     /* OpenSSL built without kTLS */
+    return 0;
+#endif
+}
+
+const char *tls_cipher(const tls_conn_t *conn) {
+    return SSL_get_cipher_name(conn->ssl);
+}
+
+void tls_close(tls_conn_t *conn) {
+    if (conn == NULL)
+        return;
+    /* Best effort: one close_notify, no wait for the reply */
+    ERR_clear_error();
+    SSL_shutdown(conn->ssl);
+    ERR_clear_error();
+    SSL_free(conn->ssl);
+    free(conn);
+}
+
+#else   /* !HAVE_OPENSSL */
+
+struct tls_ctx { int unused; };
+struct tls_conn { int unused; };
+
+int tls_available(void) {
+    return 0;
+}
+
+static tls_ctx_t *unavailable(void) {
+    log_error("TLS: built without OpenSSL (install its headers, e.g. libssl-dev, and rebuild)");
+    return NULL;
+}
+
+tls_ctx_t *tls_server_new(const char *pem_path) {
+    (void)pem_path;
+    return unavailable();
+}
+
+tls_ctx_t *tls_client_new(const char *ca_path) {
+    (void)ca_path;
+    return unavailable();
+}
+
+void tls_ctx_free(tls_ctx_t *ctx) {
+    (void)ctx;
+}
+
+tls_conn_t *tls_accept(tls_ctx_t *ctx, int fd) {
+    (void)ctx; (void)fd;
+    return NULL;
+}
+
+tls_conn_t *tls_connect(tls_ctx_t *ctx, int fd, const char *ip) {
+    (void)ctx; (void)fd; (void)ip;
+    return NULL;
+}
+
+int tls_handshake(tls_conn_t *conn) {
+    (void)conn;
+    errno = EPROTO;
+    return -1;
+}
+
+ssize_t tls_read(tls_conn_t *conn, void *buf, size_t len) {
+    (void)conn; (void)buf; (void)len;
+    errno = EPROTO;
+    return -1;
+}
+
+ssize_t tls_write(tls_conn_t *conn, const void *buf, size_t len) {
+    (void)conn; (void)buf; (void)len;
+    errno = EPROTO;
+    return -1;
+}
+
+int tls_wants_write(const tls_conn_t *conn) {
+    (void)conn;
+    return 0;
+}
+
+int tls_ktls_send(const tls_conn_t *conn) {
+    (void)conn;
+    return 0;
+}
+
+const char *tls_cipher(const tls_conn_t *conn) {
+    (void)conn;
+    return "none";
+}
+
+void tls_close(tls_conn_t *conn) {
+    (void)conn;
+}
+
+#endif
+
+int tls_write_all(tls_conn_t *conn, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = tls_write(conn, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int tls_read_all(tls_conn_t *conn, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = tls_read(conn, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
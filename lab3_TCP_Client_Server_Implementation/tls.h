@@ -0,0 +1,62 @@
+/*
+ * TLS 1.3 for tcp_server and tcp_fetch, on top of OpenSSL.
+ *
+ * After the handshake OpenSSL hands the record keys to the kernel (kernel
+ * TLS, TCP_ULP "tls") when it can: the socket then encrypts whatever is
+ * written to it, so send(), sendmsg() and sendfile() on the plain fd still
+ * work and file data never enters user space. tls_ktls_send() tells
+ * whether that happened. Without it (no tls module, or a cipher the kernel
+ * does not have) every byte goes through tls_write().
+ *
+ * Servers load one PEM file holding the private key and certificate chain.
+ * Clients verify the server against a CA file, including that the
+ * certificate names the IP address connected to.
+ *
+ * Without OpenSSL at build time the contexts cannot be created
+ * (tls_available() is 0) and the rest is never reached.
+ */
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+
+typedef struct tls_ctx tls_ctx_t;
+typedef struct tls_conn tls_conn_t;
+
+int tls_available(void);
+
+/* Contexts; NULL with the reason logged */
+tls_ctx_t *tls_server_new(const char *pem_path);
+tls_ctx_t *tls_client_new(const char *ca_path);
+void tls_ctx_free(tls_ctx_t *ctx);
+
+/* Server side, blocking fd: runs the handshake; NULL if it failed */
+tls_conn_t *tls_accept(tls_ctx_t *ctx, int fd);
+
+/* Client side, non-blocking fd: call tls_handshake() until it returns 0 */
+tls_conn_t *tls_connect(tls_ctx_t *ctx, int fd, const char *ip);
+
+/*
+ * tls_handshake, tls_read and tls_write return -1 with errno EAGAIN when a
+ * non-blocking fd would block; tls_wants_write() then tells whether to
+ * wait for writability rather than readability. Other errors are -1 with
+ * errno EPROTO (or the socket's errno). tls_read returns 0 at the end.
+ */
+int tls_handshake(tls_conn_t *conn);
+ssize_t tls_read(tls_conn_t *conn, void *buf, size_t len);
+ssize_t tls_write(tls_conn_t *conn, const void *buf, size_t len);
+int tls_wants_write(const tls_conn_t *conn);
+
+/* Blocking helpers: loop until len bytes are written / read; 0 or -1 */
+int tls_write_all(tls_conn_t *conn, const void *buf, size_t len);
+int tls_read_all(tls_conn_t *conn, void *buf, size_t len);
+
+/* The kernel encrypts writes to the fd (kTLS); 0 if they must go through tls_write */
+int tls_ktls_send(const tls_conn_t *conn);
+const char *tls_cipher(const tls_conn_t *conn);
+
+/* Send close_notify (without waiting for the peer's) and free; the fd stays open */
+void tls_close(tls_conn_t *conn);
+
+#endif
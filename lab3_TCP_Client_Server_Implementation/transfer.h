@@ -0,0 +1,166 @@
+/*
+ * Wire protocol shared by tcp_server and tcp_client.
+ *
+ * Request: fixed FILENAME_SIZE-byte buffer. The filename is NUL terminated
+ * in the first REQ_NAME_MAX bytes; the last REQ_EXT_SIZE bytes carry an
+ * optional extension block (all zero from older clients, which the server
+ * treats as a plain request).
+ *
+ * Response: 4-byte file size (network order), file contents, then - only
+ * if the request asked for a digest - a trailer of
+ * <1 byte algorithm><1 byte length><digest bytes>.
+ *
+ * With REQ_FLAG_SIZE64 set, a size of SIZE64_ESCAPE or more is sent as
+ * SIZE64_ESCAPE followed by the 8-byte size (network order); everything
+ * after it is as above. Without the flag the server refuses such files
+ * with a not-found reply rather than send the size modulo 2^32.
+ *
+ * If the request asked for compression, the size is followed by one byte
+ * naming the codec the server picked (comp_alg_t), and the contents are
+ * sent as chunks of up to COMP_CHUNK_SIZE raw bytes, each framed as
+ * <4 byte raw length><4 byte payload length | CHUNK_STORED><payload>.
+ * CHUNK_STORED marks a chunk sent uncompressed because it did not shrink.
+ * The digest always covers the uncompressed file.
+ *
+ * With REQ_FLAG_KEEPALIVE set, the server keeps the connection open after
+ * the response and waits for the next request on it (connection pooling).
+ *
+ * With REQ_FLAG_RESUME set, the last REQ_RESUME_SIZE bytes of the name
+ * field carry <8 byte offset><8 byte version> (network order): how much of
+ * the file the client already has, from the copy the server identified by
+ * that version. The size (and codec byte) are then followed by
+ * <8 byte start offset><8 byte version>, and the contents are sent from
+ * the start offset on. The server starts at 0 when the version no longer
+ * matches, and at a chunk boundary when compressing. Size and digest
+ * still cover the whole file.
+ */
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define FILENAME_SIZE 256
+#define FILE_BUFFER_SIZE 1024
+#define REQ_EXT_SIZE 16
+#define REQ_NAME_MAX (FILENAME_SIZE - REQ_EXT_SIZE)
+#define REQ_MAGIC0 'X'
+#define REQ_MAGIC1 'T'
+#define REQ_VERSION 1
+
+#define COMP_CHUNK_SIZE (128 * 1024)
+#define CHUNK_HEADER_SIZE 8
+#define CHUNK_STORED 0x80000000u
+
+#define REQ_FLAG_KEEPALIVE 0x01
+#define REQ_FLAG_RESUME    0x02
+#define REQ_FLAG_SIZE64    0x04
+
+#define SIZE64_ESCAPE 0xFFFFFFFFu
+
+#define REQ_RESUME_SIZE 16
+#define REQ_RESUME_NAME_MAX (REQ_NAME_MAX - REQ_RESUME_SIZE)
+
+typedef struct {
+    char filename[REQ_NAME_MAX];
+    uint8_t magic[2];       /* REQ_MAGIC0, REQ_MAGIC1 when the block is present */
+    uint8_t version;
+    uint8_t digest;         /* digest_alg_t for the trailer, 0 = no trailer */
+    uint8_t compress;       /* comp_alg_t wanted, 0 = raw stream */
+    uint8_t level;          /* codec level, 0 = codec default */
+    uint8_t flags;          /* REQ_FLAG_* */
+    uint8_t reserved[9];
+} request_t;
+
+_Static_assert(sizeof(request_t) == FILENAME_SIZE, "request must stay FILENAME_SIZE bytes");
+
+static inline int request_has_ext(const request_t *req) {
+    return req->magic[0] == REQ_MAGIC0 && req->magic[1] == REQ_MAGIC1;
+}
+
+static inline void request_init(request_t *req, const char *filename) {
+    memset(req, 0, sizeof(*req));
+    for (size_t i = 0; i < REQ_NAME_MAX - 1 && filename[i] != '\0'; i++)
+        req->filename[i] = filename[i];
+    req->magic[0] = REQ_MAGIC0;
+    req->magic[1] = REQ_MAGIC1;
+    req->version = REQ_VERSION;
+}
+
+static inline void put_be64(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8)
+        p[i] = (uint8_t)v;
+}
+
+static inline uint64_t get_be64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+/* Names in resume requests must fit in REQ_RESUME_NAME_MAX - 1 bytes */
+static inline void request_set_resume(request_t *req, uint64_t offset, uint64_t version) {
+    uint8_t *p = (uint8_t *)req->filename + REQ_RESUME_NAME_MAX;
+    put_be64(p, offset);
+    put_be64(p + 8, version);
+    req->flags |= REQ_FLAG_RESUME;
+}
+
+static inline void request_get_resume(const request_t *req, uint64_t *offset, uint64_t *version) {
+    const uint8_t *p = (const uint8_t *)req->filename + REQ_RESUME_NAME_MAX;
+    *offset = get_be64(p);
+    *version = get_be64(p + 8);
+}
+
+/* Loop until len bytes are sent; returns 0 or -1 */
+static inline int send_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static inline void chunk_header_pack(uint8_t *h, uint32_t raw_len, uint32_t wire) {
+    uint32_t a = htonl(raw_len), b = htonl(wire);
+    memcpy(h, &a, 4);
+    memcpy(h + 4, &b, 4);
+}
+
+static inline void chunk_header_unpack(const uint8_t *h, uint32_t *raw_len, uint32_t *wire) {
+    uint32_t a, b;
+    memcpy(&a, h, 4);
+    memcpy(&b, h + 4, 4);
+    *raw_len = ntohl(a);
+    *wire = ntohl(b);
+}
+
+/* Loop until len bytes arrive; returns 0, or -1 on error / early close */
+static inline int recv_all(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+#endif
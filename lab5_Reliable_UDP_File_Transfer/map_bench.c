@@ -0,0 +1,128 @@
+// Source-path benchmark: filling packets with read() vs. from the mapping
+// (src_map.c), from a cold page cache
+// Each pass builds and checksums every packet of the file as udp_client
+// does, without the network, so the time is the cost of getting the data.
+// The file's cached pages are dropped first (POSIX_FADV_DONTNEED); to see
+// the larger-than-RAM case, pass a file bigger than memory.
+// Usage: ./map_bench [-l MB] [file]   (no file: a temporary 256 MB one)
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "rdt.h"
+#include "src_map.h"
+
+#define TEMP_SIZE (256u << 20)
+
+static uint64_t limit = UINT64_MAX;
+static volatile int sink;       // keeps the checksums from being optimised out
+
+static double nowSec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long majorFaults(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_majflt;
+}
+
+static void run(const char *path, int mapped) {
+    static Packet packet;
+    srcmap_t map;
+    uint64_t bytes = 0;
+    unsigned long packets = 0, calls = 0;
+    int sum = 0;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    srcmap_open(&map, fd);
+    if (!mapped)
+        map.base = NULL;        // the pread() fallback, i.e. one read per packet
+
+    long faults = majorFaults();
+    double start = nowSec();
+    for (;;) {
+        size_t want = limit - bytes < DATA_SIZE ? (size_t)(limit - bytes) : DATA_SIZE;
+        ssize_t n = want > 0 ? srcmap_read(&map, bytes, packet.data, want) : 0;
+        if (n <= 0)
+            break;
+        packet.header.len = (int)n;
+        packet.header.seq_ack = (int)(packets & SEQ_MASK);
+        sum ^= getChecksum(&packet);
+        bytes += (uint64_t)n;
+        packets++;
+        calls += !mapped;
+    }
+    double secs = nowSec() - start;
+    faults = majorFaults() - faults;
+
+    sink = sum;
+    printf("  %-18s %8.1f MB/s  %6.0f ns/packet  %10lu read() calls  %8ld major faults\n",
+           mapped ? "mmap + madvise" : "read() per packet", bytes / secs / 1e6,
+           secs * 1e9 / (packets ? packets : 1), calls, faults);
+    srcmap_close(&map);
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    char temp[] = "/tmp/map_bench.XXXXXX";
+    const char *path;
+    struct stat st;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:")) != -1) {
+        switch (opt) {
+        case 'l': limit = strtoull(optarg, NULL, 10) << 20; break;
+        default:
+            fprintf(stderr, "Usage: %s [-l MB] [file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        path = argv[optind];
+    } else {
+        static char block[1 << 16];
+        int fd = mkstemp(temp);
+        if (fd < 0) {
+            perror("mkstemp");
+            return 1;
+        }
+        for (size_t i = 0; i < sizeof(block); i++)
+            block[i] = (char)('a' + i % 26);
+        for (unsigned off = 0; off < TEMP_SIZE; off += sizeof(block))
+            if (write(fd, block, sizeof(block)) != (ssize_t)sizeof(block)) {
+                perror("write");
+                unlink(temp);
+                return 1;
+            }
+        close(fd);
+        path = temp;
+    }
+    if (stat(path, &st) < 0) {
+        perror(path);
+        return 1;
+    }
+
+    printf("%s: %lld MB%s, packets of %d bytes, cold page cache\n", path,
+           (long long)(st.st_size >> 20), limit != UINT64_MAX ? " (limited)" : "", DATA_SIZE);
+    run(path, 0);
+    run(path, 1);
+    if (path == temp)
+        unlink(temp);
+    return 0;
+}
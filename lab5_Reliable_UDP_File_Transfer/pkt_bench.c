@@ -0,0 +1,179 @@
+// Packet buffer benchmark: allocations and time per packet
+// Compares the old way (a malloc'd packet per datagram, passed by value to
+// the checksum) with pooled packets passed by pointer, in one thread and
+// handed from a receiving thread to a consumer thread. "malloc + pointer"
+// separates the cost of the allocation from that of the copy.
+// Built with -Wl,--wrap=malloc so every malloc made by the code is counted.
+// Usage: ./pkt_bench [-n packets]
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rdt.h"
+#include "pool.h"
+
+#define RING_SLOTS 256
+
+static _Atomic unsigned long mallocs;
+
+void *__real_malloc(size_t size);
+void *__wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&mallocs, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+// What getChecksum looked like before packets were passed by pointer
+static int checksumByValue(Packet packet) {
+    packet.header.cksum = 0;
+    int checksum = 0;
+    char *ptr = (char *)&packet;
+    char *end = ptr + sizeof(Header) + packet.header.len;
+    while (ptr < end)
+        checksum ^= *ptr++;
+    return checksum;
+}
+
+static double nowSec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Stand-in for recvfrom(): fill the header and the payload
+static void receiveInto(Packet *p, unsigned long i) {
+    p->header.seq_ack = (int)(i & 1);
+    p->header.len = DATA_SIZE;
+    memset(p->data, (int)i, DATA_SIZE);
+    p->header.cksum = 0;
+}
+
+static volatile int sink;
+
+// Single producer / single consumer ring of packet pointers
+typedef struct {
+    Packet *slot[RING_SLOTS];
+    _Atomic unsigned long head, tail;
+    int pooled;
+    unsigned long n;
+} ring_t;
+
+static void *consumer(void *arg) {
+    ring_t *r = arg;
+    int acc = 0;
+
+    for (unsigned long i = 0; i < r->n; i++) {
+        unsigned long t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        Packet *p;
+        while (atomic_load_explicit(&r->head, memory_order_acquire) == t)
+            sched_yield();
+        p = r->slot[t % RING_SLOTS];
+        atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+        if (r->pooled) {
+            acc ^= getChecksum(p);
+            pool_put(p);
+        } else {
+            acc ^= checksumByValue(*p);
+            free(p);
+        }
+    }
+    sink = acc;
+    return NULL;
+}
+
+static void report(const char *what, unsigned long n, double secs, unsigned long allocs) {
+    printf("  %-34s %7.1f ns/packet  %.4f mallocs/packet\n", what, secs * 1e9 / n,
+           (double)allocs / n);
+}
+
+static void runThreaded(pool_t *pool, unsigned long n, int pooled) {
+    ring_t *r = calloc(1, sizeof(*r));
+    pthread_t thr;
+    unsigned long before;
+    double start;
+
+    r->n = n;
+    r->pooled = pooled;
+    pthread_create(&thr, NULL, consumer, r);
+    before = atomic_load(&mallocs);
+    start = nowSec();
+    for (unsigned long i = 0; i < n; i++) {
+        unsigned long h = atomic_load_explicit(&r->head, memory_order_relaxed);
+        Packet *p = pooled ? pool_get(pool) : malloc(sizeof(Packet));
+        receiveInto(p, i);
+        while (h - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SLOTS)
+            sched_yield();
+        r->slot[h % RING_SLOTS] = p;
+        atomic_store_explicit(&r->head, h + 1, memory_order_release);
+    }
+    pthread_join(thr, NULL);
+    report(pooled ? "pool + pointer, 2 threads" : "malloc + by value, 2 threads",
+           n, nowSec() - start, atomic_load(&mallocs) - before);
+    free(r);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long n = 5000000, before;
+    pool_t *pool;
+    pool_stats_t st;
+    double start;
+    int opt, acc = 0;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            n = strtoul(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [-n packets]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    pool = pool_create("packets", sizeof(Packet), 64);
+    printf("%lu packets of %zu bytes (DATA_SIZE %d)\n", n, sizeof(Packet), DATA_SIZE);
+
+    before = atomic_load(&mallocs);
+    start = nowSec();
+    for (unsigned long i = 0; i < n; i++) {
+        Packet *p = malloc(sizeof(Packet));
+        receiveInto(p, i);
+        acc ^= checksumByValue(*p);
+        free(p);
+    }
+    report("malloc + by value, 1 thread", n, nowSec() - start, atomic_load(&mallocs) - before);
+
+    before = atomic_load(&mallocs);
+    start = nowSec();
+    for (unsigned long i = 0; i < n; i++) {
+        Packet *p = malloc(sizeof(Packet));
+        receiveInto(p, i);
+        acc ^= getChecksum(p);
+        free(p);
+    }
+    report("malloc + pointer, 1 thread", n, nowSec() - start, atomic_load(&mallocs) - before);
+
+    before = atomic_load(&mallocs);
+    start = nowSec();
+    for (unsigned long i = 0; i < n; i++) {
+        Packet *p = pool_get(pool);
+        receiveInto(p, i);
+        acc ^= getChecksum(p);
+        pool_put(p);
+    }
+    report("pool + pointer, 1 thread", n, nowSec() - start, atomic_load(&mallocs) - before);
+    sink = acc;
+
+    runThreaded(pool, n, 0);
+    runThreaded(pool, n, 1);
+
+    pool_stats(pool, &st);
+    printf("  pool: %llu slabs, %llu packets, %llu shared-list trips\n",
+           (unsigned long long)st.slabs, (unsigned long long)st.objects,
+           (unsigned long long)st.refills);
+    pool_destroy(pool);
+    return 0;
+}
@@ -0,0 +1,74 @@
+// Packet helpers shared by udp_client and udp_server
+#include <string.h>
+#include <stdint.h>
+
+#include "rdt.h"
+#include "log.h"
+
+// XOR of the bytes in [p, p+n), eight at a time
+static unsigned char xorBytes(const unsigned char *p, size_t n) {
+    uint64_t acc = 0, w;
+    unsigned char x;
+
+    for (; n >= sizeof(w); p += sizeof(w), n -= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        acc ^= w;
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    x = (unsigned char)acc;
+    while (n-- > 0)
+        x ^= *p++;
+    return x;
+}
+
+int validLength(const Packet *packet, ssize_t n) {
+    return n >= (ssize_t)sizeof(Header) && packet->header.len >= 0
+           && packet->header.len <= DATA_SIZE && (size_t)n >= PACKET_WIRE_SIZE(packet);
+}
+
+void putU64(char *buf, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8)
+        buf[i] = (char)(v & 0xff);
+}
+
+uint64_t getU64(const char *buf) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = v << 8 | (unsigned char)buf[i];
+    return v;
+}
+
+void putOffset(Packet *packet, uint64_t offset) {
+    putU64(packet->data, offset);
+}
+
+uint64_t getOffset(const Packet *packet) {
+    return getU64(packet->data);
+}
+
+int getChecksum(const Packet *packet) {
+    size_t len = packet->header.len > 0 && packet->header.len <= DATA_SIZE
+                 ? (size_t)packet->header.len : 0;
+    unsigned char x = xorBytes((const unsigned char *)&packet->header, sizeof(Header))
+                      ^ xorBytes((const unsigned char *)&packet->header.cksum, sizeof(int))
+                      ^ xorBytes((const unsigned char *)packet->data, len);
+
+    // Same value as XOR-ing the bytes as (signed) char into an int
+    return (signed char)x;
+}
+
+void logPacket(const char *what, const Packet *packet) {
+    char data[DATA_SIZE + 1];
+    size_t len = packet->header.len > 0 && packet->header.len <= DATA_SIZE
+                 ? (size_t)packet->header.len : 0;
+
+    if (!log_enabled(LOG_LVL_DEBUG))
+        return;
+    // The logger copies strings, so hand it a terminated copy of the payload
+    memcpy(data, packet->data, len);
+    data[len] = '\0';
+    log_debug("%s: Packet{ header: { seq_ack: %d, len: %d, cksum: %d }, data: \"%s\" }",
+              what, packet->header.seq_ack, packet->header.len, packet->header.cksum, data);
+}
@@ -0,0 +1,72 @@
+// Packet format and helpers shared by udp_client and udp_server
+#ifndef RDT_H
+#define RDT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// seq_ack carries the alternating sequence bit plus flag bits
+#define SEQ_MASK    0x1
+#define FLAG_DIGEST 0x100   // digest announcement / trailer, not file data
+#define FLAG_MP     0x200   // multipath data: 8-byte file offset, then file bytes
+#define FLAG_END    0x400   // multipath: last packet on this path; data[0] = number of paths
+#define FLAG_RESUME 0x800   // resume query / reply (udp_client -r, udp_server -r)
+
+// Payload bytes per packet; client and server must be built with the same
+// value (make DATA_SIZE=1400 for MTU-sized packets)
+#ifndef DATA_SIZE
+#define DATA_SIZE 10
+#endif
+
+// Multipath (udp_client -m): each path is its own stop-and-wait channel to
+// another server port, and data packets say where in the file they go
+#define MP_MAX_PATHS    8
+#define MP_OFFSET_SIZE  8
+#define MP_PAYLOAD      (DATA_SIZE - MP_OFFSET_SIZE)
+
+// Resume (-r): before sending, the client asks which chunks of MP_PAYLOAD
+// bytes the server is missing. Query: <8 size><8 version><8 first chunk>;
+// the ACK carries <8 next first chunk, RESUME_DONE at the end> and then
+// (<8 chunk><8 count>) runs of missing chunks. All big-endian.
+#define RESUME_QUERY_SIZE 24
+#define RESUME_DONE UINT64_MAX
+
+#if DATA_SIZE <= MP_OFFSET_SIZE
+#error "DATA_SIZE must leave room for the multipath file offset"
+#endif
+
+// Header: sequence/acknowledgement number, checksum, and length of packet
+typedef struct {
+    int seq_ack;
+    int len;
+    int cksum;
+} Header;
+
+// Packet: header + data
+typedef struct {
+    Header header;
+    char data[DATA_SIZE];
+} Packet;
+
+// Bytes on the wire: the header and len bytes of data
+#define PACKET_WIRE_SIZE(p) (sizeof(Header) + (size_t)(p)->header.len)
+
+// Header present and len consistent with the n bytes received
+int validLength(const Packet *packet, ssize_t n);
+
+// Big-endian 64-bit field at buf
+void putU64(char *buf, uint64_t v);
+uint64_t getU64(const char *buf);
+
+// Multipath file offset, big-endian in the first MP_OFFSET_SIZE data bytes
+void putOffset(Packet *packet, uint64_t offset);
+uint64_t getOffset(const Packet *packet);
+
+// Calculate checksum (longitudinal parity - XOR of all bytes)
+// The checksum field itself counts as 0
+int getChecksum(const Packet *packet);
+
+// Log a packet at debug level, prefixed with what happened to it
+void logPacket(const char *what, const Packet *packet);
+
+#endif
@@ -0,0 +1,285 @@
+// Receive-path benchmark: recvfrom() vs. the TPACKET_V3 ring (rx_ring.c)
+// A sender thread streams checksummed packets to a local port as fast as
+// it can; the receiver checks each one as udp_server would. Reported are
+// the receive rate and how many packets were lost (socket buffer or ring
+// full). The ring pass reads from the loopback interface and needs
+// CAP_NET_RAW.
+// Then the same stream, sent from many source ports, goes to 1, 2, 4, ...
+// SO_REUSEPORT sockets on the port, up to -r (default: the CPUs, at least
+// 2), each read by a thread pinned to its own CPU; -E steers by receiving
+// CPU instead of by flow hash (see net.h).
+// Usage: ./rx_bench [-n packets] [-p port] [-r max_receivers] [-E]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "rdt.h"
+#include "rx_ring.h"
+#include "net.h"
+
+#define BATCH 64
+#define END_MARK (-1)
+#define SOURCE_PORTS 16         // flows for the reuseport hash to spread
+#define MAX_RECEIVERS 64
+
+static unsigned long total = 1000000;
+static int port = 6199;
+static _Atomic int sending;
+static _Atomic int sent;        // reuseport runs: the sender is done
+static int steer;
+
+static double nowSec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Streams total packets, from nsock sockets in turn (arg, NULL for one).
+// With one it then repeats the end marker until the receiver is done.
+static void *sender(void *arg) {
+    static Packet packets[BATCH];
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    struct sockaddr_in to;
+    int nsock = arg != NULL ? *(int *)arg : 1;
+    int fds[SOURCE_PORTS];
+    int fd;
+
+    for (int i = 0; i < nsock; i++)
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    fd = fds[0];
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH; i++) {
+        memset(packets[i].data, 'a' + i % 26, DATA_SIZE);
+        packets[i].header.len = DATA_SIZE;
+        iov[i].iov_base = &packets[i];
+        iov[i].iov_len = PACKET_WIRE_SIZE(&packets[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &to;
+        msgs[i].msg_hdr.msg_namelen = sizeof(to);
+    }
+
+    for (unsigned long done = 0, batch = 0; done < total; batch++) {
+        int n = total - done < BATCH ? (int)(total - done) : BATCH;
+        for (int i = 0; i < n; i++) {
+            packets[i].header.seq_ack = (int)(done + i);
+            packets[i].header.cksum = getChecksum(&packets[i]);
+        }
+        n = sendmmsg(fds[batch % nsock], msgs, (unsigned)n, 0);
+        if (n > 0)
+            done += (unsigned long)n;
+    }
+    if (nsock > 1) {
+        atomic_store(&sent, 1);
+        for (int i = 0; i < nsock; i++)
+            close(fds[i]);
+        return NULL;
+    }
+
+    // End marker, repeated until the receiver is done in case some are lost
+    packets[0].header.seq_ack = END_MARK;
+    packets[0].header.len = 0;
+    packets[0].header.cksum = getChecksum(&packets[0]);
+    while (atomic_load(&sending)) {
+        sendto(fd, &packets[0], sizeof(Header), 0, (struct sockaddr *)&to, sizeof(to));
+        usleep(1000);
+    }
+    close(fd);
+    return NULL;
+}
+
+// Check a received packet as the server does; 1 at the end marker
+static int consume(const Packet *p, ssize_t n, unsigned long *good) {
+    if (!validLength(p, n))
+        return 0;
+    if (p->header.seq_ack == END_MARK)
+        return 1;
+    if (getChecksum(p) == p->header.cksum)
+        (*good)++;
+    return 0;
+}
+
+static void run(int useRing) {
+    struct sockaddr_in addr, from;
+    rxring_t *ring = NULL;
+    pthread_t thr;
+    unsigned long good = 0;
+    int bufsize = 4 << 20;
+    double start, secs;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (useRing) {
+        ring = rxring_open("lo", port);
+        if (ring == NULL || rxring_mute(fd) < 0) {
+            perror("  Cannot set up packet ring (needs CAP_NET_RAW)");
+            rxring_close(ring);
+            close(fd);
+            return;
+        }
+    }
+
+    atomic_store(&sending, 1);
+    start = nowSec();
+    pthread_create(&thr, NULL, sender, NULL);
+    for (;;) {
+        const Packet *p;
+        ssize_t n;
+
+        if (ring != NULL) {
+            const uint8_t *payload = NULL;
+            n = rxring_next(ring, &payload, &from);
+            p = (const Packet *)payload;
+        } else {
+            static Packet buf;
+            socklen_t len = sizeof(from);
+            n = recvfrom(fd, &buf, sizeof(buf), 0, (struct sockaddr *)&from, &len);
+            p = &buf;
+        }
+        if (consume(p, n, &good))
+            break;
+    }
+    secs = nowSec() - start;
+    atomic_store(&sending, 0);
+    pthread_join(thr, NULL);
+
+    printf("  %-22s %9.0f packets/s received, %lu of %lu lost (%.1f%%)\n",
+           ring != NULL ? "TPACKET_V3 ring" : "recvfrom()", good / secs,
+           total - good, total, 100.0 * (total - good) / total);
+    if (ring != NULL) {
+        rxring_stats_t st;
+        rxring_stats(ring, &st);
+        printf("  %-22s %llu dropped with the ring full\n", "",
+               (unsigned long long)st.kernel_drops);
+    }
+    rxring_close(ring);
+    close(fd);
+}
+
+// ---------- SO_REUSEPORT: one socket and pinned thread per receiver ----------
+
+typedef struct {
+    int fd;
+    unsigned index;
+    unsigned long good;
+    double last;                // time of the last good packet
+    pthread_t thread;
+} receiver_t;
+
+static void *receiver(void *arg) {
+    receiver_t *r = (receiver_t *)arg;
+    Packet buf;
+
+    net_pin_cpu(r->index);
+    for (;;) {
+        ssize_t n = recv(r->fd, &buf, sizeof(buf), 0);
+        if (n < 0) {
+            // Timed out: done once the sender is
+            if (atomic_load(&sent))
+                break;
+            continue;
+        }
+        if (validLength(&buf, n) && getChecksum(&buf) == buf.header.cksum) {
+            r->good++;
+            r->last = nowSec();
+        }
+    }
+    return NULL;
+}
+
+static void runReuseport(unsigned nrecv) {
+    receiver_t rx[MAX_RECEIVERS];
+    struct timeval timeout = { 0, 100000 };
+    int bufsize = 4 << 20, nsock = SOURCE_PORTS;
+    unsigned long good = 0;
+    double start, last = 0;
+    pthread_t thr;
+    char spread[256];
+    int len = 0;
+
+    for (unsigned i = 0; i < nrecv; i++) {
+        rx[i] = (receiver_t){ .index = i };
+        rx[i].fd = net_bind(SOCK_DGRAM, port, NET_REUSEPORT | NET_IPV4);
+        if (rx[i].fd < 0) {
+            perror("bind");
+            exit(1);
+        }
+        setsockopt(rx[i].fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+        setsockopt(rx[i].fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    if (steer && net_steer_by_cpu(rx[0].fd, nrecv) < 0) {
+        perror("Cannot attach the steering program");
+        exit(1);
+    }
+
+    atomic_store(&sent, 0);
+    start = nowSec();
+    for (unsigned i = 0; i < nrecv; i++)
+        pthread_create(&rx[i].thread, NULL, receiver, &rx[i]);
+    pthread_create(&thr, NULL, sender, &nsock);
+    pthread_join(thr, NULL);
+    for (unsigned i = 0; i < nrecv; i++) {
+        pthread_join(rx[i].thread, NULL);
+        good += rx[i].good;
+        last = rx[i].last > last ? rx[i].last : last;
+        len += snprintf(spread + len, sizeof(spread) - (size_t)len, "%s%lu", i ? "/" : "",
+                        rx[i].good * 100 / (total ? total : 1));
+        if ((size_t)len >= sizeof(spread))
+            len = sizeof(spread) - 1;
+        close(rx[i].fd);
+    }
+
+    printf("  %2u SO_REUSEPORT socket%s  %9.0f packets/s received, %lu of %lu lost (%.1f%%), "
+           "%% per socket %s\n", nrecv, nrecv > 1 ? "s" : " ", good / (last - start),
+           total - good, total, 100.0 * (total - good) / total, spread);
+}
+
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned maxRecv = cpus > 2 ? (unsigned)cpus : 2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:r:E")) != -1) {
+        switch (opt) {
+        case 'n': total = strtoul(optarg, NULL, 10); break;
+        case 'p': port = atoi(optarg); break;
+        case 'r': maxRecv = (unsigned)atoi(optarg); break;
+        case 'E': steer = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n packets] [-p port] [-r max_receivers] [-E]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (maxRecv > MAX_RECEIVERS)
+        maxRecv = MAX_RECEIVERS;
+
+    printf("%lu packets of %zu bytes to 127.0.0.1:%d\n", total, sizeof(Header) + DATA_SIZE, port);
+    run(0);
+    run(1);
+    printf("From %d source ports, %s, %ld CPU%s:\n", SOURCE_PORTS,
+           steer ? "steered by receiving CPU" : "spread by flow hash", cpus, cpus > 1 ? "s" : "");
+    for (unsigned n = 1; n <= maxRecv; n *= 2)
+        runReuseport(n);
+    return 0;
+}
@@ -0,0 +1,229 @@
+// AF_PACKET TPACKET_V3 receive ring (see rx_ring.h)
+//
+// The ring is RXRING_BLOCKS blocks. A block belongs to the kernel until its
+// status has TP_STATUS_USER; we then walk its packets and hand the block
+// back by setting TP_STATUS_KERNEL once the last payload has been used.
+// SOCK_DGRAM strips the link-layer header, so the filter and the parser
+// start at the IPv4 header on any kind of interface.
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+
+#include "rx_ring.h"
+
+struct rxring {
+    int fd;
+    uint8_t *map;
+    size_t map_len;
+    unsigned cur;                       // block being read
+    int holding;                        // block cur is ours
+    uint32_t left;                      // packets not yet read in it
+    struct tpacket3_hdr *next;          // next packet in it
+    rxring_stats_t stats;
+    // rxring_peek(): returned again by the next rxring_next()
+    int peeked;
+    ssize_t peek_len;
+    const uint8_t *peek_payload;
+    struct sockaddr_in peek_from;
+};
+
+static struct tpacket_block_desc *block(rxring_t *r, unsigned i) {
+    return (struct tpacket_block_desc *)(r->map + (size_t)i * RXRING_BLOCK_SIZE);
+}
+
+// Accept unfragmented IPv4/UDP to port; offsets are from the IP header
+static int attachFilter(int fd, int port) {
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),                  // protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 5),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),                  // flags + fragment offset
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 3, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                 // x = IP header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),                  // UDP destination port
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)port, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0x40000),
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+int rxring_mute(int sockfd) {
+    struct sock_filter drop = BPF_STMT(BPF_RET | BPF_K, 0);
+    struct sock_fprog prog = { 1, &drop };
+
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+int rxring_unmute(int sockfd) {
+    int unused = 0;
+
+    return setsockopt(sockfd, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof(unused));
+}
+
+rxring_t *rxring_open(const char *ifname, int port) {
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    int version = TPACKET_V3, err;
+    unsigned ifindex = if_nametoindex(ifname);
+    rxring_t *r;
+
+    if (ifindex == 0)
+        return NULL;
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+        return NULL;
+    r->map = MAP_FAILED;
+    // Protocol 0: nothing is captured until bind() names the interface
+    r->fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (r->fd < 0)
+        goto fail;
+    if (attachFilter(r->fd, port) < 0
+        || setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+        goto fail;
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RXRING_BLOCK_SIZE;
+    req.tp_block_nr = RXRING_BLOCKS;
+    req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    req.tp_frame_nr = RXRING_BLOCK_SIZE / req.tp_frame_size * RXRING_BLOCKS;
+    req.tp_retire_blk_tov = RXRING_BLOCK_TOV_MS;
+    if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+        goto fail;
+    r->map_len = (size_t)RXRING_BLOCK_SIZE * RXRING_BLOCKS;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, 0);
+    if (r->map == MAP_FAILED)
+        goto fail;
+
+#ifdef PACKET_IGNORE_OUTGOING
+    // On loopback every datagram is seen leaving and arriving; keep one
+    {
+        int one = 1;
+        setsockopt(r->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+    }
+#endif
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = (int)ifindex;
+    if (bind(r->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+        goto fail;
+    return r;
+
+fail:
+    err = errno;
+    rxring_close(r);
+    errno = err;
+    return NULL;
+}
+
+void rxring_close(rxring_t *r) {
+    if (r == NULL)
+        return;
+    if (r->map != MAP_FAILED)
+        munmap(r->map, r->map_len);
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+// Payload of an IPv4/UDP datagram for us, or -1 to skip the packet
+static ssize_t parse(struct tpacket3_hdr *h, const uint8_t **payload, struct sockaddr_in *from) {
+    const struct sockaddr_ll *sll =
+        (const struct sockaddr_ll *)((uint8_t *)h + TPACKET_ALIGN(sizeof(*h)));
+    const uint8_t *ip = (const uint8_t *)h + h->tp_net;
+    uint32_t caplen = h->tp_snaplen;
+    unsigned ihl, udplen;
+
+    if (sll->sll_pkttype == PACKET_OUTGOING || caplen < 20)
+        return -1;
+    ihl = (ip[0] & 0xf) * 4u;
+    if ((ip[0] >> 4) != 4 || ihl < 20 || caplen < ihl + 8)
+        return -1;
+    udplen = (unsigned)ip[ihl + 4] << 8 | ip[ihl + 5];
+    if (udplen < 8 || ihl + udplen > caplen)
+        return -1;
+
+    memset(from, 0, sizeof(*from));
+    from->sin_family = AF_INET;
+    memcpy(&from->sin_addr, ip + 12, 4);
+    memcpy(&from->sin_port, ip + ihl, 2);
+    *payload = ip + ihl + 8;
+    return (ssize_t)udplen - 8;
+}
+
+ssize_t rxring_next(rxring_t *r, const uint8_t **payload, struct sockaddr_in *from) {
+    if (r->peeked) {
+        // Its block is still held: nothing was read after it
+        r->peeked = 0;
+        *payload = r->peek_payload;
+        *from = r->peek_from;
+        return r->peek_len;
+    }
+    for (;;) {
+        struct tpacket_block_desc *b = block(r, r->cur);
+        struct tpacket3_hdr *h;
+        ssize_t n;
+
+        if (r->holding && r->left == 0) {
+            // Everything handed out from this block has been used: give it back
+            __atomic_store_n(&b->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+            r->holding = 0;
+            r->cur = (r->cur + 1) % RXRING_BLOCKS;
+            continue;
+        }
+        if (!r->holding) {
+            if (!(__atomic_load_n(&b->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+                struct pollfd pfd = { r->fd, POLLIN | POLLERR, 0 };
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                    return -1;
+                continue;
+            }
+            r->holding = 1;
+            r->left = b->hdr.bh1.num_pkts;
+            r->next = (struct tpacket3_hdr *)((uint8_t *)b + b->hdr.bh1.offset_to_first_pkt);
+            continue;
+        }
+
+        h = r->next;
+        r->left--;
+        r->next = (struct tpacket3_hdr *)((uint8_t *)h + h->tp_next_offset);
+        if ((n = parse(h, payload, from)) >= 0) {
+            r->stats.packets++;
+            return n;
+        }
+    }
+}
+
+ssize_t rxring_peek(rxring_t *r, const uint8_t **payload, struct sockaddr_in *from) {
+    ssize_t n = rxring_next(r, payload, from);
+
+    if (n >= 0) {
+        r->peeked = 1;
+        r->peek_len = n;
+        r->peek_payload = *payload;
+        r->peek_from = *from;
+    }
+    return n;
+}
+
+void rxring_stats(rxring_t *r, rxring_stats_t *st) {
+    struct tpacket_stats_v3 ks;
+    socklen_t len = sizeof(ks);
+
+    // The kernel resets its counters on every read
+    if (getsockopt(r->fd, SOL_PACKET, PACKET_STATISTICS, &ks, &len) == 0)
+        r->stats.kernel_drops += ks.tp_drops;
+    *st = r->stats;
+}
@@ -0,0 +1,48 @@
+// Receive path for udp_server that bypasses the UDP socket layer
+//
+// An AF_PACKET socket with a TPACKET_V3 ring mapped into the process: the
+// kernel copies each IPv4/UDP datagram for our port (selected by a BPF
+// filter) into shared ring memory, and rxring_next() hands out a pointer to
+// the payload there. No recvfrom() per datagram and no copy into a user
+// buffer; the caller checks and writes the data straight from the ring.
+//
+// The kernel passes the ring a block at a time, when the block is full or
+// RXRING_BLOCK_TOV_MS after its first packet, so it suits a sender that
+// streams packets. Needs CAP_NET_RAW. Works on any interface, including
+// loopback and veth pairs.
+#ifndef RX_RING_H
+#define RX_RING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define RXRING_BLOCK_SIZE   (1 << 20)
+#define RXRING_BLOCKS       16
+#define RXRING_BLOCK_TOV_MS 1
+
+typedef struct rxring rxring_t;
+
+typedef struct {
+    uint64_t packets;       // datagrams delivered by rxring_next()
+    uint64_t kernel_drops;  // dropped because the ring was full
+} rxring_stats_t;
+
+// Ring on interface ifname for UDP datagrams to port; NULL with errno set
+rxring_t *rxring_open(const char *ifname, int port);
+void rxring_close(rxring_t *ring);
+
+// Wait for the next datagram. *payload points into the ring and stays
+// valid until the next call. Returns the payload length or -1.
+ssize_t rxring_next(rxring_t *ring, const uint8_t **payload, struct sockaddr_in *from);
+// The same, but the next rxring_next() returns this datagram again
+ssize_t rxring_peek(rxring_t *ring, const uint8_t **payload, struct sockaddr_in *from);
+
+void rxring_stats(rxring_t *ring, rxring_stats_t *st);
+
+// Keep datagrams from queueing on a UDP socket that now only sends
+int rxring_mute(int sockfd);
+// Undo rxring_mute(): the socket receives again
+int rxring_unmute(int sockfd);
+
+#endif
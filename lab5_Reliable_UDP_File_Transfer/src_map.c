@@ -0,0 +1,68 @@
+// Memory-mapped source file (see src_map.h)
+#define _DEFAULT_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "src_map.h"
+
+static uint64_t pageDown(uint64_t off) {
+    static uint64_t page;
+    if (page == 0)
+        page = (uint64_t)sysconf(_SC_PAGESIZE);
+    return off & ~(page - 1);
+}
+
+int srcmap_open(srcmap_t *m, int fd) {
+    struct stat st;
+    void *p;
+
+    memset(m, 0, sizeof(*m));
+    m->fd = fd;
+    if (fstat(fd, &st) < 0)
+        return -1;
+    m->size = (uint64_t)st.st_size;
+    if (!S_ISREG(st.st_mode) || st.st_size == 0)
+        return 0;
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return 0;
+    madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+    m->base = p;
+    return 0;
+}
+
+void srcmap_close(srcmap_t *m) {
+    if (m->base != NULL)
+        munmap((void *)m->base, (size_t)m->size);
+    m->base = NULL;
+}
+
+// Keep SRCMAP_AHEAD bytes in front of off prefetched and drop what is far
+// behind it; both in steps of half the window, not per packet
+static void slide(srcmap_t *m, uint64_t off) {
+    if (off + SRCMAP_AHEAD / 2 > m->ahead && m->ahead < m->size) {
+        uint64_t start = pageDown(off > m->ahead ? off : m->ahead);
+        uint64_t end = off + SRCMAP_AHEAD < m->size ? off + SRCMAP_AHEAD : m->size;
+        madvise((void *)(m->base + start), (size_t)(end - start), MADV_WILLNEED);
+        m->ahead = end;
+    }
+    if (off >= m->behind + 2 * (uint64_t)SRCMAP_AHEAD) {
+        uint64_t end = pageDown(off - SRCMAP_AHEAD);
+        madvise((void *)(m->base + m->behind), (size_t)(end - m->behind), MADV_DONTNEED);
+        m->behind = end;
+    }
+}
+
+ssize_t srcmap_read(srcmap_t *m, uint64_t off, void *buf, size_t len) {
+    if (m->base == NULL)
+        return pread(m->fd, buf, len, (off_t)off);
+    if (off >= m->size)
+        return 0;
+    if (len > m->size - off)
+        len = (size_t)(m->size - off);
+    slide(m, off);
+    memcpy(buf, m->base + off, len);
+    return (ssize_t)len;
+}
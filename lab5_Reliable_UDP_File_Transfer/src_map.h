@@ -0,0 +1,38 @@
+// Source file access for udp_client: the file is mmap()ed and packets are
+// filled from the mapping, so sending needs no read() per packet
+//
+// The kernel is told the access is sequential (MADV_SEQUENTIAL: larger
+// read-ahead, pages dropped early) and a window of SRCMAP_AHEAD bytes in
+// front of the sender is prefetched with MADV_WILLNEED, so page faults are
+// rare even for files much larger than RAM. Pages more than SRCMAP_AHEAD
+// behind the sender are unmapped again (MADV_DONTNEED; the page cache is
+// untouched). A retransmission resends the packet already built, so no
+// part of the file is read twice.
+//
+// Files that cannot be mapped (empty, pipes, /proc) are read with pread().
+// A mapped file must not shrink while it is sent (SIGBUS). One thread at a
+// time per srcmap_t.
+#ifndef SRC_MAP_H
+#define SRC_MAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SRCMAP_AHEAD (8u << 20)
+
+typedef struct {
+    int fd;
+    const char *base;       // NULL: not mapped, pread() instead
+    uint64_t size;
+    uint64_t ahead;         // prefetched up to here
+    uint64_t behind;        // unmapped below here
+} srcmap_t;
+
+// Map fd (size from fstat); 0, or -1 if even fstat fails
+int srcmap_open(srcmap_t *m, int fd);
+void srcmap_close(srcmap_t *m);
+
+// Copy up to len bytes at off into buf; bytes copied, 0 at the end, -1 on error
+ssize_t srcmap_read(srcmap_t *m, uint64_t off, void *buf, size_t len);
+
+#endif
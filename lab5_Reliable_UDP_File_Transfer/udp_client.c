@@ -1,5 +1,20 @@
 // UDP client with stop-and-wait rdt3.0 protocol
 // Packets have checksum, sequence number, acknowledgement number, and timer
+// With -d the file digest is announced up front and sent as a trailer so the
+// server can verify the received file without re-reading it
+// Per-packet logging only with -v (see log.h)
+// With -m the file is striped across several server ports: one stop-and-wait
+// channel per path, each packet carrying its file offset, and a scheduler
+// that hands segments to the paths that deliver them fastest
+// With -r it first asks the server (udp_server -r) which chunks it is
+// missing from an interrupted transfer and sends only those
+// The source file is memory-mapped and packets are filled from the mapping
+// with read-ahead in front of the sender (see src_map.h)
+// The server is a host name or an IPv4 or IPv6 address (see net.h)
+// With -w each path keeps up to that many packets in flight, in the compact
+// version 1 format (see wire.h): the server ACKs them together, listing
+// the ones it has, and the sender resends the ones it is missing
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,71 +23,54 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
-// Header: sequence/acknowledgement number, checksum, and length of packet
-typedef struct {
-    int seq_ack;
-    int len;
-    int cksum;
-} Header;
+#include "rdt.h"
+#include "src_map.h"
+#include "digest.h"
+#include "metrics.h"
+#include "log.h"
+#include "net.h"
+#include "wire.h"
 
-// Packet: header + data
-typedef struct {
-    Header header;
-    char data[10];
-} Packet;
+// Counted for the summary at exit
+int mSent, mTimeouts, mBadAcks;
 
-// Calculate checksum (longitudinal parity - XOR of all bytes)
-// Checksum field must be 0 when computing
-int getChecksum(Packet packet) {
-    packet.header.cksum = 0;
-    int checksum = 0;
-    char *ptr = (char *)&packet;
-    char *end = ptr + sizeof(Header) + packet.header.len;
-    while (ptr < end) {
-        checksum ^= *ptr++;
-    }
-    return checksum;
-}
-
-// Print received packet
-void printPacket(Packet packet) {
-    printf("Packet{ header: { seq_ack: %d, len: %d, cksum: %d }, data: \"",
-            packet.header.seq_ack,
-            packet.header.len,
-            packet.header.cksum);
-    fwrite(packet.data, (size_t)packet.header.len, 1, stdout);
-    printf("\" }\n");
-}
+// The file being sent
+srcmap_t source;
 
 // Client sends packet with checksum and sequence number,
 // waits for acknowledgement with select() timer, retransmits on timeout or bad ACK
+// Only the header and len data bytes go on the wire
 void clientSend(int sockfd, const struct sockaddr *address, socklen_t addrlen,
-                Packet packet, unsigned retries) {
+                Packet *packet, unsigned retries) {
     (void)retries;  /* unused, retry until ACK received */
     while (1) {
         // Calculate and set checksum
-        packet.header.cksum = getChecksum(packet);
+        packet->header.cksum = getChecksum(packet);
 
         // Simulate loss: sometimes send wrong checksum (bit error)
         if (rand() % 5 == 0) {
-            packet.header.cksum = 0;  // Corrupt checksum
-            printf("Client: Simulating corrupted checksum\n");
+            packet->header.cksum = 0;  // Corrupt checksum
+            log_debug("Client: Simulating corrupted checksum");
         }
 
         // Simulate packet loss (probability = 20%)
         if (rand() % 5 == 0) {
-            printf("Dropping packet\n");
+            log_debug("Dropping packet");
         } else {
-            printf("Client sending packet (seq=%d, len=%d)\n",
-                   packet.header.seq_ack, packet.header.len);
-            sendto(sockfd, &packet, sizeof(packet), 0, address, addrlen);
+            log_debug("Client sending packet (seq=%d, len=%d)",
+                      packet->header.seq_ack, packet->header.len);
+            sendto(sockfd, packet, PACKET_WIRE_SIZE(packet), 0, address, addrlen);
+            metrics_inc(mSent);
         }
 
         // Wait for ACK using select()
@@ -87,102 +85,1013 @@ void clientSend(int sockfd, const struct sockaddr *address, socklen_t addrlen,
         int rv = select(sockfd + 1, &readfds, NULL, NULL, &tv);
 
         if (rv == 0) {
-            printf("Timeout\n");
+            metrics_inc(mTimeouts);
+            log_debug("Timeout");
             retries++;
         } else if (rv > 0) {
-            // Receive ACK from server
+            // Receive ACK from server (header only, but accept a full packet)
             Packet recvpacket;
             socklen_t recv_addrlen = addrlen;
             ssize_t n = recvfrom(sockfd, &recvpacket, sizeof(recvpacket), 0,
                                  (struct sockaddr *)address, &recv_addrlen);
 
-            if (n < 0) {
-                printf("Client: recvfrom error\n");
+            if (n < (ssize_t)sizeof(Header)) {
+                log_debug("Client: recvfrom error");
                 retries++;
                 continue;
             }
 
-            printf("Client received ACK %d, checksum %d\n",
-                   recvpacket.header.seq_ack, recvpacket.header.cksum);
+            log_debug("Client received ACK %d, checksum %d",
+                      recvpacket.header.seq_ack, recvpacket.header.cksum);
 
             // Verify checksum of received ACK
-            int expected_cksum = getChecksum(recvpacket);
+            int expected_cksum = getChecksum(&recvpacket);
 
             if (recvpacket.header.cksum != expected_cksum) {
-                printf("Client: Bad checksum, expected checksum was: %d\n",
-                       expected_cksum);
+                metrics_inc(mBadAcks);
+                log_debug("Client: Bad checksum, expected checksum was: %d",
+                          expected_cksum);
                 retries++;
-            } else if (recvpacket.header.seq_ack != packet.header.seq_ack) {
-                printf("Client: Bad seqnum, expected sequence number was: %d\n",
-                       packet.header.seq_ack);
+            } else if ((recvpacket.header.seq_ack & SEQ_MASK)
+                       != (packet->header.seq_ack & SEQ_MASK)) {
+                log_debug("Client: Bad seqnum, expected sequence number was: %d",
+                          packet->header.seq_ack & SEQ_MASK);
                 retries++;
             } else {
-                printf("Client: Good ACK\n");
+                log_debug("Client: Good ACK");
                 break;
             }
         } else {
-            printf("Client: select error\n");
+            log_debug("Client: select error");
             retries++;
         }
     }
 }
 
+// Send digest bytes (announcement or trailer) as FLAG_DIGEST packets
+int sendDigestPackets(int sockfd, const struct sockaddr *address, socklen_t addrlen,
+                      const unsigned char *bytes, size_t len, int seq) {
+    Packet packet;
+    size_t off = 0;
+
+    while (off < len) {
+        size_t n = len - off < DATA_SIZE ? len - off : DATA_SIZE;
+        memset(&packet, 0, sizeof(packet));
+        packet.header.seq_ack = seq | FLAG_DIGEST;
+        packet.header.len = (int)n;
+        memcpy(packet.data, bytes + off, n);
+        clientSend(sockfd, address, addrlen, &packet, 0);
+        seq = (seq + 1) % 2;
+        off += n;
+    }
+    return seq;
+}
+
+// ---------- Multipath (-m) ----------
+
+// RTO bounds (seconds); a path starts at MP_RTO_INIT until it has an RTT sample
+#define MP_RTO_INIT 0.2
+#define MP_RTO_MIN  0.005
+#define MP_RTO_MAX  1.0
+// A timeout doubles the RTO, up to this many times the one from the estimate
+#define MP_BACKOFF_MAX 16
+#define MP_LOSS_GAIN 0.125
+// How long the server keeps answering after the last end packet (its MP_LINGER_MS)
+#define MP_END_WAIT 2.0
+
+// -w: a version 1 packet in flight, in slot pn % window of its path
+typedef struct {
+    uint8_t *buf;                   // the packet as sent, WIRE_MAX_PACKET bytes
+    size_t len;
+    double sentAt;                  // last (re)transmission
+    double dueAt;                   // -m delay: goes on the wire then; 0 once sent
+    int transmissions;
+    bool acked;
+} slot_t;
+
+// A packet is lost once this many later ones have been ACKed (and a round
+// trip has passed since it was sent)
+#define WIRE_REORDER 3
+
+// One server endpoint: its own socket, sequence bit, RTT estimate and
+// emulated impairment (extra one-way delay, extra loss on top of the 20%
+// every clientSend() applies)
+typedef struct {
+    char name[80];
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    int sock;
+    int delayMs, lossPct;
+    unsigned rng;
+    int seq;
+    pthread_t thread;
+    // Below: written under stripeLock, read by the scheduler
+    double srtt, rttvar, rto;       // seconds; srtt 0 until the first sample
+    double loss;                    // EWMA of sends not ACKed in time
+    unsigned long sent, timeouts, segments;
+    // -w: packets in flight; 1 for stop-and-wait
+    int window;
+    slot_t *slots;
+    uint64_t base, next;            // oldest packet not ACKed, next new one
+    uint64_t largestAcked;          // one past the highest ACKed
+    double timedOutAt;              // last retransmission timeout
+    unsigned long retransmits, acks;
+} path_t;
+
+path_t paths[MP_MAX_PATHS];
+int npaths;
+
+// Byte range [off, end) of the file still to be sent
+typedef struct {
+    uint64_t off, end;
+} range_t;
+
+// The ranges are handed out to the paths in order, a segment at a time
+pthread_mutex_t stripeLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stripeCond = PTHREAD_COND_INITIALIZER;
+range_t *stripeRanges;
+int stripeCount, stripeCur;
+uint64_t stripeOffset, stripeLeft, stripeSent;
+digest_ctx_t *stripeDigest;         // NULL when not sending the file in order
+
+// -r: ask the server what it is missing first
+int resume;
+// -w: packets in flight per path
+int window = 1;
+
+double nowSec(void) {
+    return metrics_now_ns() / 1e9;
+}
+
+// Expected time for p to deliver one segment, from handing it out; 0
+// while p has no RTT sample, so every path is tried at least once
+double pathLatency(const path_t *p) {
+    double loss = p->loss < 0.9 ? p->loss : 0.9;
+    return p->srtt / (1.0 - loss);
+}
+
+// Time p takes to deliver n segments: a window's worth per latency
+double pathCost(const path_t *p, uint64_t n) {
+    return (double)((n + (uint64_t)p->window - 1) / (uint64_t)p->window) * pathLatency(p);
+}
+
+// RFC 6298 estimator, called with stripeLock held
+void pathSample(path_t *p, double rtt) {
+    if (p->srtt == 0) {
+        p->srtt = rtt;
+        p->rttvar = rtt / 2;
+    } else {
+        double err = p->srtt > rtt ? p->srtt - rtt : rtt - p->srtt;
+        p->rttvar = 0.75 * p->rttvar + 0.25 * err;
+        p->srtt = 0.875 * p->srtt + 0.125 * rtt;
+    }
+}
+
+// RTO from the estimate alone, called with stripeLock held. Before its
+// first sample a path borrows the largest RTO of the paths that have one,
+// less their emulated delay and plus its own: an ACK lost from the first
+// window would otherwise cost MP_RTO_INIT, doubled on every further loss.
+double pathBaseRto(const path_t *p) {
+    double rto = -1;
+
+    if (p->srtt > 0) {
+        rto = p->srtt + 4 * p->rttvar;
+    } else {
+        for (int i = 0; i < npaths; i++) {
+            const path_t *o = &paths[i];
+            double r = o->srtt + 4 * o->rttvar + (p->delayMs - o->delayMs) / 1000.0;
+            if (o->srtt > 0 && r > rto)
+                rto = r;
+        }
+        if (rto < 0)
+            return MP_RTO_INIT;
+    }
+    return rto < MP_RTO_MIN ? MP_RTO_MIN : rto > MP_RTO_MAX ? MP_RTO_MAX : rto;
+}
+
+// Drop any backoff. Done on every ACK, not only on a new sample: losses
+// here are random, not congestion, and holding a backed-off timer until the
+// next clean round trip stalls the path.
+void pathResetRto(path_t *p) {
+    p->rto = pathBaseRto(p);
+}
+
+// Back off after a timeout, called with stripeLock held. Both ends drop
+// and corrupt a fifth of their packets, so a round trip fails more often
+// than not and runs of timeouts are common; backing off without a bound
+// would leave a path's last packet waiting for MP_RTO_MAX.
+void pathBackoff(path_t *p) {
+    double limit = pathBaseRto(p) * MP_BACKOFF_MAX;
+
+    if (limit > MP_RTO_MAX)
+        limit = MP_RTO_MAX;
+    p->rto = p->rto * 2 > limit ? limit : p->rto * 2;
+}
+
+// clientSend() for one path: same loss simulation, but the timer is the
+// path's RTO, doubled on every timeout, and only ACKs of first
+// transmissions give RTT samples (Karn's rule). The ACK goes to reply
+// unless it is NULL.
+void pathSend(path_t *p, Packet *packet, Packet *reply) {
+    int cksum = getChecksum(packet);
+    int attempt = 0;
+
+    while (1) {
+        double sentAt = nowSec(), rto;
+
+        packet->header.cksum = cksum;
+        if (rand_r(&p->rng) % 5 == 0) {
+            packet->header.cksum = 0;
+            log_debug("%s: Simulating corrupted checksum", p->name);
+        }
+        if (rand_r(&p->rng) % 5 == 0 || (int)(rand_r(&p->rng) % 100) < p->lossPct) {
+            log_debug("%s: Dropping packet", p->name);
+        } else {
+            if (p->delayMs > 0)
+                usleep((useconds_t)p->delayMs * 1000);
+            log_debug("%s: sending packet (seq=%d, len=%d)", p->name,
+                      packet->header.seq_ack, packet->header.len);
+            sendto(p->sock, packet, PACKET_WIRE_SIZE(packet), 0,
+                   (struct sockaddr *)&p->addr, p->addrLen);
+            metrics_inc(mSent);
+        }
+        attempt++;
+        pthread_mutex_lock(&stripeLock);
+        p->sent++;
+        rto = p->rto;
+        pthread_mutex_unlock(&stripeLock);
+
+        // Wait for the ACK; a bad one means resend now, as in clientSend()
+        int acked = 0, timedOut = 0;
+        while (!acked) {
+            int left = (int)((sentAt + rto - nowSec()) * 1000);
+            struct pollfd pfd = { p->sock, POLLIN, 0 };
+            Packet ack;
+
+            if (left <= 0 || poll(&pfd, 1, left) == 0) {
+                timedOut = 1;
+                break;
+            }
+            if (recv(p->sock, &ack, sizeof(ack), 0) < (ssize_t)sizeof(Header))
+                break;
+            if (ack.header.cksum != getChecksum(&ack)) {
+                metrics_inc(mBadAcks);
+                log_debug("%s: Bad ACK checksum", p->name);
+                break;
+            }
+            // A late ACK for the previous packet: keep waiting
+            acked = (ack.header.seq_ack & SEQ_MASK) == (packet->header.seq_ack & SEQ_MASK);
+            if (acked && reply != NULL)
+                memcpy(reply, &ack, sizeof(ack));
+        }
+
+        pthread_mutex_lock(&stripeLock);
+        if (acked) {
+            if (attempt == 1)
+                pathSample(p, nowSec() - sentAt);
+            pathResetRto(p);
+            p->loss *= 1 - MP_LOSS_GAIN;
+        } else if (timedOut) {
+            metrics_inc(mTimeouts);
+            p->timeouts++;
+            p->loss = p->loss * (1 - MP_LOSS_GAIN) + MP_LOSS_GAIN;
+            pathBackoff(p);
+            log_debug("%s: Timeout, RTO now %.0f ms", p->name, p->rto * 1000);
+        }
+        pthread_mutex_unlock(&stripeLock);
+        if (acked)
+            return;
+    }
+}
+
+// Next segment for p: up to MP_PAYLOAD file bytes into buf and their
+// offset. Returns the bytes, 0 when the file has been handed out, or -1
+// instead of waiting when wait is false. Near the end of the file a path
+// waits rather than take a segment that a faster path would deliver
+// sooner, even after the rest of its queue.
+ssize_t claimSegment(path_t *p, bool wait, char *buf, uint64_t *offset) {
+    pthread_mutex_lock(&stripeLock);
+    while (stripeLeft > 0) {
+        uint64_t left = (stripeLeft + MP_PAYLOAD - 1) / MP_PAYLOAD;
+        double mine = pathLatency(p), best = 0;
+        for (int i = 0; i < npaths; i++) {
+            double c = pathCost(&paths[i], left);
+            if (&paths[i] != p && c > 0 && (best == 0 || c < best))
+                best = c;
+        }
+        if (mine == 0 || best == 0 || best >= mine)
+            break;
+        if (!wait) {
+            pthread_mutex_unlock(&stripeLock);
+            return -1;
+        }
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += (long)(best * 1e9);
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&stripeCond, &stripeLock, &until);
+    }
+    if (stripeLeft == 0) {
+        pthread_mutex_unlock(&stripeLock);
+        return 0;
+    }
+    if (stripeOffset >= stripeRanges[stripeCur].end)
+        stripeOffset = stripeRanges[++stripeCur].off;
+
+    uint64_t end = stripeRanges[stripeCur].end;
+    size_t want = end - stripeOffset < MP_PAYLOAD ? end - stripeOffset : MP_PAYLOAD;
+    ssize_t n = srcmap_read(&source, stripeOffset, buf, want);
+    if (n <= 0) {
+        // File shrank under us: send what we have
+        log_warn("Cannot read %s at offset %llu", p->name, (unsigned long long)stripeOffset);
+        stripeLeft = 0;
+        pthread_cond_broadcast(&stripeCond);
+        pthread_mutex_unlock(&stripeLock);
+        return 0;
+    }
+    *offset = stripeOffset;
+    if (stripeDigest != NULL)
+        digest_update(stripeDigest, buf, (size_t)n);
+    stripeOffset += (uint64_t)n;
+    stripeLeft = (uint64_t)n < stripeLeft ? stripeLeft - (uint64_t)n : 0;
+    stripeSent += (uint64_t)n;
+    p->segments++;
+    pthread_cond_broadcast(&stripeCond);
+    pthread_mutex_unlock(&stripeLock);
+    return n;
+}
+
+// Next segment for p into packet; 0 when the file has been handed out
+int takeSegment(path_t *p, Packet *packet) {
+    uint64_t offset;
+    ssize_t n = claimSegment(p, true, packet->data + MP_OFFSET_SIZE, &offset);
+
+    if (n <= 0)
+        return 0;
+    putOffset(packet, offset);
+    packet->header.seq_ack = p->seq | FLAG_MP;
+    packet->header.len = MP_OFFSET_SIZE + (int)n;
+    return 1;
+}
+
+void *pathThread(void *arg) {
+    path_t *p = arg;
+    Packet packet;
+
+    while (takeSegment(p, &packet)) {
+        pathSend(p, &packet, NULL);
+        p->seq ^= 1;
+    }
+    return NULL;
+}
+
+// ---------- Windowed sending (-w) ----------
+
+// Put slot s on the wire (or in the -m delay line), through the same loss
+// and corruption simulation as pathSend()
+void wireTransmit(path_t *p, slot_t *s) {
+    double now = nowSec();
+
+    s->sentAt = now;
+    s->dueAt = 0;
+    s->transmissions++;
+    pthread_mutex_lock(&stripeLock);
+    p->sent++;
+    pthread_mutex_unlock(&stripeLock);
+    if (rand_r(&p->rng) % 5 == 0 || (int)(rand_r(&p->rng) % 100) < p->lossPct) {
+        log_debug("%s: Dropping packet", p->name);
+        return;
+    }
+    if (p->delayMs > 0) {
+        s->dueAt = now + p->delayMs / 1000.0;
+        return;
+    }
+    if (rand_r(&p->rng) % 5 == 0) {
+        s->buf[s->len - 1] ^= 0xff;
+        log_debug("%s: Simulating corrupted checksum", p->name);
+        sendto(p->sock, s->buf, s->len, 0, (struct sockaddr *)&p->addr, p->addrLen);
+        s->buf[s->len - 1] ^= 0xff;
+    } else {
+        sendto(p->sock, s->buf, s->len, 0, (struct sockaddr *)&p->addr, p->addrLen);
+    }
+    metrics_inc(mSent);
+}
+
+// Send the packets whose -m delay is over; seconds until the next is, or -1
+double wireSendDue(path_t *p) {
+    double now = nowSec(), next = -1;
+
+    for (uint64_t pn = p->base; pn < p->next; pn++) {
+        slot_t *s = &p->slots[pn % p->window];
+        if (s->acked || s->dueAt == 0)
+            continue;
+        if (s->dueAt > now) {
+            next = next < 0 || s->dueAt - now < next ? s->dueAt - now : next;
+            continue;
+        }
+        s->dueAt = 0;
+        sendto(p->sock, s->buf, s->len, 0, (struct sockaddr *)&p->addr, p->addrLen);
+        metrics_inc(mSent);
+    }
+    return next;
+}
+
+// Slot for the next packet number (the window has room); its packet is
+// built in the slot and handed to wireQueue()
+slot_t *wireSlot(path_t *p) {
+    return &p->slots[p->next % p->window];
+}
+
+void wireQueue(path_t *p, size_t len) {
+    slot_t *s = wireSlot(p);
+
+    s->len = len;
+    s->transmissions = 0;
+    s->acked = false;
+    p->next++;
+    wireTransmit(p, s);
+}
+
+// Apply an ACK: mark what it covers, take an RTT sample from the newest
+// packet it newly covers, slide the window, and resend packets
+// WIRE_REORDER or more below the highest ACKed. Retransmissions keep their
+// number, so the sample needs a packet sent once, and after the last
+// timeout: an ACK lost in a stall is only repeated when a resent packet
+// arrives, and would time the stall. (Not after the last retransmission of
+// any kind: under this much loss there nearly always is a recent one, and
+// a path would go without samples, stuck at MP_RTO_INIT.)
+void wireOnAck(path_t *p, const wire_ack_t *ack) {
+    double now = nowSec(), rtt = -1;
+    unsigned long newly = 0, lost = 0;
+
+    for (unsigned r = 0; r <= ack->nranges; r++) {
+        uint64_t from = r == 0 ? p->base : ack->start[r - 1];
+        uint64_t to = r == 0 ? ack->cum : ack->end[r - 1];
+        if (from < p->base)
+            from = p->base;
+        if (to > p->next)
+            to = p->next;
+        for (uint64_t pn = from; pn < to; pn++) {
+            slot_t *s = &p->slots[pn % p->window];
+            if (s->acked)
+                continue;
+            s->acked = true;
+            newly++;
+            if (s->transmissions == 1 && s->sentAt > p->timedOutAt)
+                rtt = now - s->sentAt - ack->delayUs / 1e6;
+        }
+        if (to > p->largestAcked)
+            p->largestAcked = to;
+    }
+    while (p->base < p->next && p->slots[p->base % p->window].acked)
+        p->base++;
+    p->acks++;
+
+    pthread_mutex_lock(&stripeLock);
+    if (rtt > 0)
+        pathSample(p, rtt);
+    if (newly > 0)
+        pathResetRto(p);
+    double srtt = p->srtt;
+    pthread_mutex_unlock(&stripeLock);
+
+    for (uint64_t pn = p->base; pn + WIRE_REORDER < p->largestAcked; pn++) {
+        slot_t *s = &p->slots[pn % p->window];
+        if (s->acked || now - s->sentAt < srtt)
+            continue;
+        log_debug("%s: Packet %llu lost, resending", p->name, (unsigned long long)pn);
+        wireTransmit(p, s);
+        lost++;
+    }
+
+    pthread_mutex_lock(&stripeLock);
+    for (unsigned long i = 0; i < newly; i++)
+        p->loss *= 1 - MP_LOSS_GAIN;
+    for (unsigned long i = 0; i < lost; i++)
+        p->loss = p->loss * (1 - MP_LOSS_GAIN) + MP_LOSS_GAIN;
+    p->retransmits += lost;
+    pthread_mutex_unlock(&stripeLock);
+}
+
+// Wait for ACKs, due packets or the retransmission timer, and handle what
+// comes; returns after one round
+void wireWait(path_t *p) {
+    double now = nowSec(), rto, wait;
+
+    // The receiver may hold its ACK back for WIRE_ACK_DELAY_MS
+    pthread_mutex_lock(&stripeLock);
+    if (p->srtt == 0 && p->timeouts == 0)
+        p->rto = pathBaseRto(p);
+    rto = p->rto + WIRE_ACK_DELAY_MS / 1000.0;
+    pthread_mutex_unlock(&stripeLock);
+
+    // The oldest transmission still waiting times out first (-1: none)
+    wait = -1;
+    for (uint64_t pn = p->base; pn < p->next; pn++) {
+        const slot_t *s = &p->slots[pn % p->window];
+        double left = s->sentAt + rto - now;
+        if (s->acked)
+            continue;
+        if (left < 0)
+            left = 0;
+        if (wait < 0 || left < wait)
+            wait = left;
+    }
+    double due = wireSendDue(p);
+    if (due >= 0 && (wait < 0 || due < wait))
+        wait = due;
+
+    struct pollfd pfd = { p->sock, POLLIN, 0 };
+    int ms = wait < 0 ? -1 : wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+    if (poll(&pfd, 1, ms) > 0) {
+        uint8_t buf[WIRE_MAX_ACK];
+        ssize_t n;
+        wire_ack_t ack;
+
+        while ((n = recv(p->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            if (wire_parse_ack(buf, (size_t)n, &ack) < 0) {
+                metrics_inc(mBadAcks);
+                log_debug("%s: Bad ACK", p->name);
+                continue;
+            }
+            log_debug("%s: ACK below %llu, %u ranges", p->name, (unsigned long long)ack.cum,
+                      ack.nranges);
+            wireOnAck(p, &ack);
+        }
+    }
+    wireSendDue(p);
+
+    // Timer: resend everything sent longer than an RTO ago, back off once
+    now = nowSec();
+    unsigned long expired = 0;
+    for (uint64_t pn = p->base; pn < p->next; pn++) {
+        slot_t *s = &p->slots[pn % p->window];
+        if (!s->acked && s->dueAt == 0 && now - s->sentAt >= rto) {
+            wireTransmit(p, s);
+            expired++;
+        }
+    }
+    if (expired > 0) {
+        metrics_inc(mTimeouts);
+        p->timedOutAt = now;
+        pthread_mutex_lock(&stripeLock);
+        p->timeouts++;
+        p->retransmits += expired;
+        p->loss = p->loss * (1 - MP_LOSS_GAIN) + MP_LOSS_GAIN;
+        pathBackoff(p);
+        log_debug("%s: Timeout, %lu resent, RTO now %.0f ms", p->name, expired, p->rto * 1000);
+        pthread_mutex_unlock(&stripeLock);
+    }
+}
+
+// Keep the window full of segments until the file is handed out and all
+// of p's packets are ACKed
+void *pathThreadWindowed(void *arg) {
+    path_t *p = arg;
+    bool handedOut = false;
+
+    while (!handedOut || p->base < p->next) {
+        while (!handedOut && p->next - p->base < (uint64_t)p->window) {
+            uint8_t *buf = wireSlot(p)->buf;
+            size_t hdr = wire_begin(buf, WIRE_DATA, p->next);
+            uint64_t offset;
+            char data[MP_PAYLOAD];
+            // Nothing in flight: no ACK to wait for, so wait for a segment
+            ssize_t n = claimSegment(p, p->base == p->next, data, &offset);
+
+            if (n < 0)
+                break;
+            if (n == 0) {
+                handedOut = true;
+                break;
+            }
+            hdr += wire_put_varint(buf + hdr, offset);
+            memcpy(buf + hdr, data, (size_t)n);
+            wireQueue(p, wire_finish(buf, hdr + (size_t)n));
+        }
+        if (p->base < p->next)
+            wireWait(p);
+    }
+    return NULL;
+}
+
+// Control packet of type (WIRE_DIGEST: a, b = algorithm, position; WIRE_END:
+// a = paths) with len bytes, sent once the window has room
+void wireSendControl(path_t *p, int type, uint64_t a, uint64_t b, const void *bytes, size_t len) {
+    while (p->next - p->base >= (uint64_t)p->window)
+        wireWait(p);
+
+    uint8_t *buf = wireSlot(p)->buf;
+    size_t n = wire_begin(buf, type, p->next);
+    n += wire_put_varint(buf + n, a);
+    if (type == WIRE_DIGEST)
+        n += wire_put_varint(buf + n, b);
+    memcpy(buf + n, bytes, len);
+    wireQueue(p, wire_finish(buf, n + len));
+}
+
+// Slots for p's window, their packet buffers in one block
+int wireAlloc(path_t *p) {
+    uint8_t *bufs;
+
+    p->slots = calloc((size_t)p->window, sizeof(slot_t));
+    bufs = malloc((size_t)p->window * WIRE_MAX_PACKET);
+    if (p->slots == NULL || bufs == NULL) {
+        free(p->slots);
+        free(bufs);
+        p->slots = NULL;
+        return -1;
+    }
+    for (int i = 0; i < p->window; i++)
+        p->slots[i].buf = bufs + (size_t)i * WIRE_MAX_PACKET;
+    return 0;
+}
+
+void wireFree(path_t *p) {
+    if (p->slots != NULL)
+        free(p->slots[0].buf);
+    free(p->slots);
+    p->slots = NULL;
+}
+
+// Wait until every packet of p is ACKed, or until nowSec() reaches until
+// (0: no limit); 0, or -1 if some are not
+int wireDrain(path_t *p, double until) {
+    while (p->base < p->next) {
+        if (until > 0 && nowSec() >= until)
+            return -1;
+        wireWait(p);
+    }
+    return 0;
+}
+
+// The end packets of all paths are waited for together, up to this time
+double endUntil;
+
+void *pathThreadEnd(void *arg) {
+    path_t *p = arg;
+
+    if (wireDrain(p, endUntil) < 0)
+        log_warn("%s: No ACK for the end packet", p->name);
+    return NULL;
+}
+
+// Control packets (digest, end) on one path
+void pathSendBytes(path_t *p, int flags, const unsigned char *bytes, size_t len) {
+    Packet packet;
+
+    for (size_t off = 0; off < len;) {
+        size_t n = len - off < DATA_SIZE ? len - off : DATA_SIZE;
+        packet.header.seq_ack = p->seq | flags;
+        packet.header.len = (int)n;
+        memcpy(packet.data, bytes + off, n);
+        pathSend(p, &packet, NULL);
+        p->seq ^= 1;
+        off += n;
+    }
+}
+
+// -r: ask the server on p which chunks of the file it is missing and make
+// them the ranges to send; -1 if it is not resuming
+int queryMissing(path_t *p, uint64_t size, uint64_t version) {
+    Packet packet, reply;
+    int cap = 16;
+    uint64_t from = 0;
+
+    stripeCount = 0;
+    if ((stripeRanges = malloc(cap * sizeof(range_t))) == NULL)
+        return -1;
+    while (from != RESUME_DONE) {
+        packet.header.seq_ack = p->seq | FLAG_RESUME;
+        packet.header.len = RESUME_QUERY_SIZE;
+        putU64(packet.data, size);
+        putU64(packet.data + 8, version);
+        putU64(packet.data + 16, from);
+        pathSend(p, &packet, &reply);
+        p->seq ^= 1;
+        if (!(reply.header.seq_ack & FLAG_RESUME) || reply.header.len < 8
+            || reply.header.len > DATA_SIZE)
+            return -1;
+
+        from = getU64(reply.data);
+        for (int off = 8; off + 16 <= reply.header.len; off += 16) {
+            uint64_t chunk = getU64(reply.data + off), count = getU64(reply.data + off + 8);
+            uint64_t start = chunk * MP_PAYLOAD, end = (chunk + count) * MP_PAYLOAD;
+            if (count == 0 || chunk > size / MP_PAYLOAD || start >= size)
+                return -1;
+            if (end > size)
+                end = size;
+            if (stripeCount == cap) {
+                range_t *more = realloc(stripeRanges, 2 * cap * sizeof(range_t));
+                if (more == NULL)
+                    return -1;
+                stripeRanges = more;
+                cap *= 2;
+            }
+            stripeRanges[stripeCount++] = (range_t){ start, end };
+            stripeLeft += end - start;
+        }
+    }
+    return 0;
+}
+
+// Digest of the whole file, read separately when it is not sent in order
+void digestFd(int fd, digest_ctx_t *digest) {
+    static char chunk[1 << 16];
+    off_t off = 0;
+    ssize_t n;
+
+    while ((n = pread(fd, chunk, sizeof(chunk), off)) > 0) {
+        digest_update(digest, chunk, (size_t)n);
+        off += n;
+    }
+}
+
+// Resolve host (a name, an IPv4 or an IPv6 address) into addr
+int resolve(const char *host, int port, struct sockaddr_storage *addr, socklen_t *len) {
+    return net_resolve(host, port, SOCK_DGRAM, addr, len);
+}
+
+// -m host:port[,delay_ms[,loss_pct]], an IPv6 address in brackets
+int addPath(const char *spec) {
+    char hostport[80], host[64];
+    const char *comma = strchr(spec, ',');
+    size_t n = comma != NULL ? (size_t)(comma - spec) : strlen(spec);
+    int port = 0, delayMs = 0, lossPct = 0;
+    path_t *p;
+
+    if (npaths == MP_MAX_PATHS || n >= sizeof(hostport))
+        return -1;
+    memcpy(hostport, spec, n);
+    hostport[n] = '\0';
+    if (net_split(hostport, host, sizeof(host), &port) < 0
+        || (comma != NULL && sscanf(comma, ",%d,%d", &delayMs, &lossPct) < 1)
+        || delayMs < 0 || lossPct < 0 || lossPct > 100)
+        return -1;
+    p = &paths[npaths];
+    if (resolve(host, port, &p->addr, &p->addrLen) < 0)
+        return -1;
+    snprintf(p->name, sizeof(p->name), "%s", hostport);
+    p->delayMs = delayMs;
+    p->lossPct = lossPct;
+    npaths++;
+    return 0;
+}
+
+// Stripe fd across all paths, then the digest trailer and an end packet on
+// every path; the server finishes when it has all the end packets
+int sendMultipath(int fd, digest_alg_t alg) {
+    struct stat st;
+    digest_ctx_t digest;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    for (int i = 0; i < npaths; i++) {
+        path_t *p = &paths[i];
+        p->sock = socket(p->addr.ss_family, SOCK_DGRAM, 0);
+        if (p->sock < 0)
+            return -1;
+        p->rng = (unsigned)time(NULL) ^ (unsigned)(i * 2654435761u);
+        p->rto = MP_RTO_INIT;
+        p->window = window;
+        if (window > 1 && wireAlloc(p) < 0)
+            return -1;
+    }
+
+    // Everything, unless the server has part of it from an interrupted run
+    stripeLeft = 0;
+    digest_init(&digest, alg);
+    stripeDigest = &digest;
+    if (resume) {
+        uint64_t version = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+        if (queryMissing(&paths[0], (uint64_t)st.st_size, version) < 0) {
+            free(stripeRanges);
+            log_error("Server is not resuming this transfer (start it with -r)");
+            errno = EPROTO;
+            return -1;
+        }
+        log_info("Resuming: %llu of %llu bytes already on the server",
+                 (unsigned long long)((uint64_t)st.st_size - stripeLeft),
+                 (unsigned long long)st.st_size);
+        stripeDigest = NULL;
+        if (alg != DIGEST_NONE)
+            digestFd(fd, &digest);
+    } else {
+        static range_t whole;
+        whole = (range_t){ 0, (uint64_t)st.st_size };
+        stripeRanges = &whole;
+        stripeCount = 1;
+        stripeLeft = whole.end;
+    }
+    stripeCur = 0;
+    stripeOffset = stripeCount > 0 ? stripeRanges[0].off : 0;
+
+    // Version 1 digest packets name the algorithm themselves
+    if (alg != DIGEST_NONE && window == 1) {
+        unsigned char id = (unsigned char)alg;
+        pathSendBytes(&paths[0], FLAG_DIGEST, &id, 1);
+    }
+
+    double start = nowSec();
+    for (int i = 0; i < npaths; i++)
+        pthread_create(&paths[i].thread, NULL, window > 1 ? pathThreadWindowed : pathThread,
+                       &paths[i]);
+    for (int i = 0; i < npaths; i++)
+        pthread_join(paths[i].thread, NULL);
+    double secs = nowSec() - start;
+
+    if (alg != DIGEST_NONE) {
+        unsigned char out[DIGEST_MAX_SIZE];
+        char hex[2 * DIGEST_MAX_SIZE + 1];
+        size_t len = digest_final(&digest, out);
+        if (window > 1) {
+            for (size_t off = 0; off < len; off += MP_PAYLOAD) {
+                size_t n = len - off < MP_PAYLOAD ? len - off : MP_PAYLOAD;
+                wireSendControl(&paths[0], WIRE_DIGEST, (uint64_t)alg, off, out + off, n);
+            }
+            wireDrain(&paths[0], 0);
+        } else {
+            pathSendBytes(&paths[0], FLAG_DIGEST, out, len);
+        }
+        digest_hex(out, len, hex);
+        log_info("Sent digest (%s): %s", digest_name(alg), hex);
+    }
+    if (window > 1) {
+        // All end packets go out first, then every path waits for its ACK
+        // at once: the server answers for MP_END_WAIT after the last one
+        // arrives, and an ACK lost all that time is not coming
+        for (int i = 0; i < npaths; i++)
+            wireSendControl(&paths[i], WIRE_END, (uint64_t)npaths, 0, NULL, 0);
+        endUntil = nowSec() + MP_END_WAIT;
+        for (int i = 0; i < npaths; i++)
+            pthread_create(&paths[i].thread, NULL, pathThreadEnd, &paths[i]);
+        for (int i = 0; i < npaths; i++)
+            pthread_join(paths[i].thread, NULL);
+    } else {
+        unsigned char count = (unsigned char)npaths;
+        for (int i = 0; i < npaths; i++)
+            pathSendBytes(&paths[i], FLAG_END, &count, 1);
+    }
+
+    log_info("File sent over %d paths: %llu bytes in %.2f s", npaths,
+             (unsigned long long)stripeSent, secs);
+    for (int i = 0; i < npaths; i++) {
+        path_t *p = &paths[i];
+        log_info("  %-21s %6lu segments, %6lu sent, %5lu timeouts, srtt %6.1f ms, loss %3.0f%%",
+                 p->name, p->segments, p->sent, p->timeouts, p->srtt * 1000, p->loss * 100);
+        if (window > 1)
+            log_info("  %-21s %6lu ACKs, %6lu resent", "", p->acks, p->retransmits);
+        close(p->sock);
+        wireFree(p);
+    }
+    if (resume)
+        free(stripeRanges);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        printf("Usage: %s <ip> <port> <srcfile>\n", argv[0]);
+    digest_alg_t alg = DIGEST_NONE;
+    digest_ctx_t digest;
+    int opt, verbose = 0;
+
+    // Path 0 is the positional endpoint, -m paths follow
+    npaths = 1;
+    while ((opt = getopt(argc, argv, "d:m:rvw:")) != -1) {
+        switch (opt) {
+        case 'd':
+            alg = digest_from_name(optarg);
+            if (alg == DIGEST_NONE) {
+                printf("Unknown digest: %s (use crc32c, xxh64 or blake3)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'm':
+            if (addPath(optarg) < 0) {
+                printf("Bad path %s (host:port[,delay_ms[,loss_pct]], at most %d paths)\n",
+                       optarg, MP_MAX_PATHS);
+                exit(1);
+            }
+            break;
+        case 'r':
+            if (DATA_SIZE < RESUME_QUERY_SIZE) {
+                printf("-r needs DATA_SIZE >= %d (make DATA_SIZE=1400)\n", RESUME_QUERY_SIZE);
+                exit(1);
+            }
+            resume = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            if (window < 1 || window > WIRE_WINDOW) {
+                printf("Window must be 1 to %d packets\n", WIRE_WINDOW);
+                exit(1);
+            }
+            break;
+        default:
+            printf("Usage: %s [-v] [-r] [-w window] [-d crc32c|xxh64|blake3] "
+                   "[-m host:port[,delay_ms[,loss_pct]]]... <host> <port> <srcfile>\n", argv[0]);
+            exit(0);
+        }
+    }
+    if (argc - optind != 3) {
+        printf("Usage: %s [-v] [-r] [-w window] [-d crc32c|xxh64|blake3] "
+               "[-m host:port[,delay_ms[,loss_pct]]]... <host> <port> <srcfile>\n", argv[0]);
         exit(0);
     }
+    argv += optind - 1;
+    log_init(verbose ? LOG_LVL_DEBUG : LOG_LVL_INFO, verbose ? LOG_TIMESTAMPS : 0);
+
+    mSent = metrics_counter("udp_client_packets_sent_total", "Packets sent, including retransmissions");
+    mTimeouts = metrics_counter("udp_client_timeouts_total", "ACK waits that timed out");
+    mBadAcks = metrics_counter("udp_client_bad_acks_total", "ACKs failing the checksum");
 
     srand((unsigned)time(NULL));
 
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Failed to create socket");
+    struct sockaddr_storage servAddr;
+    socklen_t addr_len;
+    if (resolve(argv[1], atoi(argv[2]), &servAddr, &addr_len) < 0) {
+        perror("Failed to resolve hostname");
         exit(1);
     }
 
-    struct sockaddr_in servAddr;
-    struct hostent *host;
-    host = gethostbyname(argv[1]);
-    if (host == NULL) {
-        perror("Failed to resolve hostname");
-        close(sockfd);
+    int sockfd = socket(servAddr.ss_family, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("Failed to create socket");
         exit(1);
     }
 
-    memset(&servAddr, 0, sizeof(servAddr));
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_port = htons(atoi(argv[2]));
-    memcpy(&servAddr.sin_addr, host->h_addr_list[0], host->h_length);
-
     int fp = open(argv[3], O_RDONLY);
-    if (fp < 0) {
+    if (fp < 0 || srcmap_open(&source, fp) < 0) {
         perror("Failed to open file");
         close(sockfd);
         exit(1);
     }
 
-    // Send file contents packet by packet
+    // Resuming and windows need the offsets of the multipath format, even on one path
+    if (npaths > 1 || resume || window > 1) {
+        paths[0].addr = servAddr;
+        paths[0].addrLen = addr_len;
+        snprintf(paths[0].name, sizeof(paths[0].name), "%s:%s", argv[1], argv[2]);
+        close(sockfd);
+        if (sendMultipath(fp, alg) < 0) {
+            perror("Multipath send failed");
+            exit(1);
+        }
+        srcmap_close(&source);
+        close(fp);
+        return 0;
+    }
+
+    // Send file contents packet by packet, copied from the mapping into one
+    // reused packet; retransmissions resend it as is
     int seq = 0;
-    socklen_t addr_len = sizeof(servAddr);
+    uint64_t offset = 0;
     Packet packet;
 
-    int bytes;
-    while ((bytes = read(fp, packet.data, sizeof(packet.data))) > 0) {
+    // Announce the digest algorithm before any file data
+    if (alg != DIGEST_NONE) {
+        unsigned char id = (unsigned char)alg;
+        seq = sendDigestPackets(sockfd, (struct sockaddr *)&servAddr, addr_len, &id, 1, seq);
+    }
+    digest_init(&digest, alg);
+
+    ssize_t bytes;
+    while ((bytes = srcmap_read(&source, offset, packet.data, sizeof(packet.data))) > 0) {
+        offset += (uint64_t)bytes;
         packet.header.seq_ack = seq;
-        packet.header.len = bytes;
-        clientSend(sockfd, (struct sockaddr *)&servAddr, addr_len, packet, 0);
+        packet.header.len = (int)bytes;
+        digest_update(&digest, packet.data, (size_t)bytes);
+        clientSend(sockfd, (struct sockaddr *)&servAddr, addr_len, &packet, 0);
         seq = (seq + 1) % 2;
     }
 
+    // Digest trailer
+    if (alg != DIGEST_NONE) {
+        unsigned char out[DIGEST_MAX_SIZE];
+        char hex[2 * DIGEST_MAX_SIZE + 1];
+        size_t len = digest_final(&digest, out);
+        seq = sendDigestPackets(sockfd, (struct sockaddr *)&servAddr, addr_len, out, len, seq);
+        digest_hex(out, len, hex);
+        log_info("Sent digest (%s): %s", digest_name(alg), hex);
+    }
+
     // Send zero-length packet to signal file complete
     Packet final;
     memset(&final, 0, sizeof(final));
     final.header.seq_ack = seq;
     final.header.len = 0;
-    final.header.cksum = getChecksum(final);
-    clientSend(sockfd, (struct sockaddr *)&servAddr, addr_len, final, 0);
+    final.header.cksum = getChecksum(&final);
+    clientSend(sockfd, (struct sockaddr *)&servAddr, addr_len, &final, 0);
+    log_info("File sent: %llu packets sent, %llu timeouts, %llu bad ACKs",
+             (unsigned long long)metrics_counter_value(mSent),
+             (unsigned long long)metrics_counter_value(mTimeouts),
+             (unsigned long long)metrics_counter_value(mBadAcks));
 
+    srcmap_close(&source);
     close(fp);
     close(sockfd);
     return 0;
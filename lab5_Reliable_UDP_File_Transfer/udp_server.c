@@ -1,4 +1,20 @@
 // UDP Server with stop-and-wait rdt3.0 protocol
+// Per-packet logging only with -v (see log.h); -M serves packet counters and
+// latency histograms in Prometheus format while the transfer runs (see metrics.h)
+// Received packets live in a buffer pool (see pool.h) and are passed by pointer
+// With -P <ifname> they are read from an AF_PACKET mmap ring instead and
+// checked and written straight from ring memory (see rx_ring.h)
+// Given several ports (5000,5001,...) it takes a multipath transfer from
+// udp_client -m: one stop-and-wait channel per port, each data packet
+// written at the file offset it carries
+// With -r the output file is kept across runs: a manifest next to it (see
+// manifest.h) records which chunks have arrived, and a client started with
+// -r asks for the missing ones and sends only those
+// Ports take IPv6 and IPv4 datagrams (see net.h); the -P ring reads IPv4 only
+// A windowed client (udp_client -w) sends the compact version 1 format (see
+// wire.h): the server tracks which packets arrived and ACKs them together,
+// one ACK per WIRE_ACK_EVERY packets or after WIRE_ACK_DELAY_MS
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +23,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -14,135 +31,592 @@
 #include <sys/select.h>
 #include <sys/types.h>
 
+#include "rdt.h"
+#include "rx_ring.h"
+#include "digest.h"
+#include "metrics.h"
+#include "log.h"
+#include "pool.h"
+#include "manifest.h"
+#include "net.h"
+#include "wire.h"
+
 #define PLOSTMSG 5
 
-typedef struct {
-    int seq_ack;
-    int len;
-    int cksum;
-} Header;
+// Receive buffers hold a version 0 or a version 1 packet
+#define RX_BUF_SIZE (sizeof(Packet) > WIRE_MAX_PACKET ? sizeof(Packet) : WIRE_MAX_PACKET)
 
-typedef struct {
-    Header header;
-    char data[10];
-} Packet;
+// Metric ids, registered in registerMetrics()
+int mReceived, mShort, mBadChecksum, mBadSeq, mAcksSent, mAcksDropped, mAcksCorrupted;
+int mBytesWritten, hHandleTime, hDeliveryGap;
+
+// Receive buffers
+pool_t *packetPool;
+// -P: packet ring replacing recvfrom()
+rxring_t *ring;
+// -r: output file path and the manifest of the transfer into it
+const char *resumePath;
+manifest_t *manifest;
+uint64_t resumeSize, resumeVersion;
 
-int getChecksum(Packet packet) {
-    packet.header.cksum = 0;
-    int checksum = 0;
-    char *ptr = (char *)&packet;
-    char *end = ptr + sizeof(Header) + packet.header.len;
-    while (ptr < end) {
-        checksum ^= *ptr++;
+// Send an ACK (seq_ack and len already set in packet) to the client,
+// through the same loss and corruption simulation as every ACK
+void serverSendPacket(int sockfd, const struct sockaddr *address, socklen_t addrlen,
+                      Packet *packet) {
+    if (rand() % PLOSTMSG == 0) {
+        metrics_inc(mAcksDropped);
+        log_debug("Dropping ACK");
+        return;
+    }
+
+    // Simulate corrupted checksum sometimes
+    if (rand() % 5 == 0) {
+        packet->header.cksum = 0;
+        metrics_inc(mAcksCorrupted);
+        log_debug("Server: Simulating corrupted ACK checksum");
+    } else {
+        packet->header.cksum = getChecksum(packet);
     }
-    return checksum;
-}
 
-void printPacket(Packet packet) {
-    printf("Packet{ header: { seq_ack: %d, len: %d, cksum: %d }, data: \"",
-           packet.header.seq_ack,
-           packet.header.len,
-           packet.header.cksum);
-    fwrite(packet.data, (size_t)packet.header.len, 1, stdout);
-    printf("\" }\n");
+    sendto(sockfd, packet, PACKET_WIRE_SIZE(packet), 0, address, addrlen);
+    metrics_inc(mAcksSent);
+    log_debug("Sent ACK %d, checksum %d", packet->header.seq_ack,
+              packet->header.cksum);
 }
 
 // Send ACK to client
 void serverSend(int sockfd, const struct sockaddr *address, socklen_t addrlen,
                 int seqnum) {
-    if (rand() % PLOSTMSG == 0) {
-        printf("Dropping ACK\n");
-    } else {
-        Packet packet;
-        memset(&packet, 0, sizeof(packet));
-        packet.header.seq_ack = seqnum;
-        packet.header.len = 0;
-
-        // Simulate corrupted checksum sometimes
-        if (rand() % 5 == 0) {
-            packet.header.cksum = 0;
-            printf("Server: Simulating corrupted ACK checksum\n");
-        } else {
-            packet.header.cksum = getChecksum(packet);
-        }
+    Packet packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.header.seq_ack = seqnum;
+    packet.header.len = 0;
+    serverSendPacket(sockfd, address, addrlen, &packet);
+}
+
+// Check a received datagram against the expected sequence bit; 1 if good
+int checkPacket(const Packet *packet, ssize_t n, int seqnum) {
+    metrics_inc(mReceived);
 
-        sendto(sockfd, &packet, sizeof(packet), 0, address, addrlen);
-        printf("Sent ACK %d, checksum %d\n", packet.header.seq_ack,
-               packet.header.cksum);
+    // Shorter than its header says (or than a header): nothing to check
+    if (!validLength(packet, n)) {
+        metrics_inc(mShort);
+        log_debug("Received invalid packet (too short)");
+        return 0;
     }
+
+    logPacket("Received", packet);
+
+    int expected_cksum = getChecksum(packet);
+
+    if (packet->header.cksum != expected_cksum) {
+        metrics_inc(mBadChecksum);
+        log_debug("Bad checksum, expected %d", expected_cksum);
+        return 0;
+    }
+    if ((packet->header.seq_ack & SEQ_MASK) != seqnum) {
+        metrics_inc(mBadSeq);
+        log_debug("Bad seqnum, expected %d", seqnum);
+        return 0;
+    }
+    log_debug("Good packet");
+    return 1;
 }
 
 // Receive packet from client, validate, and return when good packet received
-Packet serverReceive(int sockfd, struct sockaddr *address, socklen_t *addrlen,
-                     int seqnum, int fp) {
-    Packet packet;
+// The packet is a packetPool buffer or points into the ring; hand it to
+// releasePacket() when done (NULL: out of memory)
+const Packet *serverReceive(int sockfd, struct sockaddr *address, socklen_t *addrlen,
+                            int seqnum, int fp) {
+    Packet *buf = NULL;
     int last_ack_sent = (seqnum + 1) % 2;  // Previous seq for resending ACK
 
+    if (ring == NULL && (buf = pool_get(packetPool)) == NULL)
+        return NULL;
     while (1) {
-        memset(&packet, 0, sizeof(packet));
-        ssize_t n = recvfrom(sockfd, &packet, sizeof(packet), 0, address,
-                             addrlen);
+        const Packet *packet = buf;
+        ssize_t n;
 
-        if (n < (ssize_t)sizeof(Header)) {
-            printf("Received invalid packet (too short)\n");
-            serverSend(sockfd, address, *addrlen, last_ack_sent);
-            continue;
+        if (ring != NULL) {
+            const uint8_t *payload = NULL;
+            n = rxring_next(ring, &payload, (struct sockaddr_in *)address);
+            *addrlen = sizeof(struct sockaddr_in);
+            packet = (const Packet *)payload;
+        } else {
+            n = recvfrom(sockfd, buf, sizeof(*buf), 0, address, addrlen);
         }
+        uint64_t start = metrics_now_ns();
 
-        printf("Received: ");
-        printPacket(packet);
-
-        int expected_cksum = getChecksum(packet);
-
-        if (packet.header.cksum != expected_cksum) {
-            printf("Bad checksum, expected %d\n", expected_cksum);
-            serverSend(sockfd, address, *addrlen, last_ack_sent);
-        } else if (packet.header.seq_ack != seqnum) {
-            printf("Bad seqnum, expected %d\n", seqnum);
+        if (!checkPacket(packet, n, seqnum)) {
             serverSend(sockfd, address, *addrlen, last_ack_sent);
         } else {
-            printf("Good packet\n");
             last_ack_sent = seqnum;
             serverSend(sockfd, address, *addrlen, seqnum);
 
-            if (packet.header.len > 0) {
-                write(fp, packet.data, packet.header.len);
+            if (packet->header.len > 0 && !(packet->header.seq_ack & ~SEQ_MASK)) {
+                if (write(fp, packet->data, packet->header.len) == packet->header.len)
+                    metrics_add(mBytesWritten, (uint64_t)packet->header.len);
             }
 
+            metrics_observe(hHandleTime, metrics_now_ns() - start);
+            TRACE2(udp_server, packet, packet->header.seq_ack, packet->header.len);
             return packet;
         }
     }
 }
 
+// Done with a packet from serverReceive(); ring frames are reused by the ring
+void releasePacket(const Packet *packet) {
+    if (ring == NULL)
+        pool_put((void *)packet);
+}
+
+// ---------- Multipath: one stop-and-wait channel per port ----------
+
+// After the last end packet, keep answering retransmissions whose ACK was lost
+#define MP_LINGER_MS 2000
+
+typedef struct {
+    int sock, port;
+    int seqnum;                     // expected sequence bit
+    struct sockaddr_storage peer;
+    socklen_t peerLen;
+    unsigned long packets;          // good packets
+    uint64_t bytes;                 // file bytes
+    // Version 1: packets that arrived, and how many since the last ACK
+    wire_rx_t rx;
+    unsigned held;
+    uint64_t heldSince;             // arrival of the first of them (ns)
+    uint64_t ackedAt;               // last ACK (ns)
+} channel_t;
+
+// Data at offset into the file, noting whole chunks in the manifest
+void writeAt(channel_t *ch, int fp, const void *data, size_t len, uint64_t offset) {
+    if (pwrite(fp, data, len, (off_t)offset) == (ssize_t)len) {
+        metrics_add(mBytesWritten, (uint64_t)len);
+        ch->bytes += (uint64_t)len;
+        if (manifest != NULL && offset % MP_PAYLOAD == 0)
+            manifest_set(manifest, offset / MP_PAYLOAD);
+    }
+}
+
+// ACK what ch has received so far, with the same loss and corruption
+// simulation as version 0 ACKs (a corrupted one fails its CRC)
+void wireAck(channel_t *ch, uint64_t now) {
+    uint8_t ack[WIRE_MAX_ACK];
+    uint64_t delayUs = ch->held > 0 ? (now - ch->heldSince) / 1000 : 0;
+    size_t len = wire_put_ack(&ch->rx, delayUs, ack);
+
+    ch->held = 0;
+    ch->ackedAt = now;
+    if (rand() % PLOSTMSG == 0) {
+        metrics_inc(mAcksDropped);
+        log_debug("Dropping ACK");
+        return;
+    }
+    if (rand() % 5 == 0) {
+        ack[len - 1] ^= 0xff;
+        metrics_inc(mAcksCorrupted);
+        log_debug("Server: Simulating corrupted ACK checksum");
+    }
+    sendto(ch->sock, ack, len, 0, (struct sockaddr *)&ch->peer, ch->peerLen);
+    metrics_inc(mAcksSent);
+    log_debug("Sent ACK below %llu, %zu bytes", (unsigned long long)ch->rx.cum, len);
+}
+
+// A version 1 datagram on ch: note it, write its data and ACK it now or
+// later. 1 for a new packet (parsed into pkt), else 0
+int wireReceive(channel_t *ch, const uint8_t *buf, size_t n, int fp, wire_pkt_t *pkt) {
+    uint64_t start = metrics_now_ns();
+    int fresh;
+
+    metrics_inc(mReceived);
+    if (wire_parse(buf, n, pkt) < 0) {
+        metrics_inc(mBadChecksum);
+        log_debug("Bad version 1 packet (%zu bytes)", n);
+        return 0;
+    }
+    log_debug("Received packet %llu, type %d, %zu bytes", (unsigned long long)pkt->pn,
+              pkt->type, pkt->len);
+    if ((fresh = wire_rx_mark(&ch->rx, pkt->pn)) < 0)
+        return 0;
+    // A duplicate was sent again because the sender missed our ACK: ACK it
+    // at once, unless an ACK went out just now (the sender resends in bursts)
+    if (ch->held++ == 0)
+        ch->heldSince = start;
+    if (fresh == 0)
+        metrics_inc(mBadSeq);
+    if (ch->held >= WIRE_ACK_EVERY || pkt->type != WIRE_DATA
+        || (fresh == 0 && start - ch->ackedAt >= (uint64_t)WIRE_ACK_DELAY_MS * 1000000))
+        wireAck(ch, start);
+    if (fresh == 0)
+        return 0;
+
+    ch->packets++;
+    if (pkt->type == WIRE_DATA)
+        writeAt(ch, fp, pkt->data, pkt->len, pkt->offset);
+    metrics_observe(hHandleTime, metrics_now_ns() - start);
+    TRACE2(udp_server, packet, (int)pkt->pn, (int)pkt->len);
+    return 1;
+}
+
+// Send the ACKs held back longer than WIRE_ACK_DELAY_MS; ms until the next is due, or -1
+int wireAckDue(channel_t *ch, int nch) {
+    uint64_t now = metrics_now_ns(), delay = (uint64_t)WIRE_ACK_DELAY_MS * 1000000;
+    int next = -1;
+
+    for (int i = 0; i < nch; i++) {
+        if (ch[i].held == 0)
+            continue;
+        if (now - ch[i].heldSince >= delay) {
+            wireAck(&ch[i], now);
+            continue;
+        }
+        int ms = (int)((ch[i].heldSince + delay - now + 999999) / 1000000);
+        next = next < 0 || ms < next ? ms : next;
+    }
+    return next;
+}
+
+// Read one datagram on ch, ACK it and write its data at its offset;
+// 1 for a good new packet (left in buf, or parsed into pkt for version 1),
+// 2 for a resume query, which is left for answerQuery() whatever its
+// sequence bit
+int channelReceive(channel_t *ch, Packet *buf, int fp, wire_pkt_t *pkt) {
+    ch->peerLen = sizeof(ch->peer);
+    ssize_t n = recvfrom(ch->sock, buf, RX_BUF_SIZE, 0, (struct sockaddr *)&ch->peer, &ch->peerLen);
+    if (n < 0)
+        return 0;
+    if (wire_version((const uint8_t *)buf, (size_t)n) == WIRE_VERSION)
+        return wireReceive(ch, (const uint8_t *)buf, (size_t)n, fp, pkt);
+    pkt->type = 0;
+    uint64_t start = metrics_now_ns();
+
+    if ((buf->header.seq_ack & FLAG_RESUME) && validLength(buf, n)
+        && buf->header.cksum == getChecksum(buf)) {
+        metrics_inc(mReceived);
+        logPacket("Received", buf);
+        return 2;
+    }
+
+    if (!checkPacket(buf, n, ch->seqnum)) {
+        serverSend(ch->sock, (struct sockaddr *)&ch->peer, ch->peerLen, ch->seqnum ^ 1);
+        return 0;
+    }
+    serverSend(ch->sock, (struct sockaddr *)&ch->peer, ch->peerLen, ch->seqnum);
+    ch->seqnum ^= 1;
+    ch->packets++;
+
+    int len = buf->header.len;
+    if ((buf->header.seq_ack & FLAG_MP) && len > MP_OFFSET_SIZE)
+        writeAt(ch, fp, buf->data + MP_OFFSET_SIZE, (size_t)(len - MP_OFFSET_SIZE), getOffset(buf));
+    metrics_observe(hHandleTime, metrics_now_ns() - start);
+    TRACE2(udp_server, packet, buf->header.seq_ack, buf->header.len);
+    return 1;
+}
+
+// Answer a resume query on ch with runs of chunks still missing. A query
+// for chunk 0 starts a transfer: the manifest is (re)opened for the size
+// and version the client has, and 1 is returned so the caller starts over.
+// Queries change nothing else, so a retransmitted one gets the same answer.
+int answerQuery(channel_t *ch, const Packet *query, int fp) {
+    Packet reply;
+    int restart = 0;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.header.seq_ack = (query->header.seq_ack & SEQ_MASK) | FLAG_RESUME;
+    ch->seqnum = (query->header.seq_ack & SEQ_MASK) ^ 1;
+
+    uint64_t size = 0, version = 0, from = 0;
+    if (query->header.len >= RESUME_QUERY_SIZE) {
+        size = getU64(query->data);
+        version = getU64(query->data + 8);
+        from = getU64(query->data + 16);
+    }
+
+    // Not resuming, a query we cannot read, or one continuing a transfer we
+    // know nothing of (restarted meanwhile): a plain ACK tells the client
+    if (resumePath == NULL || query->header.len < RESUME_QUERY_SIZE
+        || (from != 0 && (manifest == NULL || size != resumeSize || version != resumeVersion))) {
+        reply.header.seq_ack &= SEQ_MASK;
+        serverSendPacket(ch->sock, (struct sockaddr *)&ch->peer, ch->peerLen, &reply);
+        return 0;
+    }
+
+    if (from == 0) {
+        restart = 1;
+        if (manifest == NULL || size != resumeSize || version != resumeVersion) {
+            manifest_close(manifest, 1);
+            manifest = manifest_open(resumePath, fp, size, MP_PAYLOAD, version, 0);
+            if (manifest == NULL) {
+                log_error("Cannot open manifest for %s: %s", resumePath, strerror(errno));
+                reply.header.seq_ack &= SEQ_MASK;
+                serverSendPacket(ch->sock, (struct sockaddr *)&ch->peer, ch->peerLen, &reply);
+                return 1;
+            }
+            resumeSize = size;
+            resumeVersion = version;
+            // Nothing usable from an earlier run: do not keep its bytes
+            if (manifest_missing(manifest) == manifest_chunks(manifest) && ftruncate(fp, 0) < 0)
+                log_warn("Cannot truncate %s: %s", resumePath, strerror(errno));
+        }
+        log_info("Resume query: %llu bytes, %llu of %llu chunks missing",
+                 (unsigned long long)size, (unsigned long long)manifest_missing(manifest),
+                 (unsigned long long)manifest_chunks(manifest));
+    }
+
+    // Runs of missing chunks from `from` on, as many as fit
+    int len = 8;
+    uint64_t next = from;
+    while (next != RESUME_DONE && len + 16 <= DATA_SIZE) {
+        uint64_t run, start = manifest_next_missing(manifest, next, &run);
+        if (run == 0) {
+            next = RESUME_DONE;
+            break;
+        }
+        putU64(reply.data + len, start);
+        putU64(reply.data + len + 8, run);
+        len += 16;
+        next = start + run;
+    }
+    if (next != RESUME_DONE && next >= manifest_chunks(manifest))
+        next = RESUME_DONE;
+    putU64(reply.data, next);
+    reply.header.len = len;
+    serverSendPacket(ch->sock, (struct sockaddr *)&ch->peer, ch->peerLen, &reply);
+    return restart;
+}
+
+// Serve all channels until every path the client uses has sent FLAG_END.
+// Digest packets (on the first path) fill in *alg and expected.
+int receiveMultipath(channel_t *ch, int nch, int fp, digest_alg_t *alg,
+                     unsigned char *expected, size_t *expected_len) {
+    struct pollfd pfds[MP_MAX_PATHS];
+    Packet *buf = pool_get(packetPool);
+    int ended = 0, paths = nch;
+    uint64_t lastGood = 0, lingerUntil = 0;
+
+    if (buf == NULL)
+        return -1;
+    for (int i = 0; i < nch; i++)
+        pfds[i] = (struct pollfd){ ch[i].sock, POLLIN, 0 };
+
+    for (;;) {
+        int timeout = wireAckDue(ch, nch);
+        if (ended >= paths) {
+            uint64_t now = metrics_now_ns();
+            if (now >= lingerUntil)
+                break;
+            int linger = (int)((lingerUntil - now) / 1000000) + 1;
+            timeout = timeout < 0 || linger < timeout ? linger : timeout;
+        }
+        if (poll(pfds, (nfds_t)nch, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            pool_put(buf);
+            return -1;
+        }
+
+        for (int i = 0; i < nch; i++) {
+            wire_pkt_t pkt;
+            int got = pfds[i].revents & POLLIN ? channelReceive(&ch[i], buf, fp, &pkt) : 0;
+            if (got == 2 && answerQuery(&ch[i], buf, fp)) {
+                // A (re)started client: its paths all begin at sequence 0
+                for (int j = 0; j < nch; j++) {
+                    if (j != i)
+                        ch[j].seqnum = 0;
+                    wire_rx_init(&ch[j].rx);
+                    ch[j].held = 0;
+                }
+                *alg = DIGEST_NONE;
+                *expected_len = 0;
+                ended = 0;
+                paths = nch;
+            }
+            if (got != 1)
+                continue;
+
+            uint64_t now = metrics_now_ns();
+            if (lastGood != 0)
+                metrics_observe(hDeliveryGap, now - lastGood);
+            lastGood = now;
+
+            // Version 1 control packets; their data packets are written
+            if (pkt.type == WIRE_DIGEST) {
+                if (*alg == DIGEST_NONE)
+                    *alg = (digest_alg_t)pkt.alg;
+                if (pkt.pos <= DIGEST_MAX_SIZE && pkt.len <= DIGEST_MAX_SIZE - pkt.pos) {
+                    memcpy(expected + pkt.pos, pkt.data, pkt.len);
+                    if (pkt.pos + pkt.len > *expected_len)
+                        *expected_len = pkt.pos + pkt.len;
+                }
+                continue;
+            }
+            if (pkt.type == WIRE_END) {
+                paths = (int)pkt.paths;
+                ended++;
+                log_debug("Path on port %d done", ch[i].port);
+                if (ended >= paths)
+                    lingerUntil = now + (uint64_t)MP_LINGER_MS * 1000000;
+                continue;
+            }
+            if (pkt.type != 0)
+                continue;
+
+            int len = buf->header.len;
+            if (buf->header.seq_ack & FLAG_DIGEST) {
+                if (*alg == DIGEST_NONE && *expected_len == 0) {
+                    *alg = (digest_alg_t)(unsigned char)buf->data[0];
+                } else if (*expected_len + len <= DIGEST_MAX_SIZE) {
+                    memcpy(expected + *expected_len, buf->data, len);
+                    *expected_len += len;
+                }
+            } else if ((buf->header.seq_ack & FLAG_END) && len > 0) {
+                // data[0]: how many paths the client striped over
+                paths = (unsigned char)buf->data[0];
+                ended++;
+                log_debug("Path on port %d done", ch[i].port);
+                if (ended >= paths)
+                    lingerUntil = now + (uint64_t)MP_LINGER_MS * 1000000;
+            }
+        }
+        if (manifest != NULL && manifest_due(manifest) && manifest_sync(manifest) < 0)
+            log_warn("Cannot write manifest: %s", strerror(errno));
+    }
+    pool_put(buf);
+    return 0;
+}
+
+// Digest of the whole output file; multipath data arrives out of order
+void digestFile(int fp, digest_ctx_t *digest) {
+    static char chunk[1 << 16];
+    off_t off = 0;
+    ssize_t n;
+
+    while ((n = pread(fp, chunk, sizeof(chunk), off)) > 0) {
+        digest_update(digest, chunk, (size_t)n);
+        off += n;
+    }
+}
+
+// Wait for the first datagram on sockfd and tell whether it is version 1
+// (left queued)
+bool firstIsWire(int sockfd) {
+    uint8_t first;
+    ssize_t n = recv(sockfd, &first, 1, MSG_PEEK);
+    return n > 0 && wire_version(&first, (size_t)n) == WIRE_VERSION;
+}
+
+// The same for the first datagram in the -P ring
+bool ringFirstIsWire(rxring_t *r) {
+    const uint8_t *payload;
+    struct sockaddr_in from;
+    ssize_t n = rxring_peek(r, &payload, &from);
+    return n > 0 && wire_version(payload, (size_t)n) == WIRE_VERSION;
+}
+
+// UDP socket bound to port on all addresses, or -1; ipv4Only for the
+// ring, whose frames carry IPv4 peers to answer
+int bindPort(int port, bool ipv4Only) {
+    return net_bind(SOCK_DGRAM, port, ipv4Only ? NET_IPV4 : 0);
+}
+
+void registerMetrics(void) {
+    mReceived = metrics_counter("udp_packets_received_total", "Datagrams received");
+    mShort = metrics_counter("udp_packets_short_total", "Datagrams shorter than their header says");
+    mBadChecksum = metrics_counter("udp_packets_bad_checksum_total", "Packets failing the checksum");
+    mBadSeq = metrics_counter("udp_packets_duplicate_total", "Packets with the old sequence bit");
+    mAcksSent = metrics_counter("udp_acks_sent_total", "ACKs sent");
+    mAcksDropped = metrics_counter("udp_acks_dropped_total", "ACKs dropped by the loss simulation");
+    mAcksCorrupted = metrics_counter("udp_acks_corrupted_total", "ACKs sent with a simulated bad checksum");
+    mBytesWritten = metrics_counter("udp_bytes_written_total", "File bytes written");
+    hHandleTime = metrics_histogram("udp_packet_handle_seconds",
+                                    "Time from receiving a good packet to ACK sent and data written");
+    hDeliveryGap = metrics_histogram("udp_delivery_interval_seconds",
+                                     "Time between consecutive in-order packets (includes retransmission waits)");
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <port> <outfile>\n", argv[0]);
+    const char *metricsEndpoint = NULL, *ringIf = NULL;
+    int opt, verbose = 0, resume = 0;
+
+    while ((opt = getopt(argc, argv, "vM:P:r")) != -1) {
+        switch (opt) {
+        case 'v': verbose = 1; break;
+        case 'M': metricsEndpoint = optarg; break;
+        case 'P': ringIf = optarg; break;
+        case 'r': resume = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-v] [-r] [-M port|unix:path] [-P ifname] <port>[,port...] <outfile>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-v] [-r] [-M port|unix:path] [-P ifname] <port>[,port...] <outfile>\n", argv[0]);
         exit(1);
     }
+    argv += optind - 1;
 
-    srand((unsigned)time(NULL));
+    // One channel per port; more than one means a multipath transfer
+    channel_t channels[MP_MAX_PATHS];
+    int nchannels = 0;
+    memset(channels, 0, sizeof(channels));
+    for (char *p = argv[1], *end; *p != '\0'; p = *end == ',' ? end + 1 : end) {
+        long port = strtol(p, &end, 10);
+        if (end == p || port <= 0 || port > 65535 || nchannels == MP_MAX_PATHS
+            || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "Bad port list %s (at most %d ports)\n", argv[1], MP_MAX_PATHS);
+            exit(1);
+        }
+        channels[nchannels++].port = (int)port;
+    }
+    if ((nchannels > 1 || resume) && ringIf != NULL) {
+        fprintf(stderr, "-P takes a single port and no -r\n");
+        exit(1);
+    }
+    if (resume && DATA_SIZE < RESUME_QUERY_SIZE) {
+        fprintf(stderr, "-r needs DATA_SIZE >= %d (make DATA_SIZE=1400)\n", RESUME_QUERY_SIZE);
+        exit(1);
+    }
 
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("Failed to create socket");
+    log_init(verbose ? LOG_LVL_DEBUG : LOG_LVL_INFO, verbose ? LOG_TIMESTAMPS : 0);
+    registerMetrics();
+    packetPool = pool_create("packets", RX_BUF_SIZE, 16);
+    if (packetPool == NULL) {
+        perror("Cannot create packet pool");
+        exit(1);
+    }
+    if (metricsEndpoint != NULL && metrics_serve(metricsEndpoint) < 0) {
+        perror("Cannot serve metrics");
         exit(1);
     }
 
-    struct sockaddr_in servAddr;
-    memset(&servAddr, 0, sizeof(servAddr));
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servAddr.sin_port = htons(atoi(argv[1]));
+    srand((unsigned)time(NULL));
+
+    for (int i = 0; i < nchannels; i++) {
+        if ((channels[i].sock = bindPort(channels[i].port, ringIf != NULL)) < 0) {
+            perror("Bind failed");
+            exit(1);
+        }
+    }
+    int sockfd = channels[0].sock;
 
-    if (bind(sockfd, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0) {
-        perror("Bind failed");
-        close(sockfd);
-        exit(1);
+    // The socket stays bound (no ICMP port unreachable) and sends the ACKs
+    if (ringIf != NULL) {
+        ring = rxring_open(ringIf, channels[0].port);
+        if (ring == NULL || rxring_mute(sockfd) < 0) {
+            perror("Cannot set up packet ring");
+            close(sockfd);
+            exit(1);
+        }
+        log_info("Receiving through a TPACKET_V3 ring on %s", ringIf);
     }
 
-    printf("Server listening on port %s\n", argv[1]);
+    log_info("Server listening on port %s", argv[1]);
 
-    int fp = open(argv[2], O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    // Read back at the end of a multipath transfer for the digest; with -r
+    // what an earlier run left is kept until a client says what it sends
+    int fp = open(argv[2], O_CREAT | O_RDWR | (resume ? 0 : O_TRUNC), 0666);
     if (fp < 0) {
         perror("File failed to open");
         close(sockfd);
@@ -150,19 +624,135 @@ int main(int argc, char *argv[]) {
     }
 
     int seqnum = 0;
-    Packet packet;
-    struct sockaddr_in clientAddr;
+    const Packet *packet;
+    int len;
+    struct sockaddr_storage clientAddr;
     socklen_t addrlen = sizeof(clientAddr);
 
-    do {
+    // Digest announced by the client (first FLAG_DIGEST packet), then trailer
+    digest_alg_t alg = DIGEST_NONE;
+    digest_ctx_t digest;
+    unsigned char expected[DIGEST_MAX_SIZE];
+    size_t expected_len = 0;
+
+    digest_init(&digest, DIGEST_NONE);
+    uint64_t lastGood = 0;
+    // Multipath format (offsets in every data packet) for several ports or
+    // -r, or when the first packet is version 1 (udp_client -w)
+    bool multipath = nchannels > 1 || resume;
+    if (!multipath && ring == NULL) {
+        multipath = firstIsWire(sockfd);
+    } else if (!multipath && ringFirstIsWire(ring)) {
+        // The ring path checks version 0 packets only: serve a windowed
+        // client from the socket; what the ring took is sent again
+        log_warn("Version 1 client (udp_client -w): -P takes version 0 only, "
+                 "receiving through the socket");
+        rxring_close(ring);
+        ring = NULL;
+        if (rxring_unmute(sockfd) < 0) {
+            perror("Cannot receive on the socket");
+            exit(1);
+        }
+        multipath = true;
+    }
+    if (resume)
+        resumePath = argv[2];
+    if (multipath) {
+        if (receiveMultipath(channels, nchannels, fp, &alg, expected, &expected_len) < 0) {
+            perror("Multipath receive failed");
+            exit(1);
+        }
+        // Drop any tail of a longer file from an earlier run
+        if (manifest != NULL && ftruncate(fp, (off_t)resumeSize) < 0)
+            log_warn("Cannot truncate %s: %s", argv[2], strerror(errno));
+        digest_init(&digest, alg);
+        if (alg != DIGEST_NONE)
+            digestFile(fp, &digest);
+    }
+    while (!multipath) {
         packet = serverReceive(sockfd, (struct sockaddr *)&clientAddr,
                                &addrlen, seqnum, fp);
+        if (packet == NULL) {
+            perror("Cannot allocate packet");
+            exit(1);
+        }
         seqnum = (seqnum + 1) % 2;
-    } while (packet.header.len > 0);
 
-    printf("File transfer complete\n");
+        uint64_t now = metrics_now_ns();
+        if (lastGood != 0)
+            metrics_observe(hDeliveryGap, now - lastGood);
+        lastGood = now;
+
+        len = packet->header.len;
+        if (packet->header.seq_ack & FLAG_DIGEST) {
+            if (alg == DIGEST_NONE && expected_len == 0) {
+                alg = (digest_alg_t)(unsigned char)packet->data[0];
+                digest_init(&digest, alg);
+            } else if (expected_len + len <= sizeof(expected)) {
+                memcpy(expected + expected_len, packet->data, len);
+                expected_len += len;
+            }
+        } else if (packet->header.seq_ack & FLAG_RESUME) {
+            // Nothing to resume against; the client gives up, so expect its next run
+            log_warn("Resume query from a client; start the server with -r to resume");
+            seqnum = 0;
+        } else if (len > 0) {
+            digest_update(&digest, packet->data, (size_t)len);
+        }
+        releasePacket(packet);
+        if (len == 0)
+            break;
+    }
+
+    log_info("File transfer complete");
+    log_info("Received %llu packets (%llu bad checksum, %llu duplicate), sent %llu ACKs "
+             "(%llu dropped), %llu bytes written; packet gap p50 %.1f ms, p99 %.1f ms",
+             (unsigned long long)metrics_counter_value(mReceived),
+             (unsigned long long)metrics_counter_value(mBadChecksum),
+             (unsigned long long)metrics_counter_value(mBadSeq),
+             (unsigned long long)metrics_counter_value(mAcksSent),
+             (unsigned long long)metrics_counter_value(mAcksDropped),
+             (unsigned long long)metrics_counter_value(mBytesWritten),
+             metrics_histogram_quantile(hDeliveryGap, 0.5) / 1e6,
+             metrics_histogram_quantile(hDeliveryGap, 0.99) / 1e6);
+    for (int i = 0; nchannels > 1 && i < nchannels; i++)
+        log_info("  port %-5d %8lu packets, %10llu bytes", channels[i].port,
+                 channels[i].packets, (unsigned long long)channels[i].bytes);
+    if (ring != NULL) {
+        rxring_stats_t st;
+        rxring_stats(ring, &st);
+        log_info("Packet ring: %llu datagrams, %llu dropped by the kernel (ring full)",
+                 (unsigned long long)st.packets, (unsigned long long)st.kernel_drops);
+    }
 
+    int status = 0;
+    if (manifest != NULL) {
+        uint64_t missing = manifest_missing(manifest);
+        if (missing > 0) {
+            log_warn("%llu chunks still missing; run the client with -r again to send them",
+                     (unsigned long long)missing);
+            status = 1;
+        }
+        if (manifest_close(manifest, 0) < 0)
+            log_warn("Cannot write manifest: %s", strerror(errno));
+    }
+    if (alg != DIGEST_NONE) {
+        unsigned char actual[DIGEST_MAX_SIZE];
+        char hex[2 * DIGEST_MAX_SIZE + 1];
+        size_t len = digest_final(&digest, actual);
+        digest_hex(actual, len, hex);
+        if (len == 0 || expected_len != len || memcmp(expected, actual, len) != 0) {
+            log_error("Digest mismatch (%s): received file hashes to %s",
+                      digest_name(alg), hex);
+            status = 1;
+        } else {
+            log_info("Digest verified (%s): %s", digest_name(alg), hex);
+        }
+    }
+
+    rxring_close(ring);
     close(fp);
-    close(sockfd);
-    return 0;
+    for (int i = 0; i < nchannels; i++)
+        close(channels[i].sock);
+    return status;
 }
@@ -0,0 +1,170 @@
+// Version 1 packet format (see wire.h)
+#include <string.h>
+
+#include "wire.h"
+#include "digest.h"
+
+size_t wire_put_varint(uint8_t *buf, uint64_t v) {
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+    return n;
+}
+
+// Varint at *p before end; advances *p, -1 if it runs past end or 64 bits
+static int getVarint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    uint64_t x = 0;
+
+    for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t wire_begin(uint8_t *buf, int type, uint64_t pn) {
+    buf[0] = (uint8_t)(WIRE_VERSION << 4 | type);
+    return 1 + wire_put_varint(buf + 1, pn);
+}
+
+static void crc(const uint8_t *buf, size_t len, uint8_t out[DIGEST_MAX_SIZE]) {
+    digest_ctx_t ctx;
+
+    digest_init(&ctx, DIGEST_CRC32C);
+    digest_update(&ctx, buf, len);
+    digest_final(&ctx, out);
+}
+
+size_t wire_finish(uint8_t *buf, size_t len) {
+    uint8_t out[DIGEST_MAX_SIZE];
+
+    crc(buf, len, out);
+    memcpy(buf + len, out, WIRE_CRC_SIZE);
+    return len + WIRE_CRC_SIZE;
+}
+
+int wire_version(const uint8_t *buf, size_t n) {
+    return n > 0 ? buf[0] >> 4 : 0;
+}
+
+// Type of a version 1 packet with a good CRC, or -1; *end is set to the CRC
+static int check(const uint8_t *buf, size_t n, const uint8_t **end) {
+    uint8_t out[DIGEST_MAX_SIZE];
+
+    if (n < 1 + WIRE_CRC_SIZE || wire_version(buf, n) != WIRE_VERSION)
+        return -1;
+    crc(buf, n - WIRE_CRC_SIZE, out);
+    if (memcmp(out, buf + n - WIRE_CRC_SIZE, WIRE_CRC_SIZE) != 0)
+        return -1;
+    *end = buf + n - WIRE_CRC_SIZE;
+    return buf[0] & 0x0f;
+}
+
+int wire_parse(const uint8_t *buf, size_t n, wire_pkt_t *pkt) {
+    const uint8_t *p = buf + 1, *end;
+
+    memset(pkt, 0, sizeof(*pkt));
+    if ((pkt->type = check(buf, n, &end)) < 0 || getVarint(&p, end, &pkt->pn) < 0)
+        return -1;
+    switch (pkt->type) {
+    case WIRE_DATA:
+        if (getVarint(&p, end, &pkt->offset) < 0)
+            return -1;
+        break;
+    case WIRE_DIGEST:
+        if (getVarint(&p, end, &pkt->alg) < 0 || getVarint(&p, end, &pkt->pos) < 0)
+            return -1;
+        break;
+    case WIRE_END:
+        if (getVarint(&p, end, &pkt->paths) < 0)
+            return -1;
+        break;
+    default:
+        return -1;
+    }
+    pkt->data = p;
+    pkt->len = (size_t)(end - p);
+    return 0;
+}
+
+int wire_parse_ack(const uint8_t *buf, size_t n, wire_ack_t *ack) {
+    const uint8_t *p = buf + 1, *end;
+    uint64_t count, at, gap, len;
+
+    if (check(buf, n, &end) != WIRE_ACK || getVarint(&p, end, &ack->cum) < 0
+        || getVarint(&p, end, &ack->delayUs) < 0 || getVarint(&p, end, &count) < 0
+        || count > WIRE_MAX_RANGES)
+        return -1;
+    at = ack->cum;
+    for (ack->nranges = 0; ack->nranges < count; ack->nranges++) {
+        if (getVarint(&p, end, &gap) < 0 || getVarint(&p, end, &len) < 0
+            || gap >= WIRE_WINDOW || len >= WIRE_WINDOW)
+            return -1;
+        ack->start[ack->nranges] = at + gap + 1;
+        ack->end[ack->nranges] = at = at + gap + 1 + len + 1;
+    }
+    return 0;
+}
+
+void wire_rx_init(wire_rx_t *rx) {
+    memset(rx, 0, sizeof(*rx));
+}
+
+static int has(const wire_rx_t *rx, uint64_t pn) {
+    return rx->bits[pn / 64 % (WIRE_WINDOW / 64)] >> (pn % 64) & 1;
+}
+
+int wire_rx_mark(wire_rx_t *rx, uint64_t pn) {
+    if (pn < rx->cum || (pn < rx->cum + WIRE_WINDOW && has(rx, pn)))
+        return 0;
+    if (pn >= rx->cum + WIRE_WINDOW)
+        return -1;
+    rx->bits[pn / 64 % (WIRE_WINDOW / 64)] |= 1ULL << (pn % 64);
+    if (pn >= rx->top)
+        rx->top = pn + 1;
+    // Slide past what has arrived in order; its bits are reused further up
+    while (rx->cum < rx->top && has(rx, rx->cum)) {
+        rx->bits[rx->cum / 64 % (WIRE_WINDOW / 64)] &= ~(1ULL << (rx->cum % 64));
+        rx->cum++;
+    }
+    return 1;
+}
+
+size_t wire_put_ack(const wire_rx_t *rx, uint64_t delayUs, uint8_t *buf) {
+    uint8_t ranges[2 * WIRE_MAX_RANGES * WIRE_VARINT_MAX];
+    size_t n, rlen = 0;
+    unsigned count = 0;
+    uint64_t at = rx->cum, pn = rx->cum;
+
+    // Runs of arrived packets above cum: cum itself has not arrived
+    while (pn < rx->top && count < WIRE_MAX_RANGES) {
+        uint64_t start;
+        while (pn < rx->top && !has(rx, pn))
+            pn++;
+        if (pn >= rx->top)
+            break;
+        start = pn;
+        while (pn < rx->top && has(rx, pn))
+            pn++;
+        rlen += wire_put_varint(ranges + rlen, start - at - 1);
+        rlen += wire_put_varint(ranges + rlen, pn - start - 1);
+        at = pn;
+        count++;
+    }
+
+    buf[0] = (uint8_t)(WIRE_VERSION << 4 | WIRE_ACK);
+    n = 1;
+    n += wire_put_varint(buf + n, rx->cum);
+    n += wire_put_varint(buf + n, delayUs);
+    n += wire_put_varint(buf + n, count);
+    memcpy(buf + n, ranges, rlen);
+    return wire_finish(buf, n + rlen);
+}
@@ -0,0 +1,108 @@
+// Compact packet format for windowed transfers (udp_client -w)
+//
+// Version 0 is the rdt.h Header: three host-order ints with a sequence
+// bit, one packet in flight and one ACK per packet. Version 1 numbers the
+// packets of each path 0, 1, 2, ... (a retransmission keeps its number),
+// so many can be in flight and one ACK covers all that have arrived.
+// Fields are unsigned LEB128 varints (7 bits a byte, low bits first): the
+// same bytes on every host, and one byte for values below 128.
+//
+//   byte 0       WIRE_VERSION << 4 | type
+//   DATA         pn, file offset, file bytes
+//   DIGEST       pn, algorithm, position in the digest, digest bytes
+//   END          pn, number of paths
+//   ACK          cum, delay_us, n, n x (gap - 1, length - 1)
+//   last 4       CRC-32C of all bytes before, big-endian
+//
+// An ACK says every packet below cum has arrived, and lists up to
+// WIRE_MAX_RANGES runs of packets above it that have (SACK), lowest
+// first: each starts gap packets after the end of the one before (or
+// after cum) and is length packets long. delay_us is how long the receiver
+// held the ACK back, for the sender's RTT samples.
+//
+// A version 0 packet begins with a byte of seq_ack below 0x10 on either
+// byte order (the sequence bit, or the high byte of the int), so both
+// versions can arrive on the same port.
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rdt.h"
+
+#define WIRE_VERSION    1
+
+#define WIRE_DATA       1
+#define WIRE_DIGEST     2
+#define WIRE_END        3
+#define WIRE_ACK        4
+
+#define WIRE_VARINT_MAX 10          // bytes of a 64-bit varint
+#define WIRE_CRC_SIZE   4
+#define WIRE_WINDOW     1024        // packets a receiver tracks above cum; largest -w
+#define WIRE_MAX_RANGES 64
+
+// Receivers ACK after WIRE_ACK_EVERY packets, or WIRE_ACK_DELAY_MS after
+// the first one not yet ACKed; control packets at once, and a duplicate
+// unless an ACK has just gone. Senders allow for the delay in their timers.
+#define WIRE_ACK_EVERY      16
+#define WIRE_ACK_DELAY_MS   1
+
+// Largest packets: a DATA packet with MP_PAYLOAD bytes, and an ACK
+#define WIRE_MAX_PACKET (1 + 2 * WIRE_VARINT_MAX + MP_PAYLOAD + WIRE_CRC_SIZE)
+#define WIRE_MAX_ACK    (1 + (3 + 2 * WIRE_MAX_RANGES) * WIRE_VARINT_MAX + WIRE_CRC_SIZE)
+
+// A parsed packet; data points into the datagram
+typedef struct {
+    int type;
+    uint64_t pn;
+    uint64_t offset;            // DATA
+    uint64_t alg, pos;          // DIGEST
+    uint64_t paths;             // END
+    const uint8_t *data;
+    size_t len;
+} wire_pkt_t;
+
+// A parsed ACK
+typedef struct {
+    uint64_t cum, delayUs;
+    unsigned nranges;
+    uint64_t start[WIRE_MAX_RANGES], end[WIRE_MAX_RANGES];     // [start, end)
+} wire_ack_t;
+
+// What a receiver has of one path's packets
+typedef struct {
+    uint64_t cum;                       // every packet below has arrived
+    uint64_t top;                       // one past the highest that has
+    uint64_t bits[WIRE_WINDOW / 64];    // arrived, for [cum, cum + WIRE_WINDOW)
+} wire_rx_t;
+
+// Varint at buf; bytes written
+size_t wire_put_varint(uint8_t *buf, uint64_t v);
+
+// Type byte and packet number at buf; bytes written. Fields, the payload
+// and then wire_finish() follow.
+size_t wire_begin(uint8_t *buf, int type, uint64_t pn);
+
+// Append the CRC to the len bytes at buf; the packet's length
+size_t wire_finish(uint8_t *buf, size_t len);
+
+// Version of the datagram at buf (0: rdt.h Header)
+int wire_version(const uint8_t *buf, size_t n);
+
+// Check and parse a version 1 packet (not an ACK); 0, or -1 if it is
+// malformed or its CRC does not match
+int wire_parse(const uint8_t *buf, size_t n, wire_pkt_t *pkt);
+int wire_parse_ack(const uint8_t *buf, size_t n, wire_ack_t *ack);
+
+void wire_rx_init(wire_rx_t *rx);
+
+// Record packet pn: 1 if it is new, 0 if it arrived before, -1 if it is
+// beyond the window (dropped unrecorded)
+int wire_rx_mark(wire_rx_t *rx, uint64_t pn);
+
+// ACK for what rx has, at buf (WIRE_MAX_ACK bytes); its length
+size_t wire_put_ack(const wire_rx_t *rx, uint64_t delayUs, uint8_t *buf);
+
+#endif
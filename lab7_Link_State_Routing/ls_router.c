@@ -13,10 +13,16 @@
 #include <arpa/inet.h>
 #include <time.h>
 
+#include "metrics.h"
+#include "log.h"
+
 // defines
 #define N           4
-#define INFINITE    1000
-#define MIN(a,b)    (((a) < (b)) ? (a) : (b))
+#define INFINITE    1000        // a cost this high or higher: no link
+#define K_PATHS     3           // shortest loop-free paths kept per destination
+#define NO_HOP      (-1)
+
+_Static_assert (N <= 32, "next-hop sets are bit masks of N bits");
 
 // types
 typedef struct routers
@@ -27,32 +33,407 @@ typedef struct routers
 
 } ROUTERS;
 
+// a loop-free path: the routers from this one to the destination
+typedef struct path
+{
+    int     cost;
+    int     len;
+    unsigned char hop[N];
+
+} PATH;
+
+// route to one destination, computed by run_link_state()
+typedef struct route
+{
+    int     cost;               // INFINITE: unreachable
+    unsigned nexthops;          // equal-cost first hops, bit i = router i
+    int     lfa;                // loop-free alternate neighbor, or NO_HOP
+    int     lfa_cost;           // cost of the route through lfa
+    int     npaths;
+    PATH    paths[K_PATHS];     // k shortest loop-free paths, cheapest first
+    int     repaired;           // moved to a backup since the last run
+
+} ROUTE;
+
 // global variables
 ROUTERS routers[N];
 int     costs[N][N];
-int     distances[N];
 int     myid, nodes;
 int     sock;
 struct sockaddr_in addr;
 struct sockaddr_in otheraddr;
 socklen_t addr_size;
 pthread_mutex_t lock;
+ROUTE   routes[N];              // result of the last run, under lock
+int     spf_done;
+unsigned topology_gen;          // bumped on every cost change, under lock
+
+// metric ids, registered in register_metrics()
+int     m_updates, m_malformed, m_sent, m_spf_runs, m_reroutes;
+int     h_spf_time, h_reroute_time;
 
-// print costs
+// print costs: copy the table under the lock, log it after releasing it
 void print_costs (void)
 {
-    int i, j;
+    int     snapshot[N][N];
+    char    row[N * 12 + 1];
+    int     i, j, len;
 
     pthread_mutex_lock (&lock);
-    printf ("Current cost table at router %d:\n", myid);
+    memcpy (snapshot, costs, sizeof (snapshot));
+    pthread_mutex_unlock (&lock);
+
+    log_info ("Current cost table at router %d:", myid);
     for (i = 0; i < nodes; i++)
     {
+        len = 0;
+        row[0] = '\0';
         for (j = 0; j < nodes; j++)
-            printf ("%4d ", costs[i][j]);
-        printf ("\n");
+            len += snprintf (row + len, sizeof (row) - len, "%4d ", snapshot[i][j]);
+        log_info ("%s", row);
+    }
+    log_info ("%s", "");
+}
+
+// ---------- Route computation ----------
+
+// Dijkstra over g from root. For every node: its distance, the set of
+// root's neighbors that start a shortest path to it (all of them on ties:
+// ECMP, a bit mask of N bits handled in one operation) and the
+// lowest-numbered predecessor on a shortest path.
+void spf (int g[N][N], int root, int dist[N], unsigned first[N], int pred[N])
+{
+    int     taken[N];
+    int     min, spot;
+    int     i, j, d;
+    unsigned via;
+
+    for (i = 0; i < N; i++)
+    {
+        taken[i] = 0;
+        dist[i] = INFINITE;
+        first[i] = 0;
+        pred[i] = NO_HOP;
+    }
+    dist[root] = 0;
+
+    for (i = 0; i < N; i++)
+    {
+        /* find closest node not yet taken */
+        min = INFINITE;
+        spot = -1;
+        for (j = 0; j < N; j++)
+        {
+            if (!taken[j] && dist[j] < min)
+            {
+                min = dist[j];
+                spot = j;
+            }
+        }
+
+        if (spot == -1)
+            break;  // remaining nodes are unreachable
+
+        taken[spot] = 1;
+
+        /* relax the links of the newly taken node */
+        for (j = 0; j < N; j++)
+        {
+            if (taken[j] || g[spot][j] >= INFINITE)
+                continue;
+            d = dist[spot] + g[spot][j];
+            if (d >= INFINITE)
+                continue;
+            via = spot == root ? 1u << j : first[spot];
+            if (d < dist[j])
+            {
+                dist[j] = d;
+                first[j] = via;
+                pred[j] = spot;
+            }
+            else if (d == dist[j])
+            {
+                first[j] |= via;
+                if (spot < pred[j])
+                    pred[j] = spot;
+            }
+        }
+    }
+}
+
+// the shortest path to dest from the pred[] of a spf() run
+void path_to (const int pred[N], int dest, int cost, PATH *p)
+{
+    int     rev[N];
+    int     n = 0, i;
+
+    for (i = dest; i != NO_HOP && n < N; i = pred[i])
+        rev[n++] = i;
+    p->len = n;
+    p->cost = cost;
+    for (i = 0; i < n; i++)
+        p->hop[i] = (unsigned char)rev[n - 1 - i];
+}
+
+int path_uses_link (const PATH *p, int a, int b)
+{
+    int     i;
+
+    for (i = 0; i + 1 < p->len; i++)
+        if ((p->hop[i] == a && p->hop[i + 1] == b) || (p->hop[i] == b && p->hop[i + 1] == a))
+            return 1;
+    return 0;
+}
+
+int path_known (const PATH *p, const PATH *list, int n)
+{
+    int     i;
+
+    for (i = 0; i < n; i++)
+        if (list[i].len == p->len && memcmp (list[i].hop, p->hop, p->len) == 0)
+            return 1;
+    return 0;
+}
+
+void cut_link (int g[N][N], int a, int b)
+{
+    g[a][b] = INFINITE;
+    g[b][a] = INFINITE;
+}
+
+// Yen's algorithm: the (up to) K_PATHS shortest loop-free paths from root
+// to dest, cheapest first. Path k+1 branches off path k at some spur node:
+// for each one, take path k's root part up to it, remove the links found
+// paths with the same root part take next and the root part's other
+// nodes, and join the shortest spur path that is left. The cheapest of
+// all such candidates is the next path.
+int k_shortest_paths (int g[N][N], int root, int dest, PATH paths[K_PATHS])
+{
+    int     h[N][N];
+    PATH    cand[K_PATHS * N];
+    PATH    spur;
+    int     dist[N], pred[N];
+    unsigned first[N];
+    int     ncand = 0, k, i, j, best, rootcost;
+
+    spf (g, root, dist, first, pred);
+    if (dist[dest] >= INFINITE)
+        return 0;
+    path_to (pred, dest, dist[dest], &paths[0]);
+
+    for (k = 1; k < K_PATHS; k++)
+    {
+        const PATH *last = &paths[k - 1];
+
+        rootcost = 0;
+        for (i = 0; i + 1 < last->len; i++)
+        {
+            PATH    p;
+
+            memcpy (h, g, sizeof (h));
+            for (j = 0; j < k; j++)
+            {
+                if (paths[j].len > i + 1 && memcmp (paths[j].hop, last->hop, i + 1) == 0)
+                    cut_link (h, paths[j].hop[i], paths[j].hop[i + 1]);
+            }
+            for (j = 0; j < i; j++)
+            {
+                int     x = last->hop[j], y;
+                for (y = 0; y < N; y++)
+                    cut_link (h, x, y);
+            }
+
+            spf (h, last->hop[i], dist, first, pred);
+            if (dist[dest] < INFINITE)
+            {
+                path_to (pred, dest, dist[dest], &spur);
+                memcpy (p.hop, last->hop, i);
+                memcpy (p.hop + i, spur.hop, spur.len);
+                p.len = i + spur.len;
+                p.cost = rootcost + spur.cost;
+                if (!path_known (&p, paths, k) && !path_known (&p, cand, ncand))
+                    cand[ncand++] = p;
+            }
+            rootcost += g[last->hop[i]][last->hop[i + 1]];
+        }
+
+        if (ncand == 0)
+            break;
+        best = 0;
+        for (j = 1; j < ncand; j++)
+        {
+            if (cand[j].cost < cand[best].cost
+                || (cand[j].cost == cand[best].cost && cand[j].len < cand[best].len))
+                best = j;
+        }
+        paths[k] = cand[best];
+        cand[best] = cand[--ncand];
+    }
+    return k;
+}
+
+// Routes from this router over g: distances, ECMP next hops, k shortest
+// paths, and for each destination the cheapest loop-free alternate
+// (RFC 5286): a neighbor n outside the ECMP set whose own shortest path
+// does not come back through this router, D(n,d) < D(n,me) + D(me,d).
+// It takes over in fast_reroute() when the next hops' links fail.
+void compute_routes (int g[N][N], ROUTE out[N])
+{
+    int     dist[N], pred[N];
+    unsigned first[N];
+    int     ndist[N][N];        // from each neighbor, INFINITE rows for non-neighbors
+    int     npred[N];
+    unsigned nfirst[N];
+    int     n, d, c;
+
+    spf (g, myid, dist, first, pred);
+    for (n = 0; n < N; n++)
+    {
+        if (n != myid && g[myid][n] < INFINITE)
+            spf (g, n, ndist[n], nfirst, npred);
+        else
+            for (d = 0; d < N; d++)
+                ndist[n][d] = INFINITE;
+    }
+
+    for (d = 0; d < N; d++)
+    {
+        ROUTE  *r = &out[d];
+
+        memset (r, 0, sizeof (*r));
+        r->cost = dist[d];
+        r->nexthops = first[d];
+        r->lfa = NO_HOP;
+        r->lfa_cost = INFINITE;
+        if (d == myid || dist[d] >= INFINITE)
+            continue;
+        r->npaths = k_shortest_paths (g, myid, d, r->paths);
+
+        for (n = 0; n < N; n++)
+        {
+            if (ndist[n][d] >= INFINITE || (first[d] & (1u << n)))
+                continue;
+            if (ndist[n][d] >= ndist[n][myid] + dist[d])
+                continue;   // n's shortest path to d comes back through us
+            c = g[myid][n] + ndist[n][d];
+            if (c < r->lfa_cost)
+            {
+                r->lfa = n;
+                r->lfa_cost = c;
+            }
+        }
+    }
+}
+
+// e.g. "cost 5 via 1|2, alternate 3 (7), paths 0-1-3 (5) 0-2-3 (5) 0-3 (7)"
+void describe_route (const ROUTE *r, char *buf, size_t size)
+{
+    size_t  len = 0;
+    int     i, j;
+
+    if (r->cost >= INFINITE)
+    {
+        snprintf (buf, size, "unreachable");
+        return;
+    }
+    len += snprintf (buf + len, size - len, "cost %d via", r->cost);
+    for (i = 0, j = 0; i < N && len < size; i++)
+        if (r->nexthops & (1u << i))
+            len += snprintf (buf + len, size - len, "%s%d", j++ ? "|" : " ", i);
+    if (r->lfa != NO_HOP && len < size)
+        len += snprintf (buf + len, size - len, ", alternate %d (%d)", r->lfa, r->lfa_cost);
+    if (r->repaired && len < size)
+        len += snprintf (buf + len, size - len, ", repaired");
+    if (len < size)
+        len += snprintf (buf + len, size - len, ", paths");
+    for (i = 0; i < r->npaths && len < size; i++)
+    {
+        for (j = 0; j < r->paths[i].len && len < size; j++)
+            len += snprintf (buf + len, size - len, "%s%d", j ? "-" : " ", r->paths[i].hop[j]);
+        if (len < size)
+            len += snprintf (buf + len, size - len, " (%d)", r->paths[i].cost);
+    }
+}
+
+// ---------- Fast reroute ----------
+
+// Link a-b failed (under lock): repair the routes right away instead of
+// at the next run, which may be 20 s off. Routes lose the paths over the
+// link; if it was one of this router's, routes through it keep their
+// other ECMP next hops, or else move to the loop-free alternate, or else
+// to the next hop of the cheapest remaining path (which the neighbor may
+// still bounce back until it has heard of the failure). Routers at the
+// ends of a remote link repair it themselves. Returns the routes moved.
+int fast_reroute (int a, int b)
+{
+    int     n = a == myid ? b : b == myid ? a : NO_HOP;
+    int     d, i, j, moved = 0;
+
+    if (!spf_done)
+        return 0;
+    for (d = 0; d < N; d++)
+    {
+        ROUTE  *r = &routes[d];
+
+        for (i = 0, j = 0; i < r->npaths; i++)
+            if (!path_uses_link (&r->paths[i], a, b))
+                r->paths[j++] = r->paths[i];
+        r->npaths = j;
+        if (n == NO_HOP || d == myid)
+            continue;
+        if (r->lfa == n)
+            r->lfa = NO_HOP;
+        if (!(r->nexthops & (1u << n)))
+            continue;
+
+        r->nexthops &= ~(1u << n);
+        if (r->nexthops == 0 && r->lfa != NO_HOP)
+        {
+            r->nexthops = 1u << r->lfa;
+            r->cost = r->lfa_cost;
+            r->lfa = NO_HOP;
+        }
+        else if (r->nexthops == 0 && r->npaths > 0)
+        {
+            r->nexthops = 1u << r->paths[0].hop[1];
+            r->cost = r->paths[0].cost;
+        }
+        else if (r->nexthops == 0)
+        {
+            r->cost = INFINITE;
+        }
+        r->repaired = 1;
+        moved++;
+    }
+    return moved;
+}
+
+// New cost for link a-b from the keyboard or an update. A cost of
+// INFINITE or more takes the link down and repairs the routes over it.
+void link_update (int a, int b, int cost)
+{
+    uint64_t start = 0, took = 0;
+    int     moved = -1;
+
+    pthread_mutex_lock (&lock);
+    costs[a][b] = cost;
+    costs[b][a] = cost;
+    topology_gen++;
+    if (cost >= INFINITE)
+    {
+        start = metrics_now_ns ();
+        moved = fast_reroute (a, b);
+        took = metrics_now_ns () - start;
     }
-    printf ("\n");
     pthread_mutex_unlock (&lock);
+
+    if (moved > 0)
+    {
+        metrics_add (m_reroutes, (uint64_t)moved);
+        metrics_observe (h_reroute_time, took);
+        log_info ("Link %d-%d down: %d route%s moved to backups in %.1f us",
+                  a, b, moved, moved > 1 ? "s" : "", took / 1e3);
+    }
 }
 
 // receive info
@@ -75,6 +456,7 @@ void * receive_info (void *arg)
         if (n != sizeof (packet))
         {
             // malformed packet, ignore
+            metrics_inc (m_malformed);
             continue;
         }
 
@@ -83,28 +465,38 @@ void * receive_info (void *arg)
         newcost = ntohl (packet[2]);
 
         if (src < 0 || src >= N || neigh < 0 || neigh >= N)
+        {
+            metrics_inc (m_malformed);
             continue;
+        }
+        metrics_inc (m_updates);
+        TRACE3 (ls_router, update, src, neigh, newcost);
 
-        pthread_mutex_lock (&lock);
-        costs[src][neigh]  = newcost;
-        costs[neigh][src]  = newcost;
-        pthread_mutex_unlock (&lock);
+        link_update (src, neigh, newcost);
 
-        printf ("Received update from router %d about link (%d,%d) new cost %d\n",
-                src, src, neigh, newcost);
-        print_costs ();
+        // the whole table after every update only with -v
+        log_debug ("Received update from router %d about link (%d,%d) new cost %d",
+                   src, src, neigh, newcost);
+        if (log_enabled (LOG_LVL_DEBUG))
+            print_costs ();
     }
 
     return NULL;
 }
 
-// run_link_state
+// run_link_state: every 10-20 s, recompute the routes from a copy of the
+// cost table and install them, unless the table changed meanwhile (then
+// again at once, so a fast reroute is never overwritten by older routes)
 void * run_link_state (void *arg)
 {
-    int taken[N];
-    int min, spot;
-    int i, j;
-    int r;
+    int     g[N][N];
+    ROUTE   fresh[N];
+    unsigned gen;
+    int     i, r, installed;
+    uint64_t start;
+    char    row[N * 12 + 1];
+    char    desc[256];
+    int     len;
 
     while (1)
     {
@@ -112,57 +504,114 @@ void * run_link_state (void *arg)
         r = (rand () % 11) + 10;
         sleep (r);
 
-        /* initialization */
-        for (i = 0; i < N; i++)
+        do
         {
-            taken[i] = 0;
+            start = metrics_now_ns ();
             pthread_mutex_lock (&lock);
-            distances[i] = costs[myid][i];
+            memcpy (g, costs, sizeof (g));
+            gen = topology_gen;
             pthread_mutex_unlock (&lock);
-        }
-        taken[myid] = 1;
-        distances[myid] = 0;
 
-        /* Dijkstra's algorithm */
-        for (i = 1; i < N; i++)
-        {
-            /* find closest node not yet taken */
-            min = INFINITE;
-            spot = -1;
-            for (j = 0; j < N; j++)
+            compute_routes (g, fresh);
+
+            pthread_mutex_lock (&lock);
+            installed = gen == topology_gen;
+            if (installed)
             {
-                if (!taken[j] && distances[j] < min)
-                {
-                    min = distances[j];
-                    spot = j;
-                }
+                memcpy (routes, fresh, sizeof (routes));
+                spf_done = 1;
             }
+            pthread_mutex_unlock (&lock);
+        } while (!installed);
+        metrics_inc (m_spf_runs);
+        metrics_observe (h_spf_time, metrics_now_ns () - start);
 
-            if (spot == -1)
-                break;  // remaining nodes are unreachable
+        len = 0;
+        for (i = 0; i < N; i++)
+            len += snprintf (row + len, sizeof (row) - len, "%d ", fresh[i].cost);
+        log_info ("New least-cost distances from router %d:", myid);
+        log_info ("%s", row);
+        if (log_enabled (LOG_LVL_DEBUG))
+        {
+            for (i = 0; i < N; i++)
+            {
+                if (i == myid)
+                    continue;
+                describe_route (&fresh[i], desc, sizeof (desc));
+                log_debug ("  to %d: %s", i, desc);
+            }
+        }
+    }
+}
 
-            taken[spot] = 1;
+// cost table and routes, read at scrape time
+void collect_tables (metrics_writer_t *w)
+{
+    char    labels[64];
+    int     i, j;
 
-            /* recalculate distances using the newly taken node */
-            for (j = 0; j < N; j++)
+    pthread_mutex_lock (&lock);
+    metrics_family (w, "ls_link_cost", "gauge", "Cost table entry (from, to)");
+    for (i = 0; i < nodes; i++)
+    {
+        for (j = 0; j < nodes; j++)
+        {
+            snprintf (labels, sizeof (labels), "from=\"%d\",to=\"%d\"", i, j);
+            metrics_sample (w, "ls_link_cost", labels, costs[i][j]);
+        }
+    }
+    if (spf_done)
+    {
+        metrics_family (w, "ls_distance", "gauge", "Least-cost distance from this router");
+        for (i = 0; i < nodes; i++)
+        {
+            snprintf (labels, sizeof (labels), "dest=\"%d\"", i);
+            metrics_sample (w, "ls_distance", labels, routes[i].cost);
+        }
+        metrics_family (w, "ls_route_next_hop", "gauge", "Equal-cost next hops (1 per dest, via)");
+        for (i = 0; i < nodes; i++)
+        {
+            for (j = 0; j < nodes; j++)
             {
-                if (taken[j] == 0)
-                {
-                    int newdist;
-                    pthread_mutex_lock (&lock);
-                    newdist = distances[spot] + costs[spot][j];
-                    pthread_mutex_unlock (&lock);
-
-                    distances[j] = MIN (distances[j], newdist);
-                }
+                if (!(routes[i].nexthops & (1u << j)))
+                    continue;
+                snprintf (labels, sizeof (labels), "dest=\"%d\",via=\"%d\"", i, j);
+                metrics_sample (w, "ls_route_next_hop", labels, 1);
+            }
+        }
+        metrics_family (w, "ls_route_alternate", "gauge", "Loop-free alternate next hop, -1 if none");
+        for (i = 0; i < nodes; i++)
+        {
+            if (i == myid)
+                continue;
+            snprintf (labels, sizeof (labels), "dest=\"%d\"", i);
+            metrics_sample (w, "ls_route_alternate", labels, routes[i].lfa);
+        }
+        metrics_family (w, "ls_path_cost", "gauge", "Cost of the k shortest loop-free paths (dest, rank)");
+        for (i = 0; i < nodes; i++)
+        {
+            for (j = 0; j < routes[i].npaths; j++)
+            {
+                snprintf (labels, sizeof (labels), "dest=\"%d\",rank=\"%d\"", i, j);
+                metrics_sample (w, "ls_path_cost", labels, routes[i].paths[j].cost);
             }
         }
-
-        printf ("New least-cost distances from router %d:\n", myid);
-        for (i = 0; i < N; i++)
-            printf ("%d ", distances[i]);
-        printf ("\n");
     }
+    pthread_mutex_unlock (&lock);
+}
+
+void register_metrics (void)
+{
+    m_updates   = metrics_counter ("ls_updates_received_total", "Link-state updates applied");
+    m_malformed = metrics_counter ("ls_updates_malformed_total", "Updates ignored as malformed");
+    m_sent      = metrics_counter ("ls_updates_sent_total", "Updates sent to other routers");
+    m_spf_runs  = metrics_counter ("ls_spf_runs_total", "Route computations");
+    m_reroutes  = metrics_counter ("ls_fast_reroutes_total", "Routes moved to a backup on a link failure");
+    h_spf_time  = metrics_histogram ("ls_spf_duration_seconds",
+                                     "Time for one route computation (SPF, ECMP, k paths, alternates)");
+    h_reroute_time = metrics_histogram ("ls_reroute_duration_seconds",
+                                        "Time to move the routes off a failed link");
+    metrics_add_collector (collect_tables);
 }
 
 // main()
@@ -173,14 +622,29 @@ int main (int argc, char *argv[])
     pthread_t   thr1, thr2;
     int     id, cost;
     int     packet[3];
+    int     opt, verbose = 0;
+    const char *metrics_endpoint = NULL;
+
+    // options: -v verbose, -M metrics endpoint
+    while ((opt = getopt (argc, argv, "vM:")) != -1)
+    {
+        if (opt == 'v')
+            verbose = 1;
+        else if (opt == 'M')
+            metrics_endpoint = optarg;
+        else
+            break;
+    }
 
     // Get from the command line, id, routers, cost table
-    if (argc != 5) {
-        printf ("Usage: %s <id> <num_routers> <routers_file> <cost_table_file>\n", argv[0]);
+    if (argc - optind != 4) {
+        printf ("Usage: %s [-v] [-M port|unix:path] <id> <num_routers> <routers_file> <cost_table_file>\n", argv[0]);
         exit (0);
     }
+    argv += optind - 1;
 
     myid = atoi (argv[1]);
+    log_init (verbose ? LOG_LVL_DEBUG : LOG_LVL_INFO, verbose ? LOG_TIMESTAMPS : 0);
     nodes = atoi (argv[2]);
 
     if (myid >= N)
@@ -249,6 +713,12 @@ int main (int argc, char *argv[])
 
     // create threads
     pthread_mutex_init (&lock, NULL);
+    register_metrics ();
+    if (metrics_endpoint != NULL && metrics_serve (metrics_endpoint) < 0)
+    {
+        perror ("metrics");
+        return 1;
+    }
     pthread_create (&thr1, NULL, receive_info, NULL);
     pthread_create (&thr2, NULL, run_link_state, NULL);
 
@@ -256,25 +726,23 @@ int main (int argc, char *argv[])
     for (i = 0; i < 2; i++)
     {
         sleep (10);    // wait 10 seconds between changes
+        log_flush ();  // keep the prompt after anything already logged
         printf ("any changes? (neighbor_id new_cost): ");
         fflush (stdout);
 
         if (scanf ("%d%d", &id, &cost) != 2)
         {
-            printf ("input error\n");
+            log_error ("input error");
             break;
         }
 
         if (id >= N  ||  id == myid)
         {
-            printf ("wrong id\n");
+            log_error ("wrong id");
             break;
         }
 
-        pthread_mutex_lock (&lock);
-        costs[myid][id] = cost;
-        costs[id][myid] = cost;
-        pthread_mutex_unlock (&lock);
+        link_update (myid, id, cost);
         print_costs ();
 
         packet[0] = htonl (myid);
@@ -291,9 +759,10 @@ int main (int argc, char *argv[])
                 inet_pton (AF_INET, routers[j].ip, &otheraddr.sin_addr.s_addr);
                 sendto (sock, packet, sizeof (packet), 0,
                         (struct sockaddr *)&otheraddr, addr_size);
+                metrics_inc (m_sent);
             }
         }
-        printf ("sent\n");
+        log_info ("sent");
     }
 
     // finish 30 seconds after executing the changes